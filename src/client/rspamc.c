@@ -574,12 +574,25 @@ rspamc_uptime_output (ucl_object_t *obj)
 	}
 }
 
+/* Latency percentile of symbol in microseconds */
+static gint64
+rspamc_percentile (const ucl_object_t *hist, const gchar *name)
+{
+	const ucl_object_t *elt;
+
+	if (hist == NULL || (elt = ucl_object_find_key (hist, name)) == NULL) {
+		return 0;
+	}
+
+	return ucl_object_toint (elt);
+}
+
 static void
 rspamc_counters_output (ucl_object_t *obj)
 {
-	const ucl_object_t *cur, *sym, *weight, *freq, *tim;
+	const ucl_object_t *cur, *sym, *weight, *freq, *tim, *cpu, *wall;
 	ucl_object_iter_t iter = NULL;
-	gchar fmt_buf[64], dash_buf[82];
+	gchar fmt_buf[128], dash_buf[130];
 	gint l, max_len = INT_MIN, i;
 
 	if (obj->type != UCL_ARRAY) {
@@ -598,21 +611,25 @@ rspamc_counters_output (ucl_object_t *obj)
 	}
 
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3s | %%%ds | %%6s | %%9s | %%9s |\n", max_len);
-	memset (dash_buf, '-', 40 + max_len);
-	dash_buf[40 + max_len] = '\0';
+		"| %%3s | %%%ds | %%6s | %%9s | %%9s | %%9s | %%9s | %%9s | %%9s |\n",
+		max_len);
+	memset (dash_buf, '-', 88 + max_len);
+	dash_buf[88 + max_len] = '\0';
 
 	printf ("Symbols cache\n");
 	printf (" %s \n", dash_buf);
 	if (tty) {
 		printf ("\033[1m");
 	}
-	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time");
+	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time",
+		"CPU p50", "CPU p99", "Wall p50", "Wall p99");
 	if (tty) {
 		printf ("\033[0m");
 	}
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f |\n", max_len);
+		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f "
+		"| %%9" G_GINT64_FORMAT " | %%9" G_GINT64_FORMAT
+		" | %%9" G_GINT64_FORMAT " | %%9" G_GINT64_FORMAT " |\n", max_len);
 
 	iter = NULL;
 	i = 0;
@@ -622,12 +639,18 @@ rspamc_counters_output (ucl_object_t *obj)
 		weight = ucl_object_find_key (cur, "weight");
 		freq = ucl_object_find_key (cur, "frequency");
 		tim = ucl_object_find_key (cur, "time");
+		cpu = ucl_object_find_key (cur, "cpu");
+		wall = ucl_object_find_key (cur, "wall");
 		if (sym && weight && freq && tim) {
 			printf (fmt_buf, i,
 				ucl_object_tostring (sym),
 				ucl_object_todouble (weight),
 				(gint)ucl_object_toint (freq),
-				ucl_object_todouble (tim));
+				ucl_object_todouble (tim),
+				rspamc_percentile (cpu, "p50"),
+				rspamc_percentile (cpu, "p99"),
+				rspamc_percentile (wall, "p50"),
+				rspamc_percentile (wall, "p99"));
 		}
 		i++;
 	}
@@ -726,12 +726,20 @@ rspamd_controller_learn_fin_task (void *ud)
 	struct rspamd_controller_session *session;
 	struct rspamd_http_connection_entry *conn_ent;
 	GError *err = NULL;
+	rspamd_stat_result_t ret;
 
 	conn_ent = task->fin_arg;
 	session = conn_ent->ud;
+	ret = rspamd_learn_task_spam (session->cl, task, session->is_spam, &err);
 
-	if (!rspamd_learn_task_spam (session->cl, task, session->is_spam, &err)) {
+	if (ret == RSPAMD_STAT_PROCESS_DELAYED) {
+		/* Called again when statfiles are learned */
+		return FALSE;
+	}
+
+	if (ret == RSPAMD_STAT_PROCESS_ERROR) {
 		rspamd_controller_send_error (conn_ent, 500 + err->code, err->message);
+		g_error_free (err);
 		return TRUE;
 	}
 	/* Successful learn */
@@ -750,7 +758,11 @@ rspamd_controller_check_fin_task (void *ud)
 	struct rspamd_http_connection_entry *conn_ent;
 	struct rspamd_http_message *msg;
 
-	rspamd_process_statistics (task);
+	if (!rspamd_process_statistics (task)) {
+		/* Called again when statfiles are loaded */
+		return FALSE;
+	}
+
 	conn_ent = task->fin_arg;
 	msg = rspamd_http_new_message (HTTP_RESPONSE);
 	msg->date = time (NULL);
@@ -810,7 +822,7 @@ rspamd_controller_handle_learn_common (
 
 	task->s = new_async_session (session->pool,
 			rspamd_controller_learn_fin_task,
-			NULL,
+			rspamd_task_restore,
 			rspamd_task_free_hard,
 			task);
 	task->s->wanna_die = TRUE;
@@ -901,7 +913,7 @@ rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
 
 	task->s = new_async_session (session->pool,
 			rspamd_controller_check_fin_task,
-			NULL,
+			rspamd_task_restore,
 			rspamd_task_free_hard,
 			task);
 	task->s->wanna_die = TRUE;
@@ -1324,6 +1336,18 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			stat->fuzzy_hashes_expired), "fuzzy_expired", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_cache_hits), "fuzzy_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_cache_misses), "fuzzy_cache_misses", 0,
+		false);
+	if (stat->fuzzy_cache_hits + stat->fuzzy_cache_misses > 0) {
+		ucl_object_insert_key (top,
+			ucl_object_fromdouble ((gdouble)stat->fuzzy_cache_hits /
+			(stat->fuzzy_cache_hits + stat->fuzzy_cache_misses)),
+			"fuzzy_cache_hit_ratio", 0, false);
+	}
 
 	/* Now write statistics for each statfile */
 
@@ -1337,6 +1361,8 @@ rspamd_controller_handle_stat_common (
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->fuzzy_cache_hits = 0;
+		session->ctx->srv->stat->fuzzy_cache_misses = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -1375,6 +1401,28 @@ rspamd_controller_handle_statreset (
 	return rspamd_controller_handle_stat_common (conn_ent, msg, TRUE);
 }
 
+static ucl_object_t *
+rspamd_controller_histogram_to_ucl (const struct rspamd_histogram *h)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_histogram_count (h)),
+		"count", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_histogram_percentile (h, 50.0)),
+		"p50", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_histogram_percentile (h, 90.0)),
+		"p90", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_histogram_percentile (h, 99.0)),
+		"p99", 0, false);
+
+	return obj;
+}
+
 static ucl_object_t *
 rspamd_controller_cache_item_to_ucl (struct cache_item *item)
 {
@@ -1389,6 +1437,13 @@ rspamd_controller_cache_item_to_ucl (struct cache_item *item)
 		"frequency", 0, false);
 	ucl_object_insert_key (obj, ucl_object_fromdouble (item->s->avg_time),
 		"time", 0, false);
+	/* Latency percentiles in microseconds */
+	ucl_object_insert_key (obj,
+		rspamd_controller_histogram_to_ucl (item->cpu_hist),
+		"cpu", 0, false);
+	ucl_object_insert_key (obj,
+		rspamd_controller_histogram_to_ucl (item->wall_hist),
+		"wall", 0, false);
 
 	return obj;
 }
@@ -1406,9 +1461,9 @@ rspamd_controller_handle_counters (
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top;
-	GList *cur;
 	struct cache_item *item;
 	struct symbols_cache *cache;
+	guint i;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
 		return 0;
@@ -1417,23 +1472,12 @@ rspamd_controller_handle_counters (
 	cache = session->ctx->cfg->cache;
 	top = ucl_object_typed_new (UCL_ARRAY);
 	if (cache != NULL) {
-		cur = cache->negative_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
-						item));
-			}
-			cur = g_list_next (cur);
-		}
-		cur = cache->static_items;
-		while (cur) {
-			item = cur->data;
+		for (i = 0; i < cache->items->len; i ++) {
+			item = g_ptr_array_index (cache->items, i);
 			if (!item->is_callback) {
 				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
 						item));
 			}
-			cur = g_list_next (cur);
 		}
 	}
 	rspamd_controller_send_ucl (conn_ent, top);
@@ -42,7 +42,7 @@
 
 /* This number is used as limit while comparing two fuzzy hashes, this value can vary from 0 to 100 */
 #define LEV_LIMIT 99
-/* This number is used as limit while we are making decision to write new hash file or not */
+/* Maximum number of queued writes before commit to the database */
 #define DEFAULT_MOD_LIMIT 10000
 /* This number is used as expire time in seconds for cache items  (2 days) */
 #define DEFAULT_EXPIRE 172800L
@@ -60,6 +60,24 @@
 
 #define INVALID_NODE_TIME (guint64) - 1
 
+/* Maximum size of fuzzy datagram */
+#define FUZZY_MAX_PACKET 2048
+
+/* Default port for replication connections */
+#define FUZZY_REPLICATION_PORT 11336
+/* Default number of updates kept for replicas catch up */
+#define DEFAULT_REPLICATION_LOG 1000000
+/* Interval of updates commit when there are connected replicas */
+#define FUZZY_REPLICATION_TIMEOUT 1
+/* Interval between attempts to connect to master */
+#define FUZZY_REPLICATION_RECONNECT 10
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define FUZZY_BATCH_IO 1
+/* Maximum number of datagrams read and replied per socket wakeup */
+#define FUZZY_BATCH_SIZE 64
+#endif
+
 /* Init functions */
 gpointer init_fuzzy (struct rspamd_config *cfg);
 void start_fuzzy (struct rspamd_worker *worker);
@@ -69,8 +87,8 @@ worker_t fuzzy_worker = {
 	init_fuzzy,                 /* Init function */
 	start_fuzzy,                /* Start function */
 	TRUE,                       /* No socket */
-	TRUE,                       /* Unique */
-	TRUE,                       /* Threaded */
+	FALSE,                      /* Unique */
+	FALSE,                      /* Threaded */
 	FALSE,                      /* Non killable */
 	SOCK_DGRAM                  /* UDP socket */
 };
@@ -83,15 +101,65 @@ static struct rspamd_stat *server_stat;
 struct rspamd_fuzzy_storage_ctx {
 	char *hashfile;
 	gdouble expire;
+	gdouble partition_time;
 	guint32 frequent_score;
 	guint32 max_mods;
 	radix_compressed_t *update_ips;
 	gchar *update_map;
 	struct event_base *ev_base;
+	gboolean memory_index;
+	gchar *writer_socket;
+
+	/* Only one process writes to the database */
+	gboolean is_writer;
+	gint lock_fd;
+	/* Socket to receive updates in the writer or to send them in readers */
+	gint writer_fd;
+	struct event writer_ev;
+
+	/* Replication, performed by the writer process only */
+	gchar *replication_bind;
+	gchar *master;
+	guint32 replication_log;
+	gchar *replication_map;
+	radix_compressed_t *replication_ips;
+	gint replication_fd;
+	struct event replication_ev;
+	struct event replication_timer;
+	GList *replicas;
+	struct fuzzy_master_conn *master_conn;
+	struct event master_timer;
 
 	struct rspamd_fuzzy_backend *backend;
 };
 
+/*
+ * Connection from replica that receives our updates
+ */
+struct fuzzy_replica {
+	gint fd;
+	struct event ev;
+	rspamd_inet_addr_t addr;
+	struct rspamd_fuzzy_replication_hello hello;
+	gsize hello_len;
+	gboolean started;
+	/* The last update queued for this replica */
+	guint64 seq;
+	GByteArray *out;
+	gsize out_pos;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+};
+
+/*
+ * Connection to master that sends us its updates
+ */
+struct fuzzy_master_conn {
+	gint fd;
+	struct event ev;
+	gboolean connected;
+	GByteArray *in;
+};
+
 struct rspamd_legacy_fuzzy_node {
 	gint32 value;
 	gint32 flag;
@@ -99,14 +167,41 @@ struct rspamd_legacy_fuzzy_node {
 	rspamd_fuzzy_t h;
 };
 
+#ifdef FUZZY_BATCH_IO
+/*
+ * Buffers for recvmmsg/sendmmsg: replies are accumulated while a batch of
+ * commands is processed and then sent by a single syscall
+ */
+struct fuzzy_io_batch {
+	guint8 in_bufs[FUZZY_BATCH_SIZE][FUZZY_MAX_PACKET];
+	rspamd_inet_addr_t in_addrs[FUZZY_BATCH_SIZE];
+	struct iovec in_iov[FUZZY_BATCH_SIZE];
+	struct mmsghdr in_msg[FUZZY_BATCH_SIZE];
+	union {
+		struct rspamd_fuzzy_reply rep;
+		gchar legacy[64];
+	} out_bufs[FUZZY_BATCH_SIZE];
+	rspamd_inet_addr_t out_addrs[FUZZY_BATCH_SIZE];
+	struct iovec out_iov[FUZZY_BATCH_SIZE];
+	struct mmsghdr out_msg[FUZZY_BATCH_SIZE];
+	guint nout;
+};
+
+static struct fuzzy_io_batch *io_batch = NULL;
+#endif
+
 struct fuzzy_session {
 	struct rspamd_worker *worker;
 	struct rspamd_fuzzy_cmd *cmd;
 	gint fd;
 	guint64 time;
 	gboolean legacy;
+	gboolean forwarded;
 	rspamd_inet_addr_t addr;
 	struct rspamd_fuzzy_storage_ctx *ctx;
+#ifdef FUZZY_BATCH_IO
+	struct fuzzy_io_batch *batch;
+#endif
 };
 
 static gboolean
@@ -121,12 +216,65 @@ rspamd_fuzzy_check_client (struct fuzzy_session *session)
 	return TRUE;
 }
 
+#ifdef FUZZY_BATCH_IO
+static void
+rspamd_fuzzy_queue_reply (struct fuzzy_session *session,
+		const void *data, gsize len)
+{
+	struct fuzzy_io_batch *batch = session->batch;
+	struct msghdr *msg;
+	guint n = batch->nout;
+
+	g_assert (n < FUZZY_BATCH_SIZE);
+	g_assert (len <= sizeof (batch->out_bufs[n]));
+
+	memcpy (&batch->out_bufs[n], data, len);
+	memcpy (&batch->out_addrs[n], &session->addr, sizeof (session->addr));
+	batch->out_iov[n].iov_base = &batch->out_bufs[n];
+	batch->out_iov[n].iov_len = len;
+	msg = &batch->out_msg[n].msg_hdr;
+	memset (msg, 0, sizeof (*msg));
+	msg->msg_name = &batch->out_addrs[n].addr.sa;
+	msg->msg_namelen = batch->out_addrs[n].slen;
+	msg->msg_iov = &batch->out_iov[n];
+	msg->msg_iovlen = 1;
+	batch->nout ++;
+}
+
+static void
+rspamd_fuzzy_flush_replies (gint fd, struct fuzzy_io_batch *batch)
+{
+	guint sent = 0;
+	gint r;
+
+	while (sent < batch->nout) {
+		r = sendmmsg (fd, &batch->out_msg[sent], batch->nout - sent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			msg_err ("error while writing reply: %s", strerror (errno));
+			/* Skip the failed datagram and try the rest */
+			sent ++;
+		}
+		else {
+			sent += r;
+		}
+	}
+
+	batch->nout = 0;
+}
+#endif
+
 static void
 rspamd_fuzzy_write_reply (struct fuzzy_session *session,
 		struct rspamd_fuzzy_reply *rep)
 {
 	gint r;
 	gchar buf[64];
+	const void *data;
+	gsize len;
 
 	if (session->legacy) {
 		if (rep->prob > 0.5) {
@@ -142,22 +290,101 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session,
 		else {
 			r = rspamd_snprintf (buf, sizeof (buf), "ERR" CRLF);
 		}
-		r = sendto (session->fd, buf, r, 0, &session->addr.addr.sa,
-			session->addr.slen);
+		data = buf;
+		len = r;
 	}
 	else {
-		r = sendto (session->fd, rep, sizeof (*rep), 0, &session->addr.addr.sa,
-				session->addr.slen);
+		data = rep;
+		len = sizeof (*rep);
+	}
+
+#ifdef FUZZY_BATCH_IO
+	if (session->batch != NULL) {
+		rspamd_fuzzy_queue_reply (session, data, len);
+		return;
 	}
+#endif
 
-	if (r == -1) {
+	while ((r = sendto (session->fd, data, len, 0, &session->addr.addr.sa,
+			session->addr.slen)) == -1) {
 		if (errno == EINTR) {
-			rspamd_fuzzy_write_reply (session, rep);
+			continue;
 		}
-		else {
-			msg_err ("error while writing reply: %s", strerror (errno));
+		msg_err ("error while writing reply: %s", strerror (errno));
+		break;
+	}
+}
+
+static gboolean rspamd_fuzzy_become_writer (struct rspamd_worker *worker);
+
+/*
+ * Writer unlinks its socket on exit, so if the socket is gone this process
+ * tries to take the lock and to apply updates itself
+ */
+static gboolean
+rspamd_fuzzy_writer_gone (struct fuzzy_session *session, gint err)
+{
+	if (err != ENOENT && err != ECONNREFUSED) {
+		return FALSE;
+	}
+
+	return rspamd_fuzzy_become_writer (session->worker);
+}
+
+/*
+ * Pass update command to the writer process, the command is applied
+ * asynchronously. If the writer has exited, this process could become writer
+ * instead, then FALSE is returned and the update should be applied locally
+ */
+static gboolean
+rspamd_fuzzy_forward_update (struct fuzzy_session *session)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct sockaddr_un su;
+	gsize len;
+	gint err;
+
+	if (ctx->writer_fd == -1) {
+		ctx->writer_fd = rspamd_socket_unix (ctx->writer_socket, &su,
+				SOCK_DGRAM, FALSE, TRUE);
+
+		if (ctx->writer_fd == -1) {
+			err = errno;
+
+			if (!rspamd_fuzzy_writer_gone (session, err)) {
+				msg_err ("cannot connect to the writer process at %s: %s",
+						ctx->writer_socket, strerror (err));
+			}
+
+			return FALSE;
 		}
 	}
+
+	if (session->cmd->shingles_count > 0) {
+		len = sizeof (struct rspamd_fuzzy_shingle_cmd);
+	}
+	else {
+		len = sizeof (struct rspamd_fuzzy_cmd);
+	}
+
+	while (send (ctx->writer_fd, session->cmd, len, 0) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		err = errno;
+		/* Writer could be restarted, so reconnect on the next update */
+		close (ctx->writer_fd);
+		ctx->writer_fd = -1;
+
+		if (!rspamd_fuzzy_writer_gone (session, err)) {
+			msg_err ("cannot forward update to the writer process: %s",
+					strerror (err));
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 static void
@@ -172,14 +399,22 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	}
 	else {
 		rep.flag = session->cmd->flag;
-		if (rspamd_fuzzy_check_client (session)) {
-			if (session->cmd->cmd == FUZZY_WRITE) {
-				res = rspamd_fuzzy_backend_add (session->ctx->backend,
-						session->cmd);
+		/* Forwarded updates have been checked by the receiving process */
+		if (session->forwarded || rspamd_fuzzy_check_client (session)) {
+			if (!session->ctx->is_writer) {
+				res = rspamd_fuzzy_forward_update (session);
 			}
-			else {
-				res = rspamd_fuzzy_backend_del (session->ctx->backend,
-						session->cmd);
+
+			/* Process could become writer while forwarding the update */
+			if (session->ctx->is_writer) {
+				if (session->cmd->cmd == FUZZY_WRITE) {
+					res = rspamd_fuzzy_backend_add (session->ctx->backend,
+							session->cmd);
+				}
+				else {
+					res = rspamd_fuzzy_backend_del (session->ctx->backend,
+							session->cmd);
+				}
 			}
 			if (!res) {
 				rep.value = 404;
@@ -197,8 +432,10 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 		server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (session->ctx->backend);
 	}
 
-	rep.tag = session->cmd->tag;
-	rspamd_fuzzy_write_reply (session, &rep);
+	if (!session->forwarded) {
+		rep.tag = session->cmd->tag;
+		rspamd_fuzzy_write_reply (session, &rep);
+	}
 }
 
 
@@ -218,6 +455,109 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 
 	return FALSE;
 }
+
+static void
+rspamd_fuzzy_process_packet (struct fuzzy_session *session, guint8 *buf,
+		gint r)
+{
+	struct rspamd_fuzzy_cmd *cmd = NULL, lcmd;
+	struct legacy_fuzzy_cmd *l;
+
+	if ((guint)r == sizeof (struct legacy_fuzzy_cmd)) {
+		session->legacy = TRUE;
+		l = (struct legacy_fuzzy_cmd *)buf;
+		lcmd.version = 2;
+		memcpy (lcmd.digest, l->hash, sizeof (lcmd.digest));
+		lcmd.cmd = l->cmd;
+		lcmd.flag = l->flag;
+		lcmd.shingles_count = 0;
+		lcmd.value = l->value;
+		lcmd.tag = 0;
+		cmd = &lcmd;
+	}
+	else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
+		/* Check shingles count sanity */
+		session->legacy = FALSE;
+		cmd = (struct rspamd_fuzzy_cmd *)buf;
+		if (!rspamd_fuzzy_command_valid (cmd, r)) {
+			/* Bad input */
+			msg_debug ("invalid fuzzy command of size %d received", r);
+		}
+	}
+	else {
+		/* Discard input */
+		msg_debug ("invalid fuzzy command of size %d received", r);
+	}
+	if (cmd != NULL) {
+		session->cmd = cmd;
+		rspamd_fuzzy_process_command (session);
+	}
+}
+
+#ifdef FUZZY_BATCH_IO
+static void
+rspamd_fuzzy_batch_init (struct fuzzy_io_batch *batch)
+{
+	guint i;
+
+	for (i = 0; i < FUZZY_BATCH_SIZE; i ++) {
+		batch->in_iov[i].iov_base = batch->in_bufs[i];
+		batch->in_iov[i].iov_len = sizeof (batch->in_bufs[i]);
+		batch->in_msg[i].msg_hdr.msg_iov = &batch->in_iov[i];
+		batch->in_msg[i].msg_hdr.msg_iovlen = 1;
+		batch->in_msg[i].msg_hdr.msg_name = &batch->in_addrs[i].addr.sa;
+	}
+}
+
+/*
+ * Read up to FUZZY_BATCH_SIZE datagrams, process them and send all replies
+ */
+static void
+rspamd_fuzzy_read_batch (gint fd, struct fuzzy_session *session,
+		struct fuzzy_io_batch *batch)
+{
+	gint r, i;
+	struct msghdr *msg;
+
+	for (i = 0; i < FUZZY_BATCH_SIZE; i ++) {
+		msg = &batch->in_msg[i].msg_hdr;
+		msg->msg_namelen = sizeof (batch->in_addrs[i].addr);
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+	}
+
+	while ((r = recvmmsg (fd, batch->in_msg, FUZZY_BATCH_SIZE, MSG_DONTWAIT,
+			NULL)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			msg_err ("got error while reading from socket: %d, %s",
+				errno,
+				strerror (errno));
+		}
+		return;
+	}
+
+	session->batch = batch;
+	batch->nout = 0;
+
+	for (i = 0; i < r; i ++) {
+		msg = &batch->in_msg[i].msg_hdr;
+		memcpy (&session->addr.addr, &batch->in_addrs[i].addr,
+				msg->msg_namelen);
+		session->addr.slen = msg->msg_namelen;
+		session->addr.af = session->addr.addr.sa.sa_family;
+		rspamd_fuzzy_process_packet (session, batch->in_bufs[i],
+				batch->in_msg[i].msg_len);
+	}
+
+	if (batch->nout > 0) {
+		rspamd_fuzzy_flush_replies (fd, batch);
+	}
+}
+#endif
+
 /*
  * Accept new connection and construct task
  */
@@ -227,18 +567,24 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
 	struct fuzzy_session session;
 	gint r;
-	guint8 buf[2048];
-	struct rspamd_fuzzy_cmd *cmd = NULL, lcmd;
-	struct legacy_fuzzy_cmd *l;
+	guint8 buf[FUZZY_MAX_PACKET];
 
 	session.worker = worker;
 	session.fd = fd;
+	session.forwarded = FALSE;
 	session.addr.slen = sizeof (session.addr.addr);
 	session.ctx = worker->ctx;
 	session.time = (guint64)time (NULL);
 
 	/* Got some data */
 	if (what == EV_READ) {
+#ifdef FUZZY_BATCH_IO
+		if (io_batch != NULL) {
+			rspamd_fuzzy_read_batch (fd, &session, io_batch);
+			return;
+		}
+		session.batch = NULL;
+#endif
 		while ((r = recvfrom (fd, buf, sizeof (buf), 0,
 			&session.addr.addr.sa, &session.addr.slen)) == -1) {
 			if (errno == EINTR) {
@@ -250,36 +596,722 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 			return;
 		}
 		session.addr.af = session.addr.addr.sa.sa_family;
-		if ((guint)r == sizeof (struct legacy_fuzzy_cmd)) {
-			session.legacy = TRUE;
-			l = (struct legacy_fuzzy_cmd *)buf;
-			lcmd.version = 2;
-			memcpy (lcmd.digest, l->hash, sizeof (lcmd.digest));
-			lcmd.cmd = l->cmd;
-			lcmd.flag = l->flag;
-			lcmd.shingles_count = 0;
-			lcmd.value = l->value;
-			lcmd.tag = 0;
-			cmd = &lcmd;
-		}
-		else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
-			/* Check shingles count sanity */
-			session.legacy = FALSE;
-			cmd = (struct rspamd_fuzzy_cmd *)buf;
-			if (!rspamd_fuzzy_command_valid (cmd, r)) {
-				/* Bad input */
-				msg_debug ("invalid fuzzy command of size %d received", r);
+		rspamd_fuzzy_process_packet (&session, buf, r);
+	}
+}
+
+/*
+ * Read updates forwarded by other processes
+ */
+static void
+rspamd_fuzzy_writer_read (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+	struct fuzzy_session session;
+	gint r;
+	guint8 buf[FUZZY_MAX_PACKET];
+
+	memset (&session, 0, sizeof (session));
+	session.worker = worker;
+	session.fd = -1;
+	session.forwarded = TRUE;
+	session.ctx = worker->ctx;
+	session.time = (guint64)time (NULL);
+
+	for (;;) {
+		r = recv (fd, buf, sizeof (buf), MSG_DONTWAIT);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				msg_err ("got error while reading from writer socket: %d, %s",
+						errno,
+						strerror (errno));
+			}
+			break;
+		}
+
+		rspamd_fuzzy_process_packet (&session, buf, r);
+	}
+}
+
+/*
+ * Replication: the writer process of master keeps log of the applied updates
+ * and streams committed updates to replicas over TCP. Replica sends sequence
+ * number of the last received update, so it catches up from that point after
+ * reconnection.
+ */
+static void
+rspamd_fuzzy_replica_free (struct fuzzy_replica *replica)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = replica->ctx;
+
+	event_del (&replica->ev);
+	close (replica->fd);
+	g_byte_array_free (replica->out, TRUE);
+	ctx->replicas = g_list_remove (ctx->replicas, replica);
+	g_slice_free1 (sizeof (*replica), replica);
+}
+
+static gboolean
+rspamd_fuzzy_replica_append (guint64 seq, const struct rspamd_fuzzy_cmd *cmd,
+		gsize len, gpointer ud)
+{
+	struct fuzzy_replica *replica = ud;
+	struct rspamd_fuzzy_replication_hdr hdr;
+
+	hdr.seq = seq;
+	hdr.len = len;
+	g_byte_array_append (replica->out, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (replica->out, (const guint8 *)cmd, len);
+	replica->seq = seq;
+
+	return TRUE;
+}
+
+/*
+ * Queue the next chunk of committed updates if the previous one is sent
+ * @return TRUE if there is something to send
+ */
+static gboolean
+rspamd_fuzzy_replica_fill (struct fuzzy_replica *replica)
+{
+	if (replica->out_pos < replica->out->len) {
+		return TRUE;
+	}
+
+	g_byte_array_set_size (replica->out, 0);
+	replica->out_pos = 0;
+	rspamd_fuzzy_backend_read_log (replica->ctx->backend, replica->seq, 0,
+			rspamd_fuzzy_replica_append, replica);
+
+	return replica->out->len > 0;
+}
+
+static void rspamd_fuzzy_replica_handler (gint fd, short what, void *arg);
+
+static void
+rspamd_fuzzy_replica_watch (struct fuzzy_replica *replica, gboolean want_write)
+{
+	event_del (&replica->ev);
+	event_set (&replica->ev, replica->fd,
+			EV_READ | EV_PERSIST | (want_write ? EV_WRITE : 0),
+			rspamd_fuzzy_replica_handler, replica);
+	event_base_set (replica->ctx->ev_base, &replica->ev);
+	event_add (&replica->ev, NULL);
+}
+
+static void
+rspamd_fuzzy_replica_start (struct fuzzy_replica *replica)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = replica->ctx;
+	struct rspamd_fuzzy_replication_hdr hdr;
+	guint64 first, last;
+
+	first = rspamd_fuzzy_backend_log_first (ctx->backend);
+	last = rspamd_fuzzy_backend_log_seq (ctx->backend);
+	replica->seq = replica->hello.seq;
+
+	if (replica->seq > last) {
+		/* Probably, master database has been replaced */
+		msg_warn ("replica %s requested updates after %L but the last update "
+				"is %L, send the whole log",
+				rspamd_inet_address_to_string (&replica->addr),
+				(gint64)replica->seq, (gint64)last);
+		replica->seq = 0;
+		/* Replica skips updates before its checkpoint, so reset it */
+		memset (&hdr, 0, sizeof (hdr));
+		g_byte_array_append (replica->out, (const guint8 *)&hdr, sizeof (hdr));
+	}
+	else if (first > 0 && replica->seq + 1 < first) {
+		msg_warn ("replica %s requested updates after %L but the oldest "
+				"update in log is %L, some updates are lost for it",
+				rspamd_inet_address_to_string (&replica->addr),
+				(gint64)replica->seq, (gint64)first);
+	}
+
+	msg_info ("replica %s connected, send updates after %L",
+			rspamd_inet_address_to_string (&replica->addr),
+			(gint64)replica->seq);
+	replica->started = TRUE;
+	rspamd_fuzzy_replica_watch (replica, rspamd_fuzzy_replica_fill (replica));
+}
+
+static void
+rspamd_fuzzy_replica_handler (gint fd, short what, void *arg)
+{
+	struct fuzzy_replica *replica = arg;
+	guint8 buf[BUFSIZ];
+	gssize r;
+
+	if (what & EV_READ) {
+		if (!replica->started) {
+			r = read (fd, ((guint8 *)&replica->hello) + replica->hello_len,
+					sizeof (replica->hello) - replica->hello_len);
 		}
 		else {
-			/* Discard input */
-			msg_debug ("invalid fuzzy command of size %d received", r);
+			/* Replica sends nothing after request, so just detect EOF */
+			r = read (fd, buf, sizeof (buf));
+		}
+
+		if (r == 0) {
+			msg_info ("replica %s disconnected",
+					rspamd_inet_address_to_string (&replica->addr));
+			rspamd_fuzzy_replica_free (replica);
+			return;
+		}
+		else if (r == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				msg_err ("cannot read from replica %s: %s",
+						rspamd_inet_address_to_string (&replica->addr),
+						strerror (errno));
+				rspamd_fuzzy_replica_free (replica);
+				return;
+			}
+		}
+		else if (!replica->started) {
+			replica->hello_len += r;
+
+			if (replica->hello_len == sizeof (replica->hello)) {
+				if (memcmp (replica->hello.magic, RSPAMD_FUZZY_REPLICATION_MAGIC,
+						sizeof (replica->hello.magic)) != 0) {
+					msg_err ("invalid replication request from %s",
+							rspamd_inet_address_to_string (&replica->addr));
+					rspamd_fuzzy_replica_free (replica);
+					return;
+				}
+
+				rspamd_fuzzy_replica_start (replica);
+			}
+
+			return;
+		}
+	}
+
+	if ((what & EV_WRITE) && replica->started) {
+		while (rspamd_fuzzy_replica_fill (replica)) {
+			r = write (fd, replica->out->data + replica->out_pos,
+					replica->out->len - replica->out_pos);
+
+			if (r == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return;
+				}
+
+				msg_err ("cannot write to replica %s: %s",
+						rspamd_inet_address_to_string (&replica->addr),
+						strerror (errno));
+				rspamd_fuzzy_replica_free (replica);
+				return;
+			}
+
+			replica->out_pos += r;
+		}
+
+		/* All committed updates are sent, wait for new ones */
+		rspamd_fuzzy_replica_watch (replica, FALSE);
+	}
+}
+
+/*
+ * Send newly committed updates to replicas that have sent everything before
+ */
+static void
+rspamd_fuzzy_replicas_push (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GList *cur;
+	struct fuzzy_replica *replica;
+
+	for (cur = ctx->replicas; cur != NULL; cur = g_list_next (cur)) {
+		replica = cur->data;
+
+		if (replica->started && replica->out_pos >= replica->out->len &&
+				rspamd_fuzzy_replica_fill (replica)) {
+			rspamd_fuzzy_replica_watch (replica, TRUE);
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_replication_accept (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct fuzzy_replica *replica;
+	rspamd_inet_addr_t addr;
+	gint nfd;
+
+	if ((nfd = rspamd_accept_from_socket (fd, &addr)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	if (ctx->replication_ips != NULL &&
+			radix_find_compressed_addr (ctx->replication_ips, &addr)
+			== RADIX_NO_VALUE) {
+		msg_warn ("replication is not allowed for %s",
+				rspamd_inet_address_to_string (&addr));
+		close (nfd);
+		return;
+	}
+
+	replica = g_slice_alloc0 (sizeof (*replica));
+	replica->fd = nfd;
+	replica->ctx = ctx;
+	replica->out = g_byte_array_new ();
+	memcpy (&replica->addr, &addr, sizeof (addr));
+	ctx->replicas = g_list_prepend (ctx->replicas, replica);
+	rspamd_fuzzy_replica_watch (replica, FALSE);
+}
+
+static void
+rspamd_fuzzy_replication_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct timeval tv;
+
+	if (ctx->replicas != NULL) {
+		/* Do not wait for sync to pass updates to replicas */
+		rspamd_fuzzy_backend_commit (ctx->backend);
+		rspamd_fuzzy_replicas_push (ctx);
+	}
+
+	tv.tv_sec = FUZZY_REPLICATION_TIMEOUT;
+	tv.tv_usec = 0;
+	evtimer_add (&ctx->replication_timer, &tv);
+}
+
+static void
+rspamd_fuzzy_master_close (struct rspamd_fuzzy_storage_ctx *ctx,
+		gboolean reconnect)
+{
+	struct fuzzy_master_conn *conn = ctx->master_conn;
+	struct timeval tv;
+
+	if (conn != NULL) {
+		event_del (&conn->ev);
+		close (conn->fd);
+		g_byte_array_free (conn->in, TRUE);
+		g_slice_free1 (sizeof (*conn), conn);
+		ctx->master_conn = NULL;
+	}
+
+	if (reconnect) {
+		tv.tv_sec = FUZZY_REPLICATION_RECONNECT;
+		tv.tv_usec = 0;
+		evtimer_add (&ctx->master_timer, &tv);
+	}
+}
+
+/*
+ * Apply update received from master, checkpoint is set before the update, so
+ * both are committed together
+ */
+static gboolean
+rspamd_fuzzy_master_apply (struct rspamd_fuzzy_storage_ctx *ctx,
+		guint64 seq, struct rspamd_fuzzy_cmd *cmd, gsize len)
+{
+	guint64 checkpoint;
+	gboolean ret;
+
+	if (!rspamd_fuzzy_command_valid (cmd, len) ||
+			(cmd->cmd != FUZZY_WRITE && cmd->cmd != FUZZY_DEL)) {
+		msg_err ("invalid update %L received from master %s",
+				(gint64)seq, ctx->master);
+		return FALSE;
+	}
+
+	if (seq <= rspamd_fuzzy_backend_checkpoint (ctx->backend)) {
+		/* Update has been already applied */
+		return TRUE;
+	}
+
+	if (rspamd_fuzzy_backend_failed (ctx->backend)) {
+		/* Wait until the queued updates are committed by sync */
+		msg_info ("postpone updates from master %s until the queued ones "
+				"are committed", ctx->master);
+		return FALSE;
+	}
+
+	checkpoint = rspamd_fuzzy_backend_checkpoint (ctx->backend);
+	rspamd_fuzzy_backend_set_checkpoint (ctx->backend, seq);
+
+	if (cmd->cmd == FUZZY_WRITE) {
+		ret = rspamd_fuzzy_backend_add (ctx->backend, cmd);
+	}
+	else {
+		ret = rspamd_fuzzy_backend_del (ctx->backend, cmd);
+	}
+
+	if (!ret) {
+		/* Update has not been queued, so it must not be skipped */
+		rspamd_fuzzy_backend_set_checkpoint (ctx->backend, checkpoint);
+		msg_err ("cannot apply update %L received from master %s",
+				(gint64)seq, ctx->master);
+		return FALSE;
+	}
+
+	if (rspamd_fuzzy_backend_failed (ctx->backend)) {
+		/* Checkpoint can be reloaded, so updates must be requested again */
+		msg_err ("cannot commit updates received from master %s",
+				ctx->master);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Master sends the whole log, so updates are applied from the beginning
+ */
+static gboolean
+rspamd_fuzzy_master_reset (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (rspamd_fuzzy_backend_failed (ctx->backend)) {
+		msg_info ("postpone reset from master %s until the queued updates "
+				"are committed", ctx->master);
+		return FALSE;
+	}
+
+	msg_warn ("master %s sends the whole log, reset checkpoint %L",
+			ctx->master, (gint64)rspamd_fuzzy_backend_checkpoint (ctx->backend));
+	rspamd_fuzzy_backend_set_checkpoint (ctx->backend, 0);
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_master_handler (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct fuzzy_master_conn *conn = ctx->master_conn;
+	struct rspamd_fuzzy_replication_hello hello;
+	struct rspamd_fuzzy_replication_hdr hdr;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+	guint8 buf[16384];
+	gsize pos = 0;
+	gssize r;
+	gint err = 0;
+	socklen_t len = sizeof (err);
+
+	if (what & EV_TIMEOUT) {
+		msg_err ("cannot connect to master %s: timeout", ctx->master);
+		rspamd_fuzzy_master_close (ctx, TRUE);
+		return;
+	}
+
+	if (!conn->connected) {
+		/* Asynchronous connect is finished */
+		if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+			err = errno;
+		}
+
+		if (err != 0) {
+			msg_err ("cannot connect to master %s: %s", ctx->master,
+					strerror (err));
+			rspamd_fuzzy_master_close (ctx, TRUE);
+			return;
+		}
+
+		memcpy (hello.magic, RSPAMD_FUZZY_REPLICATION_MAGIC,
+				sizeof (hello.magic));
+		hello.seq = rspamd_fuzzy_backend_checkpoint (ctx->backend);
+
+		if (write (fd, &hello, sizeof (hello)) != sizeof (hello)) {
+			msg_err ("cannot send replication request to master %s: %s",
+					ctx->master, strerror (errno));
+			rspamd_fuzzy_master_close (ctx, TRUE);
+			return;
+		}
+
+		msg_info ("connected to master %s, requested updates after %L",
+				ctx->master, (gint64)hello.seq);
+		conn->connected = TRUE;
+		event_del (&conn->ev);
+		event_set (&conn->ev, fd, EV_READ | EV_PERSIST,
+				rspamd_fuzzy_master_handler, ctx);
+		event_base_set (ctx->ev_base, &conn->ev);
+		event_add (&conn->ev, NULL);
+
+		return;
+	}
+
+	r = read (fd, buf, sizeof (buf));
+
+	if (r == 0) {
+		msg_info ("master %s has closed connection", ctx->master);
+		rspamd_fuzzy_master_close (ctx, TRUE);
+		return;
+	}
+	else if (r == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			msg_err ("cannot read from master %s: %s", ctx->master,
+					strerror (errno));
+			rspamd_fuzzy_master_close (ctx, TRUE);
+		}
+		return;
+	}
+
+	g_byte_array_append (conn->in, buf, r);
+
+	while (conn->in->len - pos >= sizeof (hdr)) {
+		memcpy (&hdr, conn->in->data + pos, sizeof (hdr));
+
+		if (hdr.seq == 0 && hdr.len == 0) {
+			pos += sizeof (hdr);
+
+			if (!rspamd_fuzzy_master_reset (ctx)) {
+				rspamd_fuzzy_master_close (ctx, TRUE);
+				return;
+			}
+
+			continue;
+		}
+
+		if (hdr.len < sizeof (struct rspamd_fuzzy_cmd) ||
+				hdr.len > sizeof (cmd)) {
+			msg_err ("invalid update of size %ud received from master %s",
+					hdr.len, ctx->master);
+			rspamd_fuzzy_master_close (ctx, TRUE);
+			return;
+		}
+
+		if (conn->in->len - pos < sizeof (hdr) + hdr.len) {
+			break;
+		}
+
+		memcpy (&cmd, conn->in->data + pos + sizeof (hdr), hdr.len);
+		pos += sizeof (hdr) + hdr.len;
+
+		if (!rspamd_fuzzy_master_apply (ctx, hdr.seq, &cmd.basic, hdr.len)) {
+			rspamd_fuzzy_master_close (ctx, TRUE);
+			return;
+		}
+	}
+
+	if (pos > 0) {
+		g_byte_array_remove_range (conn->in, 0, pos);
+	}
+
+	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+}
+
+static void
+rspamd_fuzzy_master_connect (gint unused, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct fuzzy_master_conn *conn;
+	rspamd_inet_addr_t *addr = NULL;
+	struct timeval tv;
+	guint naddrs = 1;
+	gint fd;
+
+	if (!rspamd_parse_host_port (ctx->master, &addr, &naddrs, NULL,
+			FUZZY_REPLICATION_PORT, NULL)) {
+		msg_err ("cannot resolve master address %s", ctx->master);
+		rspamd_fuzzy_master_close (ctx, TRUE);
+		return;
+	}
+
+	fd = rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+	g_free (addr);
+
+	if (fd == -1) {
+		msg_err ("cannot connect to master %s: %s", ctx->master,
+				strerror (errno));
+		rspamd_fuzzy_master_close (ctx, TRUE);
+		return;
+	}
+
+	conn = g_slice_alloc0 (sizeof (*conn));
+	conn->fd = fd;
+	conn->in = g_byte_array_new ();
+	ctx->master_conn = conn;
+
+	tv.tv_sec = FUZZY_REPLICATION_RECONNECT;
+	tv.tv_usec = 0;
+	event_set (&conn->ev, fd, EV_WRITE, rspamd_fuzzy_master_handler, ctx);
+	event_base_set (ctx->ev_base, &conn->ev);
+	event_add (&conn->ev, &tv);
+}
+
+static void
+rspamd_fuzzy_start_replication (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	rspamd_inet_addr_t *addr = NULL;
+	struct timeval tv;
+	guint naddrs = 1;
+
+	if (ctx->replication_bind != NULL) {
+		rspamd_fuzzy_backend_set_log_size (ctx->backend, ctx->replication_log);
+
+		if (!rspamd_parse_host_port (ctx->replication_bind, &addr, &naddrs,
+				NULL, FUZZY_REPLICATION_PORT, NULL)) {
+			msg_err ("cannot parse replication address %s",
+					ctx->replication_bind);
 		}
-		if (cmd != NULL) {
-			session.cmd = cmd;
-			rspamd_fuzzy_process_command (&session);
+		else {
+			ctx->replication_fd = rspamd_inet_address_listen (addr,
+					SOCK_STREAM, TRUE);
+			g_free (addr);
+
+			if (ctx->replication_fd == -1) {
+				msg_err ("cannot listen for replicas on %s: %s",
+						ctx->replication_bind, strerror (errno));
+			}
+			else {
+				event_set (&ctx->replication_ev, ctx->replication_fd,
+						EV_READ | EV_PERSIST, rspamd_fuzzy_replication_accept,
+						ctx);
+				event_base_set (ctx->ev_base, &ctx->replication_ev);
+				event_add (&ctx->replication_ev, NULL);
+
+				evtimer_set (&ctx->replication_timer,
+						rspamd_fuzzy_replication_timer, ctx);
+				event_base_set (ctx->ev_base, &ctx->replication_timer);
+				tv.tv_sec = FUZZY_REPLICATION_TIMEOUT;
+				tv.tv_usec = 0;
+				evtimer_add (&ctx->replication_timer, &tv);
+			}
 		}
 	}
+
+	if (ctx->master != NULL) {
+		evtimer_set (&ctx->master_timer, rspamd_fuzzy_master_connect, ctx);
+		event_base_set (ctx->ev_base, &ctx->master_timer);
+		rspamd_fuzzy_master_connect (-1, 0, ctx);
+	}
+}
+
+static void
+rspamd_fuzzy_stop_replication (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (ctx->replication_fd != -1) {
+		event_del (&ctx->replication_ev);
+		event_del (&ctx->replication_timer);
+		close (ctx->replication_fd);
+		ctx->replication_fd = -1;
+	}
+
+	while (ctx->replicas != NULL) {
+		rspamd_fuzzy_replica_free (ctx->replicas->data);
+	}
+
+	if (ctx->master != NULL) {
+		event_del (&ctx->master_timer);
+		rspamd_fuzzy_master_close (ctx, FALSE);
+	}
+}
+
+/*
+ * Writer process is elected by locking of the lock file, the lock is
+ * released by the kernel when the writer exits
+ */
+static gboolean
+rspamd_fuzzy_try_writer (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	gchar *lockfile;
+
+	if (ctx->lock_fd == -1) {
+		lockfile = g_strconcat (ctx->hashfile, ".lock", NULL);
+		ctx->lock_fd = open (lockfile, O_RDWR | O_CREAT, 00644);
+
+		if (ctx->lock_fd == -1) {
+			msg_err ("cannot open lock file %s: %s", lockfile,
+					strerror (errno));
+			g_free (lockfile);
+
+			return FALSE;
+		}
+
+		g_free (lockfile);
+	}
+
+	if (!rspamd_file_lock (ctx->lock_fd, TRUE)) {
+		return FALSE;
+	}
+
+	ctx->is_writer = TRUE;
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_open_backend (struct rspamd_worker *worker)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct sockaddr_un su;
+	GError *err = NULL;
+
+	if ((ctx->backend = rspamd_fuzzy_backend_open (ctx->hashfile,
+			ctx->memory_index, ctx->max_mods, !ctx->is_writer,
+			(gint64)ctx->partition_time, &err)) == NULL) {
+		msg_err (err->message);
+		g_error_free (err);
+		exit (EXIT_FAILURE);
+	}
+
+	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+
+	if (!ctx->is_writer) {
+		return;
+	}
+
+	rspamd_fuzzy_start_replication (ctx);
+
+	ctx->writer_fd = rspamd_socket_unix (ctx->writer_socket, &su,
+			SOCK_DGRAM, TRUE, TRUE);
+
+	if (ctx->writer_fd == -1) {
+		msg_err ("cannot listen on writer socket %s, updates from other "
+				"processes are lost: %s", ctx->writer_socket, strerror (errno));
+		return;
+	}
+
+	/* Updates are not authorized by the writer, so only owner could send them */
+	if (chmod (ctx->writer_socket, S_IRUSR | S_IWUSR) == -1) {
+		msg_err ("cannot set permissions of writer socket %s: %s",
+				ctx->writer_socket, strerror (errno));
+	}
+
+	event_set (&ctx->writer_ev, ctx->writer_fd, EV_READ | EV_PERSIST,
+			rspamd_fuzzy_writer_read, worker);
+	event_base_set (ctx->ev_base, &ctx->writer_ev);
+	event_add (&ctx->writer_ev, NULL);
+}
+
+/*
+ * Take place of the writer that has gone: the backend is reopened for
+ * writing and the writer socket is bound by this process
+ */
+static gboolean
+rspamd_fuzzy_become_writer (struct rspamd_worker *worker)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+
+	if (ctx->is_writer || !rspamd_fuzzy_try_writer (ctx)) {
+		return FALSE;
+	}
+
+	msg_info ("fuzzy storage process %P becomes writer", getpid ());
+	rspamd_fuzzy_backend_close (ctx->backend);
+
+	if (ctx->writer_fd != -1) {
+		close (ctx->writer_fd);
+		ctx->writer_fd = -1;
+	}
+
+	rspamd_fuzzy_open_backend (worker);
+
+	return TRUE;
 }
 
 static void
@@ -297,8 +1329,19 @@ sync_callback (gint fd, short what, void *arg)
 	tmv.tv_usec = 0;
 	evtimer_add (&tev, &tmv);
 
+	/* Previous writer could have gone without updates to forward */
+	rspamd_fuzzy_become_writer (worker);
+
 	/* Call backend sync */
-	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
+	if (!rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire) &&
+			ctx->master_conn != NULL) {
+		/* Reconnect to get updates after the checkpoint of the backend */
+		msg_err ("cannot commit updates received from master %s",
+				ctx->master);
+		rspamd_fuzzy_master_close (ctx, TRUE);
+	}
+
+	rspamd_fuzzy_replicas_push (ctx);
 
 	server_stat->fuzzy_hashes_expired = rspamd_fuzzy_backend_expired (ctx->backend);
 }
@@ -315,6 +1358,10 @@ init_fuzzy (struct rspamd_config *cfg)
 
 	ctx->max_mods = DEFAULT_MOD_LIMIT;
 	ctx->expire = DEFAULT_EXPIRE;
+	ctx->lock_fd = -1;
+	ctx->writer_fd = -1;
+	ctx->replication_fd = -1;
+	ctx->replication_log = DEFAULT_REPLICATION_LOG;
 
 	rspamd_rcl_register_worker_option (cfg, type, "hashfile",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -348,11 +1395,40 @@ init_fuzzy (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
 		expire), RSPAMD_CL_FLAG_TIME_FLOAT);
 
+	rspamd_rcl_register_worker_option (cfg, type, "partition_time",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		partition_time), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "memory_index",
+		rspamd_rcl_parse_struct_boolean, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, memory_index), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "writer_socket",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, writer_socket), 0);
 
 	rspamd_rcl_register_worker_option (cfg, type, "allow_update",
 		rspamd_rcl_parse_struct_string, ctx,
 		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, update_map), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "replication_bind",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replication_bind), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_log",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		replication_log), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "allow_replication",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replication_map), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "master",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, master), 0);
+
 
 	return ctx;
 }
@@ -364,21 +1440,23 @@ void
 start_fuzzy (struct rspamd_worker *worker)
 {
 	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
-	GError *err = NULL;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
 			accept_fuzzy_socket);
 	server_stat = worker->srv->stat;
 
+#ifdef FUZZY_BATCH_IO
+	io_batch = g_malloc0 (sizeof (*io_batch));
+	rspamd_fuzzy_batch_init (io_batch);
+#endif
 
-	if ((ctx->backend = rspamd_fuzzy_backend_open (ctx->hashfile, &err)) == NULL) {
-		msg_err (err->message);
-		g_error_free (err);
-		exit (EXIT_FAILURE);
+	if (ctx->writer_socket == NULL) {
+		ctx->writer_socket = g_strconcat (ctx->hashfile, ".writer", NULL);
 	}
 
-	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	rspamd_fuzzy_try_writer (ctx);
+	rspamd_fuzzy_open_backend (worker);
 
 	/* Timer event */
 	evtimer_set (&tev, sync_callback, worker);
@@ -401,13 +1479,37 @@ start_fuzzy (struct rspamd_worker *worker)
 		}
 	}
 
+	if (ctx->replication_map != NULL) {
+		if (!rspamd_map_add (worker->srv->cfg, ctx->replication_map,
+			"Allow fuzzy replication to specified addresses",
+			rspamd_radix_read, rspamd_radix_fin,
+			(void **)&ctx->replication_ips)) {
+			if (!radix_add_generic_iplist (ctx->replication_map,
+				&ctx->replication_ips)) {
+				msg_warn ("cannot load or parse ip list from '%s'",
+					ctx->replication_map);
+			}
+		}
+	}
+
 	/* Maps events */
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
 
 	event_base_loop (ctx->ev_base, 0);
 
+	if (ctx->is_writer) {
+		rspamd_fuzzy_stop_replication (ctx);
+	}
+
 	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
 	rspamd_fuzzy_backend_close (ctx->backend);
+
+	if (ctx->is_writer && ctx->writer_fd != -1) {
+		/* We still hold the lock, so nobody else could bind this socket */
+		close (ctx->writer_fd);
+		unlink (ctx->writer_socket);
+	}
+
 	rspamd_log_close (rspamd_main->logger);
 	exit (EXIT_SUCCESS);
 }
@@ -43,4 +43,23 @@ RSPAMD_PACKED(rspamd_fuzzy_reply) {
 	float prob;
 };
 
+/* Replication protocol over TCP */
+#define RSPAMD_FUZZY_REPLICATION_MAGIC "rsfr"
+
+/* Sent by replica after connection */
+RSPAMD_PACKED(rspamd_fuzzy_replication_hello) {
+	gchar magic[4];
+	guint64 seq;            /* the last update received by replica */
+};
+
+/*
+ * Header of each update sent by master, followed by the command itself.
+ * Header with zero seq and len tells replica that master sends the whole log
+ * from the beginning, so replica must forget its checkpoint
+ */
+RSPAMD_PACKED(rspamd_fuzzy_replication_hdr) {
+	guint64 seq;
+	guint32 len;
+};
+
 #endif
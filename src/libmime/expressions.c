@@ -638,6 +638,328 @@ parse_expression (rspamd_mempool_t * pool, gchar *line)
 	return expr;
 }
 
+/* Counter of regexps ids */
+static volatile gint regexps_count = 0;
+
+guint
+rspamd_regexps_count (void)
+{
+	return g_atomic_int_get (&regexps_count);
+}
+
+static guint
+rspamd_regexp_next_id (void)
+{
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	return g_atomic_int_add (&regexps_count, 1);
+#else
+	return g_atomic_int_exchange_and_add (&regexps_count, 1);
+#endif
+}
+
+/* Minimum length of literal that is worth prefiltering */
+#define REGEXP_MIN_LITERAL 3
+
+/* Skip character class starting at p, return pointer after the closing ']' */
+static const gchar *
+regexp_skip_class (const gchar *p, const gchar *end)
+{
+	p++;
+
+	if (p < end && *p == '^') {
+		p++;
+	}
+	if (p < end && *p == ']') {
+		p++;
+	}
+
+	while (p < end && *p != ']') {
+		if (*p == '\\') {
+			p += 2;
+		}
+		else if (*p == '[' && p + 1 < end && p[1] == ':') {
+			/* POSIX class, e.g. [:alpha:] */
+			p += 2;
+			while (p + 1 < end && !(p[0] == ':' && p[1] == ']')) {
+				p++;
+			}
+			p += 2;
+		}
+		else {
+			p++;
+		}
+	}
+
+	return MIN (p + 1, end);
+}
+
+/* Skip arguments of escape sequence like \x{41}, \p{L} or \k<name> */
+static const gchar *
+regexp_skip_escape_args (const gchar *p, const gchar *end, gchar c)
+{
+	gchar close = '\0';
+
+	if (p >= end) {
+		return p;
+	}
+
+	switch (*p) {
+	case '{':
+		close = '}';
+		break;
+	case '<':
+		close = '>';
+		break;
+	case '\'':
+		close = '\'';
+		break;
+	default:
+		break;
+	}
+
+	if (close != '\0' && c != 'd' && c != 'w' && c != 's') {
+		p++;
+		while (p < end && *p != close) {
+			p++;
+		}
+		return MIN (p + 1, end);
+	}
+
+	switch (c) {
+	case 'x':
+		if (p < end && g_ascii_isxdigit (*p)) {
+			p++;
+		}
+		if (p < end && g_ascii_isxdigit (*p)) {
+			p++;
+		}
+		break;
+	case 'p':
+	case 'P':
+	case 'c':
+		p++;
+		break;
+	case 'g':
+		if (p < end && (*p == '-' || *p == '+')) {
+			p++;
+		}
+		while (p < end && g_ascii_isdigit (*p)) {
+			p++;
+		}
+		break;
+	default:
+		if (g_ascii_isdigit (c)) {
+			/* Backreferences and octal codes */
+			while (p < end && g_ascii_isdigit (*p)) {
+				p++;
+			}
+		}
+		break;
+	}
+
+	return p;
+}
+
+/* Remove the last (possibly multibyte) character from the literal */
+static void
+regexp_literal_drop_char (GString *cur)
+{
+	guchar last;
+
+	while (cur->len > 0) {
+		last = cur->str[cur->len - 1];
+		g_string_truncate (cur, cur->len - 1);
+
+		if ((last & 0xC0) != 0x80) {
+			break;
+		}
+	}
+}
+
+static void
+regexp_literal_finish (GString *cur, GString *best)
+{
+	if (cur->len > best->len) {
+		g_string_assign (best, cur->str);
+	}
+
+	g_string_truncate (cur, 0);
+}
+
+/*
+ * Extract the longest literal that must be present in any text matched by
+ * regexp. Extraction is conservative: regexps with top level alternations or
+ * with constructions that are not analysed have no literal.
+ */
+static gchar *
+regexp_extract_literal (rspamd_mempool_t *pool,
+	const gchar *begin,
+	const gchar *end,
+	gint flags)
+{
+	const gchar *p, *q;
+	GString *cur, *best;
+	gboolean icase = (flags & G_REGEX_CASELESS) != 0, literal, valid = TRUE;
+	gint depth, min;
+	gchar c, *res = NULL;
+
+	if (flags & G_REGEX_EXTENDED) {
+		return NULL;
+	}
+
+	/* Check for inline options and quoting */
+	for (p = begin; p + 1 < end; p++) {
+		if (p[0] == '(' && p[1] == '?') {
+			for (q = p + 2; q < end && (g_ascii_isalpha (*q) || *q == '-');
+				q++) {
+				if (*q == 'x') {
+					return NULL;
+				}
+				else if (*q == 'i') {
+					icase = TRUE;
+				}
+			}
+		}
+		else if (p[0] == '\\' && p[1] == 'Q') {
+			return NULL;
+		}
+	}
+
+	cur = g_string_sized_new (32);
+	best = g_string_sized_new (32);
+	p = begin;
+
+	while (p < end && valid) {
+		c = *p;
+		literal = FALSE;
+
+		switch (c) {
+		case '\\':
+			if (p + 1 >= end) {
+				valid = FALSE;
+				break;
+			}
+			c = p[1];
+			p += 2;
+
+			if (c == 'n' || c == 't' || c == 'r') {
+				c = c == 'n' ? '\n' : (c == 't' ? '\t' : '\r');
+				literal = TRUE;
+			}
+			else if (g_ascii_isalnum (c)) {
+				/* Character types, assertions, backreferences and so on */
+				p = regexp_skip_escape_args (p, end, c);
+				regexp_literal_finish (cur, best);
+			}
+			else {
+				literal = TRUE;
+			}
+			break;
+		case '[':
+			p = regexp_skip_class (p, end);
+			regexp_literal_finish (cur, best);
+			break;
+		case '(':
+			/* Groups are not analysed */
+			depth = 1;
+			p++;
+			while (p < end && depth > 0) {
+				if (*p == '\\') {
+					p += 2;
+					continue;
+				}
+				else if (*p == '[') {
+					p = regexp_skip_class (p, end);
+					continue;
+				}
+				else if (*p == '(') {
+					depth++;
+				}
+				else if (*p == ')') {
+					depth--;
+				}
+				p++;
+			}
+			regexp_literal_finish (cur, best);
+			break;
+		case ')':
+		case '|':
+			/* Top level alternation or unbalanced group */
+			valid = FALSE;
+			break;
+		case '*':
+		case '?':
+			/* Previous atom is optional */
+			regexp_literal_drop_char (cur);
+			regexp_literal_finish (cur, best);
+			p++;
+			break;
+		case '+':
+			regexp_literal_finish (cur, best);
+			p++;
+			break;
+		case '{':
+			/* Check for {n}, {n,} and {n,m} quantifiers */
+			q = p + 1;
+			min = 0;
+			while (q < end && g_ascii_isdigit (*q)) {
+				min = min * 10 + (*q - '0');
+				q++;
+			}
+			if (q > p + 1) {
+				if (q < end && *q == ',') {
+					q++;
+					while (q < end && g_ascii_isdigit (*q)) {
+						q++;
+					}
+				}
+				if (q < end && *q == '}') {
+					if (min == 0) {
+						regexp_literal_drop_char (cur);
+					}
+					regexp_literal_finish (cur, best);
+					p = q + 1;
+					break;
+				}
+			}
+			literal = TRUE;
+			p++;
+			break;
+		case '.':
+		case '^':
+		case '$':
+			regexp_literal_finish (cur, best);
+			p++;
+			break;
+		default:
+			literal = TRUE;
+			p++;
+			break;
+		}
+
+		if (literal) {
+			if (icase && (c & 0x80)) {
+				/* We cannot fold non-ascii characters here */
+				regexp_literal_finish (cur, best);
+			}
+			else {
+				g_string_append_c (cur, c);
+			}
+		}
+	}
+
+	regexp_literal_finish (cur, best);
+
+	if (valid && best->len >= REGEXP_MIN_LITERAL) {
+		res = rspamd_mempool_strdup (pool, best->str);
+	}
+
+	g_string_free (cur, TRUE);
+	g_string_free (best, TRUE);
+
+	return res;
+}
+
 /*
  * Rspamd regexp utility functions
  */
@@ -701,6 +1023,7 @@ parse_regexp (rspamd_mempool_t * pool, const gchar *line, gboolean raw_mode)
 		/* Assume that line without // is just a header name */
 		result->header = rspamd_mempool_strdup (pool, line);
 		result->type = REGEXP_HEADER;
+		result->id = rspamd_regexp_next_id ();
 		return result;
 	}
 	else {
@@ -857,6 +1180,9 @@ parse_regexp (rspamd_mempool_t * pool, const gchar *line, gboolean raw_mode)
 		return NULL;
 	}
 
+	result->literal = regexp_extract_literal (pool, begin, end, regexp_flags);
+	result->id = rspamd_regexp_next_id ();
+
 	/* Add to cache for further usage */
 	re_cache_add (result->regexp_text, result, pool);
 	return result;
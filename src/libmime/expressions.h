@@ -64,6 +64,12 @@ struct rspamd_regexp * parse_regexp (rspamd_mempool_t *pool,
 	const gchar *line,
 	gboolean raw_mode);
 
+/**
+ * Get number of regexps parsed so far, regexps ids are less than this number
+ * @return number of regexps
+ */
+guint rspamd_regexps_count (void);
+
 /**
  * Parse composites line to composites structure (eg. "SYMBOL1&SYMBOL2|!SYMBOL3")
  * @param pool memory pool to use
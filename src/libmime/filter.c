@@ -255,7 +255,12 @@ insert_result_common (struct rspamd_task *task,
 	if (task->cfg->cache) {
 		item = g_hash_table_lookup (task->cfg->cache->items_by_symbol, symbol);
 		if (item != NULL) {
-			item->s->frequency++;
+			/* Statistics are shared between workers */
+			g_atomic_int_inc ((gint *)&item->s->frequency);
+
+			if (flag > 1.0 || flag < 0) {
+				mark_symbol_multiplied (task, task->cfg->cache, item);
+			}
 		}
 	}
 
@@ -357,7 +362,6 @@ rspamd_process_filters (struct rspamd_task *task)
 {
 	GList *cur;
 	struct metric *metric;
-	gpointer item = NULL;
 
 	/* Insert default metric to be sure that it exists all the time */
 	rspamd_create_metric_result (task, DEFAULT_METRIC);
@@ -373,21 +377,32 @@ rspamd_process_filters (struct rspamd_task *task)
 	}
 
 	/* Process metrics symbols */
-	while (call_symbol_callback (task, task->cfg->cache, &item)) {
+	while (call_symbol_callback (task, task->cfg->cache, &task->checkpoint)) {
+		if (task->pass_all_filters) {
+			continue;
+		}
 		/* Check reject actions */
 		cur = task->cfg->metrics_list;
 		while (cur) {
 			metric = cur->data;
-			if (!task->pass_all_filters &&
-				metric->actions[METRIC_ACTION_REJECT].score > 0 &&
+			if (metric->actions[METRIC_ACTION_REJECT].score > 0 &&
 				check_metric_is_spam (task, metric)) {
 				msg_info ("<%s> has already scored more than %.2f, so do not "
 						"plan any more checks", task->message_id,
 						metric->actions[METRIC_ACTION_REJECT].score);
+				/* Do not call delayed symbols as well */
+				task->checkpoint = NULL;
 				return 1;
 			}
 			cur = g_list_next (cur);
 		}
+		/* Check whether the remaining symbols can change any action */
+		if (check_cache_bounds (task, task->cfg->cache, task->checkpoint)) {
+			msg_info ("<%s> cannot change action by the remaining rules, so "
+					"do not plan any more checks", task->message_id);
+			task->checkpoint = NULL;
+			return 1;
+		}
 	}
 
 	task->state = WAIT_FILTER;
@@ -645,18 +660,23 @@ struct classifiers_cbdata {
 };
 
 
-void
+gboolean
 rspamd_process_statistics (struct rspamd_task *task)
 {
 	if (task->is_skipped) {
-		return;
+		return TRUE;
 	}
 
 	/* TODO: handle err here */
-	rspamd_stat_classify (task, task->cfg->lua_state, NULL);
+	if (rspamd_stat_classify (task, task->cfg->lua_state, NULL) ==
+			RSPAMD_STAT_PROCESS_DELAYED) {
+		return FALSE;
+	}
 
 	/* Process results */
 	rspamd_make_composites (task);
+
+	return TRUE;
 }
 
 void
@@ -859,7 +879,7 @@ rspamd_check_action_metric (struct rspamd_task *task,
 	return METRIC_ACTION_NOACTION;
 }
 
-gboolean
+rspamd_stat_result_t
 rspamd_learn_task_spam (struct rspamd_classifier_config *cl,
 	struct rspamd_task *task,
 	gboolean is_spam,
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "symbols_cache.h"
 #include "task.h"
+#include "libstat/stat_api.h"
 
 struct rspamd_task;
 struct rspamd_settings;
@@ -98,8 +99,10 @@ gint rspamd_process_filters (struct rspamd_task *task);
 /**
  * Process message with statfiles
  * @param task worker's task that present message from user
+ * @return FALSE if statfiles are loaded asynchronously, then this function
+ * should be called once more when events of the task session are finished
  */
-void rspamd_process_statistics (struct rspamd_task *task);
+gboolean rspamd_process_statistics (struct rspamd_task *task);
 
 /**
  * Process message with statfiles threaded
@@ -156,9 +159,10 @@ double rspamd_factor_consolidation_func (struct rspamd_task *task,
  * @param statfile symbol of statfile
  * @param task worker's task object
  * @param err pointer to GError
- * @return true if learn succeed
+ * @return RSPAMD_STAT_PROCESS_OK if learn succeed, if statfiles are learned
+ * asynchronously the result is returned by the next call
  */
-gboolean rspamd_learn_task_spam (struct rspamd_classifier_config *cl,
+rspamd_stat_result_t rspamd_learn_task_spam (struct rspamd_classifier_config *cl,
 	struct rspamd_task *task,
 	gboolean is_spam,
 	GError **err);
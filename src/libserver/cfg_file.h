@@ -74,6 +74,8 @@ struct rspamd_regexp {
 	gboolean is_test;                               /**< true if this expression must be tested				*/
 	gboolean is_raw;                                /**< true if this regexp is done by raw matching		*/
 	gboolean is_strong;                             /**< true if headers search must be case sensitive		*/
+	gchar *literal;                                 /**< literal that must be present in matched text		*/
+	guint id;                                       /**< dense id of regexp used for results caching		*/
 };
 
 /**
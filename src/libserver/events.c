@@ -100,6 +100,7 @@ new_async_session (rspamd_mempool_t * pool, session_finalizer_t fin,
 		new->cond);
 #endif
 	new->threads = 0;
+	new->cur_watcher = NULL;
 
 	rspamd_mempool_add_destructor (pool,
 		(rspamd_mempool_destruct_t) g_hash_table_destroy,
@@ -115,6 +116,7 @@ register_async_event (struct rspamd_async_session *session,
 	GQuark subsystem)
 {
 	struct rspamd_async_event *new;
+	struct rspamd_async_watcher *w;
 
 	if (session == NULL) {
 		msg_info ("session is NULL");
@@ -127,6 +129,11 @@ register_async_event (struct rspamd_async_session *session,
 	new->fin = fin;
 	new->user_data = user_data;
 	new->subsystem = subsystem;
+	new->w = session->cur_watcher;
+
+	for (w = new->w; w != NULL; w = w->parent) {
+		w->remain ++;
+	}
 
 	g_hash_table_insert (session->events, new, new);
 
@@ -144,6 +151,7 @@ remove_normal_event (struct rspamd_async_session *session,
 	void *ud)
 {
 	struct rspamd_async_event search_ev, *found_ev;
+	struct rspamd_async_watcher *w = NULL, *parent;
 
 	if (session == NULL) {
 		msg_info ("session is NULL");
@@ -160,18 +168,32 @@ remove_normal_event (struct rspamd_async_session *session,
 		msg_debug ("removed event: %p, subsystem: %s, pending %d events", ud,
 			g_quark_to_string (found_ev->subsystem),
 			g_hash_table_size (session->events));
+		w = found_ev->w;
 		/* Remove event */
 		fin (ud);
 	}
 	g_mutex_unlock (session->mtx);
 
+	/* Inner watchers are notified first */
+	while (w != NULL) {
+		parent = w->parent;
+
+		if (--w->remain == 0) {
+			w->cb (w->user_data);
+		}
+
+		w = parent;
+	}
+
 	check_session_pending (session);
 }
 
 static gboolean
-rspamd_session_destroy (gpointer k, gpointer v, gpointer unused)
+rspamd_session_destroy (gpointer k, gpointer v, gpointer ud)
 {
 	struct rspamd_async_event *ev = v;
+	struct rspamd_async_watcher *w;
+	GPtrArray *finished = ud;
 
 	/* Call event's finalizer */
 	msg_debug ("removed event on destroy: %p, subsystem: %s", ev->user_data,
@@ -181,12 +203,23 @@ rspamd_session_destroy (gpointer k, gpointer v, gpointer unused)
 		ev->fin (ev->user_data);
 	}
 
+	/* Watchers are called when the mutex is unlocked */
+	for (w = ev->w; w != NULL; w = w->parent) {
+		if (--w->remain == 0) {
+			g_ptr_array_add (finished, w);
+		}
+	}
+
 	return TRUE;
 }
 
 gboolean
 destroy_session (struct rspamd_async_session *session)
 {
+	struct rspamd_async_watcher *w;
+	GPtrArray *finished;
+	guint i;
+
 	if (session == NULL) {
 		msg_info ("session is NULL");
 		return FALSE;
@@ -200,14 +233,23 @@ destroy_session (struct rspamd_async_session *session)
 	}
 
 	session->wanna_die = TRUE;
+	finished = g_ptr_array_new ();
 
 	g_hash_table_foreach_remove (session->events,
 		rspamd_session_destroy,
-		session);
+		finished);
 
 	/* Mutex can be destroyed here */
 	g_mutex_unlock (session->mtx);
 
+	/* Events finalized on destroy are accounted by their watchers as well */
+	for (i = 0; i < finished->len; i ++) {
+		w = g_ptr_array_index (finished, i);
+		w->cb (w->user_data);
+	}
+
+	g_ptr_array_free (finished, TRUE);
+
 	if (session->cleanup != NULL) {
 		session->cleanup (session->user_data);
 	}
@@ -273,3 +315,35 @@ remove_async_thread (struct rspamd_async_session *session)
 	}
 	msg_debug ("removed thread: pending %d thread", session->threads);
 }
+
+void
+rspamd_session_watch_start (struct rspamd_async_session *session,
+	event_watcher_t cb,
+	void *user_data)
+{
+	struct rspamd_async_watcher *w;
+
+	g_assert (session != NULL);
+
+	w = rspamd_mempool_alloc (session->pool, sizeof (*w));
+	w->cb = cb;
+	w->remain = 0;
+	w->user_data = user_data;
+	w->parent = session->cur_watcher;
+
+	session->cur_watcher = w;
+}
+
+guint
+rspamd_session_watch_stop (struct rspamd_async_session *session)
+{
+	guint remain;
+
+	g_assert (session != NULL);
+	g_assert (session->cur_watcher != NULL);
+
+	remain = session->cur_watcher->remain;
+	session->cur_watcher = session->cur_watcher->parent;
+
+	return remain;
+}
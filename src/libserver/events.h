@@ -8,12 +8,21 @@ struct rspamd_async_event;
 
 typedef void (*event_finalizer_t)(void *user_data);
 typedef gboolean (*session_finalizer_t)(void *user_data);
+typedef void (*event_watcher_t)(void *user_data);
+
+struct rspamd_async_watcher {
+	event_watcher_t cb;
+	guint remain;
+	void *user_data;
+	struct rspamd_async_watcher *parent;
+};
 
 struct rspamd_async_event {
 	GQuark subsystem;
 	event_finalizer_t fin;
 	void *user_data;
 	guint ref;
+	struct rspamd_async_watcher *w;
 };
 
 struct rspamd_async_session {
@@ -27,6 +36,7 @@ struct rspamd_async_session {
 	guint threads;
 	GMutex *mtx;
 	GCond *cond;
+	struct rspamd_async_watcher *cur_watcher;
 };
 
 /**
@@ -64,6 +74,7 @@ void remove_normal_event (struct rspamd_async_session *session,
 
 /**
  * Must be called at the end of session, it calls fin functions for all non-forced callbacks
+ * and callbacks of watchers which events are finalized
  * @return true if the whole session was destroyed and false if there are forced events
  */
 gboolean destroy_session (struct rspamd_async_session *session);
@@ -87,4 +98,25 @@ void register_async_thread (struct rspamd_async_session *session);
  */
 void remove_async_thread (struct rspamd_async_session *session);
 
+/**
+ * Start watching for events registered in session: all events registered
+ * until rspamd_session_watch_stop is called are attached to a watcher.
+ * Watchers could be nested, in this case events are attached to the outer
+ * watchers as well
+ * @param session session object
+ * @param cb callback that is called when all attached events are removed
+ * @param user_data data for callback
+ */
+void rspamd_session_watch_start (struct rspamd_async_session *session,
+	event_watcher_t cb,
+	void *user_data);
+
+/**
+ * Stop watching for events, callback of watcher is not called if no events
+ * have been attached to it
+ * @param session session object
+ * @return number of events attached to the current watcher
+ */
+guint rspamd_session_watch_stop (struct rspamd_async_session *session);
+
 #endif /* RSPAMD_EVENTS_H */
@@ -25,11 +25,35 @@
 #include "main.h"
 #include "fuzzy_backend.h"
 #include "fuzzy_storage.h"
+#include "fuzzy_index.h"
+#include "bloom.h"
+#include "xxhash.h"
 
 #include <sqlite3.h>
 
 /* Magic sequence for hashes file */
 #define FUZZY_FILE_MAGIC "rsh"
+/* Default number of queued writes that forces commit */
+#define FUZZY_DEFAULT_MAX_PENDING 1000
+/* Failed writes are retried until the queue is this times larger than limit */
+#define FUZZY_PENDING_RETRY_FACTOR 10
+/* Time to wait for a database lock held by another process in milliseconds */
+#define FUZZY_BUSY_TIMEOUT 1000
+/* Number of bloom filter counters per element, gives about 0.06% of false positives */
+#define FUZZY_BLOOM_COUNTERS 16
+/*
+ * Number of counters per shingle, each digest adds RSPAMD_SHINGLE_SIZE
+ * elements, so shingles filter uses less counters per element
+ */
+#define FUZZY_BLOOM_SHINGLE_COUNTERS 10
+/* Minimal number of digests bloom filters are created for */
+#define FUZZY_BLOOM_MIN_SIZE 1024
+/* Default time covered by a single partition (1 day) */
+#define FUZZY_DEFAULT_PARTITION_TIME 86400
+/* Number of the newest partitions that are refreshed by read only backend */
+#define FUZZY_REFRESH_PARTITIONS 2
+/* Updates that are read from the log at once */
+#define FUZZY_LOG_READ_CHUNK 1024
 
 struct rspamd_legacy_fuzzy_node {
 	gint32 value;
@@ -38,23 +62,117 @@ struct rspamd_legacy_fuzzy_node {
 	rspamd_fuzzy_t h;
 };
 
+enum rspamd_fuzzy_pending_type {
+	RSPAMD_FUZZY_PENDING_INSERT = 0,
+	RSPAMD_FUZZY_PENDING_UPDATE,
+	RSPAMD_FUZZY_PENDING_DELETE
+};
+
+/*
+ * Write operation that is waiting for the next commit
+ */
+struct rspamd_fuzzy_pending_op {
+	enum rspamd_fuzzy_pending_type type;
+	gint64 id;
+	gint64 time;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+};
+
+enum rspamd_fuzzy_partition_stmt_idx {
+	RSPAMD_FUZZY_PARTITION_INSERT = 0,
+	RSPAMD_FUZZY_PARTITION_UPDATE,
+	RSPAMD_FUZZY_PARTITION_INSERT_SHINGLE,
+	RSPAMD_FUZZY_PARTITION_CHECK,
+	RSPAMD_FUZZY_PARTITION_CHECK_SHINGLES,
+	RSPAMD_FUZZY_PARTITION_DELETE,
+	RSPAMD_FUZZY_PARTITION_COUNT,
+	RSPAMD_FUZZY_PARTITION_LOAD_DIGESTS,
+	RSPAMD_FUZZY_PARTITION_LOAD_SHINGLES,
+	RSPAMD_FUZZY_PARTITION_MAX_ID,
+	RSPAMD_FUZZY_PARTITION_BLOOM_DIGESTS,
+	RSPAMD_FUZZY_PARTITION_BLOOM_SHINGLES,
+	RSPAMD_FUZZY_PARTITION_MAX
+};
+
+/*
+ * Digests are stored in time partitions: tables digests_<start> and
+ * shingles_<start>, where start is the time of the first digest rounded down
+ * to the partition time. New digests are always added to the newest
+ * partition, so expiration just drops the old partitions.
+ */
+struct rspamd_fuzzy_partition {
+	gint64 start;
+	gsize count;
+	sqlite3_stmt *stmts[RSPAMD_FUZZY_PARTITION_MAX];
+	/*
+	 * Bloom filters of the digests and shingles stored in the partition that
+	 * allow to skip sqlite lookups for the definite misses
+	 */
+	rspamd_bloom_filter_t *digests_bloom;
+	rspamd_bloom_filter_t *shingles_bloom;
+	/* Number of digests the filters are created for */
+	gsize bloom_size;
+	/* Removed digests that are still counted by the filters */
+	gsize bloom_stale;
+	/*
+	 * The last digest id loaded to the digests and shingles filters, ids are
+	 * never reused, so the newer digests always have greater ids
+	 */
+	gint64 bloom_digest_id;
+	gint64 bloom_shingle_id;
+	gboolean seen;
+};
+
 struct rspamd_fuzzy_backend {
 	sqlite3 *db;
 	char *path;
 	gsize count;
 	gsize expired;
+	struct rspamd_fuzzy_index *index;
+	/* Partitions sorted from the newest to the oldest */
+	GPtrArray *partitions;
+	gint64 partition_time;
+	gboolean use_bloom;
+	/* The last expire time passed to check or sync */
+	gint64 expire;
+	/* Queued writes */
+	GArray *pending;
+	guint max_pending;
+	/* Id for the next inserted digest, the last used id is persistent */
+	gint64 next_id;
+	/*
+	 * Digests modified by the queued writes, used when there is no full
+	 * memory index to make pending writes visible for checks
+	 */
+	struct rspamd_fuzzy_index *pending_index;
+	GHashTable *pending_deleted;
+	/* Database is modified by another process */
+	gboolean readonly;
+	/*
+	 * Log of the applied update commands used for replication: commands are
+	 * queued with writes and get sequence numbers on commit
+	 */
+	gsize log_size;
+	guint64 log_seq;
+	GArray *pending_log;
+	/* The last update received from the master */
+	guint64 checkpoint;
+	gboolean checkpoint_changed;
+	/* The last flush has failed, its writes are kept for the next one */
+	gboolean flush_failed;
 };
 
 
+/* Layout used by the previous versions, it is converted to partitions */
 const char *create_tables_sql =
 		"BEGIN;"
-		"CREATE TABLE digests("
+		"CREATE TABLE IF NOT EXISTS digests("
 		"id INTEGER PRIMARY KEY,"
 		"flag INTEGER NOT NULL,"
 		"digest TEXT NOT NULL,"
 		"value INTEGER,"
 		"time INTEGER);"
-		"CREATE TABLE shingles("
+		"CREATE TABLE IF NOT EXISTS shingles("
 		"value INTEGER NOT NULL,"
 		"number INTEGER NOT NULL,"
 		"digest_id INTEGER REFERENCES digests(id) ON DELETE CASCADE "
@@ -66,20 +184,67 @@ const char *create_index_sql =
 		"CREATE INDEX IF NOT EXISTS t ON digests(time);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 		"COMMIT;";
+/* Partition templates, all placeholders are replaced by the partition start */
+const char *create_partition_sql =
+		"CREATE TABLE IF NOT EXISTS digests_%L("
+		"id INTEGER PRIMARY KEY,"
+		"flag INTEGER NOT NULL,"
+		"digest TEXT NOT NULL,"
+		"value INTEGER,"
+		"time INTEGER);"
+		"CREATE TABLE IF NOT EXISTS shingles_%L("
+		"value INTEGER NOT NULL,"
+		"number INTEGER NOT NULL,"
+		"digest_id INTEGER NOT NULL);"
+		"CREATE UNIQUE INDEX IF NOT EXISTS d_%L ON digests_%L(digest);"
+		"CREATE UNIQUE INDEX IF NOT EXISTS s_%L ON shingles_%L(value, number);"
+		"CREATE INDEX IF NOT EXISTS sd_%L ON shingles_%L(digest_id);";
+/* Index used to load new shingles, partitions of old versions lack it */
+const char *create_shingles_index_sql =
+		"CREATE INDEX IF NOT EXISTS sd_%L ON shingles_%L(digest_id);";
+const char *drop_partition_sql =
+		"DROP TABLE IF EXISTS shingles_%L;"
+		"DROP TABLE IF EXISTS digests_%L;";
+/* Arguments are start, start, end, start, start */
+const char *migrate_partition_sql =
+		"INSERT INTO digests_%L SELECT id, flag, digest, value, time "
+		"FROM digests WHERE COALESCE(time, 0) >= %L AND "
+		"COALESCE(time, 0) < %L;"
+		"INSERT OR REPLACE INTO shingles_%L SELECT s.value, s.number, "
+		"s.digest_id FROM shingles AS s JOIN digests_%L AS d "
+		"ON d.id=s.digest_id;";
+const char *drop_legacy_sql =
+		"DROP TABLE IF EXISTS shingles;"
+		"DROP TABLE IF EXISTS digests;";
+const char *create_log_sql =
+		"CREATE TABLE IF NOT EXISTS updates("
+		"seq INTEGER PRIMARY KEY,"
+		"cmd BLOB NOT NULL);"
+		"CREATE TABLE IF NOT EXISTS replication("
+		"id INTEGER PRIMARY KEY,"
+		"seq INTEGER NOT NULL);"
+		"CREATE TABLE IF NOT EXISTS digest_ids("
+		"id INTEGER PRIMARY KEY,"
+		"last INTEGER NOT NULL);";
+
 enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_START = 0,
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK,
-	RSPAMD_FUZZY_BACKEND_INSERT,
-	RSPAMD_FUZZY_BACKEND_UPDATE,
-	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-	RSPAMD_FUZZY_BACKEND_CHECK,
-	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-	RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
-	RSPAMD_FUZZY_BACKEND_DELETE,
-	RSPAMD_FUZZY_BACKEND_COUNT,
-	RSPAMD_FUZZY_BACKEND_EXPIRE,
 	RSPAMD_FUZZY_BACKEND_VACUUM,
+	RSPAMD_FUZZY_BACKEND_PARTITIONS,
+	RSPAMD_FUZZY_BACKEND_LEGACY_EXISTS,
+	RSPAMD_FUZZY_BACKEND_LEGACY_INSERT,
+	RSPAMD_FUZZY_BACKEND_LEGACY_PARTITIONS,
+	RSPAMD_FUZZY_BACKEND_LOG_INSERT,
+	RSPAMD_FUZZY_BACKEND_LOG_TRIM,
+	RSPAMD_FUZZY_BACKEND_LOG_LAST,
+	RSPAMD_FUZZY_BACKEND_LOG_FIRST,
+	RSPAMD_FUZZY_BACKEND_LOG_READ,
+	RSPAMD_FUZZY_BACKEND_CHECKPOINT_GET,
+	RSPAMD_FUZZY_BACKEND_CHECKPOINT_SET,
+	RSPAMD_FUZZY_BACKEND_LAST_ID_GET,
+	RSPAMD_FUZZY_BACKEND_LAST_ID_SET,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
 static struct rspamd_fuzzy_stmts {
@@ -112,77 +277,235 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_INSERT,
-		.sql = "INSERT INTO digests(flag, digest, value, time) VALUES"
-				"(?1, ?2, ?3, ?4);",
-		.args = "SDII",
+		.idx = RSPAMD_FUZZY_BACKEND_VACUUM,
+		.sql = "VACUUM;",
+		.args = "",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_UPDATE,
-		.sql = "UPDATE digests SET value = value + ?1 WHERE "
-				"digest==?2;",
-		.args = "ID",
+		.idx = RSPAMD_FUZZY_BACKEND_PARTITIONS,
+		.sql = "SELECT name FROM sqlite_master WHERE type='table' AND "
+				"name LIKE 'digests\\_%' ESCAPE '\\';",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LEGACY_EXISTS,
+		.sql = "SELECT name FROM sqlite_master WHERE type='table' AND "
+				"name='digests';",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LEGACY_INSERT,
+		.sql = "INSERT INTO digests(id, flag, digest, value, time) VALUES"
+				"(?1, ?2, ?3, ?4, ?5);",
+		.args = "ISDII",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
-				"VALUES (?1, ?2, ?3);",
-		.args = "III",
+		.idx = RSPAMD_FUZZY_BACKEND_LEGACY_PARTITIONS,
+		.sql = "SELECT DISTINCT COALESCE(time, 0) - COALESCE(time, 0) % ?1 "
+				"FROM digests;",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_INSERT,
+		.sql = "INSERT INTO updates(seq, cmd) VALUES (?1, ?2);",
+		.args = "IB",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_CHECK,
-		.sql = "SELECT value, time, flag FROM digests WHERE digest==?1;",
-		.args = "D",
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_TRIM,
+		.sql = "DELETE FROM updates WHERE seq <= ?1;",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_LAST,
+		.sql = "SELECT MAX(seq) FROM updates;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_FIRST,
+		.sql = "SELECT MIN(seq) FROM updates;",
+		.args = "",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-		.sql = "SELECT digest_id FROM shingles WHERE value=?1 AND number=?2",
-		.args = "IS",
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_READ,
+		.sql = "SELECT seq, cmd FROM updates WHERE seq > ?1 "
+				"ORDER BY seq LIMIT ?2;",
+		.args = "II",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
-		.sql = "SELECT digest, value, time, flag FROM digests WHERE id=?1",
-		.args = "I",
+		.idx = RSPAMD_FUZZY_BACKEND_CHECKPOINT_GET,
+		.sql = "SELECT seq FROM replication WHERE id = 0;",
+		.args = "",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_DELETE,
-		.sql = "DELETE FROM digests WHERE digest==?1;",
-		.args = "D",
+		.idx = RSPAMD_FUZZY_BACKEND_CHECKPOINT_SET,
+		.sql = "INSERT OR REPLACE INTO replication(id, seq) VALUES (0, ?1);",
+		.args = "I",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_COUNT,
-		.sql = "SELECT COUNT(*) FROM digests;",
+		.idx = RSPAMD_FUZZY_BACKEND_LAST_ID_GET,
+		.sql = "SELECT last FROM digest_ids WHERE id = 0;",
 		.args = "",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE,
-		.sql = "DELETE FROM digests WHERE time < ?1;",
+		.idx = RSPAMD_FUZZY_BACKEND_LAST_ID_SET,
+		.sql = "INSERT OR REPLACE INTO digest_ids(id, last) VALUES (0, ?1);",
 		.args = "I",
 		.stmt = NULL,
 		.result = SQLITE_DONE
+	}
+};
+
+/*
+ * Statements of a partition, table names are formatted with the partition
+ * start (up to two times)
+ */
+static const struct rspamd_fuzzy_partition_stmts {
+	enum rspamd_fuzzy_partition_stmt_idx idx;
+	const gchar *sql;
+	const gchar *args;
+	gint result;
+} partition_stmts[RSPAMD_FUZZY_PARTITION_MAX] =
+{
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_INSERT,
+		.sql = "INSERT INTO digests_%L(id, flag, digest, value, time) VALUES"
+				"(?1, ?2, ?3, ?4, ?5);",
+		.args = "ISDII",
+		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_VACUUM,
-		.sql = "VACUUM;",
+		.idx = RSPAMD_FUZZY_PARTITION_UPDATE,
+		.sql = "UPDATE digests_%L SET value = value + ?1 WHERE "
+				"digest==?2;",
+		.args = "ID",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_INSERT_SHINGLE,
+		.sql = "INSERT OR REPLACE INTO shingles_%L(value, number, digest_id) "
+				"VALUES (?1, ?2, ?3);",
+		.args = "III",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_CHECK,
+		.sql = "SELECT value, time, flag, id FROM digests_%L WHERE digest==?1;",
+		.args = "D",
+		.result = SQLITE_ROW
+	},
+	{
+		/*
+		 * Select digest with the most shingles matched, arguments are
+		 * bound by rspamd_fuzzy_backend_run_shingles
+		 */
+		.idx = RSPAMD_FUZZY_PARTITION_CHECK_SHINGLES,
+		.sql = "SELECT d.digest, d.value, d.time, d.flag, COUNT(*) AS cnt "
+				"FROM shingles_%L AS s JOIN digests_%L AS d ON d.id=s.digest_id "
+				"WHERE "
+				"(s.value=?1 AND s.number=0) OR "
+				"(s.value=?2 AND s.number=1) OR "
+				"(s.value=?3 AND s.number=2) OR "
+				"(s.value=?4 AND s.number=3) OR "
+				"(s.value=?5 AND s.number=4) OR "
+				"(s.value=?6 AND s.number=5) OR "
+				"(s.value=?7 AND s.number=6) OR "
+				"(s.value=?8 AND s.number=7) OR "
+				"(s.value=?9 AND s.number=8) OR "
+				"(s.value=?10 AND s.number=9) OR "
+				"(s.value=?11 AND s.number=10) OR "
+				"(s.value=?12 AND s.number=11) OR "
+				"(s.value=?13 AND s.number=12) OR "
+				"(s.value=?14 AND s.number=13) OR "
+				"(s.value=?15 AND s.number=14) OR "
+				"(s.value=?16 AND s.number=15) OR "
+				"(s.value=?17 AND s.number=16) OR "
+				"(s.value=?18 AND s.number=17) OR "
+				"(s.value=?19 AND s.number=18) OR "
+				"(s.value=?20 AND s.number=19) OR "
+				"(s.value=?21 AND s.number=20) OR "
+				"(s.value=?22 AND s.number=21) OR "
+				"(s.value=?23 AND s.number=22) OR "
+				"(s.value=?24 AND s.number=23) OR "
+				"(s.value=?25 AND s.number=24) OR "
+				"(s.value=?26 AND s.number=25) OR "
+				"(s.value=?27 AND s.number=26) OR "
+				"(s.value=?28 AND s.number=27) OR "
+				"(s.value=?29 AND s.number=28) OR "
+				"(s.value=?30 AND s.number=29) OR "
+				"(s.value=?31 AND s.number=30) OR "
+				"(s.value=?32 AND s.number=31) "
+				"GROUP BY s.digest_id ORDER BY cnt DESC LIMIT 1;",
 		.args = "",
-		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_DELETE,
+		.sql = "DELETE FROM digests_%L WHERE digest==?1;",
+		.args = "D",
 		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_COUNT,
+		.sql = "SELECT COUNT(*) FROM digests_%L;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_LOAD_DIGESTS,
+		.sql = "SELECT id, flag, digest, value, time FROM digests_%L;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_LOAD_SHINGLES,
+		.sql = "SELECT value, number, digest_id FROM shingles_%L;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_MAX_ID,
+		.sql = "SELECT MAX(id) FROM digests_%L;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_BLOOM_DIGESTS,
+		.sql = "SELECT id, digest FROM digests_%L WHERE id > ?1;",
+		.args = "I",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_PARTITION_BLOOM_SHINGLES,
+		.sql = "SELECT digest_id, value, number FROM shingles_%L "
+				"WHERE digest_id > ?1;",
+		.args = "I",
+		.result = SQLITE_ROW
 	}
 };
 
@@ -192,27 +515,57 @@ rspamd_fuzzy_backend_quark(void)
 	return g_quark_from_static_string ("fuzzy-storage-backend");
 }
 
-static gboolean
-rspamd_fuzzy_backend_prepare_stmts (struct rspamd_fuzzy_backend *bk, GError **err)
+/*
+ * Bind arguments described by argtypes and execute a statement
+ */
+static int
+rspamd_fuzzy_backend_step (struct rspamd_fuzzy_backend *bk,
+		sqlite3_stmt *stmt, const gchar *argtypes, gint result, va_list ap)
 {
-	int i;
+	int retcode;
+	int i, j;
+	const void *blob;
 
-	for (i = 0; i < RSPAMD_FUZZY_BACKEND_MAX; i ++) {
-		if (prepared_stmts[i].stmt != NULL) {
-			/* Skip already prepared statements */
-			continue;
-		}
-		if (sqlite3_prepare_v2 (bk->db, prepared_stmts[i].sql, -1,
-				&prepared_stmts[i].stmt, NULL) != SQLITE_OK) {
-			g_set_error (err, rspamd_fuzzy_backend_quark (),
-				-1, "Cannot initialize prepared sql `%s`: %s",
-				prepared_stmts[i].sql, sqlite3_errmsg (bk->db));
+	msg_debug ("executing `%s`", sqlite3_sql (stmt));
+	sqlite3_reset (stmt);
 
-			return FALSE;
+	for (i = 0; argtypes[i] != '\0'; i++) {
+		switch (argtypes[i]) {
+		case 'T':
+			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), -1,
+					SQLITE_STATIC);
+			break;
+		case 'I':
+			sqlite3_bind_int64 (stmt, i + 1, va_arg (ap, gint64));
+			break;
+		case 'S':
+			sqlite3_bind_int (stmt, i + 1, va_arg (ap, gint));
+			break;
+		case 'D':
+			/* Special case for digests variable */
+			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), 64,
+					SQLITE_STATIC);
+			break;
+		case 'B':
+			/* Blob is passed as pointer and length */
+			blob = va_arg (ap, const void*);
+			j = va_arg (ap, gint);
+			sqlite3_bind_blob (stmt, i + 1, blob, j, SQLITE_STATIC);
+			break;
 		}
 	}
 
-	return TRUE;
+	retcode = sqlite3_step (stmt);
+
+	if (retcode == result) {
+		return SQLITE_OK;
+	}
+	else if (retcode != SQLITE_DONE) {
+		msg_debug ("failed to execute query %s: %d, %s", sqlite3_sql (stmt),
+				retcode, sqlite3_errmsg (bk->db));
+	}
+
+	return retcode;
 }
 
 static int
@@ -221,8 +574,6 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *bk, int idx, ...)
 	int retcode;
 	va_list ap;
 	sqlite3_stmt *stmt;
-	int i;
-	const char *argtypes;
 
 	if (idx < 0 || idx >= RSPAMD_FUZZY_BACKEND_MAX) {
 
@@ -241,45 +592,110 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *bk, int idx, ...)
 		stmt = prepared_stmts[idx].stmt;
 	}
 
-	msg_debug ("executing `%s`", prepared_stmts[idx].sql);
-	argtypes = prepared_stmts[idx].args;
-	sqlite3_reset (stmt);
 	va_start (ap, idx);
+	retcode = rspamd_fuzzy_backend_step (bk, stmt, prepared_stmts[idx].args,
+			prepared_stmts[idx].result, ap);
+	va_end (ap);
 
-	for (i = 0; argtypes[i] != '\0'; i++) {
-		switch (argtypes[i]) {
-		case 'T':
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), -1,
-					SQLITE_STATIC);
-			break;
-		case 'I':
-			sqlite3_bind_int64 (stmt, i + 1, va_arg (ap, gint64));
-			break;
-		case 'S':
-			sqlite3_bind_int (stmt, i + 1, va_arg (ap, gint));
-			break;
-		case 'D':
-			/* Special case for digests variable */
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), 64,
-					SQLITE_STATIC);
-			break;
+	return retcode;
+}
+
+static sqlite3_stmt *
+rspamd_fuzzy_partition_stmt (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_partition *part, int idx)
+{
+	gchar sql[2048];
+
+	if (part->stmts[idx] == NULL) {
+		rspamd_snprintf (sql, sizeof (sql), partition_stmts[idx].sql,
+				part->start, part->start);
+
+		if (sqlite3_prepare_v2 (bk->db, sql, -1, &part->stmts[idx], NULL)
+				!= SQLITE_OK) {
+			msg_err ("Cannot initialize prepared sql `%s`: %s",
+					sql, sqlite3_errmsg (bk->db));
+			part->stmts[idx] = NULL;
 		}
 	}
 
+	return part->stmts[idx];
+}
+
+static int
+rspamd_fuzzy_backend_run_part_stmt (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_partition *part, int idx, ...)
+{
+	int retcode;
+	va_list ap;
+	sqlite3_stmt *stmt;
+
+	if ((stmt = rspamd_fuzzy_partition_stmt (bk, part, idx)) == NULL) {
+		return SQLITE_ERROR;
+	}
+
+	va_start (ap, idx);
+	retcode = rspamd_fuzzy_backend_step (bk, stmt, partition_stmts[idx].args,
+			partition_stmts[idx].result, ap);
 	va_end (ap);
+
+	return retcode;
+}
+
+/*
+ * Bind all shingles of a command to the shingles query of a partition and
+ * execute it
+ */
+static int
+rspamd_fuzzy_backend_run_shingles (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_partition *part,
+		const struct rspamd_fuzzy_shingle_cmd *shcmd)
+{
+	const int idx = RSPAMD_FUZZY_PARTITION_CHECK_SHINGLES;
+	int retcode, i;
+	sqlite3_stmt *stmt;
+
+	if ((stmt = rspamd_fuzzy_partition_stmt (bk, part, idx)) == NULL) {
+		return SQLITE_ERROR;
+	}
+
+	sqlite3_reset (stmt);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		sqlite3_bind_int64 (stmt, i + 1, shcmd->sgl.hashes[i]);
+	}
+
 	retcode = sqlite3_step (stmt);
 
-	if (retcode == prepared_stmts[idx].result) {
+	if (retcode == partition_stmts[idx].result) {
 		return SQLITE_OK;
 	}
 	else if (retcode != SQLITE_DONE) {
-		msg_debug ("failed to execute query %s: %d, %s", prepared_stmts[idx].sql,
+		msg_debug ("failed to execute query %s: %d, %s", sqlite3_sql (stmt),
 				retcode, sqlite3_errmsg (bk->db));
 	}
 
 	return retcode;
 }
 
+static void
+rspamd_fuzzy_partition_free (struct rspamd_fuzzy_partition *part)
+{
+	int i;
+
+	for (i = 0; i < RSPAMD_FUZZY_PARTITION_MAX; i++) {
+		if (part->stmts[i] != NULL) {
+			sqlite3_finalize (part->stmts[i]);
+		}
+	}
+
+	if (part->digests_bloom != NULL) {
+		rspamd_bloom_destroy (part->digests_bloom);
+		rspamd_bloom_destroy (part->shingles_bloom);
+	}
+
+	g_slice_free1 (sizeof (*part), part);
+}
+
 static void
 rspamd_fuzzy_backend_close_stmts (struct rspamd_fuzzy_backend *bk)
 {
@@ -292,9 +708,44 @@ rspamd_fuzzy_backend_close_stmts (struct rspamd_fuzzy_backend *bk)
 		}
 	}
 
+	if (bk->partitions != NULL) {
+		for (i = 0; i < (int)bk->partitions->len; i++) {
+			rspamd_fuzzy_partition_free (g_ptr_array_index (bk->partitions, i));
+		}
+
+		g_ptr_array_set_size (bk->partitions, 0);
+	}
+
 	return;
 }
 
+/*
+ * Reset all statements to finish the implicit read transaction, otherwise
+ * a process would not see changes committed by other processes
+ */
+static void
+rspamd_fuzzy_backend_reset_stmts (struct rspamd_fuzzy_backend *bk)
+{
+	struct rspamd_fuzzy_partition *part;
+	guint i, j;
+
+	for (i = 0; i < RSPAMD_FUZZY_BACKEND_MAX; i++) {
+		if (prepared_stmts[i].stmt != NULL) {
+			sqlite3_reset (prepared_stmts[i].stmt);
+		}
+	}
+
+	for (i = 0; i < bk->partitions->len; i++) {
+		part = g_ptr_array_index (bk->partitions, i);
+
+		for (j = 0; j < RSPAMD_FUZZY_PARTITION_MAX; j++) {
+			if (part->stmts[j] != NULL) {
+				sqlite3_reset (part->stmts[j]);
+			}
+		}
+	}
+}
+
 static gboolean
 rspamd_fuzzy_backend_run_simple (int idx, struct rspamd_fuzzy_backend *bk,
 		GError **err)
@@ -324,11 +775,42 @@ rspamd_fuzzy_backend_run_sql (const gchar *sql, struct rspamd_fuzzy_backend *bk,
 	return TRUE;
 }
 
-static struct rspamd_fuzzy_backend *
-rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
-		GError **err)
-{
+/*
+ * Execute partition template with all placeholders replaced by start
+ */
+static gboolean
+rspamd_fuzzy_backend_run_partition_sql (const gchar *template,
+		struct rspamd_fuzzy_backend *bk, gint64 start, GError **err)
+{
+	gchar sql[1024];
+
+	rspamd_snprintf (sql, sizeof (sql), template, start, start, start, start,
+			start, start, start, start);
+
+	return rspamd_fuzzy_backend_run_sql (sql, bk, err);
+}
+
+static struct rspamd_fuzzy_backend *
+rspamd_fuzzy_backend_new (const gchar *path, sqlite3 *sqlite)
+{
 	struct rspamd_fuzzy_backend *bk;
+
+	bk = g_slice_alloc0 (sizeof (*bk));
+	bk->path = g_strdup (path);
+	bk->db = sqlite;
+	bk->partitions = g_ptr_array_new ();
+	bk->partition_time = FUZZY_DEFAULT_PARTITION_TIME;
+	bk->max_pending = FUZZY_DEFAULT_MAX_PENDING;
+	bk->next_id = 1;
+
+	sqlite3_busy_timeout (sqlite, FUZZY_BUSY_TIMEOUT);
+
+	return bk;
+}
+
+static struct rspamd_fuzzy_backend *
+rspamd_fuzzy_backend_create_db (const gchar *path, GError **err)
+{
 	sqlite3 *sqlite;
 	int rc;
 
@@ -342,38 +824,13 @@ rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
 		return NULL;
 	}
 
-	bk = g_slice_alloc (sizeof (*bk));
-	bk->path = g_strdup (path);
-	bk->db = sqlite;
-	bk->expired = 0;
-	bk->count = 0;
-
-	/*
-	 * Here we need to run create prior to preparing other statements
-	 */
-	if (!rspamd_fuzzy_backend_run_sql (create_tables_sql, bk, err)) {
-		rspamd_fuzzy_backend_close (bk);
-		return NULL;
-	}
-
-	if (!rspamd_fuzzy_backend_prepare_stmts (bk, err)) {
-		rspamd_fuzzy_backend_close (bk);
-
-		return NULL;
-	}
-
-	if (add_index) {
-		rspamd_fuzzy_backend_run_sql (create_index_sql, bk, NULL);
-	}
-
-	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
-			bk, NULL);
-
-	return bk;
+	/* Partitions are created when the first digest is added */
+	return rspamd_fuzzy_backend_new (path, sqlite);
 }
 
 static struct rspamd_fuzzy_backend *
-rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
+rspamd_fuzzy_backend_open_db (const gchar *path, gboolean readonly,
+		GError **err)
 {
 	struct rspamd_fuzzy_backend *bk;
 	sqlite3 *sqlite;
@@ -388,24 +845,14 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 		return NULL;
 	}
 
-	bk = g_slice_alloc (sizeof (*bk));
-	bk->path = g_strdup (path);
-	bk = g_slice_alloc (sizeof (*bk));
-	bk->db = sqlite;
-	bk->expired = 0;
+	bk = rspamd_fuzzy_backend_new (path, sqlite);
+	bk->readonly = readonly;
 
-	/* Cleanup database */
-	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_VACUUM, bk, NULL);
-
-	if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_COUNT)
-			== SQLITE_OK) {
-		bk->count = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT].stmt, 0);
+	if (!readonly) {
+		/* Cleanup database */
+		rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_VACUUM, bk, NULL);
 	}
 
-	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
-				bk, NULL);
-
 	return bk;
 }
 
@@ -419,17 +866,25 @@ rspamd_fuzzy_backend_convert (const gchar *path, int fd, GError **err)
 	struct rspamd_fuzzy_backend *nbackend;
 	struct stat st;
 	gint off;
+	gint64 id = 1;
 	guint8 *map, *p, *end;
 	struct rspamd_legacy_fuzzy_node *n;
 
 	rspamd_snprintf (tmpdb, sizeof (tmpdb), "%s.converted", path);
 	(void)unlink (tmpdb);
-	nbackend = rspamd_fuzzy_backend_create_db (tmpdb, FALSE, err);
+	nbackend = rspamd_fuzzy_backend_create_db (tmpdb, err);
 
 	if (nbackend == NULL) {
 		return FALSE;
 	}
 
+	/* Nodes are written to the single table that is partitioned on open */
+	if (!rspamd_fuzzy_backend_run_sql (create_tables_sql, nbackend, err)) {
+		rspamd_fuzzy_backend_close (nbackend);
+
+		return FALSE;
+	}
+
 	(void)fstat (fd, &st);
 	(void)lseek (fd, 0, SEEK_SET);
 
@@ -452,11 +907,12 @@ rspamd_fuzzy_backend_convert (const gchar *path, int fd, GError **err)
 	while (p < end) {
 		n = (struct rspamd_legacy_fuzzy_node *)p;
 		/* Convert node flag, digest, value, time  */
-		if (rspamd_fuzzy_backend_run_stmt (nbackend, RSPAMD_FUZZY_BACKEND_INSERT,
-				(gint)n->flag, n->h.hash_pipe,
+		if (rspamd_fuzzy_backend_run_stmt (nbackend,
+				RSPAMD_FUZZY_BACKEND_LEGACY_INSERT,
+				id ++, (gint)n->flag, n->h.hash_pipe,
 				(gint64)n->value, n->time) != SQLITE_OK) {
 			msg_warn ("Cannot execute init sql %s: %s",
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_INSERT].sql,
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_LEGACY_INSERT].sql,
 					sqlite3_errmsg (nbackend->db));
 		}
 		p += sizeof (struct rspamd_legacy_fuzzy_node);
@@ -472,300 +928,1553 @@ rspamd_fuzzy_backend_convert (const gchar *path, int fd, GError **err)
 	return TRUE;
 }
 
-struct rspamd_fuzzy_backend*
-rspamd_fuzzy_backend_open (const gchar *path, GError **err)
+/*
+ * Move digests and shingles from the single tables layout to partitions
+ */
+static gboolean
+rspamd_fuzzy_backend_migrate (struct rspamd_fuzzy_backend *bk, GError **err)
 {
-	gchar *dir, header[4];
-	gint fd, r;
-	struct rspamd_fuzzy_backend *res;
+	sqlite3_stmt *stmt;
+	GArray *starts;
+	gchar sql[1024];
+	gint64 start;
+	guint i;
 
-	/* First of all we check path for existence */
-	dir = g_path_get_dirname (path);
-	if (dir == NULL) {
-		g_set_error (err, rspamd_fuzzy_backend_quark (),
-				errno, "Cannot get directory name for %s: %s", path,
-				strerror (errno));
-		return NULL;
+	if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_LEGACY_EXISTS)
+			!= SQLITE_OK) {
+		return TRUE;
 	}
 
-	if (access (path, W_OK) == -1 && access (dir, W_OK) == -1) {
-		g_set_error (err, rspamd_fuzzy_backend_quark (),
-				errno, "Cannot access directory %s to create database: %s",
-				dir, strerror (errno));
-		g_free (dir);
+	msg_info ("converting fuzzy database %s to time partitions", bk->path);
+	starts = g_array_new (FALSE, FALSE, sizeof (gint64));
 
-		return NULL;
+	if (rspamd_fuzzy_backend_run_stmt (bk,
+			RSPAMD_FUZZY_BACKEND_LEGACY_PARTITIONS,
+			bk->partition_time) == SQLITE_OK) {
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LEGACY_PARTITIONS].stmt;
+
+		do {
+			start = sqlite3_column_int64 (stmt, 0);
+			g_array_append_val (starts, start);
+		} while (sqlite3_step (stmt) == SQLITE_ROW);
 	}
 
-	g_free (dir);
+	rspamd_fuzzy_backend_reset_stmts (bk);
 
-	if ((fd = open (path, O_RDONLY)) == -1) {
-		if (errno != ENOENT) {
-			g_set_error (err, rspamd_fuzzy_backend_quark (),
-					errno, "Cannot open file %s: %s",
-					path, strerror (errno));
+	if (!rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
+			bk, err)) {
+		g_array_free (starts, TRUE);
 
-			return NULL;
-		}
+		return FALSE;
 	}
-	else {
 
-		/* Check for legacy format */
-		if ((r = read (fd, header, sizeof (header))) == sizeof (header)) {
-			if (memcmp (header, FUZZY_FILE_MAGIC, sizeof (header) - 1) == 0) {
-				msg_info ("Trying to convert old fuzzy database");
-				if (!rspamd_fuzzy_backend_convert (path, fd, err)) {
-					close (fd);
-					return NULL;
-				}
-				msg_info ("Old database converted");
-			}
-			close (fd);
-		}
-	}
+	for (i = 0; i < starts->len; i ++) {
+		start = g_array_index (starts, gint64, i);
 
-	close (fd);
+		if (!rspamd_fuzzy_backend_run_partition_sql (create_partition_sql, bk,
+				start, err)) {
+			goto err;
+		}
 
-	/* Open database */
-	if ((res = rspamd_fuzzy_backend_open_db (path, err)) == NULL) {
-		GError *tmp = NULL;
+		rspamd_snprintf (sql, sizeof (sql), migrate_partition_sql, start,
+				start, start + bk->partition_time, start, start);
 
-		if ((res = rspamd_fuzzy_backend_create_db (path, TRUE, &tmp)) == NULL) {
-			g_clear_error (err);
-			g_propagate_error (err, tmp);
-			return NULL;
+		if (!rspamd_fuzzy_backend_run_sql (sql, bk, err)) {
+			goto err;
 		}
-		g_clear_error (err);
 	}
 
-	return res;
+	if (!rspamd_fuzzy_backend_run_sql (drop_legacy_sql, bk, err) ||
+			!rspamd_fuzzy_backend_run_simple (
+					RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT, bk, err)) {
+		goto err;
+	}
+
+	msg_info ("fuzzy database has been converted to %ud time partitions",
+			starts->len);
+	g_array_free (starts, TRUE);
+
+	return TRUE;
+
+err:
+	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK,
+			bk, NULL);
+	g_array_free (starts, TRUE);
+
+	return FALSE;
 }
 
-static gint
-rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
+/*
+ * Copy digest from the result column to a fixed size buffer
+ */
+static void
+rspamd_fuzzy_backend_column_digest (sqlite3_stmt *stmt, gint col,
+		gchar *digest)
 {
-	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
+	gint len;
 
-	return (ia - ib);
+	len = sqlite3_column_bytes (stmt, col);
+	memset (digest, 0, RSPAMD_FUZZY_DIGEST_LEN);
+	memcpy (digest, sqlite3_column_blob (stmt, col),
+			MIN (len, RSPAMD_FUZZY_DIGEST_LEN));
 }
 
-struct rspamd_fuzzy_reply
-rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
-		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+static guint
+rspamd_fuzzy_backend_digest_hash (gconstpointer key)
 {
-	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
-	const struct rspamd_fuzzy_shingle_cmd *shcmd;
-	int rc;
-	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
-	const char *digest;
+	return XXH32 (key, RSPAMD_FUZZY_DIGEST_LEN, 0);
+}
 
-	/* Try direct match first of all */
-	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
-			cmd->digest);
-
-	if (rc == SQLITE_OK) {
-		timestamp = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 1);
-		if (time (NULL) - timestamp > expire) {
-			/* Expire element */
-			msg_debug ("requested hash has been expired");
-			rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-				cmd->digest);
-			backend->expired ++;
-		}
-		else {
-			rep.value = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 0);
-			rep.prob = 1.0;
-			rep.flag = sqlite3_column_int (
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 2);
+static gboolean
+rspamd_fuzzy_backend_digest_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, RSPAMD_FUZZY_DIGEST_LEN) == 0;
+}
+
+/*
+ * Add digests and shingles stored since the previous load to the bloom
+ * filters of a partition, the filters are recreated from scratch if full
+ * is TRUE
+ */
+static void
+rspamd_fuzzy_backend_bloom_load (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_partition *part,
+		gboolean full)
+{
+	sqlite3_stmt *stmt;
+	gchar digest[RSPAMD_FUZZY_DIGEST_LEN];
+	guint64 key[2];
+	gsize ndigests = 0, nshingles = 0;
+
+	if (full) {
+		if (part->digests_bloom != NULL) {
+			rspamd_bloom_destroy (part->digests_bloom);
+			rspamd_bloom_destroy (part->shingles_bloom);
 		}
+
+		/* Leave some space for the new digests */
+		part->bloom_size = MAX (part->count + part->count / 2,
+				FUZZY_BLOOM_MIN_SIZE);
+		part->digests_bloom = rspamd_bloom_create (
+				part->bloom_size * FUZZY_BLOOM_COUNTERS,
+				RSPAMD_DEFAULT_BLOOM_HASHES);
+		part->shingles_bloom = rspamd_bloom_create (
+				part->bloom_size * RSPAMD_SHINGLE_SIZE *
+				FUZZY_BLOOM_SHINGLE_COUNTERS,
+				RSPAMD_DEFAULT_BLOOM_HASHES);
+		part->bloom_stale = 0;
+		part->bloom_digest_id = 0;
+		part->bloom_shingle_id = 0;
 	}
-	else if (cmd->shingles_count > 0) {
-		/* Fuzzy match */
-		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			rc = rspamd_fuzzy_backend_run_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-					shcmd->sgl.hashes[i], i);
-			if (rc == SQLITE_OK) {
-				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
-						0);
-			}
-			else {
-				shingle_values[i] = -1;
-			}
-			msg_debug ("looking for shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], rc);
-		}
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
 
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
+	if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+			RSPAMD_FUZZY_PARTITION_BLOOM_DIGESTS,
+			part->bloom_digest_id) == SQLITE_OK) {
+		stmt = part->stmts[RSPAMD_FUZZY_PARTITION_BLOOM_DIGESTS];
+
+		do {
+			rspamd_fuzzy_backend_column_digest (stmt, 1, digest);
+			rspamd_bloom_add_buf (part->digests_bloom, digest, sizeof (digest));
+			part->bloom_digest_id = MAX (part->bloom_digest_id,
+					sqlite3_column_int64 (stmt, 0));
+			ndigests ++;
+		} while (sqlite3_step (stmt) == SQLITE_ROW);
+	}
 
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
-				}
-				cur_cnt = 0;
-			}
-		}
+	if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+			RSPAMD_FUZZY_PARTITION_BLOOM_SHINGLES,
+			part->bloom_shingle_id) == SQLITE_OK) {
+		stmt = part->stmts[RSPAMD_FUZZY_PARTITION_BLOOM_SHINGLES];
+
+		do {
+			key[0] = sqlite3_column_int64 (stmt, 1);
+			key[1] = sqlite3_column_int64 (stmt, 2);
+			rspamd_bloom_add_buf (part->shingles_bloom, key, sizeof (key));
+			part->bloom_shingle_id = MAX (part->bloom_shingle_id,
+					sqlite3_column_int64 (stmt, 0));
+			nshingles ++;
+		} while (sqlite3_step (stmt) == SQLITE_ROW);
+	}
 
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
-		}
+	if (full) {
+		msg_info ("built bloom filters for %z digests and %z shingles of "
+				"partition %L", ndigests, nshingles, part->start);
+	}
+	else {
+		msg_debug ("added %z digests and %z shingles to bloom filters of "
+				"partition %L", ndigests, nshingles, part->start);
+	}
+}
 
-		if (sel_id != -1) {
-			/* We have some id selected here */
-			rep.prob = (gdouble)max_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
-			msg_debug ("found fuzzy hash with probability %.2f", rep.prob);
-			rc = rspamd_fuzzy_backend_run_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, sel_id);
-			if (rc == SQLITE_OK) {
-				digest = sqlite3_column_text (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 0);
-				timestamp = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 2);
-				if (time (NULL) - timestamp > expire) {
-					/* Expire element */
-					msg_debug ("requested hash has been expired");
-					backend->expired ++;
-					rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-							digest);
-					rep.prob = 0.0;
-				}
-				else {
-					rep.value = sqlite3_column_int64 (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 1);
-					rep.flag = sqlite3_column_int (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 3);
-				}
-			}
-		}
+/*
+ * Rebuild bloom filters of a partition if they are too full or contain too
+ * many removed elements
+ */
+static void
+rspamd_fuzzy_backend_bloom_sync (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_partition *part)
+{
+	if (part->digests_bloom == NULL) {
+		return;
 	}
 
-	return rep;
+	if (part->count > part->bloom_size ||
+			part->bloom_stale > part->bloom_size / 4) {
+		rspamd_fuzzy_backend_bloom_load (bk, part, TRUE);
+	}
 }
 
-gboolean
-rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
-		const struct rspamd_fuzzy_cmd *cmd)
+static inline gboolean
+rspamd_fuzzy_backend_bloom_check_digest (struct rspamd_fuzzy_partition *part,
+		const gchar *digest)
 {
-	int rc, i;
-	gint64 id;
-	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	if (part->digests_bloom == NULL) {
+		return TRUE;
+	}
 
-	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
-				cmd->digest);
+	return rspamd_bloom_check_buf (part->digests_bloom, digest,
+			RSPAMD_FUZZY_DIGEST_LEN);
+}
 
-	if (rc == SQLITE_OK) {
-		/* We need to increase weight */
-		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_UPDATE,
-			(gint64)cmd->value, cmd->digest);
+static void
+rspamd_fuzzy_backend_bloom_add (struct rspamd_fuzzy_partition *part,
+		const gchar *digest, const struct rspamd_shingle *sgl)
+{
+	guint64 key[2];
+	guint i;
+
+	if (part->digests_bloom == NULL) {
+		return;
 	}
-	else {
-		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_INSERT,
-			(gint)cmd->flag, cmd->digest, (gint64)cmd->value, (gint64)time (NULL));
 
-		if (rc == SQLITE_OK) {
-			backend->count ++;
+	rspamd_bloom_add_buf (part->digests_bloom, digest, RSPAMD_FUZZY_DIGEST_LEN);
+
+	if (sgl != NULL) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			key[0] = sgl->hashes[i];
+			key[1] = i;
+			rspamd_bloom_add_buf (part->shingles_bloom, key, sizeof (key));
+		}
+	}
+}
 
-			if (cmd->shingles_count > 0) {
-				id = sqlite3_last_insert_rowid (backend->db);
-				shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+/*
+ * Check whether any shingle of a command can be stored in a partition
+ */
+static gboolean
+rspamd_fuzzy_backend_bloom_check_shingles (struct rspamd_fuzzy_partition *part,
+		const struct rspamd_fuzzy_shingle_cmd *shcmd)
+{
+	guint64 key[2];
+	guint i;
 
-				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-					rspamd_fuzzy_backend_run_stmt (backend,
-							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], i, id);
-					msg_debug ("add shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], id);
-				}
-			}
+	if (part->shingles_bloom == NULL) {
+		return TRUE;
+	}
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		key[0] = shcmd->sgl.hashes[i];
+		key[1] = i;
+
+		if (rspamd_bloom_check_buf (part->shingles_bloom, key, sizeof (key))) {
+			return TRUE;
 		}
 	}
 
-	return (rc == SQLITE_OK);
+	return FALSE;
 }
 
+static gint
+rspamd_fuzzy_partition_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_fuzzy_partition *p1 =
+			*(const struct rspamd_fuzzy_partition **)a,
+			*p2 = *(const struct rspamd_fuzzy_partition **)b;
 
-gboolean
-rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
-		const struct rspamd_fuzzy_cmd *cmd)
+	/* Newest partitions first */
+	if (p1->start == p2->start) {
+		return 0;
+	}
+
+	return p1->start > p2->start ? -1 : 1;
+}
+
+static struct rspamd_fuzzy_partition *
+rspamd_fuzzy_partition_new (gint64 start)
 {
-	int rc;
+	struct rspamd_fuzzy_partition *part;
+
+	part = g_slice_alloc0 (sizeof (*part));
+	part->start = start;
+
+	return part;
+}
+
+static void
+rspamd_fuzzy_partition_count (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_partition *part)
+{
+	gsize count;
 
-	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-			cmd->digest);
+	if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+			RSPAMD_FUZZY_PARTITION_COUNT) == SQLITE_OK) {
+		count = sqlite3_column_int64 (
+				part->stmts[RSPAMD_FUZZY_PARTITION_COUNT], 0);
 
-	backend->count -= sqlite3_changes (backend->db);
+		if (count < part->count) {
+			/* Digests have been removed by another process */
+			part->bloom_stale += part->count - count;
+		}
 
-	return (rc == SQLITE_OK);
+		part->count = count;
+	}
 }
 
-gboolean
-rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
+static void
+rspamd_fuzzy_backend_update_count (struct rspamd_fuzzy_backend *bk)
+{
+	struct rspamd_fuzzy_partition *part;
+	guint i;
+
+	bk->count = 0;
+
+	for (i = 0; i < bk->partitions->len; i ++) {
+		part = g_ptr_array_index (bk->partitions, i);
+		bk->count += part->count;
+	}
+}
+
+/*
+ * Read partitions list from the database: new partitions are added and
+ * partitions that have been dropped by another process are removed
+ */
+static void
+rspamd_fuzzy_backend_load_partitions (struct rspamd_fuzzy_backend *bk)
 {
-	gboolean ret = FALSE;
+	struct rspamd_fuzzy_partition *part;
+	sqlite3_stmt *stmt;
+	GArray *starts;
+	const gchar *name;
+	gchar *endptr;
+	gint64 start;
+	guint i, j;
+
+	starts = g_array_new (FALSE, FALSE, sizeof (gint64));
 
-	/* Perform expire */
-	if (expire > 0) {
-		rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_EXPIRE,
-				backend, NULL);
-		backend->expired += sqlite3_changes (backend->db);
+	if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_PARTITIONS)
+			== SQLITE_OK) {
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_PARTITIONS].stmt;
+
+		do {
+			name = (const gchar *)sqlite3_column_text (stmt, 0);
+			start = strtoll (name + sizeof ("digests_") - 1, &endptr, 10);
+
+			if (endptr != NULL && *endptr == '\0') {
+				g_array_append_val (starts, start);
+			}
+		} while (sqlite3_step (stmt) == SQLITE_ROW);
 	}
-	ret = rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
-			backend, NULL);
 
-	if (ret) {
-		ret = rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
-			backend, NULL);
+	for (i = 0; i < bk->partitions->len; i ++) {
+		part = g_ptr_array_index (bk->partitions, i);
+		part->seen = FALSE;
 	}
 
-	return ret;
-}
+	for (j = 0; j < starts->len; j ++) {
+		start = g_array_index (starts, gint64, j);
+		part = NULL;
 
+		for (i = 0; i < bk->partitions->len; i ++) {
+			part = g_ptr_array_index (bk->partitions, i);
 
-void
-rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
-{
-	if (backend != NULL) {
-		if (backend->db != NULL) {
-			rspamd_fuzzy_backend_close_stmts (backend);
-			sqlite3_close (backend->db);
+			if (part->start == start) {
+				break;
+			}
+
+			part = NULL;
 		}
 
-		if (backend->path != NULL) {
-			g_free (backend->path);
+		if (part == NULL) {
+			part = rspamd_fuzzy_partition_new (start);
+			rspamd_fuzzy_partition_count (bk, part);
+
+			if (bk->use_bloom) {
+				rspamd_fuzzy_backend_bloom_load (bk, part, TRUE);
+			}
+
+			g_ptr_array_add (bk->partitions, part);
 		}
 
-		g_slice_free1 (sizeof (*backend), backend);
+		part->seen = TRUE;
 	}
-}
 
+	i = 0;
 
-gsize
-rspamd_fuzzy_backend_count (struct rspamd_fuzzy_backend *backend)
-{
-	return backend->count;
-}
+	while (i < bk->partitions->len) {
+		part = g_ptr_array_index (bk->partitions, i);
 
-gsize
+		if (!part->seen) {
+			msg_info ("partition %L has been dropped", part->start);
+			rspamd_fuzzy_partition_free (part);
+			g_ptr_array_remove_index_fast (bk->partitions, i);
+		}
+		else {
+			i ++;
+		}
+	}
+
+	g_ptr_array_sort (bk->partitions, rspamd_fuzzy_partition_cmp);
+	g_array_free (starts, TRUE);
+	rspamd_fuzzy_backend_update_count (bk);
+}
+
+/*
+ * Get partition that stores digests added at the specified time
+ */
+static struct rspamd_fuzzy_partition *
+rspamd_fuzzy_backend_get_partition (struct rspamd_fuzzy_backend *bk,
+		gint64 time)
+{
+	struct rspamd_fuzzy_partition *part;
+	guint i;
+
+	for (i = 0; i < bk->partitions->len; i ++) {
+		part = g_ptr_array_index (bk->partitions, i);
+
+		if (part->start <= time) {
+			return part;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Get partition for new digests, it is created when the partition time
+ * has passed. If the clock goes backwards, time is adjusted to keep new
+ * digests in the newest partition.
+ */
+static struct rspamd_fuzzy_partition *
+rspamd_fuzzy_backend_current_partition (struct rspamd_fuzzy_backend *bk,
+		gint64 *time)
+{
+	struct rspamd_fuzzy_partition *part = NULL, *npart;
+	GError *err = NULL;
+	gint64 start;
+
+	start = *time - *time % bk->partition_time;
+
+	if (bk->partitions->len > 0) {
+		part = g_ptr_array_index (bk->partitions, 0);
+
+		if (part->start >= start) {
+			*time = MAX (*time, part->start);
+
+			return part;
+		}
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (bk);
+
+	if (!rspamd_fuzzy_backend_run_partition_sql (create_partition_sql, bk,
+			start, &err)) {
+		msg_err ("cannot create partition %L: %s", start, err->message);
+		g_error_free (err);
+
+		return NULL;
+	}
+
+	msg_info ("created new partition %L", start);
+	npart = rspamd_fuzzy_partition_new (start);
+
+	if (bk->use_bloom) {
+		/* Use the previous partition as a hint for bloom filters size */
+		npart->count = part != NULL ? part->count : 0;
+		rspamd_fuzzy_backend_bloom_load (bk, npart, TRUE);
+		npart->count = 0;
+	}
+
+	g_ptr_array_add (bk->partitions, npart);
+	g_ptr_array_sort (bk->partitions, rspamd_fuzzy_partition_cmp);
+
+	return npart;
+}
+
+/*
+ * Drop tables of partitions that contain expired digests only, must be called
+ * within a transaction. New digests are always added to the newest partition,
+ * so all digests of a partition are older than the start of the next one.
+ * Returns number of the oldest partitions that have been dropped or -1 on
+ * error, their structures are removed after commit.
+ */
+static gint
+rspamd_fuzzy_backend_drop_partitions (struct rspamd_fuzzy_backend *bk,
+		gint64 min_time)
+{
+	struct rspamd_fuzzy_partition *part, *newer;
+	GError *err = NULL;
+	guint ndrop = 0;
+
+	/* The newest partition is never dropped */
+	while (ndrop + 1 < bk->partitions->len) {
+		part = g_ptr_array_index (bk->partitions,
+				bk->partitions->len - ndrop - 1);
+		newer = g_ptr_array_index (bk->partitions,
+				bk->partitions->len - ndrop - 2);
+
+		if (newer->start > min_time) {
+			break;
+		}
+
+		/* Tables cannot be dropped while their statements are active */
+		rspamd_fuzzy_backend_reset_stmts (bk);
+
+		if (!rspamd_fuzzy_backend_run_partition_sql (drop_partition_sql, bk,
+				part->start, &err)) {
+			msg_err ("cannot drop partition %L: %s", part->start, err->message);
+			g_error_free (err);
+
+			return -1;
+		}
+
+		ndrop ++;
+	}
+
+	return ndrop;
+}
+
+/*
+ * Remove structures of the oldest partitions which tables have been dropped
+ */
+static void
+rspamd_fuzzy_backend_remove_partitions (struct rspamd_fuzzy_backend *bk,
+		guint ndrop)
+{
+	struct rspamd_fuzzy_partition *part;
+
+	while (ndrop > 0 && bk->partitions->len > 0) {
+		part = g_ptr_array_index (bk->partitions, bk->partitions->len - 1);
+		msg_info ("dropped expired partition %L with %z digests",
+				part->start, part->count);
+		bk->expired += part->count;
+		rspamd_fuzzy_partition_free (part);
+		g_ptr_array_remove_index (bk->partitions, bk->partitions->len - 1);
+		ndrop --;
+	}
+
+	rspamd_fuzzy_backend_update_count (bk);
+}
+
+/*
+ * Load all digests and shingles to the memory index
+ */
+static void
+rspamd_fuzzy_backend_load_index (struct rspamd_fuzzy_backend *bk)
+{
+	struct rspamd_fuzzy_partition *part;
+	sqlite3_stmt *stmt;
+	gchar digest[RSPAMD_FUZZY_DIGEST_LEN];
+	gsize nshingles = 0;
+	guint i;
+
+	bk->index = rspamd_fuzzy_index_new (bk->count);
+
+	/* Start from the oldest partitions */
+	for (i = bk->partitions->len; i > 0; i --) {
+		part = g_ptr_array_index (bk->partitions, i - 1);
+
+		if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+				RSPAMD_FUZZY_PARTITION_LOAD_DIGESTS) == SQLITE_OK) {
+			stmt = part->stmts[RSPAMD_FUZZY_PARTITION_LOAD_DIGESTS];
+
+			do {
+				rspamd_fuzzy_backend_column_digest (stmt, 2, digest);
+				rspamd_fuzzy_index_insert (bk->index, digest,
+						sqlite3_column_int64 (stmt, 0),
+						sqlite3_column_int (stmt, 1),
+						sqlite3_column_int64 (stmt, 3),
+						sqlite3_column_int64 (stmt, 4));
+			} while (sqlite3_step (stmt) == SQLITE_ROW);
+		}
+
+		if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+				RSPAMD_FUZZY_PARTITION_LOAD_SHINGLES) == SQLITE_OK) {
+			stmt = part->stmts[RSPAMD_FUZZY_PARTITION_LOAD_SHINGLES];
+
+			do {
+				rspamd_fuzzy_index_add_shingle (bk->index,
+						sqlite3_column_int64 (stmt, 0),
+						sqlite3_column_int (stmt, 1),
+						sqlite3_column_int64 (stmt, 2));
+				nshingles ++;
+			} while (sqlite3_step (stmt) == SQLITE_ROW);
+		}
+	}
+
+	msg_info ("loaded %z digests and %z shingles to the memory index",
+			rspamd_fuzzy_index_count (bk->index), nshingles);
+}
+
+struct rspamd_fuzzy_backend*
+rspamd_fuzzy_backend_open (const gchar *path, gboolean use_index,
+		guint max_pending, gboolean readonly, gint64 partition_time,
+		GError **err)
+{
+	gchar *dir, header[4];
+	gint fd, r;
+	guint i;
+	struct rspamd_fuzzy_backend *res;
+	struct rspamd_fuzzy_partition *part;
+
+	/* First of all we check path for existence */
+	dir = g_path_get_dirname (path);
+	if (dir == NULL) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				errno, "Cannot get directory name for %s: %s", path,
+				strerror (errno));
+		return NULL;
+	}
+
+	if (access (path, W_OK) == -1 && access (dir, W_OK) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				errno, "Cannot access directory %s to create database: %s",
+				dir, strerror (errno));
+		g_free (dir);
+
+		return NULL;
+	}
+
+	g_free (dir);
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		if (errno != ENOENT) {
+			g_set_error (err, rspamd_fuzzy_backend_quark (),
+					errno, "Cannot open file %s: %s",
+					path, strerror (errno));
+
+			return NULL;
+		}
+	}
+	else {
+
+		/* Check for legacy format */
+		if ((r = read (fd, header, sizeof (header))) == sizeof (header)) {
+			if (memcmp (header, FUZZY_FILE_MAGIC, sizeof (header) - 1) == 0) {
+				if (readonly) {
+					g_set_error (err, rspamd_fuzzy_backend_quark (),
+							EINVAL, "Database %s has not been converted yet",
+							path);
+					close (fd);
+					return NULL;
+				}
+				msg_info ("Trying to convert old fuzzy database");
+				if (!rspamd_fuzzy_backend_convert (path, fd, err)) {
+					close (fd);
+					return NULL;
+				}
+				msg_info ("Old database converted");
+			}
+			close (fd);
+		}
+	}
+
+	close (fd);
+
+	/* Open database */
+	if ((res = rspamd_fuzzy_backend_open_db (path, readonly, err)) == NULL) {
+		GError *tmp = NULL;
+
+		if ((res = rspamd_fuzzy_backend_create_db (path, &tmp)) == NULL) {
+			g_clear_error (err);
+			g_propagate_error (err, tmp);
+			return NULL;
+		}
+		g_clear_error (err);
+		res->readonly = readonly;
+	}
+
+	if (partition_time > 0) {
+		res->partition_time = partition_time;
+	}
+
+	if (!readonly) {
+		/* Let other processes read the database while it is being written */
+		rspamd_fuzzy_backend_run_sql ("PRAGMA journal_mode=WAL;", res, NULL);
+
+		if (!rspamd_fuzzy_backend_migrate (res, err) ||
+				!rspamd_fuzzy_backend_run_sql (create_log_sql, res, err)) {
+			rspamd_fuzzy_backend_close (res);
+
+			return NULL;
+		}
+
+		if (rspamd_fuzzy_backend_run_stmt (res,
+				RSPAMD_FUZZY_BACKEND_LOG_LAST) == SQLITE_OK) {
+			res->log_seq = sqlite3_column_int64 (
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_LOG_LAST].stmt, 0);
+		}
+
+		if (rspamd_fuzzy_backend_run_stmt (res,
+				RSPAMD_FUZZY_BACKEND_CHECKPOINT_GET) == SQLITE_OK) {
+			res->checkpoint = sqlite3_column_int64 (
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECKPOINT_GET].stmt, 0);
+		}
+
+		/*
+		 * Ids of removed digests must not be reused, as readers load new
+		 * digests to bloom filters by their ids
+		 */
+		if (rspamd_fuzzy_backend_run_stmt (res,
+				RSPAMD_FUZZY_BACKEND_LAST_ID_GET) == SQLITE_OK) {
+			res->next_id = sqlite3_column_int64 (
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_LAST_ID_GET].stmt, 0) + 1;
+		}
+	}
+	else if (use_index) {
+		/* Memory index cannot see writes of another process */
+		msg_info ("memory index is disabled for read only fuzzy database");
+		use_index = FALSE;
+	}
+
+	res->use_bloom = !use_index;
+	rspamd_fuzzy_backend_load_partitions (res);
+
+	for (i = 0; i < res->partitions->len; i ++) {
+		part = g_ptr_array_index (res->partitions, i);
+
+		if (rspamd_fuzzy_backend_run_part_stmt (res, part,
+				RSPAMD_FUZZY_PARTITION_MAX_ID) == SQLITE_OK) {
+			res->next_id = MAX (res->next_id, sqlite3_column_int64 (
+					part->stmts[RSPAMD_FUZZY_PARTITION_MAX_ID], 0) + 1);
+		}
+
+		if (!readonly) {
+			rspamd_fuzzy_backend_reset_stmts (res);
+			rspamd_fuzzy_backend_run_partition_sql (create_shingles_index_sql,
+					res, part->start, NULL);
+		}
+	}
+
+	res->pending = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_fuzzy_pending_op));
+	res->pending_log = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_fuzzy_shingle_cmd));
+
+	if (max_pending > 0) {
+		res->max_pending = max_pending;
+	}
+
+	if (use_index) {
+		rspamd_fuzzy_backend_load_index (res);
+	}
+	else {
+		res->pending_index = rspamd_fuzzy_index_new (0);
+		res->pending_deleted = g_hash_table_new_full (
+				rspamd_fuzzy_backend_digest_hash,
+				rspamd_fuzzy_backend_digest_equal,
+				g_free, NULL);
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (res);
+
+	return res;
+}
+
+/*
+ * Index that reflects all queued writes: either full memory index or
+ * the index of the pending writes only
+ */
+static inline struct rspamd_fuzzy_index *
+rspamd_fuzzy_backend_view (struct rspamd_fuzzy_backend *bk)
+{
+	return bk->index != NULL ? bk->index : bk->pending_index;
+}
+
+static inline gboolean
+rspamd_fuzzy_backend_is_deleted (struct rspamd_fuzzy_backend *bk,
+		const gchar *digest)
+{
+	return bk->pending_deleted != NULL &&
+			g_hash_table_lookup (bk->pending_deleted, digest) != NULL;
+}
+
+static void
+rspamd_fuzzy_backend_queue (struct rspamd_fuzzy_backend *bk,
+		enum rspamd_fuzzy_pending_type type,
+		const gchar *digest,
+		gint64 id,
+		gint32 flag,
+		gint64 value,
+		gint64 time,
+		const struct rspamd_shingle *sgl)
+{
+	struct rspamd_fuzzy_pending_op op;
+
+	memset (&op, 0, sizeof (op));
+	op.type = type;
+	op.id = id;
+	op.time = time;
+	op.cmd.basic.flag = flag;
+	op.cmd.basic.value = value;
+	memcpy (op.cmd.basic.digest, digest, sizeof (op.cmd.basic.digest));
+
+	if (sgl != NULL) {
+		op.cmd.basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+		memcpy (&op.cmd.sgl, sgl, sizeof (op.cmd.sgl));
+	}
+
+	g_array_append_val (bk->pending, op);
+}
+
+/*
+ * Remove digest added at the specified time and queue its deletion from the
+ * database
+ */
+static void
+rspamd_fuzzy_backend_delete_digest (struct rspamd_fuzzy_backend *bk,
+		const gchar *digest, gint64 time)
+{
+	struct rspamd_fuzzy_partition *part;
+	gchar *key;
+
+	rspamd_fuzzy_backend_queue (bk, RSPAMD_FUZZY_PENDING_DELETE, digest,
+			0, 0, 0, time, NULL);
+
+	if (bk->pending_deleted != NULL) {
+		key = g_malloc (RSPAMD_FUZZY_DIGEST_LEN);
+		memcpy (key, digest, RSPAMD_FUZZY_DIGEST_LEN);
+		g_hash_table_replace (bk->pending_deleted, key, key);
+		digest = key;
+	}
+
+	if ((part = rspamd_fuzzy_backend_get_partition (bk, time)) != NULL) {
+		if (part->digests_bloom != NULL) {
+			/* Shingles of the digest are left until the filters are rebuilt */
+			rspamd_bloom_del_buf (part->digests_bloom, digest,
+					RSPAMD_FUZZY_DIGEST_LEN);
+			part->bloom_stale ++;
+		}
+
+		if (part->count > 0) {
+			part->count --;
+		}
+	}
+
+	if (bk->count > 0) {
+		bk->count --;
+	}
+
+	rspamd_fuzzy_index_remove (rspamd_fuzzy_backend_view (bk), digest);
+}
+
+static inline gsize
+rspamd_fuzzy_backend_cmd_len (const struct rspamd_fuzzy_cmd *cmd)
+{
+	if (cmd->shingles_count > 0) {
+		return sizeof (struct rspamd_fuzzy_shingle_cmd);
+	}
+
+	return sizeof (struct rspamd_fuzzy_cmd);
+}
+
+/*
+ * Queue update command to the replication log
+ */
+static void
+rspamd_fuzzy_backend_log (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_shingle_cmd logged;
+
+	if (bk->log_size == 0) {
+		return;
+	}
+
+	memset (&logged, 0, sizeof (logged));
+	memcpy (&logged, cmd, rspamd_fuzzy_backend_cmd_len (cmd));
+	g_array_append_val (bk->pending_log, logged);
+}
+
+/*
+ * Discard all queued writes and rebuild the in-memory state that reflects
+ * them from the database
+ */
+static void
+rspamd_fuzzy_backend_reload (struct rspamd_fuzzy_backend *bk)
+{
+	struct rspamd_fuzzy_partition *part;
+	guint i;
+
+	g_array_set_size (bk->pending, 0);
+	g_array_set_size (bk->pending_log, 0);
+
+	if (bk->pending_index != NULL) {
+		rspamd_fuzzy_index_destroy (bk->pending_index);
+		bk->pending_index = rspamd_fuzzy_index_new (0);
+		g_hash_table_remove_all (bk->pending_deleted);
+	}
+
+	/* Updates from the master are lost, so they are requested again */
+	if (bk->checkpoint_changed && rspamd_fuzzy_backend_run_stmt (bk,
+			RSPAMD_FUZZY_BACKEND_CHECKPOINT_GET) == SQLITE_OK) {
+		bk->checkpoint = sqlite3_column_int64 (
+				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECKPOINT_GET].stmt, 0);
+	}
+
+	bk->checkpoint_changed = FALSE;
+	rspamd_fuzzy_backend_load_partitions (bk);
+
+	for (i = 0; i < bk->partitions->len; i ++) {
+		part = g_ptr_array_index (bk->partitions, i);
+		rspamd_fuzzy_partition_count (bk, part);
+
+		if (part->digests_bloom != NULL) {
+			/* Filters could lose digests removed by the discarded writes */
+			rspamd_fuzzy_backend_bloom_load (bk, part, TRUE);
+		}
+	}
+
+	rspamd_fuzzy_backend_update_count (bk);
+
+	if (bk->index != NULL) {
+		rspamd_fuzzy_index_destroy (bk->index);
+		rspamd_fuzzy_backend_load_index (bk);
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (bk);
+}
+
+/*
+ * Commit all queued writes and drop expired partitions in a single
+ * transaction. If anything fails, the transaction is rolled back and the
+ * writes are kept to be retried by the next flush.
+ */
+static gboolean
+rspamd_fuzzy_backend_flush (struct rspamd_fuzzy_backend *bk, gint64 min_time)
+{
+	struct rspamd_fuzzy_pending_op *op;
+	struct rspamd_fuzzy_partition *part;
+	struct rspamd_fuzzy_shingle_cmd *shcmd;
+	GError *err = NULL;
+	guint i, j, nops, nlog;
+	gint ndrop = 0;
+
+	nops = bk->pending->len;
+	nlog = bk->pending_log->len;
+
+	if (nops == 0 && nlog == 0 && !bk->checkpoint_changed && min_time == 0) {
+		/* Writes that have failed could be discarded */
+		bk->flush_failed = FALSE;
+
+		return TRUE;
+	}
+
+	if (!rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
+			bk, &err)) {
+		msg_err ("cannot start transaction: %s", err->message);
+		g_error_free (err);
+		bk->flush_failed = TRUE;
+
+		return FALSE;
+	}
+
+	for (i = 0; i < nops; i ++) {
+		op = &g_array_index (bk->pending, struct rspamd_fuzzy_pending_op, i);
+
+		if ((part = rspamd_fuzzy_backend_get_partition (bk, op->time)) == NULL) {
+			/* Partition has been dropped */
+			continue;
+		}
+
+		switch (op->type) {
+		case RSPAMD_FUZZY_PENDING_INSERT:
+			if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+					RSPAMD_FUZZY_PARTITION_INSERT,
+					op->id, (gint)op->cmd.basic.flag, op->cmd.basic.digest,
+					(gint64)op->cmd.basic.value, op->time) != SQLITE_OK) {
+				goto err;
+			}
+
+			if (op->cmd.basic.shingles_count > 0) {
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+					if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+							RSPAMD_FUZZY_PARTITION_INSERT_SHINGLE,
+							op->cmd.sgl.hashes[j], (gint64)j, op->id)
+							!= SQLITE_OK) {
+						goto err;
+					}
+				}
+			}
+			break;
+		case RSPAMD_FUZZY_PENDING_UPDATE:
+			if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+					RSPAMD_FUZZY_PARTITION_UPDATE,
+					(gint64)op->cmd.basic.value, op->cmd.basic.digest)
+					!= SQLITE_OK) {
+				goto err;
+			}
+			break;
+		case RSPAMD_FUZZY_PENDING_DELETE:
+			if (rspamd_fuzzy_backend_run_part_stmt (bk, part,
+					RSPAMD_FUZZY_PARTITION_DELETE,
+					op->cmd.basic.digest) != SQLITE_OK) {
+				goto err;
+			}
+			break;
+		}
+	}
+
+	for (i = 0; i < nlog; i ++) {
+		shcmd = &g_array_index (bk->pending_log,
+				struct rspamd_fuzzy_shingle_cmd, i);
+
+		if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_LOG_INSERT,
+				(gint64)(bk->log_seq + i + 1), shcmd,
+				(gint)rspamd_fuzzy_backend_cmd_len (&shcmd->basic))
+				!= SQLITE_OK) {
+			goto err;
+		}
+	}
+
+	if (nlog > 0 && bk->log_seq + nlog > bk->log_size &&
+			rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_LOG_TRIM,
+				(gint64)(bk->log_seq + nlog - bk->log_size)) != SQLITE_OK) {
+		goto err;
+	}
+
+	if (nops > 0 && rspamd_fuzzy_backend_run_stmt (bk,
+			RSPAMD_FUZZY_BACKEND_LAST_ID_SET,
+			(gint64)(bk->next_id - 1)) != SQLITE_OK) {
+		goto err;
+	}
+
+	/* Checkpoint is committed with the updates received from the master */
+	if (bk->checkpoint_changed &&
+			rspamd_fuzzy_backend_run_stmt (bk,
+				RSPAMD_FUZZY_BACKEND_CHECKPOINT_SET,
+				(gint64)bk->checkpoint) != SQLITE_OK) {
+		goto err;
+	}
+
+	if (min_time > 0 &&
+			(ndrop = rspamd_fuzzy_backend_drop_partitions (bk, min_time)) < 0) {
+		goto rollback;
+	}
+
+	if (!rspamd_fuzzy_backend_run_simple (
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT, bk, &err)) {
+		msg_err ("cannot commit %ud pending writes: %s", nops, err->message);
+		g_error_free (err);
+		goto rollback;
+	}
+
+	msg_debug ("committed %ud pending writes", nops);
+
+	if (ndrop > 0) {
+		rspamd_fuzzy_backend_remove_partitions (bk, ndrop);
+	}
+
+	if (min_time > 0 && bk->index != NULL) {
+		rspamd_fuzzy_index_expire (bk->index, min_time);
+	}
+
+	bk->flush_failed = FALSE;
+	bk->log_seq += nlog;
+	g_array_set_size (bk->pending, 0);
+	g_array_set_size (bk->pending_log, 0);
+	bk->checkpoint_changed = FALSE;
+
+	if (bk->pending_index != NULL) {
+		rspamd_fuzzy_index_destroy (bk->pending_index);
+		bk->pending_index = rspamd_fuzzy_index_new (0);
+		g_hash_table_remove_all (bk->pending_deleted);
+	}
+
+	return TRUE;
+
+err:
+	msg_err ("cannot write %ud pending writes: %s", nops,
+			sqlite3_errmsg (bk->db));
+rollback:
+	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK,
+			bk, NULL);
+	bk->flush_failed = TRUE;
+
+	if (nops + nlog >= bk->max_pending * FUZZY_PENDING_RETRY_FACTOR) {
+		msg_err ("discard %ud pending writes and %ud log entries that cannot "
+				"be committed", nops, nlog);
+		rspamd_fuzzy_backend_reload (bk);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Expired digests are not removed here, they are dropped with their partition
+ */
+static void
+rspamd_fuzzy_backend_reply_elt (struct rspamd_fuzzy_index_digest *elt,
+		struct rspamd_fuzzy_reply *rep,
+		gint64 expire)
+{
+	if (time (NULL) - elt->time > expire) {
+		msg_debug ("requested hash has been expired");
+		rep->prob = 0.0;
+	}
+	else {
+		rep->value = elt->value;
+		rep->flag = elt->flag;
+	}
+}
+
+/*
+ * Find digest in the stored partitions starting from the newest one
+ */
+static struct rspamd_fuzzy_index_digest *
+rspamd_fuzzy_backend_find_stored (struct rspamd_fuzzy_backend *bk,
+		const gchar *digest,
+		struct rspamd_fuzzy_index_digest *found)
+{
+	struct rspamd_fuzzy_partition *part;
+	sqlite3_stmt *stmt;
+	guint i;
+
+	for (i = 0; i < bk->partitions->len; i ++) {
+		part = g_ptr_array_index (bk->partitions, i);
+
+		if (rspamd_fuzzy_backend_bloom_check_digest (part, digest) &&
+				rspamd_fuzzy_backend_run_part_stmt (bk, part,
+						RSPAMD_FUZZY_PARTITION_CHECK, digest) == SQLITE_OK) {
+			stmt = part->stmts[RSPAMD_FUZZY_PARTITION_CHECK];
+			memcpy (found->digest, digest, RSPAMD_FUZZY_DIGEST_LEN);
+			found->value = sqlite3_column_int64 (stmt, 0);
+			found->time = sqlite3_column_int64 (stmt, 1);
+			found->flag = sqlite3_column_int (stmt, 2);
+			found->id = sqlite3_column_int64 (stmt, 3);
+
+			return found;
+		}
+	}
+
+	return NULL;
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check_common (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_index *view;
+	struct rspamd_fuzzy_index_digest *elt, found;
+	struct rspamd_fuzzy_partition *part;
+	gint64 cnt;
+	guint nmatched = 0, i;
+	sqlite3_stmt *stmt;
+	gchar digest[RSPAMD_FUZZY_DIGEST_LEN];
+
+	view = rspamd_fuzzy_backend_view (backend);
+
+	/* Try direct match first of all */
+	elt = rspamd_fuzzy_index_find (view, cmd->digest);
+
+	if (elt == NULL && backend->index == NULL &&
+			!rspamd_fuzzy_backend_is_deleted (backend, cmd->digest)) {
+		elt = rspamd_fuzzy_backend_find_stored (backend, cmd->digest, &found);
+	}
+
+	if (elt != NULL) {
+		rep.prob = 1.0;
+		rspamd_fuzzy_backend_reply_elt (elt, &rep, expire);
+
+		return rep;
+	}
+
+	if (cmd->shingles_count > 0) {
+		/* Fuzzy match */
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+		elt = rspamd_fuzzy_index_match_shingles (view,
+				shcmd->sgl.hashes, RSPAMD_SHINGLE_SIZE, &nmatched);
+
+		for (i = 0; backend->index == NULL && i < backend->partitions->len &&
+				nmatched < RSPAMD_SHINGLE_SIZE; i ++) {
+			part = g_ptr_array_index (backend->partitions, i);
+
+			if (!rspamd_fuzzy_backend_bloom_check_shingles (part, shcmd) ||
+					rspamd_fuzzy_backend_run_shingles (backend, part, shcmd)
+					!= SQLITE_OK) {
+				continue;
+			}
+
+			stmt = part->stmts[RSPAMD_FUZZY_PARTITION_CHECK_SHINGLES];
+			cnt = sqlite3_column_int64 (stmt, 4);
+			rspamd_fuzzy_backend_column_digest (stmt, 0, digest);
+
+			if (cnt > nmatched &&
+					!rspamd_fuzzy_backend_is_deleted (backend, digest)) {
+				nmatched = cnt;
+				/* Digest could be modified by the pending writes */
+				elt = rspamd_fuzzy_index_find (view, digest);
+
+				if (elt == NULL) {
+					memcpy (found.digest, digest, sizeof (digest));
+					found.value = sqlite3_column_int64 (stmt, 1);
+					found.time = sqlite3_column_int64 (stmt, 2);
+					found.flag = sqlite3_column_int (stmt, 3);
+					elt = &found;
+				}
+			}
+		}
+
+		if (elt != NULL) {
+			rep.prob = (gdouble)nmatched / (gdouble)RSPAMD_SHINGLE_SIZE;
+			msg_debug ("found fuzzy hash with probability %.2f", rep.prob);
+			rspamd_fuzzy_backend_reply_elt (elt, &rep, expire);
+		}
+	}
+
+	return rep;
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	backend->expire = expire;
+	rep = rspamd_fuzzy_backend_check_common (backend, cmd, expire);
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return rep;
+}
+
+/*
+ * Find digest in the queued writes or in the database, in the latter case
+ * it is added to the pending index
+ */
+static struct rspamd_fuzzy_index_digest *
+rspamd_fuzzy_backend_find_digest (struct rspamd_fuzzy_backend *bk,
+		const gchar *digest)
+{
+	struct rspamd_fuzzy_index_digest *elt, found;
+
+	elt = rspamd_fuzzy_index_find (rspamd_fuzzy_backend_view (bk), digest);
+
+	if (elt == NULL && bk->index == NULL &&
+			!rspamd_fuzzy_backend_is_deleted (bk, digest) &&
+			rspamd_fuzzy_backend_find_stored (bk, digest, &found) != NULL) {
+		elt = rspamd_fuzzy_index_insert (bk->pending_index, digest,
+				found.id, found.flag, found.value, found.time);
+	}
+
+	return elt;
+}
+
+gboolean
+rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	gint64 id, now;
+	guint i;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd = NULL;
+	struct rspamd_fuzzy_index *view;
+	struct rspamd_fuzzy_index_digest *elt;
+	struct rspamd_fuzzy_partition *part;
+
+	if (backend->readonly) {
+		return FALSE;
+	}
+
+	rspamd_fuzzy_backend_log (backend, cmd);
+	now = time (NULL);
+	view = rspamd_fuzzy_backend_view (backend);
+	elt = rspamd_fuzzy_backend_find_digest (backend, cmd->digest);
+
+	if (elt != NULL && backend->expire > 0 &&
+			now - elt->time > backend->expire) {
+		/* Expired digest is waiting for its partition to be dropped */
+		rspamd_fuzzy_backend_delete_digest (backend, cmd->digest, elt->time);
+		elt = NULL;
+	}
+
+	if (elt != NULL) {
+		/* We need to increase weight */
+		elt->value += cmd->value;
+		rspamd_fuzzy_backend_queue (backend, RSPAMD_FUZZY_PENDING_UPDATE,
+				cmd->digest, elt->id, elt->flag, cmd->value, elt->time, NULL);
+	}
+	else {
+		if ((part = rspamd_fuzzy_backend_current_partition (backend, &now))
+				== NULL) {
+			return FALSE;
+		}
+
+		id = backend->next_id ++;
+		rspamd_fuzzy_index_insert (view, cmd->digest, id, cmd->flag,
+				cmd->value, now);
+
+		if (cmd->shingles_count > 0) {
+			shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+				rspamd_fuzzy_index_add_shingle (view, shcmd->sgl.hashes[i],
+						i, id);
+				msg_debug ("add shingle %d -> %L: %L", i, shcmd->sgl.hashes[i],
+						id);
+			}
+		}
+
+		rspamd_fuzzy_backend_queue (backend, RSPAMD_FUZZY_PENDING_INSERT,
+				cmd->digest, id, cmd->flag, cmd->value, now,
+				shcmd != NULL ? &shcmd->sgl : NULL);
+		rspamd_fuzzy_backend_bloom_add (part, cmd->digest,
+				shcmd != NULL ? &shcmd->sgl : NULL);
+
+		if (backend->pending_deleted != NULL) {
+			g_hash_table_remove (backend->pending_deleted, cmd->digest);
+		}
+
+		part->count ++;
+		backend->count ++;
+	}
+
+	if (backend->pending->len + backend->pending_log->len >=
+			backend->max_pending) {
+		rspamd_fuzzy_backend_flush (backend, 0);
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return TRUE;
+}
+
+
+gboolean
+rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_index_digest *elt;
+
+	if (backend->readonly) {
+		return FALSE;
+	}
+
+	/* Replicas could have this digest even if it is missing here */
+	rspamd_fuzzy_backend_log (backend, cmd);
+
+	if ((elt = rspamd_fuzzy_backend_find_digest (backend, cmd->digest))
+			!= NULL) {
+		rspamd_fuzzy_backend_delete_digest (backend, cmd->digest, elt->time);
+	}
+
+	if (backend->pending->len + backend->pending_log->len >=
+			backend->max_pending) {
+		rspamd_fuzzy_backend_flush (backend, 0);
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
+{
+	struct rspamd_fuzzy_partition *part;
+	gboolean ret = TRUE;
+	guint i;
+
+	backend->expire = expire;
+
+	if (backend->readonly) {
+		/*
+		 * Writer adds digests to the newest partitions only, so just load
+		 * the partitions list and refresh the newest partitions
+		 */
+		rspamd_fuzzy_backend_load_partitions (backend);
+
+		for (i = 0; i < MIN (backend->partitions->len,
+				FUZZY_REFRESH_PARTITIONS); i ++) {
+			part = g_ptr_array_index (backend->partitions, i);
+			rspamd_fuzzy_partition_count (backend, part);
+
+			if (part->digests_bloom != NULL) {
+				rspamd_fuzzy_backend_bloom_load (backend, part, FALSE);
+			}
+		}
+
+		rspamd_fuzzy_backend_update_count (backend);
+	}
+	else {
+		ret = rspamd_fuzzy_backend_flush (backend,
+				expire > 0 ? time (NULL) - expire : 0);
+	}
+
+	for (i = 0; i < backend->partitions->len; i ++) {
+		rspamd_fuzzy_backend_bloom_sync (backend,
+				g_ptr_array_index (backend->partitions, i));
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return ret;
+}
+
+
+void
+rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
+{
+	if (backend != NULL) {
+		if (backend->pending != NULL) {
+			/* Do not lose queued writes */
+			if (backend->db != NULL) {
+				rspamd_fuzzy_backend_flush (backend, 0);
+			}
+
+			g_array_free (backend->pending, TRUE);
+			g_array_free (backend->pending_log, TRUE);
+		}
+
+		if (backend->db != NULL) {
+			rspamd_fuzzy_backend_close_stmts (backend);
+			sqlite3_close (backend->db);
+		}
+
+		if (backend->partitions != NULL) {
+			g_ptr_array_free (backend->partitions, TRUE);
+		}
+
+		if (backend->path != NULL) {
+			g_free (backend->path);
+		}
+
+		if (backend->index != NULL) {
+			rspamd_fuzzy_index_destroy (backend->index);
+		}
+
+		if (backend->pending_index != NULL) {
+			rspamd_fuzzy_index_destroy (backend->pending_index);
+		}
+
+		if (backend->pending_deleted != NULL) {
+			g_hash_table_destroy (backend->pending_deleted);
+		}
+
+		g_slice_free1 (sizeof (*backend), backend);
+	}
+}
+
+
+gsize
+rspamd_fuzzy_backend_count (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->count;
+}
+
+gsize
 rspamd_fuzzy_backend_expired (struct rspamd_fuzzy_backend *backend)
 {
 	return backend->expired;
 }
+
+void
+rspamd_fuzzy_backend_set_log_size (struct rspamd_fuzzy_backend *backend,
+		gsize size)
+{
+	backend->log_size = size;
+}
+
+guint64
+rspamd_fuzzy_backend_log_seq (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->log_seq;
+}
+
+guint64
+rspamd_fuzzy_backend_log_first (struct rspamd_fuzzy_backend *backend)
+{
+	guint64 first = 0;
+
+	if (rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_LOG_FIRST) == SQLITE_OK) {
+		first = sqlite3_column_int64 (
+				prepared_stmts[RSPAMD_FUZZY_BACKEND_LOG_FIRST].stmt, 0);
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return first;
+}
+
+guint
+rspamd_fuzzy_backend_read_log (struct rspamd_fuzzy_backend *backend,
+		guint64 seq, guint limit, rspamd_fuzzy_log_cb cb, gpointer ud)
+{
+	sqlite3_stmt *stmt;
+	const struct rspamd_fuzzy_cmd *cmd;
+	gsize len;
+	guint nread = 0;
+
+	if (limit == 0) {
+		limit = FUZZY_LOG_READ_CHUNK;
+	}
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_LOG_READ,
+			(gint64)seq, (gint64)limit) == SQLITE_OK) {
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOG_READ].stmt;
+
+		do {
+			cmd = sqlite3_column_blob (stmt, 1);
+			len = sqlite3_column_bytes (stmt, 1);
+
+			if (cmd == NULL || len < sizeof (*cmd) ||
+					len != rspamd_fuzzy_backend_cmd_len (cmd)) {
+				msg_err ("skip corrupted update %L in the replication log",
+						(gint64)sqlite3_column_int64 (stmt, 0));
+				continue;
+			}
+
+			nread ++;
+
+			if (!cb (sqlite3_column_int64 (stmt, 0), cmd, len, ud)) {
+				break;
+			}
+		} while (sqlite3_step (stmt) == SQLITE_ROW);
+	}
+
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return nread;
+}
+
+guint64
+rspamd_fuzzy_backend_checkpoint (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->checkpoint;
+}
+
+void
+rspamd_fuzzy_backend_set_checkpoint (struct rspamd_fuzzy_backend *backend,
+		guint64 seq)
+{
+	backend->checkpoint = seq;
+	backend->checkpoint_changed = TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_commit (struct rspamd_fuzzy_backend *backend)
+{
+	gboolean ret;
+
+	ret = rspamd_fuzzy_backend_flush (backend, 0);
+	rspamd_fuzzy_backend_reset_stmts (backend);
+
+	return ret;
+}
+
+gboolean
+rspamd_fuzzy_backend_failed (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->flush_failed;
+}
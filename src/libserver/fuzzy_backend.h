@@ -32,10 +32,22 @@ struct rspamd_fuzzy_backend;
 /**
  * Open fuzzy backend
  * @param path file to open (legacy file will be converted automatically)
+ * @param use_index load all digests and shingles to the memory index, so
+ * sqlite is used merely as a persistent storage
+ * @param max_pending number of queued writes that forces commit (0 for
+ * the default value)
+ * @param readonly database is written by another process, so updates are
+ * refused and expired digests are left for the writer
+ * @param partition_time time in seconds covered by a single partition of
+ * digests, expired partitions are dropped as a whole (0 for the default value)
  * @param err error pointer
  * @return backend structure or NULL
  */
 struct rspamd_fuzzy_backend* rspamd_fuzzy_backend_open (const gchar *path,
+		gboolean use_index,
+		guint max_pending,
+		gboolean readonly,
+		gint64 partition_time,
 		GError **err);
 
 /**
@@ -50,7 +62,8 @@ struct rspamd_fuzzy_reply rspamd_fuzzy_backend_check (
 		gint64 expire);
 
 /**
- * Add digest to the database
+ * Add digest to the database, write is queued and committed on sync or
+ * when there are too many queued writes
  * @param backend
  * @param cmd
  * @return
@@ -70,7 +83,7 @@ gboolean rspamd_fuzzy_backend_del (
 		const struct rspamd_fuzzy_cmd *cmd);
 
 /**
- * Sync storage
+ * Commit queued writes and expire old digests
  * @param backend
  * @return
  */
@@ -86,4 +99,66 @@ void rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend);
 gsize rspamd_fuzzy_backend_count (struct rspamd_fuzzy_backend *backend);
 gsize rspamd_fuzzy_backend_expired (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Commit all queued writes, writes that cannot be committed are kept and
+ * retried by the next commit or sync
+ * @param backend
+ * @return TRUE if writes have been committed
+ */
+gboolean rspamd_fuzzy_backend_commit (struct rspamd_fuzzy_backend *backend);
+
+/**
+ * Keep log of the update commands for replication, each committed command
+ * gets the next sequence number
+ * @param backend
+ * @param size number of the last commands kept in the log (0 disables log)
+ */
+void rspamd_fuzzy_backend_set_log_size (struct rspamd_fuzzy_backend *backend,
+		gsize size);
+
+/**
+ * Get sequence number of the last committed command
+ */
+guint64 rspamd_fuzzy_backend_log_seq (struct rspamd_fuzzy_backend *backend);
+
+/**
+ * Get sequence number of the oldest command kept in the log
+ * @return sequence number or 0 if log is empty
+ */
+guint64 rspamd_fuzzy_backend_log_first (struct rspamd_fuzzy_backend *backend);
+
+typedef gboolean (*rspamd_fuzzy_log_cb) (guint64 seq,
+		const struct rspamd_fuzzy_cmd *cmd, gsize len, gpointer ud);
+
+/**
+ * Read committed commands with sequence number greater than seq
+ * @param backend
+ * @param seq the last command that has been read
+ * @param limit maximum number of commands to read (0 for the default value)
+ * @param cb callback that is called for each command, reading is stopped if
+ * it returns FALSE
+ * @return number of commands read
+ */
+guint rspamd_fuzzy_backend_read_log (struct rspamd_fuzzy_backend *backend,
+		guint64 seq, guint limit, rspamd_fuzzy_log_cb cb, gpointer ud);
+
+/**
+ * Get sequence number of the last command received from the master
+ */
+guint64 rspamd_fuzzy_backend_checkpoint (struct rspamd_fuzzy_backend *backend);
+
+/**
+ * Set sequence number of the last command received from the master, it is
+ * committed with the writes of that command
+ */
+void rspamd_fuzzy_backend_set_checkpoint (struct rspamd_fuzzy_backend *backend,
+		guint64 seq);
+
+/**
+ * Check whether the last commit of queued writes has failed, such writes are
+ * kept for the next commit and checkpoint is reloaded if they are discarded
+ * @return TRUE if queued writes are not committed
+ */
+gboolean rspamd_fuzzy_backend_failed (struct rspamd_fuzzy_backend *backend);
+
 #endif /* FUZZY_BACKEND_H_ */
@@ -0,0 +1,568 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "fuzzy_index.h"
+#include "xxhash.h"
+
+/* Minimal size of a table, must be power of two */
+#define FUZZY_INDEX_MIN_SIZE 64
+/* Size of votes table for shingles match, must be power of two */
+#define FUZZY_INDEX_VOTE_SLOTS 64
+
+struct fuzzy_ptr_slot {
+	struct rspamd_fuzzy_index_digest *elt;
+	guint32 hash;
+};
+
+struct fuzzy_ptr_table {
+	struct fuzzy_ptr_slot *slots;
+	gsize mask;
+	gsize nelts;
+};
+
+struct fuzzy_shingle_slot {
+	guint64 value;
+	gint64 id;  /* 0 means empty slot, sqlite rowids start from 1 */
+	guint32 number;
+};
+
+struct fuzzy_shingle_table {
+	struct fuzzy_shingle_slot *slots;
+	gsize mask;
+	gsize nelts;
+};
+
+struct rspamd_fuzzy_index {
+	struct fuzzy_ptr_table digests;
+	struct fuzzy_ptr_table ids;
+	struct fuzzy_shingle_table shingles;
+	gsize removed;
+};
+
+typedef gboolean (*fuzzy_ptr_eq_t) (const struct rspamd_fuzzy_index_digest *elt,
+		gconstpointer key);
+
+static inline guint64
+fuzzy_index_mix (guint64 h)
+{
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline guint32
+fuzzy_digest_hash (const gchar *digest)
+{
+	return XXH32 (digest, RSPAMD_FUZZY_DIGEST_LEN, 0);
+}
+
+static inline guint32
+fuzzy_id_hash (gint64 id)
+{
+	return fuzzy_index_mix (id);
+}
+
+static inline gsize
+fuzzy_shingle_hash (guint64 value, guint number)
+{
+	return fuzzy_index_mix (value ^ number);
+}
+
+static gboolean
+fuzzy_digest_eq (const struct rspamd_fuzzy_index_digest *elt,
+		gconstpointer key)
+{
+	return memcmp (elt->digest, key, sizeof (elt->digest)) == 0;
+}
+
+static gboolean
+fuzzy_id_eq (const struct rspamd_fuzzy_index_digest *elt,
+		gconstpointer key)
+{
+	return elt->id == *(const gint64 *)key;
+}
+
+static gsize
+fuzzy_table_size (gsize hint)
+{
+	gsize size = FUZZY_INDEX_MIN_SIZE;
+
+	/* Keep load factor below 0.5 */
+	while (size < hint * 2) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+/*
+ * Checks whether element from slot `j` with home slot `home` can be moved to
+ * the free slot `i` without breaking its probe sequence
+ */
+static inline gboolean
+fuzzy_slot_can_move (gsize i, gsize j, gsize home)
+{
+	if (j > i) {
+		return home <= i || home > j;
+	}
+
+	return home <= i && home > j;
+}
+
+static void
+fuzzy_ptr_table_init (struct fuzzy_ptr_table *t, gsize size)
+{
+	t->slots = g_malloc0 (size * sizeof (*t->slots));
+	t->mask = size - 1;
+	t->nelts = 0;
+}
+
+/*
+ * Returns either slot containing the key or the first empty slot
+ */
+static gsize
+fuzzy_ptr_table_lookup (struct fuzzy_ptr_table *t, guint32 hash,
+		fuzzy_ptr_eq_t eq, gconstpointer key)
+{
+	gsize i = hash & t->mask;
+
+	while (t->slots[i].elt != NULL) {
+		if (t->slots[i].hash == hash && eq (t->slots[i].elt, key)) {
+			break;
+		}
+		i = (i + 1) & t->mask;
+	}
+
+	return i;
+}
+
+static void
+fuzzy_ptr_table_grow (struct fuzzy_ptr_table *t)
+{
+	struct fuzzy_ptr_slot *old = t->slots;
+	gsize oldsize = t->mask + 1, i, j;
+
+	t->slots = g_malloc0 (oldsize * 2 * sizeof (*t->slots));
+	t->mask = oldsize * 2 - 1;
+
+	for (i = 0; i < oldsize; i ++) {
+		if (old[i].elt != NULL) {
+			j = old[i].hash & t->mask;
+
+			while (t->slots[j].elt != NULL) {
+				j = (j + 1) & t->mask;
+			}
+
+			t->slots[j] = old[i];
+		}
+	}
+
+	g_free (old);
+}
+
+static void
+fuzzy_ptr_table_put (struct fuzzy_ptr_table *t, guint32 hash,
+		struct rspamd_fuzzy_index_digest *elt,
+		fuzzy_ptr_eq_t eq, gconstpointer key)
+{
+	gsize i;
+
+	if ((t->nelts + 1) * 2 > t->mask + 1) {
+		fuzzy_ptr_table_grow (t);
+	}
+
+	i = fuzzy_ptr_table_lookup (t, hash, eq, key);
+
+	if (t->slots[i].elt == NULL) {
+		t->nelts ++;
+	}
+
+	t->slots[i].elt = elt;
+	t->slots[i].hash = hash;
+}
+
+/* Backward shift deletion, so we need no tombstones */
+static void
+fuzzy_ptr_table_delete (struct fuzzy_ptr_table *t, gsize i)
+{
+	gsize j = i;
+
+	for (;;) {
+		j = (j + 1) & t->mask;
+
+		if (t->slots[j].elt == NULL) {
+			break;
+		}
+
+		if (fuzzy_slot_can_move (i, j, t->slots[j].hash & t->mask)) {
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+
+	t->slots[i].elt = NULL;
+	t->nelts --;
+}
+
+static void
+fuzzy_shingle_table_init (struct fuzzy_shingle_table *t, gsize size)
+{
+	t->slots = g_malloc0 (size * sizeof (*t->slots));
+	t->mask = size - 1;
+	t->nelts = 0;
+}
+
+static gsize
+fuzzy_shingle_table_lookup (struct fuzzy_shingle_table *t, guint64 value,
+		guint number)
+{
+	gsize i = fuzzy_shingle_hash (value, number) & t->mask;
+
+	while (t->slots[i].id != 0) {
+		if (t->slots[i].value == value && t->slots[i].number == number) {
+			break;
+		}
+		i = (i + 1) & t->mask;
+	}
+
+	return i;
+}
+
+static void
+fuzzy_shingle_table_grow (struct fuzzy_shingle_table *t)
+{
+	struct fuzzy_shingle_slot *old = t->slots;
+	gsize oldsize = t->mask + 1, i, j;
+
+	t->slots = g_malloc0 (oldsize * 2 * sizeof (*t->slots));
+	t->mask = oldsize * 2 - 1;
+
+	for (i = 0; i < oldsize; i ++) {
+		if (old[i].id != 0) {
+			j = fuzzy_shingle_hash (old[i].value, old[i].number) & t->mask;
+
+			while (t->slots[j].id != 0) {
+				j = (j + 1) & t->mask;
+			}
+
+			t->slots[j] = old[i];
+		}
+	}
+
+	g_free (old);
+}
+
+struct rspamd_fuzzy_index *
+rspamd_fuzzy_index_new (gsize hint)
+{
+	struct rspamd_fuzzy_index *idx;
+
+	idx = g_slice_alloc (sizeof (*idx));
+	fuzzy_ptr_table_init (&idx->digests, fuzzy_table_size (hint));
+	fuzzy_ptr_table_init (&idx->ids, fuzzy_table_size (hint));
+	/* We usually have a lot of shingles per digest */
+	fuzzy_shingle_table_init (&idx->shingles, FUZZY_INDEX_MIN_SIZE);
+	idx->removed = 0;
+
+	return idx;
+}
+
+struct rspamd_fuzzy_index_digest *
+rspamd_fuzzy_index_find (struct rspamd_fuzzy_index *idx, const gchar *digest)
+{
+	gsize i;
+
+	i = fuzzy_ptr_table_lookup (&idx->digests, fuzzy_digest_hash (digest),
+			fuzzy_digest_eq, digest);
+
+	return idx->digests.slots[i].elt;
+}
+
+struct rspamd_fuzzy_index_digest *
+rspamd_fuzzy_index_find_id (struct rspamd_fuzzy_index *idx, gint64 id)
+{
+	gsize i;
+
+	i = fuzzy_ptr_table_lookup (&idx->ids, fuzzy_id_hash (id),
+			fuzzy_id_eq, &id);
+
+	return idx->ids.slots[i].elt;
+}
+
+static void
+fuzzy_index_remove_elt (struct rspamd_fuzzy_index *idx,
+		struct rspamd_fuzzy_index_digest *elt)
+{
+	gsize i;
+
+	i = fuzzy_ptr_table_lookup (&idx->digests, fuzzy_digest_hash (elt->digest),
+			fuzzy_digest_eq, elt->digest);
+	g_assert (idx->digests.slots[i].elt == elt);
+	fuzzy_ptr_table_delete (&idx->digests, i);
+
+	i = fuzzy_ptr_table_lookup (&idx->ids, fuzzy_id_hash (elt->id),
+			fuzzy_id_eq, &elt->id);
+
+	if (idx->ids.slots[i].elt == elt) {
+		fuzzy_ptr_table_delete (&idx->ids, i);
+	}
+
+	idx->removed ++;
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+struct rspamd_fuzzy_index_digest *
+rspamd_fuzzy_index_insert (struct rspamd_fuzzy_index *idx,
+		const gchar *digest,
+		gint64 id,
+		gint32 flag,
+		gint64 value,
+		gint64 time)
+{
+	struct rspamd_fuzzy_index_digest *elt;
+
+	elt = rspamd_fuzzy_index_find (idx, digest);
+
+	if (elt != NULL) {
+		fuzzy_index_remove_elt (idx, elt);
+	}
+
+	elt = g_slice_alloc (sizeof (*elt));
+	memcpy (elt->digest, digest, sizeof (elt->digest));
+	elt->id = id;
+	elt->flag = flag;
+	elt->value = value;
+	elt->time = time;
+
+	fuzzy_ptr_table_put (&idx->digests, fuzzy_digest_hash (digest), elt,
+			fuzzy_digest_eq, digest);
+	fuzzy_ptr_table_put (&idx->ids, fuzzy_id_hash (id), elt,
+			fuzzy_id_eq, &id);
+
+	return elt;
+}
+
+gboolean
+rspamd_fuzzy_index_remove (struct rspamd_fuzzy_index *idx,
+		const gchar *digest)
+{
+	struct rspamd_fuzzy_index_digest *elt;
+
+	elt = rspamd_fuzzy_index_find (idx, digest);
+
+	if (elt == NULL) {
+		return FALSE;
+	}
+
+	fuzzy_index_remove_elt (idx, elt);
+
+	return TRUE;
+}
+
+/*
+ * Drop shingles that point to the removed digests
+ */
+static void
+fuzzy_index_purge_shingles (struct rspamd_fuzzy_index *idx)
+{
+	struct fuzzy_shingle_table *t = &idx->shingles, nt;
+	gsize i, j;
+
+	fuzzy_shingle_table_init (&nt, t->mask + 1);
+
+	for (i = 0; i <= t->mask; i ++) {
+		if (t->slots[i].id != 0 &&
+				rspamd_fuzzy_index_find_id (idx, t->slots[i].id) != NULL) {
+			j = fuzzy_shingle_hash (t->slots[i].value, t->slots[i].number) &
+					nt.mask;
+
+			while (nt.slots[j].id != 0) {
+				j = (j + 1) & nt.mask;
+			}
+
+			nt.slots[j] = t->slots[i];
+			nt.nelts ++;
+		}
+	}
+
+	g_free (t->slots);
+	*t = nt;
+}
+
+gsize
+rspamd_fuzzy_index_expire (struct rspamd_fuzzy_index *idx, gint64 min_time)
+{
+	GPtrArray *expired;
+	struct rspamd_fuzzy_index_digest *elt;
+	gsize i, nexpired;
+
+	expired = g_ptr_array_new ();
+
+	/* We cannot remove elements while iterating due to backward shifts */
+	for (i = 0; i <= idx->digests.mask; i ++) {
+		elt = idx->digests.slots[i].elt;
+
+		if (elt != NULL && elt->time < min_time) {
+			g_ptr_array_add (expired, elt);
+		}
+	}
+
+	for (i = 0; i < expired->len; i ++) {
+		fuzzy_index_remove_elt (idx, g_ptr_array_index (expired, i));
+	}
+
+	nexpired = expired->len;
+	g_ptr_array_free (expired, TRUE);
+
+	if (idx->removed > 0) {
+		fuzzy_index_purge_shingles (idx);
+		idx->removed = 0;
+	}
+
+	return nexpired;
+}
+
+void
+rspamd_fuzzy_index_add_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value,
+		guint number,
+		gint64 id)
+{
+	struct fuzzy_shingle_table *t = &idx->shingles;
+	gsize i;
+
+	g_assert (id != 0);
+
+	if ((t->nelts + 1) * 2 > t->mask + 1) {
+		fuzzy_shingle_table_grow (t);
+	}
+
+	i = fuzzy_shingle_table_lookup (t, value, number);
+
+	if (t->slots[i].id == 0) {
+		t->nelts ++;
+		t->slots[i].value = value;
+		t->slots[i].number = number;
+	}
+
+	t->slots[i].id = id;
+}
+
+gint64
+rspamd_fuzzy_index_find_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value,
+		guint number)
+{
+	gsize i;
+
+	i = fuzzy_shingle_table_lookup (&idx->shingles, value, number);
+
+	if (idx->shingles.slots[i].id == 0) {
+		return -1;
+	}
+
+	return idx->shingles.slots[i].id;
+}
+
+struct rspamd_fuzzy_index_digest *
+rspamd_fuzzy_index_match_shingles (struct rspamd_fuzzy_index *idx,
+		const guint64 *values,
+		guint nvalues,
+		guint *nmatched)
+{
+	struct {
+		gint64 id;
+		guint cnt;
+	} votes[FUZZY_INDEX_VOTE_SLOTS];
+	struct rspamd_fuzzy_index_digest *elt, *best = NULL;
+	gint64 id;
+	guint i, j;
+
+	/* Keep votes table at most half full */
+	g_assert (nvalues * 2 <= FUZZY_INDEX_VOTE_SLOTS);
+	memset (votes, 0, sizeof (votes));
+
+	for (i = 0; i < nvalues; i ++) {
+		id = rspamd_fuzzy_index_find_shingle (idx, values[i], i);
+
+		if (id == -1) {
+			continue;
+		}
+
+		j = fuzzy_id_hash (id) & (FUZZY_INDEX_VOTE_SLOTS - 1);
+
+		while (votes[j].id != 0 && votes[j].id != id) {
+			j = (j + 1) & (FUZZY_INDEX_VOTE_SLOTS - 1);
+		}
+
+		votes[j].id = id;
+		votes[j].cnt ++;
+	}
+
+	*nmatched = 0;
+
+	for (j = 0; j < FUZZY_INDEX_VOTE_SLOTS; j ++) {
+		if (votes[j].cnt > *nmatched) {
+			/* Shingles of the removed digests could be still here */
+			elt = rspamd_fuzzy_index_find_id (idx, votes[j].id);
+
+			if (elt != NULL) {
+				best = elt;
+				*nmatched = votes[j].cnt;
+			}
+		}
+	}
+
+	return best;
+}
+
+gsize
+rspamd_fuzzy_index_count (struct rspamd_fuzzy_index *idx)
+{
+	return idx->digests.nelts;
+}
+
+void
+rspamd_fuzzy_index_destroy (struct rspamd_fuzzy_index *idx)
+{
+	gsize i;
+
+	if (idx != NULL) {
+		for (i = 0; i <= idx->digests.mask; i ++) {
+			if (idx->digests.slots[i].elt != NULL) {
+				g_slice_free1 (sizeof (struct rspamd_fuzzy_index_digest),
+						idx->digests.slots[i].elt);
+			}
+		}
+
+		g_free (idx->digests.slots);
+		g_free (idx->ids.slots);
+		g_free (idx->shingles.slots);
+		g_slice_free1 (sizeof (*idx), idx);
+	}
+}
@@ -0,0 +1,138 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FUZZY_INDEX_H_
+#define FUZZY_INDEX_H_
+
+#include "config.h"
+
+/*
+ * Memory resident index of fuzzy digests and shingles. It uses open
+ * addressing tables with linear probing, so a lookup usually touches a single
+ * cache line
+ */
+
+#define RSPAMD_FUZZY_DIGEST_LEN 64
+
+struct rspamd_fuzzy_index;
+
+struct rspamd_fuzzy_index_digest {
+	gchar digest[RSPAMD_FUZZY_DIGEST_LEN];
+	gint64 id;
+	gint64 value;
+	gint64 time;
+	gint32 flag;
+};
+
+/**
+ * Create new index
+ * @param hint expected number of digests
+ * @return new index
+ */
+struct rspamd_fuzzy_index * rspamd_fuzzy_index_new (gsize hint);
+
+/**
+ * Find digest in the index
+ * @return digest element or NULL
+ */
+struct rspamd_fuzzy_index_digest * rspamd_fuzzy_index_find (
+		struct rspamd_fuzzy_index *idx,
+		const gchar *digest);
+
+/**
+ * Find digest by its database id
+ * @return digest element or NULL
+ */
+struct rspamd_fuzzy_index_digest * rspamd_fuzzy_index_find_id (
+		struct rspamd_fuzzy_index *idx,
+		gint64 id);
+
+/**
+ * Insert new digest to the index, the existing element with the same digest
+ * is replaced
+ * @return inserted element that can be modified by a caller
+ */
+struct rspamd_fuzzy_index_digest * rspamd_fuzzy_index_insert (
+		struct rspamd_fuzzy_index *idx,
+		const gchar *digest,
+		gint64 id,
+		gint32 flag,
+		gint64 value,
+		gint64 time);
+
+/**
+ * Remove digest from the index. Shingles that point to this digest are not
+ * removed but they cannot be resolved to a digest anymore
+ * @return TRUE if digest has been found
+ */
+gboolean rspamd_fuzzy_index_remove (struct rspamd_fuzzy_index *idx,
+		const gchar *digest);
+
+/**
+ * Remove all digests older than the specified time and drop shingles of
+ * the digests removed since the previous call
+ * @return number of removed digests
+ */
+gsize rspamd_fuzzy_index_expire (struct rspamd_fuzzy_index *idx,
+		gint64 min_time);
+
+/**
+ * Add or replace shingle for the specified digest id
+ */
+void rspamd_fuzzy_index_add_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value,
+		guint number,
+		gint64 id);
+
+/**
+ * Find digest id for the specified shingle
+ * @return digest id or -1 if shingle is not found
+ */
+gint64 rspamd_fuzzy_index_find_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value,
+		guint number);
+
+/**
+ * Find digest that has the most shingles matched, shingle number is the
+ * position of value in the array
+ * @param values shingles values
+ * @param nvalues number of shingles
+ * @param nmatched number of matched shingles for the selected digest
+ * @return digest element or NULL
+ */
+struct rspamd_fuzzy_index_digest * rspamd_fuzzy_index_match_shingles (
+		struct rspamd_fuzzy_index *idx,
+		const guint64 *values,
+		guint nvalues,
+		guint *nmatched);
+
+/**
+ * Get number of digests in the index
+ */
+gsize rspamd_fuzzy_index_count (struct rspamd_fuzzy_index *idx);
+
+/**
+ * Destroy index and all its elements
+ */
+void rspamd_fuzzy_index_destroy (struct rspamd_fuzzy_index *idx);
+
+#endif /* FUZZY_INDEX_H_ */
@@ -28,6 +28,7 @@
 #include "message.h"
 #include "symbols_cache.h"
 #include "cfg_file.h"
+#include "expressions.h"
 
 #define WEIGHT_MULT 4.0
 #define FREQUENCY_MULT 10.0
@@ -35,6 +36,10 @@
 
 /* After which number of messages try to resort cache */
 #define MAX_USES 100
+/* How often shared statistics are flushed to the cache file (seconds) */
+#define CHECKPOINT_INTERVAL 60
+/* Weight of saved average time when statistics are loaded from a file */
+#define WARM_SAMPLES 100
 /*
  * Symbols cache utility functions
  */
@@ -104,71 +109,336 @@ rspamd_set_counter (struct cache_item *item, guint32 value)
 	return cd->value;
 }
 
+static gint
+cache_ptr_cmp (gconstpointer p1, gconstpointer p2)
+{
+	return cache_cmp (*(gpointer *)p1, *(gpointer *)p2);
+}
+
 static GChecksum *
 get_mem_cksum (struct symbols_cache *cache)
 {
 	GChecksum *result;
-	GList *cur, *l;
+	GPtrArray *sorted;
 	struct cache_item *item;
+	guint i;
 
 	result = g_checksum_new (G_CHECKSUM_SHA1);
 
-	l = g_list_copy (cache->negative_items);
-	l = g_list_sort (l, cache_cmp);
-	cur = g_list_first (l);
-	while (cur) {
-		item = cur->data;
-		if (item->s->symbol[0] != '\0') {
-			g_checksum_update (result, item->s->symbol,
-				strlen (item->s->symbol));
-		}
-		cur = g_list_next (cur);
+	sorted = g_ptr_array_sized_new (cache->items->len);
+	for (i = 0; i < cache->items->len; i ++) {
+		g_ptr_array_add (sorted, g_ptr_array_index (cache->items, i));
 	}
-	g_list_free (l);
+	g_ptr_array_sort (sorted, cache_ptr_cmp);
 
-
-	l = g_list_copy (cache->static_items);
-	l = g_list_sort (l, cache_cmp);
-	cur = g_list_first (l);
-	while (cur) {
-		item = cur->data;
+	for (i = 0; i < sorted->len; i ++) {
+		item = g_ptr_array_index (sorted, i);
 		if (item->s->symbol[0] != '\0') {
 			g_checksum_update (result, item->s->symbol,
 				strlen (item->s->symbol));
 		}
 		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
 	}
-	g_list_free (l);
+	g_ptr_array_free (sorted, TRUE);
 
 	return result;
 }
 
+static void
+resolve_cache_deps (struct symbols_cache *cache, struct cache_item *item)
+{
+	struct cache_dependency *dep;
+	guint i;
+
+	if (item->deps == NULL) {
+		return;
+	}
+
+	for (i = 0; i < item->deps->len; i ++) {
+		dep = g_ptr_array_index (item->deps, i);
+
+		if (dep->item == NULL) {
+			dep->item = g_hash_table_lookup (cache->items_by_symbol, dep->sym);
+
+			if (dep->item == NULL) {
+				msg_warn ("cannot find dependency %s of symbol %s",
+					dep->sym, item->s->symbol);
+			}
+			else if (dep->item == item) {
+				msg_warn ("symbol %s depends on itself", item->s->symbol);
+				dep->item = NULL;
+			}
+		}
+	}
+}
+
+static void
+init_item_bounds (struct symbols_cache *cache, struct cache_item *item)
+{
+	struct rspamd_config *cfg = cache->cfg;
+	struct rspamd_symbol_def *sdef;
+	struct cache_bound *total;
+	const gchar *sym = item->s->symbol;
+	gboolean bounded;
+	gdouble w;
+	guint i;
+
+	if (item->bounds == NULL) {
+		item->bounds = rspamd_mempool_alloc0 (cache->static_pool,
+				sizeof (struct cache_bound) * cache->nmetrics);
+	}
+
+	for (i = 0; i < cache->nmetrics; i ++) {
+		total = &cache->bounds[i];
+		sdef = g_hash_table_lookup (cache->metrics[i]->symbols, sym);
+
+		if (sdef == NULL || item->is_skipped) {
+			item->bounds[i].pos = 0;
+			item->bounds[i].neg = 0;
+			continue;
+		}
+
+		w = *sdef->weight_ptr;
+		item->bounds[i].pos = MAX (w, 0);
+		item->bounds[i].neg = MAX (-w, 0);
+
+		/*
+		 * Normal symbols are inserted by their own callbacks once per task,
+		 * whilst virtual ones can be inserted many times (e.g. per url) unless
+		 * they are one shot, composites or classifiers
+		 */
+		bounded = !item->is_virtual || cfg->one_shot_mode || sdef->one_shot ||
+			g_hash_table_lookup (cfg->composite_symbols, sym) != NULL ||
+			g_hash_table_lookup (cfg->classifiers_symbols, sym) != NULL;
+
+		if (item->is_multiplied) {
+			/* Multiplier can increase weight or change its sign */
+			if (w != 0) {
+				total->pos_unbounded = TRUE;
+				total->neg_unbounded = TRUE;
+			}
+		}
+		else if (bounded) {
+			total->pos += item->bounds[i].pos;
+			total->neg += item->bounds[i].neg;
+		}
+		else if (w > 0) {
+			total->pos_unbounded = TRUE;
+		}
+		else if (w < 0) {
+			total->neg_unbounded = TRUE;
+		}
+	}
+}
+
+/*
+ * Calculate maximum contribution of all items to each metric, composites can
+ * also remove weights of positive symbols
+ */
+static void
+init_cache_bounds (struct symbols_cache *cache)
+{
+	struct rspamd_config *cfg = cache->cfg;
+	struct rspamd_composite *comp;
+	struct rspamd_symbol_def *sdef;
+	struct expression *expr;
+	GHashTableIter it;
+	gpointer k, v;
+	GList *cur;
+	gchar *sym;
+	guint i;
+
+	if (cfg == NULL || cfg->metrics_list == NULL) {
+		return;
+	}
+
+	if (cache->metrics == NULL) {
+		cache->nmetrics = g_list_length (cfg->metrics_list);
+		cache->metrics = rspamd_mempool_alloc (cache->static_pool,
+				sizeof (struct metric *) * cache->nmetrics);
+		cache->bounds = rspamd_mempool_alloc (cache->static_pool,
+				sizeof (struct cache_bound) * cache->nmetrics);
+
+		for (i = 0, cur = cfg->metrics_list; cur != NULL;
+			cur = g_list_next (cur), i ++) {
+			cache->metrics[i] = cur->data;
+		}
+	}
+
+	memset (cache->bounds, 0, sizeof (struct cache_bound) * cache->nmetrics);
+
+	for (i = 0; i < cache->items->len; i ++) {
+		init_item_bounds (cache, g_ptr_array_index (cache->items, i));
+	}
+
+	/* Symbols without items can be inserted by anything, e.g. lua rules */
+	for (i = 0; i < cache->nmetrics; i ++) {
+		g_hash_table_iter_init (&it, cache->metrics[i]->symbols);
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+
+			if (g_hash_table_lookup (cache->items_by_symbol, k) != NULL) {
+				continue;
+			}
+			if (*sdef->weight_ptr > 0) {
+				cache->bounds[i].pos_unbounded = TRUE;
+			}
+			else if (*sdef->weight_ptr < 0) {
+				cache->bounds[i].neg_unbounded = TRUE;
+			}
+		}
+	}
+
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		comp = v;
+
+		for (expr = comp->expr; expr != NULL; expr = expr->next) {
+			if (expr->type != EXPR_STR) {
+				continue;
+			}
+			sym = expr->content.operand;
+			if (*sym == '~' || *sym == '-') {
+				sym++;
+			}
+			for (i = 0; i < cache->nmetrics; i ++) {
+				sdef = g_hash_table_lookup (cache->metrics[i]->symbols, sym);
+				if (sdef != NULL && *sdef->weight_ptr > 0) {
+					cache->bounds[i].neg += *sdef->weight_ptr;
+				}
+			}
+		}
+	}
+}
+
+static void
+free_cache_order (struct cache_order *order)
+{
+	g_free (order->ids);
+	g_free (order->async_ids);
+	g_slice_free1 (sizeof (*order), order);
+}
+
+/* Copy hot data of items to a contiguous array indexed by items' ids */
+static void
+freeze_cache (struct symbols_cache *cache)
+{
+	struct cache_item_hot *hot;
+	struct counter_data *counters;
+	struct cache_item *item;
+	guint i;
+
+	g_free (cache->hot);
+	cache->nhot = cache->items->len;
+	cache->hot = g_malloc0 (sizeof (struct cache_item_hot) * (cache->nhot + 1));
+	counters = rspamd_mempool_alloc0_shared (cache->static_pool,
+			sizeof (struct counter_data) * (cache->nhot + 1));
+
+	for (i = 0; i < cache->nhot; i ++) {
+		item = g_ptr_array_index (cache->items, i);
+		hot = &cache->hot[i];
+
+		hot->func = item->func;
+		hot->user_data = item->user_data;
+		hot->priority = item->priority;
+		hot->item = item;
+		hot->flags = 0;
+
+		if (item->is_virtual) {
+			hot->flags |= CACHE_ITEM_FLAG_VIRTUAL;
+		}
+		if (item->is_callback) {
+			hot->flags |= CACHE_ITEM_FLAG_CALLBACK;
+		}
+		if (item->is_skipped) {
+			hot->flags |= CACHE_ITEM_FLAG_SKIPPED;
+		}
+		if (item->is_async) {
+			hot->flags |= CACHE_ITEM_FLAG_ASYNC;
+		}
+
+		memcpy (&counters[i], item->cd, sizeof (struct counter_data));
+		item->cd = &counters[i];
+	}
+
+	cache->counters = counters;
+}
+
+static gint
+cache_order_cmp (gconstpointer p1, gconstpointer p2, gpointer ud)
+{
+	struct symbols_cache *cache = ud;
+	const struct cache_item *i1, *i2;
+
+	i1 = g_ptr_array_index (cache->items, *(const guint *)p1);
+	i2 = g_ptr_array_index (cache->items, *(const guint *)p2);
+
+	/* Negative items are always processed first */
+	if (i1->is_negative != i2->is_negative) {
+		return i1->is_negative ? -1 : 1;
+	}
+
+	return cache_logic_cmp (i1, i2);
+}
+
+/*
+ * Build new processing order of items and replace the current one, tasks that
+ * are in progress keep references to the order they have started with
+ */
+static void
+resort_cache (struct symbols_cache *cache)
+{
+	struct cache_order *order, *old;
+	struct cache_item *item;
+	guint i;
+
+	order = g_slice_alloc0 (sizeof (*order));
+	REF_INIT_RETAIN (order, free_cache_order);
+	order->nids = cache->items->len;
+	order->ids = g_malloc (sizeof (guint) * (order->nids + 1));
+	order->async_ids = g_malloc (sizeof (guint) * (order->nids + 1));
+
+	for (i = 0; i < order->nids; i ++) {
+		order->ids[i] = i;
+	}
+
+	g_qsort_with_data (order->ids, order->nids, sizeof (guint),
+		cache_order_cmp, cache);
+
+	for (i = 0; i < order->nids; i ++) {
+		item = g_ptr_array_index (cache->items, order->ids[i]);
+		if (item->is_async) {
+			order->async_ids[order->nasync++] = order->ids[i];
+		}
+	}
+
+	old = cache->order;
+	cache->order = order;
+	REF_RELEASE (old);
+}
+
 /* Sort items in logical order */
 static void
 post_cache_init (struct symbols_cache *cache)
 {
-	GList *cur;
 	struct cache_item *item;
+	guint i;
 
 	total_frequency = 0;
 	nsymbols = cache->used_items;
-	cur = g_list_first (cache->negative_items);
-	while (cur) {
-		item = cur->data;
+
+	for (i = 0; i < cache->items->len; i ++) {
+		item = g_ptr_array_index (cache->items, i);
 		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
+		resolve_cache_deps (cache, item);
 	}
-	cur = g_list_first (cache->static_items);
-	while (cur) {
-		item = cur->data;
-		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
+
+	if (cache->nhot != cache->items->len) {
+		freeze_cache (cache);
 	}
 
-	cache->negative_items =
-		g_list_sort (cache->negative_items, cache_logic_cmp);
-	cache->static_items = g_list_sort (cache->static_items, cache_logic_cmp);
+	resort_cache (cache);
+	init_cache_bounds (cache);
 }
 
 /* Unmap cache file */
@@ -178,15 +448,76 @@ unmap_cache_file (gpointer arg)
 	struct symbols_cache *cache = arg;
 
 	/* A bit ugly usage */
+	msync (cache->map, cache->used_items * sizeof (struct saved_cache_item),
+		MS_SYNC);
 	munmap (cache->map, cache->used_items * sizeof (struct saved_cache_item));
 }
 
+/* Schedule write of statistics shared by all workers to the cache file */
+static void
+checkpoint_cache_file (struct symbols_cache *cache)
+{
+	time_t now;
+
+	now = time (NULL);
+	if (cache->map == NULL || now - cache->last_checkpoint < CHECKPOINT_INTERVAL) {
+		return;
+	}
+
+	cache->last_checkpoint = now;
+	if (msync (cache->map, cache->used_items * sizeof (struct saved_cache_item),
+		MS_ASYNC) == -1) {
+		msg_warn ("cannot sync cache file: %s", strerror (errno));
+	}
+}
+
+/*
+ * Copy statistics of symbols that are still registered from an outdated cache
+ * file, so changes of configuration do not reset ordering of symbols
+ */
+static void
+load_cache_stats (struct symbols_cache *cache, const gchar *filename,
+	gsize cklen)
+{
+	struct saved_cache_item saved;
+	struct cache_item *item;
+	struct stat st;
+	gint fd;
+	guint i, n, loaded = 0;
+
+	if ((fd = open (filename, O_RDONLY)) == -1) {
+		return;
+	}
+	if (fstat (fd, &st) == -1 || (gsize)st.st_size < cklen) {
+		close (fd);
+		return;
+	}
+
+	n = (st.st_size - cklen) / sizeof (struct saved_cache_item);
+
+	for (i = 0; i < n; i ++) {
+		if (read (fd, &saved, sizeof (saved)) != sizeof (saved)) {
+			break;
+		}
+		saved.symbol[sizeof (saved.symbol) - 1] = '\0';
+		item = g_hash_table_lookup (cache->items_by_symbol, saved.symbol);
+		if (item != NULL) {
+			item->s->frequency = saved.frequency;
+			item->s->avg_time = saved.avg_time;
+			loaded ++;
+		}
+	}
+
+	close (fd);
+	msg_info ("loaded statistics of %ud symbols from %s", loaded, filename);
+}
+
 static gboolean
 mmap_cache_file (struct symbols_cache *cache, gint fd, rspamd_mempool_t *pool)
 {
 	guint8 *map;
-	gint i;
-	GList *cur;
+	guint i;
+	struct saved_cache_item *saved;
 	struct cache_item *item;
 
 	if (cache->used_items > 0) {
@@ -204,25 +535,24 @@ mmap_cache_file (struct symbols_cache *cache, gint fd, rspamd_mempool_t *pool)
 		/* Close descriptor as it would never be used */
 		close (fd);
 		cache->map = map;
-		/* Now free old values for saved cache items and fill them with mmapped ones */
-		i = 0;
-		cur = g_list_first (cache->negative_items);
-		while (cur) {
-			item = cur->data;
-			item->s =
-				(struct saved_cache_item *)(map + i *
+		/*
+		 * Now replace old values for saved cache items with mmapped ones,
+		 * checksum guarantees the same set of symbols but not their order
+		 */
+		for (i = 0; i < cache->used_items; i ++) {
+			saved = (struct saved_cache_item *)(map + i *
 				sizeof (struct saved_cache_item));
-			cur = g_list_next (cur);
-			i++;
-		}
-		cur = g_list_first (cache->static_items);
-		while (cur) {
-			item = cur->data;
-			item->s =
-				(struct saved_cache_item *)(map + i *
-				sizeof (struct saved_cache_item));
-			cur = g_list_next (cur);
-			i++;
+			saved->symbol[sizeof (saved->symbol) - 1] = '\0';
+			item = g_hash_table_lookup (cache->items_by_symbol, saved->symbol);
+
+			if (item != NULL) {
+				item->s = saved;
+				/* Continue averaging from the saved value */
+				if (saved->avg_time > 0) {
+					item->cd->value = saved->avg_time;
+					item->cd->number = WARM_SAMPLES;
+				}
+			}
 		}
 
 		post_cache_init (cache);
@@ -241,7 +571,7 @@ create_cache_file (struct symbols_cache *cache,
 	GChecksum *cksum;
 	u_char *digest;
 	gsize cklen;
-	GList *cur;
+	guint i;
 	struct cache_item *item;
 
 	/* Calculate checksum */
@@ -257,9 +587,8 @@ create_cache_file (struct symbols_cache *cache,
 
 	g_checksum_get_digest (cksum, digest, &cklen);
 	/* Now write data to file */
-	cur = g_list_first (cache->negative_items);
-	while (cur) {
-		item = cur->data;
+	for (i = 0; i < cache->items->len; i ++) {
+		item = g_ptr_array_index (cache->items, i);
 		if (write (fd, item->s, sizeof (struct saved_cache_item)) == -1) {
 			msg_err ("cannot write to file %d, %s", errno, strerror (errno));
 			close (fd);
@@ -267,19 +596,6 @@ create_cache_file (struct symbols_cache *cache,
 			g_free (digest);
 			return FALSE;
 		}
-		cur = g_list_next (cur);
-	}
-	cur = g_list_first (cache->static_items);
-	while (cur) {
-		item = cur->data;
-		if (write (fd, item->s, sizeof (struct saved_cache_item)) == -1) {
-			msg_err ("cannot write to file %d, %s", errno, strerror (errno));
-			close (fd);
-			g_checksum_free (cksum);
-			g_free (digest);
-			return FALSE;
-		}
-		cur = g_list_next (cur);
 	}
 	/* Write checksum */
 	if (write (fd, digest, cklen) == -1) {
@@ -313,7 +629,7 @@ register_symbol_common (struct symbols_cache **cache,
 {
 	struct cache_item *item = NULL;
 	struct symbols_cache *pcache = *cache;
-	GList **target, *cur;
+	GList *cur;
 	struct metric *m;
 	struct rspamd_symbol_def *s;
 	gboolean skipped;
@@ -325,6 +641,7 @@ register_symbol_common (struct symbols_cache **cache,
 			rspamd_mempool_new (rspamd_mempool_suggest_size ());
 		pcache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
 				rspamd_str_equal);
+		pcache->items = g_ptr_array_new ();
 	}
 
 	item = rspamd_mempool_alloc0 (pcache->static_pool,
@@ -336,6 +653,11 @@ register_symbol_common (struct symbols_cache **cache,
 			sizeof (struct counter_data));
 
 	item->mtx = rspamd_mempool_get_mutex (pcache->static_pool);
+	/* Histograms are shared between workers */
+	item->cpu_hist = rspamd_mempool_alloc0_shared (pcache->static_pool,
+			sizeof (struct rspamd_histogram));
+	item->wall_hist = rspamd_mempool_alloc0_shared (pcache->static_pool,
+			sizeof (struct rspamd_histogram));
 
 	rspamd_strlcpy (item->s->symbol, name, sizeof (item->s->symbol));
 	item->func = func;
@@ -406,31 +728,22 @@ register_symbol_common (struct symbols_cache **cache,
 				name);
 	}
 
-	/* If we have undefined priority determine list according to weight */
+	/* If we have undefined priority determine group according to weight */
 	if (priority == 0) {
-		if (item->s->weight > 0) {
-			target = &(*cache)->static_items;
-		}
-		else {
-			target = &(*cache)->negative_items;
-		}
+		item->is_negative = item->s->weight <= 0;
 	}
 	else {
 		/* Items with more priority are called before items with less priority */
-		if (priority < 0) {
-			target = &(*cache)->negative_items;
-		}
-		else {
-			target = &(*cache)->static_items;
-		}
+		item->is_negative = priority < 0;
 	}
 
+	item->id = pcache->used_items;
 	pcache->used_items++;
 	g_hash_table_insert (pcache->items_by_symbol, item->s->symbol, item);
 	msg_debug ("used items: %d, added symbol: %s", (*cache)->used_items, name);
 	rspamd_set_counter (item, 0);
 
-	*target = g_list_prepend (*target, item);
+	g_ptr_array_add (pcache->items, item);
 }
 
 void
@@ -494,6 +807,46 @@ register_callback_symbol_priority (struct symbols_cache **cache,
 }
 
 
+void
+register_symbol_dependency (struct symbols_cache *cache,
+	const gchar *symbol,
+	const gchar *dep)
+{
+	struct cache_item *item;
+	struct cache_dependency *d;
+
+	if (cache == NULL ||
+		(item = g_hash_table_lookup (cache->items_by_symbol, symbol)) == NULL) {
+		msg_err ("cannot add dependency on %s to unknown symbol %s",
+			dep, symbol);
+		return;
+	}
+
+	d = rspamd_mempool_alloc0 (cache->static_pool, sizeof (*d));
+	d->sym = rspamd_mempool_strdup (cache->static_pool, dep);
+
+	if (item->deps == NULL) {
+		item->deps = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (cache->static_pool,
+			(rspamd_mempool_destruct_t)g_ptr_array_unref, item->deps);
+	}
+
+	g_ptr_array_add (item->deps, d);
+}
+
+void
+set_symbol_async (struct symbols_cache *cache, const gchar *symbol)
+{
+	struct cache_item *item;
+
+	if (cache == NULL ||
+		(item = g_hash_table_lookup (cache->items_by_symbol, symbol)) == NULL) {
+		msg_err ("cannot mark unknown symbol %s as asynchronous", symbol);
+		return;
+	}
+
+	item->is_async = TRUE;
+}
 
 static void
 free_cache (gpointer arg)
@@ -504,12 +857,9 @@ free_cache (gpointer arg)
 		unmap_cache_file (cache);
 	}
 
-	if (cache->static_items) {
-		g_list_free (cache->static_items);
-	}
-	if (cache->negative_items) {
-		g_list_free (cache->negative_items);
-	}
+	REF_RELEASE (cache->order);
+	g_free (cache->hot);
+	g_ptr_array_free (cache->items, TRUE);
 	g_hash_table_destroy (cache->items_by_symbol);
 	rspamd_mempool_delete (cache->static_pool);
 
@@ -633,6 +983,7 @@ init_symbols_cache (rspamd_mempool_t * pool,
 			g_free (file_sum);
 			g_checksum_free (cksum);
 			msg_info ("checksum mismatch, recreating file");
+			load_cache_stats (cache, filename, cklen);
 			/* Reopen with rw permissions */
 			if ((fd =
 				open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR |
@@ -682,30 +1033,13 @@ static void
 rspamd_symbols_cache_metric_cb (gpointer k, gpointer v, gpointer ud)
 {
 	struct symbols_cache *cache = (struct symbols_cache *)ud;
-	GList *cur;
 	const gchar *sym = k;
 	struct rspamd_symbol_def *s = (struct rspamd_symbol_def *)v;
-	gdouble weight;
 	struct cache_item *item;
 
-	weight = *s->weight_ptr;
-	cur = cache->negative_items;
-	while (cur) {
-		item = cur->data;
-		if (strcmp (item->s->symbol, sym) == 0) {
-			item->metric_weight = weight;
-			return;
-		}
-		cur = g_list_next (cur);
-	}
-	cur = cache->static_items;
-	while (cur) {
-		item = cur->data;
-		if (strcmp (item->s->symbol, sym) == 0) {
-			item->metric_weight = weight;
-			return;
-		}
-		cur = g_list_next (cur);
+	item = g_hash_table_lookup (cache->items_by_symbol, sym);
+	if (item != NULL) {
+		item->metric_weight = *s->weight_ptr;
 	}
 }
 
@@ -714,9 +1048,7 @@ validate_cache (struct symbols_cache *cache,
 	struct rspamd_config *cfg,
 	gboolean strict)
 {
-	struct cache_item *item;
-	GList *cur, *p, *metric_symbols;
-	gboolean res;
+	GList *cur, *metric_symbols;
 
 	if (cache == NULL) {
 		msg_err ("empty cache is invalid");
@@ -727,28 +1059,7 @@ validate_cache (struct symbols_cache *cache,
 	metric_symbols = g_hash_table_get_keys (cfg->metrics_symbols);
 	cur = metric_symbols;
 	while (cur) {
-		res = FALSE;
-		p = cache->negative_items;
-		while (p) {
-			item = p->data;
-			if (strcmp (item->s->symbol, cur->data) == 0) {
-				res = TRUE;
-				break;
-			}
-			p = g_list_next (p);
-		}
-		if (!res) {
-			p = cache->static_items;
-			while (p) {
-				item = p->data;
-				if (strcmp (item->s->symbol, cur->data) == 0) {
-					res = TRUE;
-					break;
-				}
-				p = g_list_next (p);
-			}
-		}
-		if (!res) {
+		if (g_hash_table_lookup (cache->items_by_symbol, cur->data) == NULL) {
 			msg_warn (
 				"symbol '%s' is registered in metric but not found in cache",
 				cur->data);
@@ -767,158 +1078,440 @@ validate_cache (struct symbols_cache *cache,
 			rspamd_symbols_cache_metric_cb,
 			cache);
 		/* Resort caches */
-		cache->negative_items = g_list_sort (cache->negative_items,
-				cache_logic_cmp);
-		cache->static_items =
-			g_list_sort (cache->static_items, cache_logic_cmp);
+		if (cache->nhot != cache->items->len) {
+			freeze_cache (cache);
+		}
+		resort_cache (cache);
+		init_cache_bounds (cache);
 	}
 
 	return TRUE;
 }
 
+/* Per-task state of cache items */
+#define CACHE_ITEM_STARTED (1 << 0)
+#define CACHE_ITEM_DELAYED (1 << 1)
+
 struct symbol_callback_data {
 	enum {
-		CACHE_STATE_NEGATIVE,
-		CACHE_STATE_STATIC
+		CACHE_STATE_ASYNC,
+		CACHE_STATE_SYNC,
+		CACHE_STATE_DELAYED
 	} state;
 	struct cache_item *saved_item;
-	GList *list_pointer;
+	struct cache_order *order;
+	guint pos;
+	guint8 *items_state;
+	guint nitems;
+	GPtrArray *delayed;
+	/* Maximum contribution of symbols that are not processed yet */
+	struct cache_bound *remaining;
+	guint nmetrics;
 };
 
-gboolean
-call_symbol_callback (struct rspamd_task * task,
-	struct symbols_cache * cache,
-	gpointer *save)
+static void
+release_cache_order (gpointer p)
+{
+	struct cache_order *order = p;
+
+	REF_RELEASE (order);
+}
+
+struct cache_watcher_data {
+	struct cache_item *item;
+	struct timeval tv;
+};
+
+static guint64
+cache_wall_diff (const struct timeval *tv)
+{
+	struct timeval now;
+	gint64 diff;
+
+	if (gettimeofday (&now, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+		return 0;
+	}
+
+	diff = (gint64)(now.tv_sec - tv->tv_sec) * 1000000 +
+		(now.tv_usec - tv->tv_usec);
+
+	return diff > 0 ? diff : 0;
+}
+
+/* Called when all events registered by a symbol are finished */
+static void
+cache_watcher_cb (void *ud)
+{
+	struct cache_watcher_data *wd = ud;
+
+	rspamd_histogram_add (wd->item->wall_hist, cache_wall_diff (&wd->tv));
+}
+
+static void
+call_cache_item (struct rspamd_task *task, struct cache_item_hot *hot)
 {
 #ifdef HAVE_CLOCK_GETTIME
 	struct timespec ts1, ts2;
 #else
 	struct timeval tv1, tv2;
 #endif
+	struct cache_item *item = hot->item;
+	struct cache_watcher_data *wd;
 	guint64 diff;
-	struct cache_item *item = NULL;
-	struct symbol_callback_data *s = *save;
+	guint events = 0, threads = 0;
+	gboolean watching = FALSE;
 
-	if (s == NULL) {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		if (cache->uses++ >= MAX_USES) {
-			msg_info ("resort symbols cache");
-			cache->uses = 0;
-			/* Resort while having write lock */
-			post_cache_init (cache);
-		}
-		s =
-			rspamd_mempool_alloc0 (task->task_pool,
-				sizeof (struct symbol_callback_data));
-		*save = s;
-		if (cache->negative_items != NULL) {
-			s->list_pointer = g_list_first (cache->negative_items);
-			s->saved_item = s->list_pointer->data;
-			s->state = CACHE_STATE_NEGATIVE;
-		}
-		else {
-			s->state = CACHE_STATE_STATIC;
-			s->list_pointer = g_list_first (cache->static_items);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
-				return FALSE;
-			}
-		}
-		item = s->saved_item;
+	wd = rspamd_mempool_alloc (task->task_pool, sizeof (*wd));
+	wd->item = item;
+	if (gettimeofday (&wd->tv, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
 	}
-	else {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		switch (s->state) {
-		case CACHE_STATE_NEGATIVE:
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer == NULL) {
-				s->state = CACHE_STATE_STATIC;
-				s->list_pointer = g_list_first (cache->static_items);
-				if (s->list_pointer) {
-					s->saved_item = s->list_pointer->data;
-				}
-				else {
-					return FALSE;
-				}
-			}
-			else {
-				s->saved_item = s->list_pointer->data;
-			}
-			item = s->saved_item;
-			break;
-		case CACHE_STATE_STATIC:
-			/* Next pointer */
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
-				return FALSE;
-			}
-			item = s->saved_item;
-			break;
+
+	if (task->s != NULL) {
+		threads = g_atomic_int_get (&task->s->threads);
+		if (task->s->cur_watcher == NULL) {
+			rspamd_session_watch_start (task->s, cache_watcher_cb, wd);
+			watching = TRUE;
 		}
 	}
-	if (!item) {
-		return FALSE;
-	}
-	if (!item->is_virtual && !item->is_skipped) {
+
 #ifdef HAVE_CLOCK_GETTIME
 # ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts1);
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts1);
 # elif defined(HAVE_CLOCK_VIRTUAL)
-		clock_gettime (CLOCK_VIRTUAL,			 &ts1);
+	clock_gettime (CLOCK_VIRTUAL,			 &ts1);
 # else
-		clock_gettime (CLOCK_REALTIME,			 &ts1);
+	clock_gettime (CLOCK_REALTIME,			 &ts1);
 # endif
 #else
-		if (gettimeofday (&tv1, NULL) == -1) {
-			msg_warn ("gettimeofday failed: %s", strerror (errno));
-		}
+	if (gettimeofday (&tv1, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
 #endif
-		if (G_UNLIKELY (check_debug_symbol (task->cfg, item->s->symbol))) {
-			rspamd_log_debug (rspamd_main->logger);
-			item->func (task, item->user_data);
-			rspamd_log_nodebug (rspamd_main->logger);
-		}
-		else {
-			item->func (task, item->user_data);
-		}
+	if (G_UNLIKELY (task->cfg->debug_symbols != NULL &&
+		check_debug_symbol (task->cfg, item->s->symbol))) {
+		rspamd_log_debug (rspamd_main->logger);
+		hot->func (task, hot->user_data);
+		rspamd_log_nodebug (rspamd_main->logger);
+	}
+	else {
+		hot->func (task, hot->user_data);
+	}
 
 
 #ifdef HAVE_CLOCK_GETTIME
 # ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts2);
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts2);
 # elif defined(HAVE_CLOCK_VIRTUAL)
-		clock_gettime (CLOCK_VIRTUAL,			 &ts2);
+	clock_gettime (CLOCK_VIRTUAL,			 &ts2);
 # else
-		clock_gettime (CLOCK_REALTIME,			 &ts2);
+	clock_gettime (CLOCK_REALTIME,			 &ts2);
 # endif
 #else
-		if (gettimeofday (&tv2, NULL) == -1) {
-			msg_warn ("gettimeofday failed: %s", strerror (errno));
-		}
+	if (gettimeofday (&tv2, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
 #endif
 
 #ifdef HAVE_CLOCK_GETTIME
-		diff =
-			(ts2.tv_sec -
-			ts1.tv_sec) * 1000000 + (ts2.tv_nsec - ts1.tv_nsec) / 1000;
+	diff =
+		(ts2.tv_sec -
+		ts1.tv_sec) * 1000000 + (ts2.tv_nsec - ts1.tv_nsec) / 1000;
 #else
-		diff =
-			(tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+	diff =
+		(tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
 #endif
-		item->s->avg_time = rspamd_set_counter (item, diff);
+	item->s->avg_time = rspamd_set_counter (item, diff);
+	rspamd_histogram_add (item->cpu_hist, diff);
+
+	if (watching) {
+		events = rspamd_session_watch_stop (task->s);
+	}
+	/* Otherwise wall time is written when all events are finished */
+	if (events == 0) {
+		rspamd_histogram_add (item->wall_hist, cache_wall_diff (&wd->tv));
+	}
+
+	/*
+	 * Symbol has started some events or threads, so it would be started
+	 * before synchronous symbols after the next resort
+	 */
+	if (!(hot->flags & CACHE_ITEM_FLAG_ASYNC) && task->s != NULL &&
+		(events > 0 ||
+		(guint)g_atomic_int_get (&task->s->threads) > threads)) {
+		msg_debug ("symbol %s is asynchronous", item->s->symbol);
+		hot->flags |= CACHE_ITEM_FLAG_ASYNC;
+		item->is_async = TRUE;
+	}
+}
+
+/*
+ * Call item after all its dependencies, returns FALSE if item has been
+ * already processed or it must wait for asynchronous dependencies
+ */
+static gboolean
+schedule_cache_item (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	struct symbol_callback_data *s,
+	guint id,
+	gboolean delayed)
+{
+	struct cache_item_hot *hot;
+	struct cache_dependency *dep;
+	struct cache_item *dep_item;
+	gboolean wait_async = FALSE;
+	guint i;
+
+	if (id >= s->nitems || id >= cache->nhot ||
+		(s->items_state[id] & CACHE_ITEM_STARTED)) {
+		return FALSE;
+	}
+	if (!delayed && (s->items_state[id] & CACHE_ITEM_DELAYED)) {
+		return FALSE;
+	}
+
+	hot = &cache->hot[id];
+	/* Mark item before processing of dependencies to break cycles */
+	s->items_state[id] |= CACHE_ITEM_STARTED;
+
+	if (hot->item->deps != NULL) {
+		for (i = 0; i < hot->item->deps->len; i ++) {
+			dep = g_ptr_array_index (hot->item->deps, i);
+			dep_item = dep->item;
+
+			if (dep_item == NULL || dep_item->id >= s->nitems) {
+				continue;
+			}
+
+			schedule_cache_item (task, cache, s, dep_item->id, delayed);
+
+			if (!delayed &&
+				((dep_item->is_async && !dep_item->is_skipped) ||
+				(s->items_state[dep_item->id] & CACHE_ITEM_DELAYED))) {
+				wait_async = TRUE;
+			}
+		}
+	}
+
+	if (wait_async) {
+		s->items_state[id] &= ~CACHE_ITEM_STARTED;
+		s->items_state[id] |= CACHE_ITEM_DELAYED;
+
+		if (s->delayed == NULL) {
+			s->delayed = g_ptr_array_new ();
+			rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)g_ptr_array_unref, s->delayed);
+		}
+		g_ptr_array_add (s->delayed, hot->item);
+
+		return FALSE;
+	}
+
+	if (!(hot->flags & (CACHE_ITEM_FLAG_VIRTUAL|CACHE_ITEM_FLAG_SKIPPED))) {
+		call_cache_item (task, hot);
+
+		/* Results of asynchronous items are not known yet */
+		if (s->remaining != NULL && hot->item->bounds != NULL &&
+			!(hot->flags & CACHE_ITEM_FLAG_ASYNC)) {
+			for (i = 0; i < s->nmetrics; i ++) {
+				s->remaining[i].pos -= hot->item->bounds[i].pos;
+				s->remaining[i].neg -= hot->item->bounds[i].neg;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+call_delayed_symbols (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	gpointer save)
+{
+	struct symbol_callback_data *s = save;
+	struct cache_item *item;
+	gboolean ret = FALSE;
+	guint i;
+
+	if (cache == NULL || s == NULL || s->delayed == NULL) {
+		return FALSE;
+	}
+
+	s->state = CACHE_STATE_DELAYED;
+
+	for (i = 0; i < s->delayed->len; i ++) {
+		item = g_ptr_array_index (s->delayed, i);
+		s->saved_item = item;
+
+		if (schedule_cache_item (task, cache, s, item->id, TRUE)) {
+			ret = TRUE;
+		}
+	}
+
+	g_ptr_array_set_size (s->delayed, 0);
+
+	return ret;
+}
+
+gboolean
+call_symbol_callback (struct rspamd_task * task,
+	struct symbols_cache * cache,
+	gpointer *save)
+{
+	struct symbol_callback_data *s = *save;
+	struct cache_order *order;
+	guint id;
+
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	if (s == NULL) {
+		if (cache->order == NULL || cache->uses++ >= MAX_USES) {
+			msg_info ("resort symbols cache");
+			cache->uses = 0;
+			/* Resort while having write lock */
+			post_cache_init (cache);
+			checkpoint_cache_file (cache);
+		}
+		s =
+			rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (struct symbol_callback_data));
+		s->order = cache->order;
+		REF_RETAIN (s->order);
+		rspamd_mempool_add_destructor (task->task_pool,
+			release_cache_order, s->order);
+		s->nitems = cache->nhot;
+		s->items_state = rspamd_mempool_alloc0 (task->task_pool,
+				s->nitems + 1);
+		if (cache->bounds != NULL) {
+			s->nmetrics = cache->nmetrics;
+			s->remaining = rspamd_mempool_alloc (task->task_pool,
+					sizeof (struct cache_bound) * s->nmetrics);
+			memcpy (s->remaining, cache->bounds,
+				sizeof (struct cache_bound) * s->nmetrics);
+		}
+		/* Asynchronous items are started first to wait for them in parallel */
+		s->state = CACHE_STATE_ASYNC;
+		s->pos = 0;
+		*save = s;
+	}
+	else {
+		s->pos ++;
+	}
+
+	order = s->order;
+
+	if (s->state == CACHE_STATE_ASYNC && s->pos >= order->nasync) {
+		s->state = CACHE_STATE_SYNC;
+		s->pos = 0;
+	}
+	if (s->state == CACHE_STATE_SYNC && s->pos >= order->nids) {
+		/*
+		 * Delayed items are called now only if there are no pending events,
+		 * otherwise they are called when a session is finished
+		 */
+		s->state = CACHE_STATE_DELAYED;
+		if (task->s == NULL || g_hash_table_size (task->s->events) == 0) {
+			return call_delayed_symbols (task, cache, s);
+		}
+		return FALSE;
+	}
+	if (s->state == CACHE_STATE_DELAYED) {
+		return FALSE;
+	}
+
+	if (s->state == CACHE_STATE_ASYNC) {
+		id = order->async_ids[s->pos];
+	}
+	else {
+		id = order->ids[s->pos];
+	}
+
+	s->saved_item = g_ptr_array_index (cache->items, id);
+	schedule_cache_item (task, cache, s, id, FALSE);
+
+	return TRUE;
+}
+
+gboolean
+check_cache_bounds (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	gpointer save)
+{
+	struct symbol_callback_data *s = save;
+	struct metric_result *res;
+	struct cache_bound *b;
+	struct metric *m;
+	gdouble score;
+	gint lo, hi;
+	guint i;
+
+	/* Settings can change weights of symbols */
+	if (cache == NULL || s == NULL || s->remaining == NULL ||
+		task->settings != NULL) {
+		return FALSE;
 	}
 
-	s->saved_item = item;
+	for (i = 0; i < s->nmetrics; i ++) {
+		m = cache->metrics[i];
+		b = &s->remaining[i];
+
+		if (b->pos_unbounded || m->grow_factor > 1.0) {
+			return FALSE;
+		}
+
+		res = g_hash_table_lookup (task->results, m->name);
+		score = res != NULL ? res->score : 0.0;
+
+		hi = rspamd_check_action_metric (task, score + b->pos, NULL, m);
+		if (b->neg_unbounded) {
+			lo = METRIC_ACTION_NOACTION;
+		}
+		else {
+			lo = rspamd_check_action_metric (task, score - b->neg, NULL, m);
+		}
+
+		if (lo != hi) {
+			return FALSE;
+		}
+	}
 
 	return TRUE;
+}
 
+void
+mark_symbol_multiplied (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	struct cache_item *item)
+{
+	struct symbol_callback_data *s = task->checkpoint;
+	struct rspamd_symbol_def *sdef;
+	guint i;
+
+	if (item->is_multiplied) {
+		return;
+	}
+
+	msg_info ("symbol %s is inserted with multiplier, it is treated as "
+		"unbounded from now", item->s->symbol);
+	item->is_multiplied = TRUE;
+
+	if (cache->bounds != NULL) {
+		init_cache_bounds (cache);
+	}
+
+	/* Item can be inserted again while processing the current task */
+	if (s != NULL && s->remaining != NULL) {
+		for (i = 0; i < s->nmetrics; i ++) {
+			sdef = g_hash_table_lookup (cache->metrics[i]->symbols,
+					item->s->symbol);
+
+			if (sdef != NULL && *sdef->weight_ptr != 0) {
+				s->remaining[i].pos_unbounded = TRUE;
+				s->remaining[i].neg_unbounded = TRUE;
+			}
+		}
+	}
 }
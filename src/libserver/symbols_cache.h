@@ -3,6 +3,8 @@
 
 #include "config.h"
 #include "radix.h"
+#include "ref.h"
+#include "histogram.h"
 
 #define MAX_SYMBOL 128
 
@@ -29,6 +31,22 @@ struct counter_data {
 	gint number;
 };
 
+struct cache_item;
+struct metric;
+
+/* Maximum contribution of symbols to a metric score */
+struct cache_bound {
+	gdouble pos;
+	gdouble neg;
+	gboolean pos_unbounded;
+	gboolean neg_unbounded;
+};
+
+struct cache_dependency {
+	struct cache_item *item;
+	gchar *sym;
+};
+
 struct cache_item {
 	/* Static item's data */
 	struct saved_cache_item *s;
@@ -54,6 +72,47 @@ struct cache_item {
 	/* Priority */
 	gint priority;
 	gdouble metric_weight;
+
+	/* Item starts asynchronous events (e.g. DNS requests) */
+	gboolean is_async;
+	/* Item is processed before items with positive weights */
+	gboolean is_negative;
+	/* Index of item used for per-task processing state */
+	guint id;
+	/* Symbols that must be processed before this one */
+	GPtrArray *deps;
+	/* Contribution to each metric of the cache */
+	struct cache_bound *bounds;
+	/* Item has been inserted with multiplier that is not in [0, 1] */
+	gboolean is_multiplied;
+
+	/* Latency of calls in microseconds, wall time includes async events */
+	struct rspamd_histogram *cpu_hist;
+	struct rspamd_histogram *wall_hist;
+};
+
+/* Flags of hot items */
+#define CACHE_ITEM_FLAG_VIRTUAL (1 << 0)
+#define CACHE_ITEM_FLAG_CALLBACK (1 << 1)
+#define CACHE_ITEM_FLAG_SKIPPED (1 << 2)
+#define CACHE_ITEM_FLAG_ASYNC (1 << 3)
+
+/* Data of item that is used on each call, stored contiguously by item's id */
+struct cache_item_hot {
+	symbol_func_t func;
+	gpointer user_data;
+	guint flags;
+	gint priority;
+	struct cache_item *item;
+};
+
+/* Processing order of items, replaced as a whole on resort */
+struct cache_order {
+	guint *ids;
+	guint nids;
+	guint *async_ids;
+	guint nasync;
+	ref_entry_t ref;
 };
 
 enum rspamd_symbol_type {
@@ -63,21 +122,34 @@ enum rspamd_symbol_type {
 };
 
 struct symbols_cache {
-	/* Normal cache items */
-	GList *static_items;
+	/* All items indexed by their ids */
+	GPtrArray *items;
 
-	/* Items that have negative weights */
-	GList *negative_items;
+	/* Hot data of items indexed by their ids */
+	struct cache_item_hot *hot;
+	guint nhot;
+
+	/* Statistics counters of items indexed by their ids */
+	struct counter_data *counters;
+
+	/* Current order of processing */
+	struct cache_order *order;
 
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
 
+	/* Metrics and total contribution of all items to them */
+	struct metric **metrics;
+	struct cache_bound *bounds;
+	guint nmetrics;
+
 	rspamd_mempool_t *static_pool;
 
 	guint cur_items;
 	guint used_items;
 	guint uses;
 	gpointer map;
+	time_t last_checkpoint;
 	struct rspamd_config *cfg;
 };
 
@@ -169,6 +241,27 @@ register_symbol_common (struct symbols_cache **cache,
 	gpointer user_data,
 	enum rspamd_symbol_type type);
 
+/**
+ * Make symbol `symbol` dependent on symbol `dep`: `dep` is always processed
+ * before `symbol` and, if `dep` is asynchronous, `symbol` is delayed until
+ * all pending events of a task are finished
+ * @param cache symbols cache
+ * @param symbol dependent symbol
+ * @param dep dependency
+ */
+void register_symbol_dependency (struct symbols_cache *cache,
+	const gchar *symbol,
+	const gchar *dep);
+
+/**
+ * Declare that callback of the symbol starts asynchronous events, such symbols
+ * are started before all synchronous ones. Symbols that register events are
+ * also detected automatically on processing.
+ * @param cache symbols cache
+ * @param symbol symbol name
+ */
+void set_symbol_async (struct symbols_cache *cache, const gchar *symbol);
+
 /**
  * Call function for cached symbol using saved callback
  * @param task task object
@@ -179,6 +272,40 @@ gboolean call_symbol_callback (struct rspamd_task *task,
 	struct symbols_cache *cache,
 	gpointer *save);
 
+/**
+ * Call symbols that were delayed until asynchronous results of their
+ * dependencies are ready
+ * @param task task object
+ * @param cache symbols cache
+ * @param save processing state saved by call_symbol_callback
+ * @return TRUE if any symbol has been called
+ */
+gboolean call_delayed_symbols (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	gpointer save);
+
+/**
+ * Check whether the remaining symbols cannot change action of any metric
+ * @param task task object
+ * @param cache symbols cache
+ * @param save processing state saved by call_symbol_callback
+ * @return TRUE if processing of symbols can be stopped
+ */
+gboolean check_cache_bounds (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	gpointer save);
+
+/**
+ * Mark item inserted with multiplier outside of [0, 1]: its weight is not
+ * bounded anymore, so it disables early stop of checks for its metrics
+ * @param task task object
+ * @param cache symbols cache
+ * @param item item of the inserted symbol
+ */
+void mark_symbol_multiplied (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	struct cache_item *item);
+
 /**
  * Remove all dynamic rules from cache
  * @param cache symbols cache
@@ -26,6 +26,7 @@
 #include "filter.h"
 #include "protocol.h"
 #include "message.h"
+#include "expressions.h"
 #include "lua/lua_common.h"
 
 static void
@@ -71,10 +72,13 @@ rspamd_task_new (struct rspamd_worker *worker)
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->results);
-	new_task->re_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->re_cache);
+	/* Two bits per regexp: checked and matched */
+	new_task->re_cache_size = rspamd_regexps_count ();
+	new_task->re_cache = rspamd_mempool_alloc0 (new_task->task_pool,
+			(new_task->re_cache_size / 16 + 1) * sizeof (guint));
+	/* Scan sets are indexed by ids of their first regexps */
+	new_task->re_sets = rspamd_mempool_alloc0 (new_task->task_pool,
+			(new_task->re_cache_size / 32 + 1) * sizeof (guint));
 	new_task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
 	new_task->request_headers = g_hash_table_new_full ((GHashFunc)g_string_hash,
@@ -137,12 +141,21 @@ rspamd_task_fin (void *arg)
 		return TRUE;
 	}
 
+	/* Call symbols that have been waiting for asynchronous dependencies */
+	if (task->state == WAIT_FILTER && task->checkpoint != NULL &&
+		call_delayed_symbols (task, task->cfg->cache, task->checkpoint)) {
+		return FALSE;
+	}
+
 	/* We processed all filters and want to process statfiles */
 	if (task->state != WAIT_POST_FILTER && task->state != WAIT_PRE_FILTER) {
 		/* Process all statfiles */
 		if (task->classify_pool == NULL) {
 			/* Non-threaded version */
-			rspamd_process_statistics (task);
+			if (!rspamd_process_statistics (task)) {
+				/* Called again when statfiles are loaded */
+				return FALSE;
+			}
 		}
 		else {
 			/* Just process composites */
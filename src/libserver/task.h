@@ -121,7 +121,9 @@ struct rspamd_task {
 	InternetAddressList *from_envelope;
 
 	GList *messages;                                            /**< list of messages that would be reported		*/
-	GHashTable *re_cache;                                       /**< cache for matched or not matched regexps		*/
+	guint *re_cache;                                            /**< bitset of checked and matched regexps			*/
+	guint re_cache_size;                                        /**< number of regexps that fit in re_cache			*/
+	guint *re_sets;                                             /**< bitset of prefiltered regexp scan sets			*/
 	struct rspamd_config *cfg;                                  /**< pointer to config object						*/
 	gchar *last_error;                                          /**< last error										*/
 	gint error_code;                                                /**< code of last error								*/
@@ -149,6 +151,8 @@ struct rspamd_task {
 		gchar *str;                                             /**< String describing action						*/
 	} pre_result;                                               /**< Result of pre-filters							*/
 
+	gpointer checkpoint;                                        /**< Symbols cache processing state					*/
+	gpointer stat_checkpoint;                                   /**< Statistics processing state					*/
 	ucl_object_t *settings;                                     /**< Settings applied to task						*/
 	gpointer peer_key;											/**< Peer's pubkey									*/
 };
@@ -797,6 +797,8 @@ url_init (void)
 					i);
 			}
 		}
+
+		rspamd_trie_compile (url_scanner->patterns);
 	}
 
 	return 0;
@@ -38,15 +38,32 @@ struct rspamd_stat_ctx;
 struct rspamd_token_result;
 struct rspamd_statfile_runtime;
 struct token_node_s;
+struct rspamd_task;
 
 struct rspamd_stat_backend {
 	const char *name;
 	gpointer (*init)(struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
-	gpointer (*runtime)(struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
+	/* Task is NULL when runtime is requested for statistics output */
+	gpointer (*runtime)(struct rspamd_task *task,
+			struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
 	gboolean (*process_token)(struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
 	gboolean (*learn_token)(struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
+	/*
+	 * Batch versions of process_token and learn_token: all tokens are
+	 * processed for the statfile which results are at position id, these
+	 * functions return number of tokens with non-zero values and learn_tokens
+	 * returns -1 if tokens cannot be stored. If backend does not define them,
+	 * tokens are processed one by one, otherwise process_token and learn_token
+	 * are not used and may be undefined. Backends could process tokens
+	 * asynchronously registering events in the task session, then results
+	 * are stored when events are finished and failed statfiles are marked
+	 */
+	guint (*process_tokens)(GArray *tokens, guint id,
+			struct rspamd_statfile_runtime *runtime, gpointer ctx);
+	gint (*learn_tokens)(GArray *tokens, guint id,
+			struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gulong (*total_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gulong (*inc_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	ucl_object_t* (*get_stat)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
@@ -54,7 +71,8 @@ struct rspamd_stat_backend {
 };
 
 gpointer rspamd_mmaped_file_init(struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
-gpointer rspamd_mmaped_file_runtime (struct rspamd_statfile_config *stcf,
+gpointer rspamd_mmaped_file_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
 		gboolean learn, gpointer ctx);
 gboolean rspamd_mmaped_file_process_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
@@ -62,6 +80,12 @@ gboolean rspamd_mmaped_file_process_token (struct token_node_s *tok,
 gboolean rspamd_mmaped_file_learn_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
 		gpointer ctx);
+guint rspamd_mmaped_file_process_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gint rspamd_mmaped_file_learn_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
 gulong rspamd_mmaped_file_total_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 gulong rspamd_mmaped_file_inc_learns (struct rspamd_statfile_runtime *runtime,
@@ -69,4 +93,38 @@ gulong rspamd_mmaped_file_inc_learns (struct rspamd_statfile_runtime *runtime,
 ucl_object_t * rspamd_mmaped_file_get_stat (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 
+gpointer rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
+gpointer rspamd_redis_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer ctx);
+guint rspamd_redis_process_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gint rspamd_redis_learn_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+ucl_object_t * rspamd_redis_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+
+gpointer rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
+gpointer rspamd_sqlite3_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer ctx);
+guint rspamd_sqlite3_process_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gint rspamd_sqlite3_learn_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_sqlite3_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_sqlite3_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+ucl_object_t * rspamd_sqlite3_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+
 #endif /* BACKENDS_H_ */
@@ -38,6 +38,14 @@
 #define DEFAULT_STATFILE_INVALIDATE_JITTER 30
 
 #define MMAPED_BACKEND_TYPE "mmap"
+/* Number of tokens which chains are prefetched ahead of the lookup */
+#define PREFETCH_DISTANCE 8
+
+#ifdef __GNUC__
+#define STATFILE_PREFETCH(addr) __builtin_prefetch ((addr), 0, 1)
+#else
+#define STATFILE_PREFETCH(addr) (void)(addr)
+#endif
 
 /**
  * Common statfile header
@@ -121,24 +129,27 @@ rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 gint rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool,
 		const gchar *filename, size_t size, struct rspamd_statfile_config *stcf);
 
-double
-rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
-	rspamd_mmaped_file_t * file,
-	guint32 h1,
-	guint32 h2)
+/*
+ * Returns the first block of chain for the specified hash
+ */
+static inline struct stat_file_block *
+rspamd_mmaped_file_get_chain (rspamd_mmaped_file_t *file, guint32 h1,
+	guint *blocknum)
 {
-	struct stat_file_block *block;
-	guint i, blocknum;
-	u_char *c;
+	*blocknum = h1 % file->cur_section.length;
 
-	if (!file->map) {
-		return 0;
-	}
+	return (struct stat_file_block *)((u_char *)file->map + file->seek_pos +
+		*blocknum * sizeof (struct stat_file_block));
+}
 
-	blocknum = h1 % file->cur_section.length;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
+static inline double
+rspamd_mmaped_file_find_block (rspamd_mmaped_file_t *file,
+	struct stat_file_block *block,
+	guint blocknum,
+	guint32 h1,
+	guint32 h2)
+{
+	guint i;
 
 	for (i = 0; i < CHAIN_LENGTH; i++) {
 		if (i + blocknum >= file->cur_section.length) {
@@ -147,14 +158,30 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
 		if (block->hash1 == h1 && block->hash2 == h2) {
 			return block->value;
 		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+		block ++;
 	}
 
-
 	return 0;
 }
 
+double
+rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
+	rspamd_mmaped_file_t * file,
+	guint32 h1,
+	guint32 h2)
+{
+	struct stat_file_block *block;
+	guint blocknum;
+
+	if (!file->map) {
+		return 0;
+	}
+
+	block = rspamd_mmaped_file_get_chain (file, h1, &blocknum);
+
+	return rspamd_mmaped_file_find_block (file, block, blocknum, h1, h2);
+}
+
 static void
 rspamd_mmaped_file_set_block_common (rspamd_mmaped_file_ctx * pool,
 		rspamd_mmaped_file_t * file,
@@ -515,6 +542,10 @@ rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 			(void)t;
 			pos += size;
 		}
+
+		/* Tokens are looked up randomly, so restore the default read ahead */
+		pos = (guint8 *)file->map;
+		madvise (pos, end - pos, MADV_NORMAL);
 	}
 }
 
@@ -525,6 +556,9 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 {
 	struct stat st;
 	rspamd_mmaped_file_t *new_file;
+#ifdef HAVE_MADV_HUGEPAGE
+	const ucl_object_t *hugepages;
+#endif
 
 	if ((new_file = rspamd_mmaped_file_is_open (pool, stcf)) != NULL) {
 		return new_file;
@@ -570,6 +604,22 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 
 	}
 
+#ifdef HAVE_MADV_HUGEPAGE
+	/*
+	 * Huge pages reduce TLB misses of random lookups, but they are supported
+	 * for file mappings by the recent kernels only. Advice is given before
+	 * pages are faulted in by mlock, check and preload
+	 */
+	hugepages = ucl_object_find_key (stcf->opts, "hugepages");
+
+	if (hugepages != NULL && ucl_object_toboolean (hugepages)) {
+		if (madvise (new_file->map, st.st_size, MADV_HUGEPAGE) == -1) {
+			msg_info ("cannot use huge pages for statfile %s: %s",
+					filename, strerror (errno));
+		}
+	}
+#endif
+
 	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
 	new_file->len = st.st_size;
 	/* Try to lock pages in RAM */
@@ -795,7 +845,7 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 			 * By default, all statfiles are treated as mmaped files
 			 */
 			if (stf->backend == NULL ||
-					strcmp (stf->backend, MMAPED_BACKEND_TYPE)) {
+					strcmp (stf->backend, MMAPED_BACKEND_TYPE) == 0) {
 				/*
 				 * Check configuration sanity
 				 */
@@ -835,7 +885,8 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 }
 
 gpointer
-rspamd_mmaped_file_runtime (struct rspamd_statfile_config *stcf, gboolean learn,
+rspamd_mmaped_file_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf, gboolean learn,
 		gpointer p)
 {
 	rspamd_mmaped_file_ctx *ctx = (rspamd_mmaped_file_ctx *)p;
@@ -891,7 +942,6 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 	g_assert (p != NULL);
 	g_assert (res->st_runtime != NULL);
 	g_assert (tok != NULL);
-	g_assert (tok->datalen >= sizeof (guint32) * 2);
 
 	mf = (rspamd_mmaped_file_t *)res->st_runtime->backend_runtime;
 
@@ -901,8 +951,8 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 		return FALSE;
 	}
 
-	memcpy (&h1, tok->data, sizeof (h1));
-	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+	h1 = tok->data & 0xffffffff;
+	h2 = tok->data >> 32;
 	res->value = rspamd_mmaped_file_get_block (ctx, mf, h1, h2);
 
 	if (res->value > 0.0) {
@@ -925,7 +975,6 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 	g_assert (p != NULL);
 	g_assert (res->st_runtime != NULL);
 	g_assert (tok != NULL);
-	g_assert (tok->datalen >= sizeof (guint32) * 2);
 
 	mf = (rspamd_mmaped_file_t *)res->st_runtime->backend_runtime;
 
@@ -935,8 +984,8 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 		return FALSE;
 	}
 
-	memcpy (&h1, tok->data, sizeof (h1));
-	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+	h1 = tok->data & 0xffffffff;
+	h2 = tok->data >> 32;
 	rspamd_mmaped_file_set_block (ctx, mf, h1, h2, res->value);
 
 	if (res->value > 0.0) {
@@ -946,6 +995,102 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 	return FALSE;
 }
 
+guint
+rspamd_mmaped_file_process_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	rspamd_mmaped_file_t *mf;
+	rspamd_token_t *tok;
+	struct rspamd_token_result *res;
+	struct stat_file_block *chains[PREFETCH_DISTANCE];
+	guint blocknums[PREFETCH_DISTANCE];
+	guint i, slot, found = 0;
+
+	g_assert (p != NULL);
+	g_assert (runtime != NULL);
+
+	mf = (rspamd_mmaped_file_t *)runtime->backend_runtime;
+
+	if (mf == NULL || mf->map == NULL) {
+		/* Statfile is does not exist, so all values are zero */
+		for (i = 0; i < tokens->len; i ++) {
+			tok = &g_array_index (tokens, rspamd_token_t, i);
+			tok->results[id].value = 0.0;
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Chains are spread randomly over the whole file, so each lookup is
+	 * likely a cache miss. Chains of the next tokens are prefetched while
+	 * the current one is scanned, chain positions are kept in a ring
+	 */
+	for (i = 0; i < PREFETCH_DISTANCE && i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		chains[i] = rspamd_mmaped_file_get_chain (mf, tok->data & 0xffffffff,
+				&blocknums[i]);
+		STATFILE_PREFETCH (chains[i]);
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		res = &tok->results[id];
+		slot = i % PREFETCH_DISTANCE;
+
+		res->value = rspamd_mmaped_file_find_block (mf, chains[slot],
+				blocknums[slot], tok->data & 0xffffffff, tok->data >> 32);
+
+		if (i + PREFETCH_DISTANCE < tokens->len) {
+			tok = &g_array_index (tokens, rspamd_token_t, i + PREFETCH_DISTANCE);
+			chains[slot] = rspamd_mmaped_file_get_chain (mf,
+					tok->data & 0xffffffff, &blocknums[slot]);
+			STATFILE_PREFETCH (chains[slot]);
+		}
+
+		if (res->value > 0.0) {
+			found ++;
+		}
+	}
+
+	return found;
+}
+
+gint
+rspamd_mmaped_file_learn_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	rspamd_mmaped_file_ctx *ctx = (rspamd_mmaped_file_ctx *)p;
+	rspamd_mmaped_file_t *mf;
+	rspamd_token_t *tok;
+	struct rspamd_token_result *res;
+	guint i, learned = 0;
+
+	g_assert (p != NULL);
+	g_assert (runtime != NULL);
+
+	mf = (rspamd_mmaped_file_t *)runtime->backend_runtime;
+
+	if (mf == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		res = &tok->results[id];
+		rspamd_mmaped_file_set_block (ctx, mf,
+				tok->data & 0xffffffff, tok->data >> 32, res->value);
+
+		if (res->value > 0.0) {
+			learned ++;
+		}
+	}
+
+	return learned;
+}
+
 gulong
 rspamd_mmaped_file_total_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx)
@@ -0,0 +1,980 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Redis statistics backend: each statfile is stored as a redis hash where
+ * fields are tokens and values are their counts, the number of learns is
+ * stored in the field `learns` of the same hash. So all scanners that use
+ * the same redis servers share the same model.
+ *
+ * Tokens are loaded and learned asynchronously: requests are registered as
+ * events of the task session, so the task waits for them. To keep the delay
+ * of a message low, statfiles of a classifier that use the same servers are
+ * processed together: tokens and learns of all statfiles are loaded by a
+ * single pipeline and learning sends a single transaction, so each message
+ * costs one round trip. After a failure the remaining statfiles of the
+ * classifier are not requested for this message.
+ */
+
+#include "config.h"
+#include "stat_internal.h"
+#include "upstream.h"
+#include "main.h"
+
+#ifndef WITH_SYSTEM_HIREDIS
+#include "hiredis.h"
+#include "async.h"
+#include "adapters/libevent.h"
+#else
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+#endif
+
+#define REDIS_BACKEND_TYPE "redis"
+#define REDIS_DEFAULT_PORT 6379
+#define REDIS_DEFAULT_TIMEOUT 0.5
+#define REDIS_LEARNS_FIELD "learns"
+
+struct redis_stat_ctx {
+	GHashTable *elts;                   /**< statfile config -> redis_stat_elt */
+	GHashTable *conns;                  /**< upstream -> redisContext */
+	GHashTable *servers;                /**< servers config -> upstream_list */
+};
+
+struct redis_stat_elt;
+
+struct redis_stat_runtime {
+	struct redis_stat_elt *elt;
+	struct rspamd_task *task;
+	/* Statfiles of a classifier are loaded and learned by a single request */
+	gboolean loaded;
+	gboolean learned;
+	gint nlearned;
+	gulong learns;
+};
+
+/* Request sent for statfiles of a classifier that use the same servers */
+struct redis_stat_request {
+	redisAsyncContext *redis;
+	struct upstream *up;
+	struct rspamd_task *task;
+	GArray *tokens;
+	struct rspamd_statfile_runtime **batch;
+	guint *ids;
+	guint nbatch;
+	guint nreplies;
+	gboolean learn;
+	gboolean finished;
+	struct event timeout_ev;
+};
+
+struct redis_stat_elt {
+	struct rspamd_statfile_config *stcf;
+	struct upstream_list *read_servers;
+	struct upstream_list *write_servers;
+	const gchar *key;
+	struct timeval tv;
+	struct redis_stat_runtime stat_rt;
+};
+
+/*
+ * Statistics output is requested without a task, so it is loaded by blocking
+ * connections with timeouts
+ */
+static redisContext *
+rspamd_redis_get_conn (struct redis_stat_ctx *ctx, struct redis_stat_elt *elt,
+		struct upstream_list *ups, struct upstream **pup)
+{
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	redisContext *conn;
+
+	up = rspamd_upstream_get (ups, RSPAMD_UPSTREAM_ROUND_ROBIN);
+
+	if (up == NULL) {
+		msg_err ("no upstreams available for statfile %s", elt->stcf->symbol);
+		return NULL;
+	}
+
+	*pup = up;
+	conn = g_hash_table_lookup (ctx->conns, up);
+
+	if (conn != NULL) {
+		return conn;
+	}
+
+	addr = rspamd_upstream_addr (up);
+
+	if (addr->af == AF_UNIX) {
+		conn = redisConnectUnixWithTimeout (rspamd_inet_address_to_string (addr),
+				elt->tv);
+	}
+	else {
+		conn = redisConnectWithTimeout (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr), elt->tv);
+	}
+
+	if (conn == NULL || conn->err != 0) {
+		msg_err ("cannot connect to redis server %s: %s",
+				rspamd_upstream_name (up),
+				conn ? conn->errstr : "allocation error");
+		rspamd_upstream_fail (up);
+
+		if (conn != NULL) {
+			redisFree (conn);
+		}
+
+		return NULL;
+	}
+
+	redisSetTimeout (conn, elt->tv);
+	g_hash_table_insert (ctx->conns, up, conn);
+
+	return conn;
+}
+
+/*
+ * Connection cannot be reused after an error as replies are not synchronized
+ * with requests anymore
+ */
+static void
+rspamd_redis_conn_fail (struct redis_stat_ctx *ctx, struct upstream *up,
+		redisContext *conn, redisReply *reply)
+{
+	if (reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+		msg_err ("redis server %s returned error: %s",
+				rspamd_upstream_name (up), reply->str);
+	}
+	else {
+		msg_err ("cannot communicate with redis server %s: %s",
+				rspamd_upstream_name (up), conn->errstr);
+	}
+
+	rspamd_upstream_fail (up);
+	g_hash_table_remove (ctx->conns, up);
+}
+
+static gdouble
+rspamd_redis_reply_value (redisReply *reply)
+{
+	if (reply->type == REDIS_REPLY_STRING) {
+		return g_ascii_strtod (reply->str, NULL);
+	}
+	else if (reply->type == REDIS_REPLY_INTEGER) {
+		return reply->integer;
+	}
+
+	return 0.0;
+}
+
+/*
+ * Statfiles with the same servers share upstreams, so they use the same
+ * connection and could be processed by a single pipeline
+ */
+static struct upstream_list *
+rspamd_redis_get_servers (struct redis_stat_ctx *ctx,
+		struct rspamd_config *cfg, const ucl_object_t *obj)
+{
+	struct upstream_list *ups;
+	gchar *key;
+
+	key = (gchar *)ucl_object_emit (obj, UCL_EMIT_JSON_COMPACT);
+
+	if (key == NULL) {
+		return NULL;
+	}
+
+	ups = g_hash_table_lookup (ctx->servers, key);
+
+	if (ups != NULL) {
+		free (key);
+		return ups;
+	}
+
+	ups = rspamd_upstreams_create ();
+
+	if (!rspamd_upstreams_from_ucl (ups, obj, REDIS_DEFAULT_PORT, NULL)) {
+		rspamd_upstreams_destroy (ups);
+		free (key);
+		return NULL;
+	}
+
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)rspamd_upstreams_destroy, ups);
+	g_hash_table_insert (ctx->servers, key, ups);
+
+	return ups;
+}
+
+static struct redis_stat_elt *
+rspamd_redis_parse_statfile (struct redis_stat_ctx *ctx,
+		struct rspamd_config *cfg,
+		struct rspamd_statfile_config *stf)
+{
+	struct redis_stat_elt *elt;
+	const ucl_object_t *serverso, *elto;
+	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
+
+	serverso = ucl_object_find_key (stf->opts, "servers");
+
+	if (serverso == NULL) {
+		msg_err ("statfile %s has no redis servers defined", stf->symbol);
+		return NULL;
+	}
+
+	elt = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*elt));
+	elt->stcf = stf;
+	elt->stat_rt.elt = elt;
+	elt->read_servers = rspamd_redis_get_servers (ctx, cfg, serverso);
+
+	if (elt->read_servers == NULL) {
+		msg_err ("statfile %s has invalid redis servers", stf->symbol);
+		return NULL;
+	}
+
+	elto = ucl_object_find_key (stf->opts, "write_servers");
+
+	if (elto != NULL) {
+		elt->write_servers = rspamd_redis_get_servers (ctx, cfg, elto);
+
+		if (elt->write_servers == NULL) {
+			msg_err ("statfile %s has invalid redis write servers",
+					stf->symbol);
+			return NULL;
+		}
+	}
+	else {
+		elt->write_servers = elt->read_servers;
+	}
+
+	elto = ucl_object_find_key (stf->opts, "prefix");
+
+	if (elto != NULL && ucl_object_type (elto) == UCL_STRING) {
+		elt->key = ucl_object_tostring (elto);
+	}
+	else {
+		elt->key = stf->symbol;
+	}
+
+	elto = ucl_object_find_key (stf->opts, "timeout");
+
+	if (elto != NULL) {
+		timeout = ucl_object_todouble (elto);
+	}
+
+	elt->tv.tv_sec = (time_t)timeout;
+	elt->tv.tv_usec = (timeout - (gdouble)elt->tv.tv_sec) * 1000000;
+
+	return elt;
+}
+
+gpointer
+rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
+{
+	struct redis_stat_ctx *new;
+	struct redis_stat_elt *elt;
+	struct rspamd_classifier_config *clf;
+	struct rspamd_statfile_config *stf;
+	GList *cur, *curst;
+
+	new = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*new));
+	new->elts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	new->conns = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, (GDestroyNotify)redisFree);
+	new->servers = g_hash_table_new_full (g_str_hash, g_str_equal,
+			free, NULL);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, new->conns);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, new->servers);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, new->elts);
+
+	cur = cfg->classifiers;
+
+	while (cur) {
+		clf = cur->data;
+
+		curst = clf->statfiles;
+		while (curst) {
+			stf = curst->data;
+
+			if (stf->backend != NULL &&
+					strcmp (stf->backend, REDIS_BACKEND_TYPE) == 0) {
+				elt = rspamd_redis_parse_statfile (new, cfg, stf);
+
+				if (elt != NULL) {
+					g_hash_table_insert (new->elts, stf, elt);
+					ctx->statfiles ++;
+				}
+			}
+
+			curst = curst->next;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return (gpointer)new;
+}
+
+gpointer
+rspamd_redis_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer p)
+{
+	struct redis_stat_ctx *ctx = (struct redis_stat_ctx *)p;
+	struct redis_stat_runtime *rt;
+	struct redis_stat_elt *elt;
+
+	g_assert (ctx != NULL);
+
+	elt = g_hash_table_lookup (ctx->elts, stcf);
+
+	if (elt == NULL) {
+		return NULL;
+	}
+
+	if (task == NULL) {
+		/* Statistics requests do not load any tokens */
+		return &elt->stat_rt;
+	}
+
+	if (!learn && task->classify_pool != NULL) {
+		/* Classify threads cannot use the event loop of the worker */
+		msg_debug ("redis statfile %s is not used by classify threads",
+				stcf->symbol);
+		return NULL;
+	}
+
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rt->elt = elt;
+	rt->task = task;
+	/* Tokens are learned by increments, so they are not loaded on learning */
+	rt->loaded = learn;
+
+	return rt;
+}
+
+/* Tokens are stored as decimal numbers, so 20 digits are enough */
+#define REDIS_TOKEN_LEN 24
+
+static gsize
+rspamd_redis_token_field (rspamd_token_t *tok, gchar *buf)
+{
+	return rspamd_snprintf (buf, REDIS_TOKEN_LEN, "%uL", tok->data);
+}
+
+/*
+ * Find statfiles of the classifier that use the same servers as runtime and
+ * have not been processed yet, their results are stored at positions ids
+ */
+static guint
+rspamd_redis_classifier_batch (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime, gboolean learn,
+		struct rspamd_statfile_runtime ***pbatch, guint **pids)
+{
+	struct redis_stat_runtime *rt, *cur_rt;
+	struct rspamd_classifier_runtime *cl_runtime;
+	struct rspamd_statfile_runtime *st_runtime, **batch;
+	struct upstream_list *ups;
+	GList *cur;
+	guint *ids, pos, nbatch = 0;
+
+	rt = (struct redis_stat_runtime *)runtime->backend_runtime;
+	cl_runtime = g_array_index (tokens, rspamd_token_t, 0).results[id].cl_runtime;
+	ups = learn ? rt->elt->write_servers : rt->elt->read_servers;
+
+	batch = rspamd_mempool_alloc (rt->task->task_pool,
+			sizeof (*batch) * g_list_length (cl_runtime->st_runtime));
+	ids = rspamd_mempool_alloc (rt->task->task_pool,
+			sizeof (*ids) * g_list_length (cl_runtime->st_runtime));
+	pos = cl_runtime->start_pos;
+
+	for (cur = cl_runtime->st_runtime; cur != NULL; cur = g_list_next (cur),
+			pos ++) {
+		st_runtime = (struct rspamd_statfile_runtime *)cur->data;
+		cur_rt = (struct redis_stat_runtime *)st_runtime->backend_runtime;
+
+		if (st_runtime->backend != runtime->backend || cur_rt == NULL ||
+				cur_rt->task == NULL) {
+			continue;
+		}
+
+		if (learn) {
+			if (cur_rt->learned || cur_rt->elt->write_servers != ups) {
+				continue;
+			}
+
+			cur_rt->learned = TRUE;
+		}
+		else {
+			if (cur_rt->loaded || cur_rt->elt->read_servers != ups) {
+				continue;
+			}
+
+			cur_rt->loaded = TRUE;
+		}
+
+		batch[nbatch] = st_runtime;
+		ids[nbatch] = pos;
+		nbatch ++;
+	}
+
+	*pbatch = batch;
+	*pids = ids;
+
+	return nbatch;
+}
+
+/* Failed request is not repeated for other statfiles of the batch */
+static void
+rspamd_redis_batch_fail (struct redis_stat_request *req)
+{
+	struct redis_stat_runtime *rt;
+	rspamd_token_t *tok;
+	guint i, j;
+
+	for (i = 0; i < req->nbatch; i ++) {
+		req->batch[i]->failed = TRUE;
+		rt = (struct redis_stat_runtime *)req->batch[i]->backend_runtime;
+
+		if (req->learn) {
+			rt->nlearned = -1;
+		}
+		else {
+			/* Do not classify by the part of statfiles */
+			for (j = 0; j < req->tokens->len; j ++) {
+				tok = &g_array_index (req->tokens, rspamd_token_t, j);
+				tok->results[req->ids[i]].value = 0.0;
+			}
+
+			rt->learns = 0;
+		}
+	}
+}
+
+static void
+rspamd_redis_fin (gpointer data)
+{
+	struct redis_stat_request *req = data;
+	redisAsyncContext *redis;
+
+	event_del (&req->timeout_ev);
+
+	if (!req->finished) {
+		/* Session is destroyed before the request is finished */
+		req->finished = TRUE;
+		rspamd_redis_batch_fail (req);
+	}
+
+	if (req->redis != NULL) {
+		redis = req->redis;
+		req->redis = NULL;
+		/* Pending callbacks are called with NULL replies and ignored */
+		redisAsyncFree (redis);
+	}
+}
+
+static void
+rspamd_redis_request_done (struct redis_stat_request *req)
+{
+	req->finished = TRUE;
+	rspamd_upstream_ok (req->up);
+	remove_normal_event (req->task->s, rspamd_redis_fin, req);
+}
+
+static void
+rspamd_redis_request_fail (struct redis_stat_request *req,
+		redisAsyncContext *c, redisReply *reply)
+{
+	if (reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+		msg_err ("redis server %s returned error: %s",
+				rspamd_upstream_name (req->up), reply->str);
+	}
+	else if (c->err == REDIS_ERR_IO) {
+		msg_err ("cannot communicate with redis server %s: %s",
+				rspamd_upstream_name (req->up), strerror (errno));
+	}
+	else {
+		msg_err ("cannot communicate with redis server %s: %s",
+				rspamd_upstream_name (req->up),
+				c->err != 0 ? c->errstr : "unexpected reply");
+	}
+
+	if (c->err != 0) {
+		/* Context is freed by hiredis after an error */
+		req->redis = NULL;
+	}
+
+	req->finished = TRUE;
+	rspamd_upstream_fail (req->up);
+	rspamd_redis_batch_fail (req);
+	remove_normal_event (req->task->s, rspamd_redis_fin, req);
+}
+
+static void
+rspamd_redis_timeout (gint fd, short what, gpointer d)
+{
+	struct redis_stat_request *req = d;
+
+	msg_err ("connection to redis server %s timed out",
+			rspamd_upstream_name (req->up));
+	req->finished = TRUE;
+	rspamd_upstream_fail (req->up);
+	rspamd_redis_batch_fail (req);
+	remove_normal_event (req->task->s, rspamd_redis_fin, req);
+}
+
+static struct redis_stat_request *
+rspamd_redis_request_new (struct rspamd_task *task, struct redis_stat_elt *elt,
+		struct upstream_list *ups)
+{
+	struct redis_stat_request *req;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *redis;
+
+	up = rspamd_upstream_get (ups, RSPAMD_UPSTREAM_ROUND_ROBIN);
+
+	if (up == NULL) {
+		msg_err ("no upstreams available for statfile %s", elt->stcf->symbol);
+		return NULL;
+	}
+
+	addr = rspamd_upstream_addr (up);
+
+	if (addr->af == AF_UNIX) {
+		redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (redis == NULL || redis->err != 0) {
+		msg_err ("cannot connect to redis server %s: %s",
+				rspamd_upstream_name (up),
+				redis ? redis->errstr : "allocation error");
+		rspamd_upstream_fail (up);
+
+		if (redis != NULL) {
+			redisAsyncFree (redis);
+		}
+
+		return NULL;
+	}
+
+	req = rspamd_mempool_alloc0 (task->task_pool, sizeof (*req));
+	req->redis = redis;
+	req->up = up;
+	req->task = task;
+	redisLibeventAttach (redis, task->ev_base);
+
+	return req;
+}
+
+/* Connection and commands sent are limited by the timeout of statfile */
+static void
+rspamd_redis_request_start (struct redis_stat_request *req,
+		struct redis_stat_elt *elt)
+{
+	evtimer_set (&req->timeout_ev, rspamd_redis_timeout, req);
+	event_base_set (req->task->ev_base, &req->timeout_ev);
+	event_add (&req->timeout_ev, &elt->tv);
+	register_async_event (req->task->s, rspamd_redis_fin, req,
+			g_quark_from_static_string ("redis statistics"));
+}
+
+/* Replies to HMGET and HGET commands follow each other for each statfile */
+static void
+rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_request *req = priv;
+	struct redis_stat_runtime *rt;
+	struct rspamd_token_result *res;
+	redisReply *reply = r;
+	rspamd_token_t *tok;
+	guint i, j;
+
+	if (req->finished) {
+		/* Request has been failed or its session is destroyed */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		rspamd_redis_request_fail (req, c, reply);
+		return;
+	}
+
+	i = req->nreplies / 2;
+	rt = (struct redis_stat_runtime *)req->batch[i]->backend_runtime;
+
+	if (req->nreplies % 2 == 0) {
+		if (reply->type != REDIS_REPLY_ARRAY ||
+				reply->elements != req->tokens->len) {
+			rspamd_redis_request_fail (req, c, NULL);
+			return;
+		}
+
+		for (j = 0; j < req->tokens->len; j ++) {
+			tok = &g_array_index (req->tokens, rspamd_token_t, j);
+			res = &tok->results[req->ids[i]];
+			res->value = rspamd_redis_reply_value (reply->element[j]);
+		}
+	}
+	else {
+		rt->learns = rspamd_redis_reply_value (reply);
+	}
+
+	if (++ req->nreplies == req->nbatch * 2) {
+		rspamd_redis_request_done (req);
+	}
+}
+
+/*
+ * Tokens of all statfiles in the batch are loaded by HMGET commands and
+ * learns by HGET commands sent as a single pipeline, results are stored
+ * when replies are received
+ */
+guint
+rspamd_redis_process_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_runtime *rt, *cur_rt;
+	struct redis_stat_request *req;
+	struct rspamd_statfile_runtime **batch;
+	rspamd_token_t *tok;
+	const gchar **argv;
+	gsize *argvlen;
+	gchar *fields;
+	guint i, nbatch, *ids;
+
+	g_assert (p != NULL);
+	g_assert (runtime != NULL);
+
+	rt = (struct redis_stat_runtime *)runtime->backend_runtime;
+
+	if (rt == NULL || rt->task == NULL || rt->loaded || tokens->len == 0) {
+		return 0;
+	}
+
+	nbatch = rspamd_redis_classifier_batch (tokens, id, runtime, FALSE,
+			&batch, &ids);
+	req = rspamd_redis_request_new (rt->task, rt->elt, rt->elt->read_servers);
+
+	if (req == NULL) {
+		for (i = 0; i < nbatch; i ++) {
+			batch[i]->failed = TRUE;
+		}
+
+		return 0;
+	}
+
+	req->tokens = tokens;
+	req->batch = batch;
+	req->ids = ids;
+	req->nbatch = nbatch;
+
+	argv = rspamd_mempool_alloc (rt->task->task_pool,
+			sizeof (*argv) * (tokens->len + 2));
+	argvlen = rspamd_mempool_alloc (rt->task->task_pool,
+			sizeof (*argvlen) * (tokens->len + 2));
+	fields = rspamd_mempool_alloc (rt->task->task_pool,
+			REDIS_TOKEN_LEN * tokens->len);
+
+	argv[0] = "HMGET";
+	argvlen[0] = sizeof ("HMGET") - 1;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		argv[i + 2] = &fields[i * REDIS_TOKEN_LEN];
+		argvlen[i + 2] = rspamd_redis_token_field (tok,
+				&fields[i * REDIS_TOKEN_LEN]);
+	}
+
+	/* Commands are buffered until the connection is established */
+	for (i = 0; i < nbatch; i ++) {
+		cur_rt = (struct redis_stat_runtime *)batch[i]->backend_runtime;
+		argv[1] = cur_rt->elt->key;
+		argvlen[1] = strlen (cur_rt->elt->key);
+
+		redisAsyncCommandArgv (req->redis, rspamd_redis_processed, req,
+				tokens->len + 2, argv, argvlen);
+		redisAsyncCommand (req->redis, rspamd_redis_processed, req,
+				"HGET %s " REDIS_LEARNS_FIELD, cur_rt->elt->key);
+	}
+
+	rspamd_redis_request_start (req, rt->elt);
+
+	return 0;
+}
+
+/* Only the reply to EXEC is processed, errors of commands are found there */
+static void
+rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_request *req = priv;
+	struct redis_stat_runtime *rt;
+	redisReply *reply = r;
+	guint i, pos = 0;
+
+	if (req->finished) {
+		/* Request has been failed or its session is destroyed */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+		rspamd_redis_request_fail (req, c, reply);
+		return;
+	}
+
+	for (i = 0; i < reply->elements; i ++) {
+		if (reply->element[i]->type == REDIS_REPLY_ERROR) {
+			rspamd_redis_request_fail (req, c, reply->element[i]);
+			return;
+		}
+	}
+
+	/* Learns are incremented by the last command of each statfile */
+	for (i = 0; i < req->nbatch; i ++) {
+		rt = (struct redis_stat_runtime *)req->batch[i]->backend_runtime;
+		pos += rt->nlearned + 1;
+
+		if (pos > reply->elements) {
+			rspamd_redis_request_fail (req, c, NULL);
+			return;
+		}
+
+		rt->learns = rspamd_redis_reply_value (reply->element[pos - 1]);
+	}
+
+	rspamd_redis_request_done (req);
+}
+
+/*
+ * Classifiers increase values of tokens learned and tokens are not loaded on
+ * learning, so values are sent as increments and concurrent learning on
+ * several scanners does not lose updates. Increments of all statfiles in the
+ * batch and their learns are sent as a single transaction, so learns are
+ * counted only if tokens are stored
+ */
+gint
+rspamd_redis_learn_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_runtime *rt, *cur_rt;
+	struct redis_stat_request *req;
+	struct rspamd_statfile_runtime **batch;
+	struct rspamd_token_result *res;
+	rspamd_token_t *tok;
+	const gchar *argv[4];
+	gsize argvlen[4];
+	gchar field[REDIS_TOKEN_LEN], incr[64];
+	guint i, j, nbatch, *ids;
+
+	g_assert (p != NULL);
+	g_assert (runtime != NULL);
+
+	rt = (struct redis_stat_runtime *)runtime->backend_runtime;
+
+	if (rt == NULL || rt->task == NULL || tokens->len == 0) {
+		return 0;
+	}
+
+	if (rt->learned) {
+		return rt->nlearned;
+	}
+
+	nbatch = rspamd_redis_classifier_batch (tokens, id, runtime, TRUE,
+			&batch, &ids);
+
+	for (i = 0; i < nbatch; i ++) {
+		cur_rt = (struct redis_stat_runtime *)batch[i]->backend_runtime;
+		cur_rt->nlearned = -1;
+	}
+
+	req = rspamd_redis_request_new (rt->task, rt->elt, rt->elt->write_servers);
+
+	if (req == NULL) {
+		return -1;
+	}
+
+	req->learn = TRUE;
+	req->batch = batch;
+	req->ids = ids;
+	req->nbatch = nbatch;
+
+	/* Replies to MULTI and queued commands are not processed */
+	redisAsyncCommand (req->redis, NULL, NULL, "MULTI");
+	argv[0] = "HINCRBYFLOAT";
+	argvlen[0] = sizeof ("HINCRBYFLOAT") - 1;
+	argv[2] = field;
+	argv[3] = incr;
+
+	for (i = 0; i < nbatch; i ++) {
+		cur_rt = (struct redis_stat_runtime *)batch[i]->backend_runtime;
+		cur_rt->nlearned = 0;
+		argv[1] = cur_rt->elt->key;
+		argvlen[1] = strlen (cur_rt->elt->key);
+
+		for (j = 0; j < tokens->len; j ++) {
+			tok = &g_array_index (tokens, rspamd_token_t, j);
+			res = &tok->results[ids[i]];
+
+			if (res->value == 0.0) {
+				continue;
+			}
+
+			argvlen[2] = rspamd_redis_token_field (tok, field);
+			argvlen[3] = rspamd_snprintf (incr, sizeof (incr), "%.6f",
+					res->value);
+			redisAsyncCommandArgv (req->redis, NULL, NULL, 4, argv, argvlen);
+			cur_rt->nlearned ++;
+		}
+
+		redisAsyncCommand (req->redis, NULL, NULL,
+				"HINCRBY %s " REDIS_LEARNS_FIELD " 1", cur_rt->elt->key);
+	}
+
+	redisAsyncCommand (req->redis, rspamd_redis_learned, req, "EXEC");
+	rspamd_redis_request_start (req, rt->elt);
+
+	return rt->nlearned;
+}
+
+gulong
+rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_ctx *ctx = (struct redis_stat_ctx *)p;
+	struct redis_stat_runtime *rt = (struct redis_stat_runtime *)runtime;
+	struct upstream *up;
+	redisContext *conn;
+	redisReply *reply;
+	gulong learns = 0;
+
+	if (rt == NULL) {
+		return 0;
+	}
+
+	if (rt->task != NULL) {
+		/* Learns are loaded with tokens */
+		return rt->learns;
+	}
+
+	if ((conn = rspamd_redis_get_conn (ctx, rt->elt,
+			rt->elt->read_servers, &up)) == NULL) {
+		return 0;
+	}
+
+	reply = redisCommand (conn, "HGET %s " REDIS_LEARNS_FIELD, rt->elt->key);
+
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		rspamd_redis_conn_fail (ctx, up, conn, reply);
+	}
+	else {
+		learns = rspamd_redis_reply_value (reply);
+		rspamd_upstream_ok (up);
+	}
+
+	if (reply != NULL) {
+		freeReplyObject (reply);
+	}
+
+	return learns;
+}
+
+gulong
+rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_runtime *rt = (struct redis_stat_runtime *)runtime;
+
+	if (rt == NULL) {
+		return 0;
+	}
+
+	/* Learns are incremented within the learning transaction */
+	return rt->learns;
+}
+
+ucl_object_t *
+rspamd_redis_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_ctx *ctx = (struct redis_stat_ctx *)p;
+	struct redis_stat_runtime *rt = (struct redis_stat_runtime *)runtime;
+	struct rspamd_statfile_config *stcf;
+	struct upstream *up;
+	redisContext *conn;
+	redisReply *reply;
+	ucl_object_t *res = NULL;
+	gint64 used = 0;
+
+	if (rt == NULL ||
+			(conn = rspamd_redis_get_conn (ctx, rt->elt,
+					rt->elt->read_servers, &up)) == NULL) {
+		return NULL;
+	}
+
+	reply = redisCommand (conn, "HLEN %s", rt->elt->key);
+
+	if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+		rspamd_redis_conn_fail (ctx, up, conn, reply);
+	}
+	else {
+		/* Do not count learns field */
+		used = reply->integer > 0 ? reply->integer - 1 : 0;
+		rspamd_upstream_ok (up);
+	}
+
+	if (reply != NULL) {
+		freeReplyObject (reply);
+	}
+
+	stcf = rt->elt->stcf;
+	res = ucl_object_typed_new (UCL_OBJECT);
+
+	ucl_object_insert_key (res, ucl_object_fromint (
+			rspamd_redis_total_learns (runtime, p)), "revision", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (used), "used", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (used), "total", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (0), "size", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromstring (stcf->symbol),
+			"symbol", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromstring (REDIS_BACKEND_TYPE),
+			"type", 0, false);
+
+	if (stcf->label) {
+		ucl_object_insert_key (res, ucl_object_fromstring (stcf->label),
+				"label", 0, false);
+	}
+
+	return res;
+}
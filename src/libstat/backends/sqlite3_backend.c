@@ -0,0 +1,767 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sqlite statistics backend: each statfile is a database where tokens counts
+ * are stored per user, so it is possible to have personal statistics for a
+ * large number of users without preallocating space for each of them.
+ */
+
+#include "config.h"
+#include "stat_internal.h"
+#include "main.h"
+
+#include <sqlite3.h>
+
+#define SQLITE3_BACKEND_TYPE "sqlite3"
+/* Time to wait for a database lock held by another process in milliseconds */
+#define SQLITE3_BUSY_TIMEOUT 1000
+/* The first version that supports tables without rowid */
+#define SQLITE3_WITHOUT_ROWID_VERSION 3008002
+
+/*
+ * Tokens table has no rowid if sqlite supports it, so each token is stored
+ * only once within the primary key b-tree
+ */
+static const char *create_tables_sql =
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS users("
+		"id INTEGER PRIMARY KEY,"
+		"name TEXT NOT NULL,"
+		"learns INTEGER NOT NULL DEFAULT 0);"
+		"CREATE UNIQUE INDEX IF NOT EXISTS un ON users(name);"
+		"CREATE TABLE IF NOT EXISTS tokens("
+		"token INTEGER NOT NULL,"
+		"user INTEGER NOT NULL,"
+		"value INTEGER NOT NULL,"
+		"PRIMARY KEY(token, user))%s;"
+		"COMMIT;";
+/* Tokens of a message are loaded by joining this table with tokens */
+static const char *create_query_sql =
+		"CREATE TEMP TABLE IF NOT EXISTS tokens_query("
+		"token INTEGER PRIMARY KEY);";
+
+enum rspamd_stat_sqlite3_stmt_idx {
+	RSPAMD_STAT_SQLITE3_TRANSACTION_START = 0,
+	RSPAMD_STAT_SQLITE3_TRANSACTION_START_IMMEDIATE,
+	RSPAMD_STAT_SQLITE3_TRANSACTION_COMMIT,
+	RSPAMD_STAT_SQLITE3_TRANSACTION_ROLLBACK,
+	RSPAMD_STAT_SQLITE3_GET_USER,
+	RSPAMD_STAT_SQLITE3_INSERT_USER,
+	RSPAMD_STAT_SQLITE3_GET_LEARNS,
+	RSPAMD_STAT_SQLITE3_SUM_LEARNS,
+	RSPAMD_STAT_SQLITE3_INC_LEARNS,
+	RSPAMD_STAT_SQLITE3_CLEAR_QUERY,
+	RSPAMD_STAT_SQLITE3_INSERT_QUERY,
+	RSPAMD_STAT_SQLITE3_GET_TOKENS,
+	RSPAMD_STAT_SQLITE3_UPDATE_TOKEN,
+	RSPAMD_STAT_SQLITE3_INSERT_TOKEN,
+	RSPAMD_STAT_SQLITE3_COUNT_TOKENS,
+	RSPAMD_STAT_SQLITE3_COUNT_USERS,
+	RSPAMD_STAT_SQLITE3_MAX
+};
+
+static struct rspamd_stat_sqlite3_prstmt {
+	int idx;
+	const char *sql;
+	const char *args;
+	int result;
+} prepared_stmts[RSPAMD_STAT_SQLITE3_MAX] = {
+	{
+		.idx = RSPAMD_STAT_SQLITE3_TRANSACTION_START,
+		.sql = "BEGIN TRANSACTION;",
+		.args = "",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_TRANSACTION_START_IMMEDIATE,
+		.sql = "BEGIN IMMEDIATE TRANSACTION;",
+		.args = "",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_TRANSACTION_COMMIT,
+		.sql = "COMMIT;",
+		.args = "",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_TRANSACTION_ROLLBACK,
+		.sql = "ROLLBACK;",
+		.args = "",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_GET_USER,
+		.sql = "SELECT id FROM users WHERE name=?1;",
+		.args = "T",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_INSERT_USER,
+		.sql = "INSERT OR IGNORE INTO users(name, learns) VALUES (?1, 0);",
+		.args = "T",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_GET_LEARNS,
+		.sql = "SELECT learns FROM users WHERE id=?1;",
+		.args = "I",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_SUM_LEARNS,
+		.sql = "SELECT COALESCE(SUM(learns), 0) FROM users;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_INC_LEARNS,
+		.sql = "UPDATE users SET learns=learns + 1 WHERE id=?1;",
+		.args = "I",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_CLEAR_QUERY,
+		.sql = "DELETE FROM temp.tokens_query;",
+		.args = "",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_INSERT_QUERY,
+		.sql = "INSERT OR IGNORE INTO temp.tokens_query(token) VALUES (?1);",
+		.args = "I",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_GET_TOKENS,
+		.sql = "SELECT q.token, t.value FROM temp.tokens_query AS q "
+				"JOIN tokens AS t ON t.token=q.token AND t.user=?1;",
+		.args = "I",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_UPDATE_TOKEN,
+		.sql = "UPDATE tokens SET value=value + ?3 WHERE token=?1 AND user=?2;",
+		.args = "IIF",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_INSERT_TOKEN,
+		.sql = "INSERT INTO tokens(token, user, value) VALUES (?1, ?2, ?3);",
+		.args = "IIF",
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_COUNT_TOKENS,
+		.sql = "SELECT COUNT(*) FROM tokens;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_STAT_SQLITE3_COUNT_USERS,
+		.sql = "SELECT COUNT(*) FROM users;",
+		.args = "",
+		.result = SQLITE_ROW
+	}
+};
+
+enum rspamd_stat_sqlite3_users {
+	RSPAMD_STAT_SQLITE3_USERS_NONE = 0,
+	RSPAMD_STAT_SQLITE3_USERS_RCPT,
+	RSPAMD_STAT_SQLITE3_USERS_DOMAIN
+};
+
+struct rspamd_stat_sqlite3_db;
+
+struct rspamd_stat_sqlite3_rt {
+	struct rspamd_stat_sqlite3_db *db;
+	struct rspamd_task *task;
+	/* Id of the user or -1 if user has no statistics */
+	gint64 user_id;
+	/* Values loaded from database, they are used to find increments on learning */
+	gdouble *values;
+	guint nvalues;
+};
+
+struct rspamd_stat_sqlite3_db {
+	struct rspamd_statfile_config *stcf;
+	const gchar *path;
+	enum rspamd_stat_sqlite3_users users;
+	/* Database is opened on the first use, so it is never shared after fork */
+	sqlite3 *sqlite;
+	sqlite3_stmt *stmts[RSPAMD_STAT_SQLITE3_MAX];
+	struct rspamd_stat_sqlite3_rt stat_rt;
+};
+
+struct rspamd_stat_sqlite3_ctx {
+	GHashTable *dbs;                    /**< statfile config -> rspamd_stat_sqlite3_db */
+};
+
+static int
+rspamd_sqlite3_run_stmt (struct rspamd_stat_sqlite3_db *db, int idx, ...)
+{
+	int retcode;
+	guint i;
+	va_list ap;
+	sqlite3_stmt *stmt;
+	const gchar *argtypes;
+
+	stmt = db->stmts[idx];
+	argtypes = prepared_stmts[idx].args;
+	sqlite3_reset (stmt);
+
+	va_start (ap, idx);
+
+	for (i = 0; argtypes[i] != '\0'; i++) {
+		switch (argtypes[i]) {
+		case 'T':
+			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), -1,
+					SQLITE_STATIC);
+			break;
+		case 'I':
+			sqlite3_bind_int64 (stmt, i + 1, va_arg (ap, gint64));
+			break;
+		case 'F':
+			sqlite3_bind_double (stmt, i + 1, va_arg (ap, gdouble));
+			break;
+		}
+	}
+
+	va_end (ap);
+
+	retcode = sqlite3_step (stmt);
+
+	if (retcode == prepared_stmts[idx].result) {
+		return SQLITE_OK;
+	}
+	else if (retcode != SQLITE_DONE) {
+		msg_err ("failed to execute query %s: %d, %s", prepared_stmts[idx].sql,
+				retcode, sqlite3_errmsg (db->sqlite));
+	}
+
+	return retcode;
+}
+
+static void
+rspamd_sqlite3_close (struct rspamd_stat_sqlite3_db *db)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_STAT_SQLITE3_MAX; i ++) {
+		if (db->stmts[i] != NULL) {
+			sqlite3_finalize (db->stmts[i]);
+			db->stmts[i] = NULL;
+		}
+	}
+
+	if (db->sqlite != NULL) {
+		sqlite3_close (db->sqlite);
+		db->sqlite = NULL;
+	}
+}
+
+static gboolean
+rspamd_sqlite3_open (struct rspamd_stat_sqlite3_db *db)
+{
+	gchar sql[1024];
+	guint i;
+	int rc;
+
+	if (db->sqlite != NULL) {
+		return TRUE;
+	}
+
+	if ((rc = sqlite3_open_v2 (db->path, &db->sqlite,
+			SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX, NULL))
+			!= SQLITE_OK) {
+		msg_err ("cannot open sqlite db %s: %d", db->path, rc);
+		sqlite3_close (db->sqlite);
+		db->sqlite = NULL;
+
+		return FALSE;
+	}
+
+	sqlite3_busy_timeout (db->sqlite, SQLITE3_BUSY_TIMEOUT);
+	/* Allow scanners to read statistics while it is being learned */
+	sqlite3_exec (db->sqlite, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+
+	rspamd_snprintf (sql, sizeof (sql), create_tables_sql,
+			sqlite3_libversion_number () >= SQLITE3_WITHOUT_ROWID_VERSION ?
+			" WITHOUT ROWID" : "");
+
+	if (sqlite3_exec (db->sqlite, sql, NULL, NULL, NULL) != SQLITE_OK ||
+			sqlite3_exec (db->sqlite, create_query_sql, NULL, NULL, NULL)
+			!= SQLITE_OK) {
+		msg_err ("cannot create tables in sqlite db %s: %s", db->path,
+				sqlite3_errmsg (db->sqlite));
+		rspamd_sqlite3_close (db);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < RSPAMD_STAT_SQLITE3_MAX; i ++) {
+		if (sqlite3_prepare_v2 (db->sqlite, prepared_stmts[i].sql, -1,
+				&db->stmts[i], NULL) != SQLITE_OK) {
+			msg_err ("cannot initialize prepared sql `%s`: %s",
+					prepared_stmts[i].sql, sqlite3_errmsg (db->sqlite));
+			rspamd_sqlite3_close (db);
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Returns the name of user whose statistics are used for a task, the empty
+ * name is used for common statistics
+ */
+static const gchar *
+rspamd_sqlite3_get_user (struct rspamd_stat_sqlite3_db *db,
+		struct rspamd_task *task)
+{
+	const gchar *user = task->deliver_to, *domain;
+
+	if (db->users == RSPAMD_STAT_SQLITE3_USERS_NONE || user == NULL) {
+		return "";
+	}
+
+	if (db->users == RSPAMD_STAT_SQLITE3_USERS_DOMAIN) {
+		domain = strrchr (user, '@');
+
+		if (domain != NULL) {
+			return domain + 1;
+		}
+	}
+
+	return user;
+}
+
+static gint64
+rspamd_sqlite3_get_user_id (struct rspamd_stat_sqlite3_db *db,
+		const gchar *user, gboolean learn)
+{
+	gint64 id = -1;
+
+	if (learn) {
+		rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_INSERT_USER, user);
+	}
+
+	if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_GET_USER, user)
+			== SQLITE_OK) {
+		id = sqlite3_column_int64 (db->stmts[RSPAMD_STAT_SQLITE3_GET_USER], 0);
+	}
+
+	sqlite3_reset (db->stmts[RSPAMD_STAT_SQLITE3_GET_USER]);
+
+	return id;
+}
+
+gpointer
+rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
+{
+	struct rspamd_stat_sqlite3_ctx *new;
+	struct rspamd_stat_sqlite3_db *db;
+	struct rspamd_classifier_config *clf;
+	struct rspamd_statfile_config *stf;
+	const ucl_object_t *elt;
+	const gchar *users;
+	GList *cur, *curst;
+
+	new = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*new));
+	new->dbs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, (GDestroyNotify)rspamd_sqlite3_close);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, new->dbs);
+
+	cur = cfg->classifiers;
+
+	while (cur) {
+		clf = cur->data;
+
+		curst = clf->statfiles;
+		while (curst) {
+			stf = curst->data;
+
+			if (stf->backend == NULL ||
+					strcmp (stf->backend, SQLITE3_BACKEND_TYPE) != 0) {
+				curst = curst->next;
+				continue;
+			}
+
+			elt = ucl_object_find_key (stf->opts, "path");
+			if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+				elt = ucl_object_find_key (stf->opts, "filename");
+				if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+					msg_err ("statfile %s has no filename defined", stf->symbol);
+					curst = curst->next;
+					continue;
+				}
+			}
+
+			db = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*db));
+			db->stcf = stf;
+			db->path = ucl_object_tostring (elt);
+			db->stat_rt.db = db;
+			db->stat_rt.user_id = -1;
+
+			elt = ucl_object_find_key (stf->opts, "users");
+			if (elt != NULL && ucl_object_type (elt) == UCL_STRING) {
+				users = ucl_object_tostring (elt);
+
+				if (g_ascii_strcasecmp (users, "recipient") == 0) {
+					db->users = RSPAMD_STAT_SQLITE3_USERS_RCPT;
+				}
+				else if (g_ascii_strcasecmp (users, "domain") == 0) {
+					db->users = RSPAMD_STAT_SQLITE3_USERS_DOMAIN;
+				}
+				else {
+					msg_warn ("statfile %s has invalid users type: %s, "
+							"use common statistics", stf->symbol, users);
+				}
+			}
+
+			g_hash_table_insert (new->dbs, stf, db);
+			ctx->statfiles ++;
+
+			curst = curst->next;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return (gpointer)new;
+}
+
+gpointer
+rspamd_sqlite3_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer p)
+{
+	struct rspamd_stat_sqlite3_ctx *ctx = (struct rspamd_stat_sqlite3_ctx *)p;
+	struct rspamd_stat_sqlite3_db *db;
+	struct rspamd_stat_sqlite3_rt *rt;
+
+	g_assert (ctx != NULL);
+
+	db = g_hash_table_lookup (ctx->dbs, stcf);
+
+	if (db == NULL || !rspamd_sqlite3_open (db)) {
+		return NULL;
+	}
+
+	if (task == NULL) {
+		/* Statistics requests are not related to any user */
+		return &db->stat_rt;
+	}
+
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rt->db = db;
+	rt->task = task;
+	rt->user_id = rspamd_sqlite3_get_user_id (db,
+			rspamd_sqlite3_get_user (db, task), learn);
+
+	return rt;
+}
+
+static gint
+rspamd_sqlite3_token_cmp (const void *a, const void *b)
+{
+	const guint64 *key = a;
+	const rspamd_token_t *tok = b;
+
+	if (*key < tok->data) {
+		return -1;
+	}
+	else if (*key > tok->data) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Tokens are inserted to the temporary table and joined with the tokens of
+ * the user, so all tokens are loaded by a single query. Tokens array is sorted
+ * by tokenizer, so results are matched with tokens by binary search
+ */
+guint
+rspamd_sqlite3_process_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct rspamd_stat_sqlite3_rt *rt;
+	struct rspamd_stat_sqlite3_db *db;
+	struct rspamd_token_result *res;
+	rspamd_token_t *tok;
+	sqlite3_stmt *stmt;
+	guint64 data;
+	guint i, found = 0;
+	int rc;
+
+	g_assert (runtime != NULL);
+
+	rt = (struct rspamd_stat_sqlite3_rt *)runtime->backend_runtime;
+
+	if (rt == NULL || rt->task == NULL || rt->user_id == -1 ||
+			tokens->len == 0) {
+		return 0;
+	}
+
+	db = rt->db;
+
+	if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_TRANSACTION_START)
+			!= SQLITE_OK) {
+		return 0;
+	}
+
+	rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_CLEAR_QUERY);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+
+		if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_INSERT_QUERY,
+				(gint64)tok->data) != SQLITE_OK) {
+			rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_TRANSACTION_ROLLBACK);
+			return 0;
+		}
+	}
+
+	rt->values = rspamd_mempool_alloc0 (rt->task->task_pool,
+			sizeof (gdouble) * tokens->len);
+	rt->nvalues = tokens->len;
+	stmt = db->stmts[RSPAMD_STAT_SQLITE3_GET_TOKENS];
+	rc = rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_GET_TOKENS,
+			rt->user_id);
+
+	while (rc == SQLITE_OK) {
+		data = sqlite3_column_int64 (stmt, 0);
+		tok = bsearch (&data, tokens->data, tokens->len,
+				sizeof (rspamd_token_t), rspamd_sqlite3_token_cmp);
+
+		if (tok != NULL) {
+			res = &tok->results[id];
+			res->value = sqlite3_column_double (stmt, 1);
+			rt->values[tok - (rspamd_token_t *)tokens->data] = res->value;
+
+			if (res->value > 0.0) {
+				found ++;
+			}
+		}
+
+		rc = sqlite3_step (stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_DONE;
+	}
+
+	sqlite3_reset (stmt);
+	rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_CLEAR_QUERY);
+	rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_TRANSACTION_COMMIT);
+
+	return found;
+}
+
+/*
+ * Tokens are learned by increments relative to the loaded values within
+ * a single transaction
+ */
+gint
+rspamd_sqlite3_learn_tokens (GArray *tokens, guint id,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct rspamd_stat_sqlite3_rt *rt;
+	struct rspamd_stat_sqlite3_db *db;
+	struct rspamd_token_result *res;
+	rspamd_token_t *tok;
+	gdouble delta;
+	guint i, learned = 0;
+
+	g_assert (runtime != NULL);
+
+	rt = (struct rspamd_stat_sqlite3_rt *)runtime->backend_runtime;
+
+	if (rt == NULL || tokens->len == 0) {
+		return 0;
+	}
+
+	db = rt->db;
+
+	if (rt->user_id == -1) {
+		msg_err ("cannot learn statfile %s: user is not registered",
+				db->stcf->symbol);
+		return -1;
+	}
+
+	if (rspamd_sqlite3_run_stmt (db,
+			RSPAMD_STAT_SQLITE3_TRANSACTION_START_IMMEDIATE) != SQLITE_OK) {
+		msg_err ("cannot learn statfile %s: %s", db->stcf->symbol,
+				sqlite3_errmsg (db->sqlite));
+		return -1;
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		res = &tok->results[id];
+		delta = res->value;
+
+		if (i < rt->nvalues) {
+			delta -= rt->values[i];
+		}
+
+		if (res->value > 0.0) {
+			learned ++;
+		}
+
+		if (delta == 0.0) {
+			continue;
+		}
+
+		if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_UPDATE_TOKEN,
+				(gint64)tok->data, rt->user_id, delta) != SQLITE_OK ||
+				(sqlite3_changes (db->sqlite) == 0 &&
+				rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_INSERT_TOKEN,
+						(gint64)tok->data, rt->user_id, delta) != SQLITE_OK)) {
+			msg_err ("cannot learn statfile %s: %s", db->stcf->symbol,
+					sqlite3_errmsg (db->sqlite));
+			rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_TRANSACTION_ROLLBACK);
+
+			return -1;
+		}
+	}
+
+	if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_TRANSACTION_COMMIT)
+			!= SQLITE_OK) {
+		msg_err ("cannot commit learning of statfile %s: %s", db->stcf->symbol,
+				sqlite3_errmsg (db->sqlite));
+		rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_TRANSACTION_ROLLBACK);
+
+		return -1;
+	}
+
+	return learned;
+}
+
+gulong
+rspamd_sqlite3_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct rspamd_stat_sqlite3_rt *rt = (struct rspamd_stat_sqlite3_rt *)runtime;
+	struct rspamd_stat_sqlite3_db *db;
+	gulong learns = 0;
+
+	if (rt == NULL) {
+		return 0;
+	}
+
+	db = rt->db;
+
+	if (rt->task == NULL) {
+		if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_SUM_LEARNS)
+				== SQLITE_OK) {
+			learns = sqlite3_column_int64 (
+					db->stmts[RSPAMD_STAT_SQLITE3_SUM_LEARNS], 0);
+		}
+
+		sqlite3_reset (db->stmts[RSPAMD_STAT_SQLITE3_SUM_LEARNS]);
+	}
+	else if (rt->user_id != -1) {
+		if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_GET_LEARNS,
+				rt->user_id) == SQLITE_OK) {
+			learns = sqlite3_column_int64 (
+					db->stmts[RSPAMD_STAT_SQLITE3_GET_LEARNS], 0);
+		}
+
+		sqlite3_reset (db->stmts[RSPAMD_STAT_SQLITE3_GET_LEARNS]);
+	}
+
+	return learns;
+}
+
+gulong
+rspamd_sqlite3_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct rspamd_stat_sqlite3_rt *rt = (struct rspamd_stat_sqlite3_rt *)runtime;
+
+	if (rt == NULL || rt->task == NULL || rt->user_id == -1) {
+		return 0;
+	}
+
+	rspamd_sqlite3_run_stmt (rt->db, RSPAMD_STAT_SQLITE3_INC_LEARNS,
+			rt->user_id);
+
+	return rspamd_sqlite3_total_learns (runtime, p);
+}
+
+ucl_object_t *
+rspamd_sqlite3_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct rspamd_stat_sqlite3_rt *rt = (struct rspamd_stat_sqlite3_rt *)runtime;
+	struct rspamd_stat_sqlite3_db *db;
+	ucl_object_t *res;
+	gint64 tokens = 0, users = 0;
+
+	if (rt == NULL) {
+		return NULL;
+	}
+
+	db = rt->db;
+
+	if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_COUNT_TOKENS)
+			== SQLITE_OK) {
+		tokens = sqlite3_column_int64 (
+				db->stmts[RSPAMD_STAT_SQLITE3_COUNT_TOKENS], 0);
+	}
+
+	if (rspamd_sqlite3_run_stmt (db, RSPAMD_STAT_SQLITE3_COUNT_USERS)
+			== SQLITE_OK) {
+		users = sqlite3_column_int64 (
+				db->stmts[RSPAMD_STAT_SQLITE3_COUNT_USERS], 0);
+	}
+
+	sqlite3_reset (db->stmts[RSPAMD_STAT_SQLITE3_COUNT_TOKENS]);
+	sqlite3_reset (db->stmts[RSPAMD_STAT_SQLITE3_COUNT_USERS]);
+
+	res = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (res, ucl_object_fromint (
+			rspamd_sqlite3_total_learns (runtime, p)), "revision", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (tokens), "used", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (tokens), "total", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (0), "size", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (users), "users", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromstring (db->stcf->symbol),
+			"symbol", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromstring (SQLITE3_BACKEND_TYPE),
+			"type", 0, false);
+
+	if (db->stcf->label) {
+		ucl_object_insert_key (res, ucl_object_fromstring (db->stcf->label),
+				"label", 0, false);
+	}
+
+	return res;
+}
@@ -82,18 +82,17 @@ inv_chi_square (gdouble value, gint freedom_deg)
 /*
  * In this callback we calculate local probabilities for tokens
  */
-static gboolean
-bayes_classify_callback (gpointer key, gpointer value, gpointer data)
+static void
+bayes_classify_token (rspamd_token_t *node,
+	struct rspamd_classifier_runtime *rt)
 {
-	rspamd_token_t *node = value;
-	struct rspamd_classifier_runtime *rt = (struct rspamd_classifier_runtime *)data;
 	guint i;
 	struct rspamd_token_result *res;
 	guint64 spam_count = 0, ham_count = 0, total_count = 0;
 	double spam_prob, spam_freq, ham_freq, bayes_spam_prob;
 
 	for (i = rt->start_pos; i < rt->end_pos; i++) {
-		res = &g_array_index (node->results, struct rspamd_token_result, i);
+		res = &node->results[i];
 
 		if (res->value > 0) {
 			if (res->st_runtime->st->is_spam) {
@@ -117,8 +116,6 @@ bayes_classify_callback (gpointer key, gpointer value, gpointer data)
 		rt->spam_prob += log (bayes_spam_prob);
 		rt->ham_prob += log (1. - bayes_spam_prob);
 	}
-
-	return FALSE;
 }
 
 struct classifier_ctx *
@@ -136,12 +133,12 @@ bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier_config *cfg)
 
 gboolean
 bayes_classify (struct classifier_ctx * ctx,
-	GTree *input,
+	GArray *input,
 	struct rspamd_classifier_runtime *rt,
 	struct rspamd_task *task)
 {
 	double final_prob, h, s;
-	guint maxhits = 0;
+	guint maxhits = 0, i;
 	struct rspamd_statfile_runtime *st, *selected_st = NULL;
 	GList *cur;
 	char *sumbuf;
@@ -151,7 +148,9 @@ bayes_classify (struct classifier_ctx * ctx,
 	g_assert (rt != NULL);
 	g_assert (rt->end_pos > rt->start_pos);
 
-	g_tree_foreach (input, bayes_classify_callback, rt);
+	for (i = 0; i < input->len; i ++) {
+		bayes_classify_token (&g_array_index (input, rspamd_token_t, i), rt);
+	}
 
 	if (rt->spam_prob == 0) {
 		final_prob = 0;
@@ -206,64 +205,34 @@ bayes_classify (struct classifier_ctx * ctx,
 	return TRUE;
 }
 
-static gboolean
-bayes_learn_spam_callback (gpointer key, gpointer value, gpointer data)
-{
-	rspamd_token_t *node = value;
-	struct rspamd_token_result *res;
-	struct rspamd_classifier_runtime *rt = (struct rspamd_classifier_runtime *)data;
-	guint i;
-
-
-	for (i = rt->start_pos; i < rt->end_pos; i++) {
-		res = &g_array_index (node->results, struct rspamd_token_result, i);
-
-		if (res->st_runtime->st->is_spam) {
-			res->value ++;
-		}
-	}
-
-	return FALSE;
-}
-
-static gboolean
-bayes_learn_ham_callback (gpointer key, gpointer value, gpointer data)
-{
-	rspamd_token_t *node = value;
-	struct rspamd_token_result *res;
-	struct rspamd_classifier_runtime *rt = (struct rspamd_classifier_runtime *)data;
-	guint i;
-
-
-	for (i = rt->start_pos; i < rt->end_pos; i++) {
-		res = &g_array_index (node->results, struct rspamd_token_result, i);
-
-		if (!res->st_runtime->st->is_spam) {
-			res->value ++;
-		}
-	}
-
-	return FALSE;
-}
-
 gboolean
 bayes_learn_spam (struct classifier_ctx * ctx,
-	GTree *input,
+	GArray *input,
 	struct rspamd_classifier_runtime *rt,
 	struct rspamd_task *task,
 	gboolean is_spam,
 	GError **err)
 {
+	rspamd_token_t *node;
+	struct rspamd_token_result *res;
+	guint i, j;
+
 	g_assert (ctx != NULL);
 	g_assert (input != NULL);
 	g_assert (rt != NULL);
 	g_assert (rt->end_pos > rt->start_pos);
 
-	if (is_spam) {
-		g_tree_foreach (input, bayes_learn_spam_callback, rt);
-	}
-	else {
-		g_tree_foreach (input, bayes_learn_ham_callback, rt);
+	for (i = 0; i < input->len; i ++) {
+		node = &g_array_index (input, rspamd_token_t, i);
+
+		for (j = rt->start_pos; j < rt->end_pos; j ++) {
+			res = &node->results[j];
+
+			if (is_spam ? res->st_runtime->st->is_spam :
+					!res->st_runtime->st->is_spam) {
+				res->value ++;
+			}
+		}
 	}
 
 
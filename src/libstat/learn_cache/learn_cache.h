@@ -37,7 +37,7 @@ typedef enum rspamd_learn_cache_result {
 struct rspamd_stat_cache {
 	const char *name;
 	gpointer (*init)(struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
-	rspamd_learn_t (*process)(GTree *input, gboolean is_spam, gpointer ctx);
+	rspamd_learn_t (*process)(GArray *input, gboolean is_spam, gpointer ctx);
 	gpointer ctx;
 };
 
@@ -32,6 +32,15 @@
  * High level statistics API
  */
 
+/**
+ * The results of statistics processing
+ */
+typedef enum rspamd_stat_result_e {
+	RSPAMD_STAT_PROCESS_ERROR = 0,
+	RSPAMD_STAT_PROCESS_OK,
+	RSPAMD_STAT_PROCESS_DELAYED
+} rspamd_stat_result_t;
+
 /**
  * Initialise statistics modules
  * @param cfg
@@ -39,21 +48,28 @@
 void rspamd_stat_init (struct rspamd_config *cfg);
 
 /**
- * Classify the task specified and insert symbols if needed
+ * Classify the task specified and insert symbols if needed. Backends could
+ * load tokens asynchronously registering events in the task session, then
+ * RSPAMD_STAT_PROCESS_DELAYED is returned and the task is classified when
+ * these events are finished. The next call returns the final result
  * @param task
- * @return TRUE if task has been classified
+ * @return RSPAMD_STAT_PROCESS_OK if task has been classified
  */
-gboolean rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err);
+rspamd_stat_result_t rspamd_stat_classify (struct rspamd_task *task,
+		lua_State *L, GError **err);
 
 
 /**
- * Learn task as spam or ham, task must be processed prior to this call
+ * Learn task as spam or ham, task must be processed prior to this call.
+ * Backends could store tokens asynchronously registering events in the task
+ * session, then RSPAMD_STAT_PROCESS_DELAYED is returned and learning is
+ * finished with these events. The next call returns the final result
  * @param task task to learn
  * @param spam if TRUE learn spam, otherwise learn ham
- * @return TRUE if task has been learned
+ * @return RSPAMD_STAT_PROCESS_OK if task has been learned
  */
-gboolean rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
-		GError **err);
+rspamd_stat_result_t rspamd_stat_learn (struct rspamd_task *task,
+		gboolean spam, lua_State *L, GError **err);
 
 /**
  * Get the overall statistics for all statfile backends
@@ -51,9 +51,31 @@ struct rspamd_stat_backend stat_backends[] = {
 		.runtime = rspamd_mmaped_file_runtime,
 		.process_token = rspamd_mmaped_file_process_token,
 		.learn_token = rspamd_mmaped_file_learn_token,
+		.process_tokens = rspamd_mmaped_file_process_tokens,
+		.learn_tokens = rspamd_mmaped_file_learn_tokens,
 		.total_learns = rspamd_mmaped_file_total_learns,
 		.inc_learns = rspamd_mmaped_file_inc_learns,
 		.get_stat = rspamd_mmaped_file_get_stat
+	},
+	{
+		.name = "redis",
+		.init = rspamd_redis_init,
+		.runtime = rspamd_redis_runtime,
+		.process_tokens = rspamd_redis_process_tokens,
+		.learn_tokens = rspamd_redis_learn_tokens,
+		.total_learns = rspamd_redis_total_learns,
+		.inc_learns = rspamd_redis_inc_learns,
+		.get_stat = rspamd_redis_get_stat
+	},
+	{
+		.name = "sqlite3",
+		.init = rspamd_sqlite3_init,
+		.runtime = rspamd_sqlite3_runtime,
+		.process_tokens = rspamd_sqlite3_process_tokens,
+		.learn_tokens = rspamd_sqlite3_learn_tokens,
+		.total_learns = rspamd_sqlite3_total_learns,
+		.inc_learns = rspamd_sqlite3_inc_learns,
+		.get_stat = rspamd_sqlite3_get_stat
 	}
 };
 
@@ -30,7 +30,7 @@
 #include "backends/backends.h"
 
 struct rspamd_tokenizer_runtime {
-	GTree *tokens;
+	GArray *tokens;
 	const gchar *name;
 	struct rspamd_stat_tokenizer *tokenizer;
 	struct rspamd_tokenizer_runtime *next;
@@ -42,6 +42,8 @@ struct rspamd_statfile_runtime {
 	gpointer backend_runtime;
 	guint64 hits;
 	guint64 total_hits;
+	/* Set by asynchronous backends if tokens cannot be loaded or stored */
+	gboolean failed;
 };
 
 struct rspamd_classifier_runtime {
@@ -65,11 +67,9 @@ struct rspamd_token_result {
 	struct rspamd_classifier_runtime *cl_runtime;
 };
 
-#define RSPAMD_MAX_TOKEN_LEN 64
 typedef struct token_node_s {
-	guchar data[RSPAMD_MAX_TOKEN_LEN];
-	guint datalen;
-	GArray *results;
+	guint64 data;
+	struct rspamd_token_result *results;
 } rspamd_token_t;
 
 struct rspamd_stat_ctx {
@@ -36,6 +36,24 @@ struct preprocess_cb_data {
 	guint results_count;
 };
 
+/*
+ * Statistics processing state of a task: backends could load and learn tokens
+ * asynchronously, then processing is continued by the watcher of their events
+ */
+struct stat_process_cbdata {
+	struct rspamd_task *task;
+	GList *cl_runtimes;
+	/* Classifiers which tokens have been sent to backends on learning */
+	struct rspamd_classifier_runtime **learned;
+	guint nlearned;
+	gboolean learn;
+	gboolean spam;
+	gboolean watch;
+	gboolean finished;
+	rspamd_stat_result_t result;
+	GError *err;
+};
+
 static struct rspamd_tokenizer_runtime *
 rspamd_stat_get_tokenizer_runtime (const gchar *name, rspamd_mempool_t *pool,
 		struct rspamd_tokenizer_runtime **ls)
@@ -57,9 +75,8 @@ rspamd_stat_get_tokenizer_runtime (const gchar *name, rspamd_mempool_t *pool,
 			return NULL;
 		}
 
-		tok->tokens = g_tree_new (token_node_compare_func);
-		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t)g_tree_destroy, tok->tokens);
+		/* Tokens array is allocated when the number of words is known */
+		tok->tokens = NULL;
 		tok->name = name;
 		LL_PREPEND(*ls, tok);
 	}
@@ -67,68 +84,133 @@ rspamd_stat_get_tokenizer_runtime (const gchar *name, rspamd_mempool_t *pool,
 	return tok;
 }
 
+static void
+rspamd_stat_tokens_dtor (gpointer p)
+{
+	GArray *ar = p;
+
+	g_array_free (ar, TRUE);
+}
+
 static gboolean
-preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
+rspamd_stat_skip_classifier (struct rspamd_classifier_runtime *cl_runtime,
+		struct rspamd_task *task, GArray *tokens)
 {
-	rspamd_token_t *t = (rspamd_token_t *)v;
-	struct preprocess_cb_data *cbdata = (struct preprocess_cb_data *)d;
-	struct rspamd_statfile_runtime *st_runtime;
-	struct rspamd_classifier_runtime *cl_runtime;
-	struct rspamd_token_result *res;
-	GList *cur, *curst;
-	gint i = 0;
+	if (cl_runtime->clcf->min_tokens > 0 &&
+			tokens->len < cl_runtime->clcf->min_tokens) {
+		msg_debug ("<%s> contains less tokens than required for %s classifier: "
+				"%ud < %ud", task->message_id, cl_runtime->clcf->name,
+				tokens->len,
+				cl_runtime->clcf->min_tokens);
+		return TRUE;
+	}
+
+	return FALSE;
+}
 
-	t->results = g_array_sized_new (FALSE, TRUE,
-			sizeof (struct rspamd_token_result), cbdata->results_count);
-	g_array_set_size (t->results, cbdata->results_count);
+static guint
+rspamd_stat_backend_process_tokens (struct rspamd_statfile_runtime *st_runtime,
+		GArray *tokens, guint id)
+{
+	struct rspamd_stat_backend *bk = st_runtime->backend;
+	rspamd_token_t *t;
+	guint i, found = 0;
 
-	cur = g_list_first (cbdata->classifier_runtimes);
+	if (bk->process_tokens != NULL) {
+		return bk->process_tokens (tokens, id, st_runtime, bk->ctx);
+	}
 
-	while (cur) {
-		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+	for (i = 0; i < tokens->len; i ++) {
+		t = &g_array_index (tokens, rspamd_token_t, i);
 
-		if (cl_runtime->clcf->min_tokens > 0 &&
-				(guint32)g_tree_nnodes (cbdata->tok->tokens) < cl_runtime->clcf->min_tokens) {
-			/* Skip this classifier */
-			msg_debug ("<%s> contains less tokens than required for %s classifier: "
-					"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
-					g_tree_nnodes (cbdata->tok->tokens),
-					cl_runtime->clcf->min_tokens);
-			cur = g_list_next (cur);
-			continue;
+		if (bk->process_token (t, &t->results[id], bk->ctx)) {
+			found ++;
 		}
+	}
 
-		curst = cl_runtime->st_runtime;
+	return found;
+}
 
-		while (curst) {
+static gint
+rspamd_stat_backend_learn_tokens (struct rspamd_statfile_runtime *st_runtime,
+		GArray *tokens, guint id)
+{
+	struct rspamd_stat_backend *bk = st_runtime->backend;
+	rspamd_token_t *t;
+	guint i;
+	gint learned = 0;
 
-			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
-			res = &g_array_index (t->results, struct rspamd_token_result, i);
-			res->cl_runtime = cl_runtime;
-			res->st_runtime = st_runtime;
+	if (bk->learn_tokens != NULL) {
+		return bk->learn_tokens (tokens, id, st_runtime, bk->ctx);
+	}
 
-			if (st_runtime->backend->process_token (t, res,
-					st_runtime->backend->ctx)) {
+	for (i = 0; i < tokens->len; i ++) {
+		t = &g_array_index (tokens, rspamd_token_t, i);
 
-				if (cl_runtime->clcf->max_tokens > 0 &&
-						cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
-					msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
-							"%ud > %ud", cbdata->task, cl_runtime->clcf->name,
-							cl_runtime->processed_tokens,
-							cl_runtime->clcf->max_tokens);
+		if (bk->learn_token (t, &t->results[id], bk->ctx)) {
+			learned ++;
+		}
+	}
 
-					return TRUE;
-				}
-			}
+	return learned;
+}
 
-			i ++;
-			curst = g_list_next (curst);
+/*
+ * Results of all tokens are allocated as a single array, then values are
+ * loaded from backends for each statfile at once
+ */
+static void
+preprocess_init_stat_tokens (struct preprocess_cb_data *cbdata)
+{
+	GArray *tokens = cbdata->tok->tokens;
+	rspamd_token_t *t;
+	struct rspamd_statfile_runtime *st_runtime;
+	struct rspamd_classifier_runtime *cl_runtime;
+	struct rspamd_token_result *results, *res;
+	GList *cur, *curst;
+	guint i, pos;
+
+	if (tokens->len == 0) {
+		return;
+	}
+
+	results = rspamd_mempool_alloc0 (cbdata->task->task_pool,
+			sizeof (*results) * cbdata->results_count * tokens->len);
+
+	for (i = 0; i < tokens->len; i ++) {
+		t = &g_array_index (tokens, rspamd_token_t, i);
+		t->results = &results[i * cbdata->results_count];
+
+		for (cur = cbdata->classifier_runtimes; cur != NULL;
+				cur = g_list_next (cur)) {
+			cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+			pos = cl_runtime->start_pos;
+
+			for (curst = cl_runtime->st_runtime; curst != NULL;
+					curst = g_list_next (curst)) {
+				res = &t->results[pos ++];
+				res->cl_runtime = cl_runtime;
+				res->st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+			}
 		}
-		cur = g_list_next (cur);
 	}
 
+	for (cur = cbdata->classifier_runtimes; cur != NULL;
+			cur = g_list_next (cur)) {
+		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
 
-	return FALSE;
+		if (rspamd_stat_skip_classifier (cl_runtime, cbdata->task, tokens)) {
+			continue;
+		}
+
+		pos = cl_runtime->start_pos;
+
+		for (curst = cl_runtime->st_runtime; curst != NULL;
+				curst = g_list_next (curst)) {
+			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+			rspamd_stat_backend_process_tokens (st_runtime, tokens, pos ++);
+		}
+	}
 }
 
 static GList*
@@ -198,7 +280,7 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 				continue;
 			}
 
-			backend_runtime = bk->runtime (stcf, learn, bk->ctx);
+			backend_runtime = bk->runtime (task, stcf, learn, bk->ctx);
 
 			st_runtime = rspamd_mempool_alloc0 (task->task_pool,
 					sizeof (*st_runtime));
@@ -206,15 +288,6 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 			st_runtime->backend_runtime = backend_runtime;
 			st_runtime->backend = bk;
 
-			if (stcf->is_spam) {
-				cl_runtime->total_spam += bk->total_learns (backend_runtime,
-						bk->ctx);
-			}
-			else {
-				cl_runtime->total_ham += bk->total_learns (backend_runtime,
-						bk->ctx);
-			}
-
 			cl_runtime->st_runtime = g_list_prepend (cl_runtime->st_runtime,
 					st_runtime);
 			result_size ++;
@@ -252,13 +325,121 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 		cbdata.classifier_runtimes = cl_runtimes;
 		cbdata.task = task;
 		cbdata.tok = cl_runtime->tok;
-		g_tree_foreach (cl_runtime->tok->tokens, preprocess_init_stat_token,
-				&cbdata);
+		preprocess_init_stat_tokens (&cbdata);
 	}
 
 	return cl_runtimes;
 }
 
+/*
+ * Backends could load learns with tokens, so they are requested when all
+ * tokens are loaded
+ */
+static void
+rspamd_stat_load_learns (GList *cl_runtimes)
+{
+	struct rspamd_classifier_runtime *cl_runtime;
+	struct rspamd_statfile_runtime *st_runtime;
+	struct rspamd_stat_backend *bk;
+	GList *cur, *curst;
+
+	for (cur = cl_runtimes; cur != NULL; cur = g_list_next (cur)) {
+		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+
+		for (curst = cl_runtime->st_runtime; curst != NULL;
+				curst = g_list_next (curst)) {
+			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+			bk = st_runtime->backend;
+
+			if (st_runtime->st->is_spam) {
+				cl_runtime->total_spam += bk->total_learns (
+						st_runtime->backend_runtime, bk->ctx);
+			}
+			else {
+				cl_runtime->total_ham += bk->total_learns (
+						st_runtime->backend_runtime, bk->ctx);
+			}
+		}
+	}
+}
+
+/*
+ * Events registered by backends until rspamd_stat_watch_stop are finished
+ * before cb is called
+ */
+static void
+rspamd_stat_watch_start (struct stat_process_cbdata *cbdata,
+		event_watcher_t cb)
+{
+	if (cbdata->watch) {
+		rspamd_session_watch_start (cbdata->task->s, cb, cbdata);
+	}
+}
+
+static guint
+rspamd_stat_watch_stop (struct stat_process_cbdata *cbdata)
+{
+	if (cbdata->watch) {
+		return rspamd_session_watch_stop (cbdata->task->s);
+	}
+
+	return 0;
+}
+
+static void
+rspamd_stat_finish (struct stat_process_cbdata *cbdata,
+		rspamd_stat_result_t result)
+{
+	cbdata->result = result;
+	cbdata->finished = TRUE;
+
+	if (cbdata->err != NULL) {
+		rspamd_mempool_add_destructor (cbdata->task->task_pool,
+				(rspamd_mempool_destruct_t)g_error_free, cbdata->err);
+	}
+}
+
+static rspamd_stat_result_t
+rspamd_stat_get_result (struct stat_process_cbdata *cbdata, GError **err)
+{
+	if (!cbdata->finished) {
+		return RSPAMD_STAT_PROCESS_DELAYED;
+	}
+
+	if (cbdata->err != NULL && err != NULL && *err == NULL) {
+		*err = g_error_copy (cbdata->err);
+	}
+
+	return cbdata->result;
+}
+
+/*
+ * Backends that process tokens asynchronously mark statfiles which tokens
+ * cannot be loaded or stored
+ */
+static gboolean
+rspamd_stat_check_failed (struct rspamd_classifier_runtime *cl_runtime,
+		const gchar *what, GError **err)
+{
+	struct rspamd_statfile_runtime *st_runtime;
+	GList *cur;
+
+	for (cur = cl_runtime->st_runtime; cur != NULL; cur = g_list_next (cur)) {
+		st_runtime = (struct rspamd_statfile_runtime *)cur->data;
+
+		if (st_runtime->failed) {
+			if (*err == NULL) {
+				g_set_error (err, rspamd_stat_quark (), 500,
+						"cannot %s statfile %s", what, st_runtime->st->symbol);
+			}
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 /*
  * Tokenize task using the tokenizer specified
  */
@@ -270,6 +451,25 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	GArray *words;
 	gchar *sub;
 	GList *cur;
+	guint nwords = 0;
+
+	if (tok->tokens != NULL) {
+		/* Another classifier uses the same tokenizer */
+		return;
+	}
+
+	for (cur = task->text_parts; cur != NULL; cur = g_list_next (cur)) {
+		part = (struct mime_text_part *)cur->data;
+
+		if (!part->is_empty && part->words != NULL) {
+			nwords += part->words->len;
+		}
+	}
+
+	tok->tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+			nwords * RSPAMD_TOKENIZER_TOKENS_PER_WORD);
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_stat_tokens_dtor,
+			tok->tokens);
 
 	cur = task->text_parts;
 
@@ -305,25 +505,73 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 			g_array_free (words, TRUE);
 		}
 	}
+
+	/* Tokens of all parts are deduplicated at once */
+	rspamd_tokenizer_sort_tokens (tok->tokens);
 }
 
 
-gboolean
+static void
+rspamd_stat_classify_runtimes (struct stat_process_cbdata *cbdata)
+{
+	struct rspamd_task *task = cbdata->task;
+	struct rspamd_classifier_runtime *cl_run;
+	struct classifier_ctx *cl_ctx;
+	GList *cur;
+
+	if (cbdata->cl_runtimes == NULL) {
+		rspamd_stat_finish (cbdata, RSPAMD_STAT_PROCESS_ERROR);
+		return;
+	}
+
+	rspamd_stat_load_learns (cbdata->cl_runtimes);
+	cur = cbdata->cl_runtimes;
+
+	while (cur) {
+		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+
+		if (cl_run->cl) {
+			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
+
+			if (cl_ctx != NULL) {
+				cl_run->cl->classify_func (cl_ctx, cl_run->tok->tokens,
+						cl_run, task);
+			}
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	rspamd_stat_finish (cbdata, RSPAMD_STAT_PROCESS_OK);
+}
+
+/* Called when all tokens are loaded by asynchronous backends */
+static void
+rspamd_stat_classify_cb (void *ud)
+{
+	struct stat_process_cbdata *cbdata = ud;
+
+	rspamd_stat_classify_runtimes (cbdata);
+}
+
+rspamd_stat_result_t
 rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 {
 	struct rspamd_stat_classifier *cls;
 	struct rspamd_classifier_config *clcf;
 	struct rspamd_stat_ctx *st_ctx;
 	struct rspamd_tokenizer_runtime *tklist = NULL, *tok;
-	struct rspamd_classifier_runtime *cl_run;
-	struct classifier_ctx *cl_ctx;
-	GList *cl_runtimes;
+	struct stat_process_cbdata *cbdata = task->stat_checkpoint;
 	GList *cur;
-	gboolean ret = FALSE;
 
 	st_ctx = rspamd_stat_get_ctx ();
 	g_assert (st_ctx != NULL);
 
+	if (cbdata != NULL && !cbdata->learn) {
+		/* Classification has been started by the previous call */
+		return rspamd_stat_get_result (cbdata, err);
+	}
+
 	cur = g_list_first (task->cfg->classifiers);
 
 	/* Tokenization */
@@ -334,7 +582,7 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 		if (cls == NULL) {
 			g_set_error (err, rspamd_stat_quark (), 500, "type %s is not defined"
 					"for classifiers", clcf->classifier);
-			return FALSE;
+			return RSPAMD_STAT_PROCESS_ERROR;
 		}
 
 		tok = rspamd_stat_get_tokenizer_runtime (clcf->tokenizer, task->task_pool,
@@ -343,7 +591,7 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 		if (tok == NULL) {
 			g_set_error (err, rspamd_stat_quark (), 500, "type %s is not defined"
 					"for tokenizers", clcf->tokenizer);
-			return FALSE;
+			return RSPAMD_STAT_PROCESS_ERROR;
 		}
 
 		rspamd_stat_process_tokenize (st_ctx, task, tok);
@@ -351,92 +599,202 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 		cur = g_list_next (cur);
 	}
 
+	cbdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbdata));
+	cbdata->task = task;
+	/* Classify threads cannot wait for events of the task session */
+	cbdata->watch = task->s != NULL && task->classify_pool == NULL;
+	task->stat_checkpoint = cbdata;
+
 	/* Initialize classifiers and statfiles runtime */
-	if ((cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
-			FALSE, FALSE, err)) == NULL) {
-		return FALSE;
+	rspamd_stat_watch_start (cbdata, rspamd_stat_classify_cb);
+	cbdata->cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
+			FALSE, FALSE, &cbdata->err);
+
+	if (rspamd_stat_watch_stop (cbdata) == 0) {
+		rspamd_stat_classify_runtimes (cbdata);
 	}
 
-	cur = cl_runtimes;
+	return rspamd_stat_get_result (cbdata, err);
+}
 
-	while (cur) {
-		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+static gboolean
+rspamd_stat_learn_tokens (struct rspamd_classifier_runtime *cl_runtime,
+		struct rspamd_task *task, GError **err)
+{
+	GArray *tokens = cl_runtime->tok->tokens, *learned = NULL;
+	struct rspamd_statfile_runtime *st_runtime;
+	GList *cur;
+	guint pos;
+	gint nlearned;
+	gboolean ret = TRUE;
 
-		if (cl_run->cl) {
-			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
+	if (rspamd_stat_skip_classifier (cl_runtime, task, tokens) ||
+			tokens->len == 0) {
+		return TRUE;
+	}
 
-			if (cl_ctx != NULL) {
-				ret |= cl_run->cl->classify_func (cl_ctx, cl_run->tok->tokens,
-						cl_run, task);
-			}
+	if (cl_runtime->clcf->max_tokens > 0 &&
+			tokens->len > cl_runtime->clcf->max_tokens) {
+		msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
+				"%ud > %ud", task->message_id, cl_runtime->clcf->name,
+				tokens->len,
+				cl_runtime->clcf->max_tokens);
+		/* Learn only the first tokens, the array is shared with other classifiers */
+		learned = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+				cl_runtime->clcf->max_tokens);
+		g_array_append_vals (learned, tokens->data, cl_runtime->clcf->max_tokens);
+		tokens = learned;
+	}
+
+	pos = cl_runtime->start_pos;
+
+	for (cur = cl_runtime->st_runtime; cur != NULL; cur = g_list_next (cur)) {
+		st_runtime = (struct rspamd_statfile_runtime *)cur->data;
+		nlearned = rspamd_stat_backend_learn_tokens (st_runtime, tokens, pos ++);
+
+		if (nlearned == -1) {
+			g_set_error (err, rspamd_stat_quark (), 500,
+					"cannot learn statfile %s", st_runtime->st->symbol);
+			ret = FALSE;
+			break;
 		}
 
-		cur = g_list_next (cur);
+		cl_runtime->processed_tokens += nlearned;
+	}
+
+	if (learned != NULL) {
+		g_array_free (learned, TRUE);
 	}
 
 	return ret;
 }
 
-static gboolean
-rspamd_stat_learn_token (gpointer k, gpointer v, gpointer d)
+/*
+ * Learns of statfiles are increased only if their tokens have been stored
+ */
+static void
+rspamd_stat_learn_finish (struct stat_process_cbdata *cbdata)
 {
-	rspamd_token_t *t = (rspamd_token_t *)v;
-	struct preprocess_cb_data *cbdata = (struct preprocess_cb_data *)d;
-	struct rspamd_statfile_runtime *st_runtime;
-	struct rspamd_classifier_runtime *cl_runtime;
-	struct rspamd_token_result *res;
-	GList *cur, *curst;
-	gint i = 0;
-
-	cur = g_list_first (cbdata->classifier_runtimes);
+	struct rspamd_classifier_runtime *cl_run;
+	struct rspamd_statfile_runtime *st_run;
+	gboolean ret = cbdata->err == NULL;
+	GList *cur;
+	gulong nrev;
+	guint i;
 
-	while (cur) {
-		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+	for (i = 0; i < cbdata->nlearned; i ++) {
+		cl_run = cbdata->learned[i];
 
-		if (cl_runtime->clcf->min_tokens > 0 &&
-				(guint32)g_tree_nnodes (cbdata->tok->tokens) < cl_runtime->clcf->min_tokens) {
-			/* Skip this classifier */
-			msg_debug ("<%s> contains less tokens than required for %s classifier: "
-					"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
-					g_tree_nnodes (cbdata->tok->tokens),
-					cl_runtime->clcf->min_tokens);
-			cur = g_list_next (cur);
+		if (rspamd_stat_check_failed (cl_run, "learn", &cbdata->err)) {
+			/* Revisions are not increased for failed learning */
+			ret = FALSE;
 			continue;
 		}
 
-		res = &g_array_index (t->results, struct rspamd_token_result, i);
+		msg_debug ("learned %s classifier %s", cbdata->spam ? "spam" : "ham",
+				cl_run->clcf->name);
 
-		curst = res->cl_runtime->st_runtime;
+		for (cur = cl_run->st_runtime; cur != NULL; cur = g_list_next (cur)) {
+			st_run = (struct rspamd_statfile_runtime *)cur->data;
 
-		while (curst) {
-			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+			nrev = st_run->backend->inc_learns (st_run->backend_runtime,
+					st_run->backend->ctx);
 
-			if (st_runtime->backend->learn_token (t, res,
-					st_runtime->backend->ctx)) {
-				cl_runtime->processed_tokens ++;
+			msg_debug ("learned %s, new revision: %ul",
+					st_run->st->symbol, nrev);
+		}
+	}
 
-				if (cl_runtime->clcf->max_tokens > 0 &&
-						cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
-					msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
-							"%ud > %ud", cbdata->task, cl_runtime->clcf->name,
-							cl_runtime->processed_tokens,
-							cl_runtime->clcf->max_tokens);
+	rspamd_stat_finish (cbdata, ret && cbdata->nlearned > 0 ?
+			RSPAMD_STAT_PROCESS_OK : RSPAMD_STAT_PROCESS_ERROR);
+}
 
-					return TRUE;
+/* Called when tokens are stored by asynchronous backends */
+static void
+rspamd_stat_learned_cb (void *ud)
+{
+	struct stat_process_cbdata *cbdata = ud;
+
+	rspamd_stat_learn_finish (cbdata);
+
+	if (cbdata->err != NULL) {
+		msg_err ("<%s> cannot learn message: %s", cbdata->task->message_id,
+				cbdata->err->message);
+	}
+}
+
+static void
+rspamd_stat_learn_runtimes (struct stat_process_cbdata *cbdata)
+{
+	struct rspamd_task *task = cbdata->task;
+	struct rspamd_classifier_runtime *cl_run;
+	struct classifier_ctx *cl_ctx;
+	GList *cur;
+
+	if (cbdata->cl_runtimes == NULL) {
+		rspamd_stat_finish (cbdata, RSPAMD_STAT_PROCESS_ERROR);
+		return;
+	}
+
+	for (cur = cbdata->cl_runtimes; cur != NULL; cur = g_list_next (cur)) {
+		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+
+		/* Values of tokens that have not been loaded cannot be learned */
+		if (rspamd_stat_check_failed (cl_run, "load", &cbdata->err)) {
+			rspamd_stat_finish (cbdata, RSPAMD_STAT_PROCESS_ERROR);
+			return;
+		}
+	}
+
+	rspamd_stat_load_learns (cbdata->cl_runtimes);
+	cbdata->learned = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*cbdata->learned) * g_list_length (cbdata->cl_runtimes));
+	rspamd_stat_watch_start (cbdata, rspamd_stat_learned_cb);
+
+	for (cur = cbdata->cl_runtimes; cur != NULL; cur = g_list_next (cur)) {
+		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+
+		if (cl_run->cl) {
+			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
+
+			if (cl_ctx != NULL) {
+				if (!cl_run->cl->learn_spam_func (cl_ctx, cl_run->tok->tokens,
+						cl_run, task, cbdata->spam, &cbdata->err) ||
+						!rspamd_stat_learn_tokens (cl_run, task, &cbdata->err)) {
+					/* Classifiers learned before are finished anyway */
+					if (cbdata->err == NULL) {
+						g_set_error (&cbdata->err, rspamd_stat_quark (), 500,
+								"cannot learn classifier %s", cl_run->clcf->name);
+					}
+
+					break;
 				}
-			}
 
-			i ++;
-			curst = g_list_next (curst);
+				cbdata->learned[cbdata->nlearned ++] = cl_run;
+			}
 		}
-		cur = g_list_next (cur);
 	}
 
+	if (rspamd_stat_watch_stop (cbdata) == 0) {
+		rspamd_stat_learn_finish (cbdata);
+	}
+}
 
-	return FALSE;
+/* Called when tokens are loaded by asynchronous backends */
+static void
+rspamd_stat_learn_loaded_cb (void *ud)
+{
+	struct stat_process_cbdata *cbdata = ud;
+
+	rspamd_stat_learn_runtimes (cbdata);
+
+	if (cbdata->finished && cbdata->err != NULL) {
+		msg_err ("<%s> cannot learn message: %s", cbdata->task->message_id,
+				cbdata->err->message);
+	}
 }
 
-gboolean
+rspamd_stat_result_t
 rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		GError **err)
 {
@@ -444,18 +802,17 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 	struct rspamd_classifier_config *clcf;
 	struct rspamd_stat_ctx *st_ctx;
 	struct rspamd_tokenizer_runtime *tklist = NULL, *tok;
-	struct rspamd_classifier_runtime *cl_run;
-	struct rspamd_statfile_runtime *st_run;
-	struct classifier_ctx *cl_ctx;
-	struct preprocess_cb_data cbdata;
-	GList *cl_runtimes;
-	GList *cur, *curst;
-	gboolean ret = FALSE;
-	gulong nrev;
+	struct stat_process_cbdata *cbdata = task->stat_checkpoint;
+	GList *cur;
 
 	st_ctx = rspamd_stat_get_ctx ();
 	g_assert (st_ctx != NULL);
 
+	if (cbdata != NULL && cbdata->learn && cbdata->spam == spam) {
+		/* Learning has been started by the previous call */
+		return rspamd_stat_get_result (cbdata, err);
+	}
+
 	cur = g_list_first (task->cfg->classifiers);
 
 	/* Tokenization */
@@ -466,7 +823,7 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		if (cls == NULL) {
 			g_set_error (err, rspamd_stat_quark (), 500, "type %s is not defined"
 					"for classifiers", clcf->classifier);
-			return FALSE;
+			return RSPAMD_STAT_PROCESS_ERROR;
 		}
 
 		tok = rspamd_stat_get_tokenizer_runtime (clcf->tokenizer, task->task_pool,
@@ -475,7 +832,7 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		if (tok == NULL) {
 			g_set_error (err, rspamd_stat_quark (), 500, "type %s is not defined"
 					"for tokenizers", clcf->tokenizer);
-			return FALSE;
+			return RSPAMD_STAT_PROCESS_ERROR;
 		}
 
 		rspamd_stat_process_tokenize (st_ctx, task, tok);
@@ -483,58 +840,23 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		cur = g_list_next (cur);
 	}
 
-	/* Initialize classifiers and statfiles runtime */
-	if ((cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
-			TRUE, spam, err)) == NULL) {
-		return FALSE;
-	}
+	cbdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbdata));
+	cbdata->task = task;
+	cbdata->learn = TRUE;
+	cbdata->spam = spam;
+	cbdata->watch = task->s != NULL;
+	task->stat_checkpoint = cbdata;
 
-	cur = cl_runtimes;
-
-	while (cur) {
-		cl_run = (struct rspamd_classifier_runtime *)cur->data;
-
-		if (cl_run->cl) {
-			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
-
-			if (cl_ctx != NULL) {
-				if (cl_run->cl->learn_spam_func (cl_ctx, cl_run->tok->tokens,
-						cl_run, task, spam, err)) {
-					msg_debug ("learned %s classifier %s", spam ? "spam" : "ham",
-							cl_run->clcf->name);
-					ret = TRUE;
-
-					cbdata.classifier_runtimes = cur;
-					cbdata.task = task;
-					cbdata.tok = cl_run->tok;
-					g_tree_foreach (cl_run->tok->tokens, rspamd_stat_learn_token,
-							&cbdata);
-
-					curst = g_list_first (cl_run->st_runtime);
-
-					while (curst) {
-						st_run = (struct rspamd_statfile_runtime *)curst->data;
-
-						nrev = st_run->backend->inc_learns (st_run->backend_runtime,
-								st_run->backend->ctx);
-
-						msg_debug ("learned %s, new revision: %ul",
-								st_run->st->symbol, nrev);
-
-						curst = g_list_next (curst);
-					}
-				}
-				else {
-					return FALSE;
-				}
-
-			}
-		}
+	/* Initialize classifiers and statfiles runtime */
+	rspamd_stat_watch_start (cbdata, rspamd_stat_learn_loaded_cb);
+	cbdata->cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
+			TRUE, spam, &cbdata->err);
 
-		cur = g_list_next (cur);
+	if (rspamd_stat_watch_stop (cbdata) == 0) {
+		rspamd_stat_learn_runtimes (cbdata);
 	}
 
-	return ret;
+	return rspamd_stat_get_result (cbdata, err);
 }
 
 ucl_object_t *
@@ -570,7 +892,7 @@ rspamd_stat_statistics (struct rspamd_config *cfg, guint64 *total_learns)
 					continue;
 				}
 
-				backend_runtime = bk->runtime (stcf, FALSE, bk->ctx);
+				backend_runtime = bk->runtime (NULL, stcf, FALSE, bk->ctx);
 
 				learns += bk->total_learns (backend_runtime, bk->ctx);
 				elt = bk->get_stat (backend_runtime, bk->ctx);
@@ -41,22 +41,23 @@ int
 osb_tokenize_text (struct rspamd_stat_tokenizer *tokenizer,
 	rspamd_mempool_t * pool,
 	GArray * input,
-	GTree * tree,
+	GArray * tokens,
 	gboolean is_utf)
 {
-	rspamd_token_t *new = NULL;
+	rspamd_token_t new;
 	rspamd_fstring_t *token;
 	guint32 hashpipe[FEATURE_WINDOW_SIZE], h1, h2;
 	gint i, processed = 0;
 	guint w;
 
-	g_assert (tree != NULL);
+	g_assert (tokens != NULL);
 
 	if (input == NULL) {
 		return FALSE;
 	}
 
 	memset (hashpipe, 0xfe, FEATURE_WINDOW_SIZE * sizeof (hashpipe[0]));
+	new.results = NULL;
 
 	for (w = 0; w < input->len; w ++) {
 		token = &g_array_index (input, rspamd_fstring_t, w);
@@ -78,14 +79,9 @@ osb_tokenize_text (struct rspamd_stat_tokenizer *tokenizer,
 				h1 = hashpipe[0] * primes[0] + hashpipe[i] * primes[i << 1];
 				h2 = hashpipe[0] * primes[1] + hashpipe[i] *
 					primes[(i << 1) - 1];
-				new = rspamd_mempool_alloc0 (pool, sizeof (rspamd_token_t));
-				new->datalen = sizeof(gint32) * 2;
-				memcpy(new->data, &h1, sizeof(h1));
-				memcpy(new->data + sizeof(h1), &h2, sizeof(h2));
-
-				if (g_tree_lookup (tree, new) == NULL) {
-					g_tree_insert (tree, new, new);
-				}
+				/* Duplicates are removed when all text is tokenized */
+				new.data = ((guint64)h2 << 32) | h1;
+				g_array_append_val (tokens, new);
 			}
 		}
 	}
@@ -94,14 +90,8 @@ osb_tokenize_text (struct rspamd_stat_tokenizer *tokenizer,
 		for (i = 1; i < processed; i++) {
 			h1 = hashpipe[0] * primes[0] + hashpipe[i] * primes[i << 1];
 			h2 = hashpipe[0] * primes[1] + hashpipe[i] * primes[(i << 1) - 1];
-			new = rspamd_mempool_alloc0 (pool, sizeof (rspamd_token_t));
-			new->datalen = sizeof(gint32) * 2;
-			memcpy(new->data, &h1, sizeof(h1));
-			memcpy(new->data + sizeof(h1), &h2, sizeof(h2));
-
-			if (g_tree_lookup (tree, new) == NULL) {
-				g_tree_insert (tree, new, new);
-			}
+			new.data = ((guint64)h2 << 32) | h1;
+			g_array_append_val (tokens, new);
 		}
 	}
 
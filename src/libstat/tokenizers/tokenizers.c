@@ -72,16 +72,64 @@ const gchar t_delimiters[255] = {
 	0, 0, 0, 0, 0
 };
 
-int
-token_node_compare_func (gconstpointer a, gconstpointer b)
+/*
+ * LSD radix sort of tokens by 8 bits per pass, passes where all tokens have
+ * the same byte are skipped. Duplicates are removed while copying tokens
+ * back to the array
+ */
+void
+rspamd_tokenizer_sort_tokens (GArray *tokens)
 {
-	const rspamd_token_t *aa = a, *bb = b;
+	rspamd_token_t *src, *dst, *tmp, *out, *buf;
+	guint counts[sizeof (guint64)][256], offsets[256];
+	guint i, j, n, pass, off;
+
+	n = tokens->len;
+
+	if (n < 2) {
+		return;
+	}
+
+	out = (rspamd_token_t *)tokens->data;
+	memset (counts, 0, sizeof (counts));
+
+	for (i = 0; i < n; i ++) {
+		for (pass = 0; pass < sizeof (guint64); pass ++) {
+			counts[pass][(out[i].data >> (pass * 8)) & 0xff] ++;
+		}
+	}
+
+	buf = g_malloc (n * sizeof (rspamd_token_t));
+	src = out;
+	dst = buf;
 
-	if (aa->datalen != bb->datalen) {
-		return aa->datalen - bb->datalen;
+	for (pass = 0; pass < sizeof (guint64); pass ++) {
+		if (counts[pass][(src[0].data >> (pass * 8)) & 0xff] == n) {
+			continue;
+		}
+
+		for (j = 0, off = 0; j < 256; j ++) {
+			offsets[j] = off;
+			off += counts[pass][j];
+		}
+
+		for (i = 0; i < n; i ++) {
+			dst[offsets[(src[i].data >> (pass * 8)) & 0xff] ++] = src[i];
+		}
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	for (i = 0, j = 0; i < n; i ++) {
+		if (j == 0 || out[j - 1].data != src[i].data) {
+			out[j ++] = src[i];
+		}
 	}
 
-	return memcmp (aa->data, bb->data, aa->datalen);
+	g_array_set_size (tokens, j);
+	g_free (buf);
 }
 
 /* Get next word from specified f_str_t buf */
@@ -259,9 +259,9 @@ rspamd_inet_address_connect (rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
-int
-rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+static int
+rspamd_inet_address_listen_common (rspamd_inet_addr_t *addr, gint type,
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -277,6 +277,23 @@ rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
 	}
 
 	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
+
+	if (reuseport) {
+#ifdef HAVE_SO_REUSEPORT
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint)) == -1) {
+			close (fd);
+			msg_warn ("cannot set SO_REUSEPORT: %d, '%s'", errno,
+					strerror (errno));
+			return -1;
+		}
+#else
+		close (fd);
+		msg_warn ("SO_REUSEPORT is not supported");
+		return -1;
+#endif
+	}
+
 	r = bind (fd, &addr->addr.sa, addr->slen);
 	if (r == -1) {
 		if (!async || errno != EINPROGRESS) {
@@ -300,6 +317,20 @@ rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
+int
+rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
+		gboolean async)
+{
+	return rspamd_inet_address_listen_common (addr, type, async, FALSE);
+}
+
+int
+rspamd_inet_address_listen_reuseport (rspamd_inet_addr_t *addr, gint type,
+		gboolean async)
+{
+	return rspamd_inet_address_listen_common (addr, type, async, TRUE);
+}
+
 gboolean
 rspamd_parse_host_port_priority_strv (gchar **tokens,
 	rspamd_inet_addr_t **addr,
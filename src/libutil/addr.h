@@ -89,6 +89,18 @@ int rspamd_inet_address_connect (rspamd_inet_addr_t *addr, gint type,
  */
 int rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
 	gboolean async);
+
+/**
+ * Listen on a specified inet address with SO_REUSEPORT option, so several
+ * sockets can be bound to the same address
+ * @param addr
+ * @param type
+ * @param async
+ * @return
+ */
+int rspamd_inet_address_listen_reuseport (rspamd_inet_addr_t *addr, gint type,
+	gboolean async);
+
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
@@ -30,35 +30,31 @@
 #define SIZE_BIT 4
 
 /* These macroes are for 4 bits for counting element */
-#define INCBIT(a, n, acc) do {                                                              \
-		acc = \
-			a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
-			(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));     \
-		acc ++;                                                                                 \
-		acc &= 0xF;                                                                             \
-                                                                                            \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] &= (0xF << (4 - (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)));      \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] |= (acc << (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));            \
-} while (0);
-
-#define DECBIT(a, n, acc) do {                                                              \
-		acc = \
-			a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
-			(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));     \
-		acc --;                                                                                 \
-		acc &= 0xF;                                                                             \
-                                                                                            \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] &= (0xF << (4 - (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)));      \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] |= (acc << (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));            \
-} while (0);
-
-#define GETBIT(a, \
-		n) (a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
-	(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)))
+#define COUNTER_IDX(n) ((n) * SIZE_BIT / CHAR_BIT)
+#define COUNTER_SHIFT(n) ((n) % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)
+
+#define GETBIT(a, n) \
+	(((guchar)(a)[COUNTER_IDX (n)] >> COUNTER_SHIFT (n)) & 0xF)
+
+#define SETBIT(a, n, v) do {                                                \
+		(a)[COUNTER_IDX (n)] &= ~(0xF << COUNTER_SHIFT (n));                \
+		(a)[COUNTER_IDX (n)] |= ((v) & 0xF) << COUNTER_SHIFT (n);           \
+} while (0)
+
+/* Saturated counters are never changed as their real value is unknown */
+#define INCBIT(a, n, acc) do {                                              \
+		acc = GETBIT (a, n);                                                \
+		if (acc < 0xF) {                                                    \
+			SETBIT (a, n, acc + 1);                                         \
+		}                                                                   \
+} while (0)
+
+#define DECBIT(a, n, acc) do {                                              \
+		acc = GETBIT (a, n);                                                \
+		if (acc > 0 && acc < 0xF) {                                         \
+			SETBIT (a, n, acc - 1);                                         \
+		}                                                                   \
+} while (0)
 
 /* Common hash functions */
 
@@ -105,18 +101,18 @@ rspamd_bloom_destroy (rspamd_bloom_filter_t * bloom)
 }
 
 gboolean
-rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_add_buf (rspamd_bloom_filter_t * bloom, const void *data,
+	gsize len)
 {
-	size_t n, len;
+	size_t n;
 	u_char t;
 	guint v;
 
-	if (s == NULL) {
+	if (data == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = XXH32 (s, len, bloom->seeds[n]) % bloom->asize;
+		v = XXH32 (data, len, bloom->seeds[n]) % bloom->asize;
 		INCBIT (bloom->a, v, t);
 	}
 
@@ -124,37 +120,36 @@ rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
 }
 
 gboolean
-rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_del_buf (rspamd_bloom_filter_t * bloom, const void *data,
+	gsize len)
 {
-	size_t n, len;
+	size_t n;
 	u_char t;
 	guint v;
 
-	if (s == NULL) {
+	if (data == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = XXH32 (s, len, bloom->seeds[n]) % bloom->asize;
+		v = XXH32 (data, len, bloom->seeds[n]) % bloom->asize;
 		DECBIT (bloom->a, v, t);
 	}
 
 	return TRUE;
-
 }
 
 gboolean
-rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_check_buf (rspamd_bloom_filter_t * bloom, const void *data,
+	gsize len)
 {
-	size_t n, len;
+	size_t n;
 	guint v;
 
-	if (s == NULL) {
+	if (data == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = XXH32 (s, len, bloom->seeds[n]) % bloom->asize;
+		v = XXH32 (data, len, bloom->seeds[n]) % bloom->asize;
 		if (!(GETBIT (bloom->a, v))) {
 			return FALSE;
 		}
@@ -162,3 +157,33 @@ rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
 
 	return TRUE;
 }
+
+gboolean
+rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_add_buf (bloom, s, strlen (s));
+}
+
+gboolean
+rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_del_buf (bloom, s, strlen (s));
+}
+
+gboolean
+rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_check_buf (bloom, s, strlen (s));
+}
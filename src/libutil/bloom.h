@@ -45,4 +45,22 @@ gboolean rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s);
  */
 gboolean rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s);
 
+/*
+ * Add binary data of the specified length to bloom filter
+ */
+gboolean rspamd_bloom_add_buf (rspamd_bloom_filter_t * bloom, const void *data,
+	gsize len);
+
+/*
+ * Delete binary data from bloom filter
+ */
+gboolean rspamd_bloom_del_buf (rspamd_bloom_filter_t * bloom, const void *data,
+	gsize len);
+
+/*
+ * Check whether binary data is in bloom filter
+ */
+gboolean rspamd_bloom_check_buf (rspamd_bloom_filter_t * bloom,
+	const void *data, gsize len);
+
 #endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "histogram.h"
+
+static guint
+rspamd_histogram_bucket (guint64 value)
+{
+	guint msb = 0, shift;
+	guint32 v;
+
+	if (value > G_MAXUINT32) {
+		return RSPAMD_HISTOGRAM_BUCKETS - 1;
+	}
+	if (value < RSPAMD_HISTOGRAM_SUB_BUCKETS) {
+		/* Small values are stored exactly */
+		return value;
+	}
+
+	v = value;
+	while (v >>= 1) {
+		msb ++;
+	}
+
+	/* Leading bit is implied by the group, next bits select linear bucket */
+	shift = msb - RSPAMD_HISTOGRAM_SUB_BITS;
+
+	return (shift + 1) * RSPAMD_HISTOGRAM_SUB_BUCKETS +
+		   ((value >> shift) & (RSPAMD_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static guint64
+rspamd_histogram_bucket_max (guint idx)
+{
+	guint shift, sub;
+
+	if (idx < RSPAMD_HISTOGRAM_SUB_BUCKETS) {
+		return idx;
+	}
+
+	shift = idx / RSPAMD_HISTOGRAM_SUB_BUCKETS - 1;
+	sub = idx % RSPAMD_HISTOGRAM_SUB_BUCKETS;
+
+	return (((guint64)RSPAMD_HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void
+rspamd_histogram_add (struct rspamd_histogram *h, guint64 value)
+{
+	g_atomic_int_inc (&h->buckets[rspamd_histogram_bucket (value)]);
+}
+
+guint64
+rspamd_histogram_count (const struct rspamd_histogram *h)
+{
+	guint64 total = 0;
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		total += (guint)h->buckets[i];
+	}
+
+	return total;
+}
+
+guint64
+rspamd_histogram_percentile (const struct rspamd_histogram *h,
+	gdouble percentile)
+{
+	guint64 total, target, seen = 0;
+	guint i;
+
+	total = rspamd_histogram_count (h);
+
+	if (total == 0) {
+		return 0;
+	}
+
+	percentile = CLAMP (percentile, 0.0, 100.0);
+	target = (guint64)(total * percentile / 100.0 + 0.5);
+	target = MAX (target, 1);
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		seen += (guint)h->buckets[i];
+
+		if (seen >= target) {
+			return rspamd_histogram_bucket_max (i);
+		}
+	}
+
+	return rspamd_histogram_bucket_max (RSPAMD_HISTOGRAM_BUCKETS - 1);
+}
+
+void
+rspamd_histogram_reset (struct rspamd_histogram *h)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		g_atomic_int_set (&h->buckets[i], 0);
+	}
+}
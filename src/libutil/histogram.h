@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RSPAMD_HISTOGRAM_H__
+#define __RSPAMD_HISTOGRAM_H__
+
+#include "config.h"
+
+/*
+ * Log-linear histogram of integer values (e.g. microseconds): each power of
+ * two is split to 2^RSPAMD_HISTOGRAM_SUB_BITS linear buckets, so any value is
+ * stored with relative error less than 1 / 2^RSPAMD_HISTOGRAM_SUB_BITS
+ */
+#define RSPAMD_HISTOGRAM_SUB_BITS 3
+#define RSPAMD_HISTOGRAM_SUB_BUCKETS (1 << RSPAMD_HISTOGRAM_SUB_BITS)
+/* Values up to 2^32 - 1 */
+#define RSPAMD_HISTOGRAM_BUCKETS \
+	((32 - RSPAMD_HISTOGRAM_SUB_BITS + 1) * RSPAMD_HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * Histogram does not contain pointers, so it can be placed to a shared
+ * memory and updated from several processes
+ */
+struct rspamd_histogram {
+	gint buckets[RSPAMD_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Add value to histogram atomically, values larger than 2^32 - 1 are
+ * stored in the last bucket
+ */
+void rspamd_histogram_add (struct rspamd_histogram *h, guint64 value);
+
+/*
+ * Get the number of values in histogram
+ */
+guint64 rspamd_histogram_count (const struct rspamd_histogram *h);
+
+/*
+ * Get the highest value that is equivalent to the specified percentile
+ * @param h histogram
+ * @param percentile percentile from 0 to 100
+ * @return value or 0 if histogram is empty
+ */
+guint64 rspamd_histogram_percentile (const struct rspamd_histogram *h,
+	gdouble percentile);
+
+/*
+ * Remove all values from histogram
+ */
+void rspamd_histogram_reset (struct rspamd_histogram *h);
+
+#endif
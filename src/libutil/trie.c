@@ -25,6 +25,41 @@
 #include "mem_pool.h"
 #include "trie.h"
 
+/*
+ * Compiled automaton: all transitions are stored in a dense table of
+ * nstates * nclasses cells, where input bytes are mapped to equivalence classes
+ * (all bytes that are not used in patterns share class 0).
+ * Each cell contains the index of the next state shifted left by one bit, the
+ * lowest bit is set if the next state (or any state in its fail chain) is final.
+ */
+#define TRIE_STATE_HAS_OUTPUT 0x1
+#define TRIE_NO_STATE G_MAXUINT32
+
+struct rspamd_trie_compiled {
+	guint16 classes[256];
+	guint nclasses;
+	guint nstates;
+	guint32 *trans;
+	/* Pattern id for final states */
+	gint *ids;
+	/* Pattern length for final states or 0 for non-final states */
+	guint *lens;
+	/* Next final state in the fail chain or 0 if none */
+	guint32 *dict;
+};
+
+static void
+rspamd_trie_compiled_free (struct rspamd_trie_compiled *comp)
+{
+	if (comp != NULL) {
+		g_free (comp->trans);
+		g_free (comp->ids);
+		g_free (comp->lens);
+		g_free (comp->dict);
+		g_free (comp);
+	}
+}
+
 rspamd_trie_t *
 rspamd_trie_create (gboolean icase)
 {
@@ -40,6 +75,7 @@ rspamd_trie_create (gboolean icase)
 	new->root.next = NULL;
 	new->root.match = NULL;
 	new->fail_states = g_ptr_array_sized_new (8);
+	new->compiled = NULL;
 
 	return new;
 }
@@ -110,6 +146,11 @@ rspamd_trie_insert (rspamd_trie_t *trie, const gchar *pattern, gint pattern_id)
 	gchar c;
 
 	/* Insert pattern to the trie */
+	if (trie->compiled != NULL) {
+		/* Compiled automaton is no longer valid */
+		rspamd_trie_compiled_free (trie->compiled);
+		trie->compiled = NULL;
+	}
 
 	cur_node = &trie->root;
 
@@ -170,68 +211,213 @@ rspamd_trie_insert (rspamd_trie_t *trie, const gchar *pattern, gint pattern_id)
 	}
 }
 
+void
+rspamd_trie_compile (rspamd_trie_t *trie)
+{
+	struct rspamd_trie_compiled *comp;
+	struct rspamd_trie_state *st;
+	struct rspamd_trie_match *m;
+	GPtrArray *states;
+	GHashTable *indexes;
+	guint32 *fail, *row, *frow, next;
+	guint *depth;
+	guint i, j, ncl, nst, cls;
+	guchar c;
+
+	if (trie->compiled != NULL) {
+		return;
+	}
+
+	comp = g_malloc0 (sizeof (*comp));
+	states = g_ptr_array_new ();
+	indexes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	/* Enumerate states in BFS order and assign classes to input characters */
+	g_ptr_array_add (states, &trie->root);
+	g_hash_table_insert (indexes, &trie->root, GUINT_TO_POINTER (0));
+	ncl = 1;
+
+	for (i = 0; i < states->len; i++) {
+		st = g_ptr_array_index (states, i);
+
+		for (m = st->match; m != NULL; m = m->next) {
+			c = m->c;
+
+			if (comp->classes[c] == 0) {
+				comp->classes[c] = ncl++;
+			}
+
+			g_hash_table_insert (indexes, m->state,
+				GUINT_TO_POINTER (states->len));
+			g_ptr_array_add (states, m->state);
+		}
+	}
+
+	if (trie->icase) {
+		/* Patterns are lowercased, so map uppercase letters to the same classes */
+		for (i = 'A'; i <= 'Z'; i++) {
+			comp->classes[i] = comp->classes[(guchar)g_ascii_tolower (i)];
+		}
+	}
+
+	nst = states->len;
+	comp->nclasses = ncl;
+	comp->nstates = nst;
+	comp->trans = g_malloc (sizeof (guint32) * nst * ncl);
+	comp->ids = g_malloc (sizeof (gint) * nst);
+	comp->lens = g_malloc0 (sizeof (guint) * nst);
+	comp->dict = g_malloc0 (sizeof (guint32) * nst);
+	fail = g_malloc0 (sizeof (guint32) * nst);
+	depth = g_malloc0 (sizeof (guint) * nst);
+
+	memset (comp->trans, 0xff, sizeof (guint32) * nst * ncl);
+
+	/* Fill goto function */
+	for (i = 0; i < nst; i++) {
+		st = g_ptr_array_index (states, i);
+		row = &comp->trans[i * ncl];
+		comp->ids[i] = -1;
+
+		for (m = st->match; m != NULL; m = m->next) {
+			next = GPOINTER_TO_UINT (g_hash_table_lookup (indexes, m->state));
+			row[comp->classes[(guchar)m->c]] = next;
+			depth[next] = depth[i] + 1;
+		}
+
+		/* Final state is the state where some pattern ends exactly */
+		if (i != 0 && st->final == depth[i]) {
+			comp->ids[i] = st->id;
+			comp->lens[i] = depth[i];
+		}
+	}
+
+	/*
+	 * Build fail links and complete transitions table, states are processed
+	 * in BFS order, so fail state of each state is always processed before it
+	 */
+	for (i = 0; i < nst; i++) {
+		row = &comp->trans[i * ncl];
+		frow = &comp->trans[fail[i] * ncl];
+
+		for (cls = 0; cls < ncl; cls++) {
+			next = row[cls];
+
+			if (next != TRIE_NO_STATE) {
+				fail[next] = (i == 0) ? 0 : frow[cls];
+				comp->dict[next] = comp->lens[fail[next]] != 0 ?
+					fail[next] : comp->dict[fail[next]];
+			}
+			else {
+				row[cls] = (i == 0) ? 0 : frow[cls];
+			}
+		}
+	}
+
+	/* Encode output flags into transitions */
+	for (j = 0; j < nst * ncl; j++) {
+		next = comp->trans[j];
+		comp->trans[j] = next << 1;
+
+		if (comp->lens[next] != 0 || comp->dict[next] != 0) {
+			comp->trans[j] |= TRIE_STATE_HAS_OUTPUT;
+		}
+	}
+
+	g_free (fail);
+	g_free (depth);
+	g_hash_table_unref (indexes);
+	g_ptr_array_free (states, TRUE);
+
+	trie->compiled = comp;
+}
+
 const gchar *
 rspamd_trie_lookup (rspamd_trie_t *trie,
 	const gchar *buffer,
 	gsize buflen,
 	gint *matched_id)
 {
-	const guchar *p = buffer, *prev, *ret;
-	struct rspamd_trie_state *cur_node;
-	struct rspamd_trie_match *m = NULL;
-	gchar c;
+	const guchar *p = (const guchar *)buffer, *end = p + buflen;
+	struct rspamd_trie_compiled *comp;
+	guint32 st = 0, tr;
 
+	if (trie->compiled == NULL) {
+		rspamd_trie_compile (trie);
+	}
 
-	cur_node = &trie->root;
-	prev = p;
-	ret = p;
+	comp = trie->compiled;
 
-	while (buflen) {
-		c = trie->icase ? g_ascii_tolower (*p) : *p;
+	while (p < end) {
+		tr = comp->trans[st * comp->nclasses + comp->classes[*p]];
+		st = tr >> 1;
+		p++;
 
-		/* Match pattern or use fail-path to restore state */
-		while (cur_node != NULL && (m = check_match (cur_node, c)) == NULL) {
-			cur_node = cur_node->fail;
-		}
+		if (tr & TRIE_STATE_HAS_OUTPUT) {
+			/* The complete pattern found */
+			if (comp->lens[st] == 0) {
+				st = comp->dict[st];
+			}
 
-		/* Shift left in the text */
-		if (cur_node == &trie->root) {
-			/* 1 character pattern found */
-			ret = prev;
-		}
-		else if (cur_node == NULL) {
-			/* We have tried the pattern but eventually it was not found */
-			cur_node = &trie->root;
-			ret = p;
-			p++;
-			prev = p;
-			buflen--;
-			continue;
+			if (matched_id != NULL) {
+				*matched_id = comp->ids[st];
+			}
+
+			return (const gchar *)(p - comp->lens[st]);
 		}
+	}
 
-		if (m != NULL) {
-			/* Match found */
-			cur_node = m->state;
+	return NULL;
+}
+
+guint
+rspamd_trie_lookup_multiple (rspamd_trie_t *trie,
+	const gchar *buffer,
+	gsize buflen,
+	rspamd_trie_match_cb cb,
+	gpointer ud)
+{
+	const guchar *p = (const guchar *)buffer, *end = p + buflen;
+	struct rspamd_trie_compiled *comp;
+	guint32 st = 0, tr, out;
+	guint nmatches = 0;
+
+	if (trie->compiled == NULL) {
+		rspamd_trie_compile (trie);
+	}
 
-			if (cur_node->final) {
-				/* The complete pattern found */
-				if (matched_id != NULL) {
-					*matched_id = cur_node->id;
+	comp = trie->compiled;
+
+	while (p < end) {
+		tr = comp->trans[st * comp->nclasses + comp->classes[*p]];
+		st = tr >> 1;
+		p++;
+
+		if (tr & TRIE_STATE_HAS_OUTPUT) {
+			out = comp->lens[st] != 0 ? st : comp->dict[st];
+
+			/* Report all patterns that end at this position */
+			while (out != 0) {
+				nmatches++;
+
+				if (cb != NULL && cb (comp->ids[out],
+					(const gchar *)(p - comp->lens[out]),
+					(const gchar *)p,
+					ud)) {
+					return nmatches;
 				}
-				return (const gchar *) ret;
+
+				out = comp->dict[out];
 			}
 		}
-		p++;
-		prev = p;
-		buflen--;
 	}
 
-	return NULL;
+	return nmatches;
 }
 
 void
 rspamd_trie_free (rspamd_trie_t *trie)
 {
+	rspamd_trie_compiled_free (trie->compiled);
 	g_ptr_array_free (trie->fail_states, TRUE);
 	rspamd_mempool_delete (trie->pool);
 	g_free (trie);
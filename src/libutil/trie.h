@@ -33,6 +33,7 @@
  */
 
 struct rspamd_trie_match;
+struct rspamd_trie_compiled;
 
 struct rspamd_trie_state {
 	struct rspamd_trie_state *next;
@@ -53,8 +54,22 @@ typedef struct rspamd_trie_s {
 	GPtrArray *fail_states;
 	gboolean icase;
 	rspamd_mempool_t *pool;
+	struct rspamd_trie_compiled *compiled;
 } rspamd_trie_t;
 
+/*
+ * Callback for multiple matches search
+ * @param id id of the pattern found
+ * @param begin start of the matched pattern in text
+ * @param end end of the matched pattern in text (the next character after match)
+ * @param ud opaque user data
+ * @return TRUE to stop the search, FALSE to continue
+ */
+typedef gboolean (*rspamd_trie_match_cb) (gint id,
+	const gchar *begin,
+	const gchar *end,
+	gpointer ud);
+
 /*
  * Create a new suffix trie
  */
@@ -70,6 +85,15 @@ void rspamd_trie_insert (rspamd_trie_t *trie,
 	const gchar *pattern,
 	gint pattern_id);
 
+/*
+ * Freeze trie converting it to the dense transitions table. Trie is compiled
+ * automatically on the first lookup, however, it is better to compile it
+ * explicitly when all patterns are inserted. Inserting of a new pattern
+ * invalidates the compiled automaton.
+ * @param trie suffix trie
+ */
+void rspamd_trie_compile (rspamd_trie_t *trie);
+
 /*
  * Search for a text using suffix trie
  * @param trie suffix trie
@@ -83,6 +107,21 @@ const gchar * rspamd_trie_lookup (rspamd_trie_t *trie,
 	gsize buflen,
 	gint *matched_id);
 
+/*
+ * Search for all patterns occurrences in a text (including overlapping ones)
+ * @param trie suffix trie
+ * @param buffer a text where to search for trie patterns
+ * @param buflen a length of text
+ * @param cb callback to be called for each match
+ * @param ud opaque data for callback
+ * @return number of matches found
+ */
+guint rspamd_trie_lookup_multiple (rspamd_trie_t *trie,
+	const gchar *buffer,
+	gsize buflen,
+	rspamd_trie_match_cb cb,
+	gpointer ud);
+
 /*
  * Deallocate suffix trie
  */
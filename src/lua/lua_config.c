@@ -205,6 +205,14 @@ LUA_FUNCTION_DEF (config, register_virtual_symbol);
  */
 LUA_FUNCTION_DEF (config, register_callback_symbol);
 LUA_FUNCTION_DEF (config, register_callback_symbol_priority);
+/***
+ * @method rspamd_config:register_dependency(name, dependency)
+ * Make symbol `name` dependent on symbol `dependency`: dependency is always checked before the
+ * symbol and, if dependency is asynchronous, the symbol is checked when its results are ready.
+ * @param {string} name dependent symbol's name
+ * @param {string} dependency name of dependency
+ */
+LUA_FUNCTION_DEF (config, register_dependency);
 /***
  * @method rspamd_config:register_pre_filter(callback)
  * Register function to be called prior to symbols processing.
@@ -289,6 +297,7 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, register_virtual_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol_priority),
+	LUA_INTERFACE_DEF (config, register_dependency),
 	LUA_INTERFACE_DEF (config, register_module_option),
 	LUA_INTERFACE_DEF (config, register_pre_filter),
 	LUA_INTERFACE_DEF (config, register_post_filter),
@@ -1026,6 +1035,23 @@ lua_config_register_virtual_symbol (lua_State * L)
 	return 0;
 }
 
+static gint
+lua_config_register_dependency (lua_State * L)
+{
+	struct rspamd_config *cfg = lua_check_config (L);
+	const gchar *name, *dep;
+
+	if (cfg) {
+		name = luaL_checkstring (L, 2);
+		dep = luaL_checkstring (L, 3);
+		if (name && dep) {
+			register_symbol_dependency (cfg->cache, name, dep);
+		}
+	}
+
+	return 0;
+}
+
 static gint
 lua_config_register_callback_symbol (lua_State * L)
 {
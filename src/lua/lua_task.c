@@ -405,7 +405,8 @@ LUA_FUNCTION_DEF (task, get_metric_action);
  * `bayes` classifier.
  * @param {boolean} is_spam learn spam or ham
  * @param {string} classifier classifier's name
- * @return {boolean} `true` if classifier has been learnt successfully
+ * @return {boolean} `true` if classifier has been learnt successfully or if
+ * statfiles are learnt asynchronously, failures of such learning are logged
  */
 LUA_FUNCTION_DEF (task, learn);
 /***
@@ -1868,7 +1869,8 @@ lua_task_learn (lua_State *L)
 		ret = 2;
 	}
 	else {
-		if (!rspamd_learn_task_spam (cl, task, is_spam, &err)) {
+		if (rspamd_learn_task_spam (cl, task, is_spam, &err) ==
+				RSPAMD_STAT_PROCESS_ERROR) {
 			lua_pushboolean (L, FALSE);
 			if (err != NULL) {
 				lua_pushstring (L, err->message);
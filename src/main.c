@@ -98,6 +98,11 @@ static GArray *other_workers = NULL;
 /* List of active listen sockets indexed by worker type */
 static GHashTable *listen_sockets = NULL;
 
+#ifdef HAVE_SO_REUSEPORT
+/* Per process listen sockets of datagram workers indexed by bind addresses */
+static GHashTable *reuseport_sockets = NULL;
+#endif
+
 struct rspamd_main *rspamd_main;
 
 /* Commandline options */
@@ -578,7 +583,8 @@ af_cmp_workaround (const void *a, const void *b)
 }
 
 static GList *
-create_listen_socket (rspamd_inet_addr_t *addrs, guint cnt, gint listen_type)
+create_listen_socket (rspamd_inet_addr_t *addrs, guint cnt, gint listen_type,
+		gboolean reuseport)
 {
 	GList *result = NULL;
 	gint fd;
@@ -587,7 +593,13 @@ create_listen_socket (rspamd_inet_addr_t *addrs, guint cnt, gint listen_type)
 	/* Fuck morons that have invented ipv6/v4 sockets */
 	qsort (addrs, cnt, sizeof (*addrs), af_cmp_workaround);
 	for (i = 0; i < cnt; i ++) {
-		fd = rspamd_inet_address_listen (&addrs[i], listen_type, TRUE);
+		if (reuseport) {
+			fd = rspamd_inet_address_listen_reuseport (&addrs[i], listen_type,
+					TRUE);
+		}
+		else {
+			fd = rspamd_inet_address_listen (&addrs[i], listen_type, TRUE);
+		}
 		if (fd != -1) {
 			result = g_list_prepend (result, GINT_TO_POINTER (fd));
 		}
@@ -674,6 +686,112 @@ make_listen_key (struct rspamd_worker_bind_conf *cf)
 	return XXH32_digest (xxh);
 }
 
+#ifdef HAVE_SO_REUSEPORT
+/*
+ * Datagram workers with several processes get a separate SO_REUSEPORT socket
+ * per process, so the kernel balances packets between processes instead of
+ * waking all of them on each packet
+ */
+static gboolean
+worker_use_reuseport (struct rspamd_worker_conf *cf)
+{
+	struct rspamd_worker_bind_conf *bcf;
+
+	if (!cf->worker->has_socket || cf->worker->listen_type != SOCK_DGRAM ||
+			cf->worker->unique || cf->worker->threaded || cf->count <= 1) {
+		return FALSE;
+	}
+
+	LL_FOREACH (cf->bind_conf, bcf) {
+		if (bcf->is_systemd) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static GPtrArray *
+reuseport_get_array (struct rspamd_worker_conf *cf)
+{
+	struct rspamd_worker_bind_conf *bcf;
+	GPtrArray *socks;
+	guintptr key = 0;
+
+	LL_FOREACH (cf->bind_conf, bcf) {
+		key = key * 31 + make_listen_key (bcf);
+	}
+
+	if ((socks = g_hash_table_lookup (reuseport_sockets,
+			(gpointer)key)) == NULL) {
+		socks = g_ptr_array_new ();
+		g_hash_table_insert (reuseport_sockets, (gpointer)key, socks);
+	}
+
+	return socks;
+}
+
+/*
+ * Get listen sockets of the process number num, sockets are kept between
+ * reloads as other processes are bound to the same addresses
+ */
+static GList *
+reuseport_get_sockets (struct rspamd_worker_conf *cf, gint num)
+{
+	GPtrArray *socks;
+	GList *ls, *res;
+	struct rspamd_worker_bind_conf *bcf;
+
+	socks = reuseport_get_array (cf);
+
+	while (socks->len <= (guint)num) {
+		res = NULL;
+
+		LL_FOREACH (cf->bind_conf, bcf) {
+			ls = create_listen_socket (bcf->addrs, bcf->cnt,
+					cf->worker->listen_type, TRUE);
+
+			if (ls == NULL) {
+				msg_err ("cannot listen on socket %s: %s",
+					bcf->name,
+					strerror (errno));
+				exit (-errno);
+			}
+
+			res = g_list_concat (res, ls);
+		}
+
+		g_ptr_array_add (socks, res);
+	}
+
+	return g_ptr_array_index (socks, num);
+}
+
+/*
+ * Close sockets of processes that are not spawned anymore, otherwise
+ * the kernel would still send some packets to them
+ */
+static void
+reuseport_close_sockets (struct rspamd_worker_conf *cf)
+{
+	GPtrArray *socks;
+	GList *ls, *cur;
+
+	socks = reuseport_get_array (cf);
+
+	while (socks->len > (guint)cf->count) {
+		ls = g_ptr_array_index (socks, socks->len - 1);
+
+		for (cur = ls; cur != NULL; cur = g_list_next (cur)) {
+			close (GPOINTER_TO_INT (cur->data));
+		}
+
+		g_list_free (ls);
+		g_ptr_array_remove_index (socks, socks->len - 1);
+	}
+}
+#endif
+
 static void
 spawn_workers (struct rspamd_main *rspamd)
 {
@@ -683,6 +801,10 @@ spawn_workers (struct rspamd_main *rspamd)
 	gpointer p;
 	guintptr key;
 	struct rspamd_worker_bind_conf *bcf;
+	gboolean reuseport = FALSE;
+#ifdef HAVE_SO_REUSEPORT
+	struct rspamd_worker_conf wcf;
+#endif
 
 	cur = rspamd->cfg->workers;
 
@@ -693,7 +815,10 @@ spawn_workers (struct rspamd_main *rspamd)
 			msg_err ("type of worker is unspecified, skip spawning");
 		}
 		else {
-			if (cf->worker->has_socket) {
+#ifdef HAVE_SO_REUSEPORT
+			reuseport = worker_use_reuseport (cf);
+#endif
+			if (cf->worker->has_socket && !reuseport) {
 				LL_FOREACH (cf->bind_conf, bcf) {
 					key = make_listen_key (bcf);
 					if ((p =
@@ -702,7 +827,7 @@ spawn_workers (struct rspamd_main *rspamd)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, FALSE);
 						}
 						else {
 							ls = systemd_get_socket (bcf->cnt);
@@ -738,8 +863,22 @@ spawn_workers (struct rspamd_main *rspamd)
 			}
 			else {
 				for (i = 0; i < cf->count; i++) {
+#ifdef HAVE_SO_REUSEPORT
+					if (reuseport) {
+						/* Configuration is copied by fork_worker */
+						memcpy (&wcf, cf, sizeof (wcf));
+						wcf.listen_socks = reuseport_get_sockets (cf, i);
+						fork_worker (rspamd, &wcf);
+						continue;
+					}
+#endif
 					fork_worker (rspamd, cf);
 				}
+#ifdef HAVE_SO_REUSEPORT
+				if (reuseport) {
+					reuseport_close_sockets (cf);
+				}
+#endif
 			}
 		}
 
@@ -864,9 +1003,9 @@ init_cfg_cache (struct rspamd_config *cfg)
 static void
 print_symbols_cache (struct rspamd_config *cfg)
 {
-	GList *cur;
 	struct cache_item *item;
-	gint i;
+	struct cache_order *order;
+	guint i;
 
 	if (!init_symbols_cache (cfg->cfg_pool, cfg->cache, cfg,
 		cfg->cache_filename, TRUE)) {
@@ -878,26 +1017,9 @@ print_symbols_cache (struct rspamd_config *cfg)
 			"-----------------------------------------------------------------\n");
 		printf (
 			"| Pri  | Symbol                | Weight | Frequency | Avg. time |\n");
-		i = 0;
-		cur = cfg->cache->negative_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				printf (
-						"-----------------------------------------------------------------\n");
-				printf ("| %3d | %22s | %6.1f | %9d | %9.3f |\n",
-					i,
-					item->s->symbol,
-					item->s->weight,
-					item->s->frequency,
-					item->s->avg_time);
-			}
-			cur = g_list_next (cur);
-			i++;
-		}
-		cur = cfg->cache->static_items;
-		while (cur) {
-			item = cur->data;
+		order = cfg->cache->order;
+		for (i = 0; order != NULL && i < order->nids; i ++) {
+			item = g_ptr_array_index (cfg->cache->items, order->ids[i]);
 			if (!item->is_callback) {
 				printf (
 						"-----------------------------------------------------------------\n");
@@ -908,8 +1030,6 @@ print_symbols_cache (struct rspamd_config *cfg)
 					item->s->frequency,
 					item->s->avg_time);
 			}
-			cur = g_list_next (cur);
-			i++;
 		}
 
 		printf (
@@ -1242,6 +1362,9 @@ main (gint argc, gchar **argv, gchar **env)
 
 	/* Init listen sockets hash */
 	listen_sockets = g_hash_table_new (g_direct_hash, g_direct_equal);
+#ifdef HAVE_SO_REUSEPORT
+	reuseport_sockets = g_hash_table_new (g_direct_hash, g_direct_equal);
+#endif
 
 	/* If we want to test lua skip everything except it */
 	if (lua_tests != NULL && lua_tests[0] != NULL) {
@@ -94,6 +94,8 @@ struct rspamd_stat {
 	guint messages_learned;                             /**< messages learned								*/
 	guint fuzzy_hashes;                                 /**< number of fuzzy hashes stored					*/
 	guint fuzzy_hashes_expired;                         /**< number of fuzzy hashes expired					*/
+	guint fuzzy_cache_hits;                             /**< fuzzy checks answered from client cache		*/
+	guint fuzzy_cache_misses;                           /**< fuzzy checks not found in client cache			*/
 };
 
 /**
@@ -207,6 +207,7 @@ dkim_module_config (struct rspamd_config *cfg)
 			1,
 			dkim_symbol_callback,
 			NULL);
+		set_symbol_async (cfg->cache, dkim_module_ctx->symbol_reject);
 		register_virtual_symbol (&cfg->cache,
 			dkim_module_ctx->symbol_tempfail,
 			1);
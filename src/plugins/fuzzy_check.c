@@ -50,6 +50,7 @@
 #include "blake2.h"
 #include "ottery.h"
 #include "libstemmer.h"
+#include "xxhash.h"
 
 #define DEFAULT_SYMBOL "R_FUZZY_HASH"
 #define DEFAULT_UPSTREAM_ERROR_TIME 10
@@ -57,8 +58,14 @@
 #define DEFAULT_UPSTREAM_MAXERRORS 10
 
 #define DEFAULT_IO_TIMEOUT 500
+#define DEFAULT_RETRANSMITS 1
+#define DEFAULT_CACHE_TTL 60
 #define DEFAULT_PORT 11335
 
+#ifdef HAVE_SENDMMSG
+#define FUZZY_CLIENT_BATCH 64
+#endif
+
 struct fuzzy_mapping {
 	guint64 fuzzy_flag;
 	const gchar *symbol;
@@ -81,6 +88,7 @@ struct fuzzy_rule {
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	rspamd_lru_hash_t *cache;
 };
 
 struct fuzzy_ctx {
@@ -95,17 +103,33 @@ struct fuzzy_ctx {
 	guint32 min_height;
 	guint32 min_width;
 	guint32 io_timeout;
+	guint32 retransmits;
+	guint32 cache_size;
+	guint32 cache_ttl;
+	GHashTable *conns;
+};
+
+/*
+ * Persistent socket to a fuzzy storage shared by all tasks of a worker,
+ * replies are matched to requests by tags
+ */
+struct fuzzy_client_conn {
+	struct upstream *server;
+	struct event ev;
+	GHashTable *requests;
+	GQueue *out;
+	gboolean want_write;
+	gint fd;
 };
 
 struct fuzzy_client_session {
-	gint state;
 	GPtrArray *commands;
 	struct event ev;
 	struct timeval tv;
 	struct rspamd_task *task;
-	struct upstream *server;
+	struct fuzzy_client_conn *conn;
 	struct fuzzy_rule *rule;
-	gint fd;
+	guint retransmits;
 };
 
 struct fuzzy_learn_session {
@@ -280,6 +304,18 @@ fuzzy_to_string (rspamd_fuzzy_t *h)
 	return strbuf;
 }
 
+static guint
+fuzzy_digest_hash (gconstpointer key)
+{
+	return XXH32 (key, sizeof (((struct rspamd_fuzzy_cmd *)NULL)->digest), 0);
+}
+
+static gboolean
+fuzzy_digest_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, sizeof (((struct rspamd_fuzzy_cmd *)NULL)->digest)) == 0;
+}
+
 static struct fuzzy_rule *
 fuzzy_rule_new (const char *default_symbol, rspamd_mempool_t *pool)
 {
@@ -294,6 +330,16 @@ fuzzy_rule_new (const char *default_symbol, rspamd_mempool_t *pool)
 		rule->mappings);
 	rule->read_only = FALSE;
 
+	if (fuzzy_module_ctx->cache_size > 0) {
+		/* Replies are cached by digest separately for each rule */
+		rule->cache = rspamd_lru_hash_new_full (fuzzy_module_ctx->cache_size,
+				fuzzy_module_ctx->cache_ttl, g_free, g_free,
+				fuzzy_digest_hash, fuzzy_digest_equal);
+		rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)rspamd_lru_hash_destroy,
+			rule->cache);
+	}
+
 	return rule;
 }
 
@@ -421,12 +467,27 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	return 0;
 }
 
+static void
+fuzzy_client_conn_free (gpointer p)
+{
+	struct fuzzy_client_conn *conn = p;
+
+	event_del (&conn->ev);
+	close (conn->fd);
+	g_hash_table_unref (conn->requests);
+	g_queue_free (conn->out);
+	g_slice_free1 (sizeof (*conn), conn);
+}
+
 gint
 fuzzy_check_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value, *cur;
 	gint res = TRUE;
 
+	fuzzy_module_ctx->conns = g_hash_table_new_full (g_direct_hash,
+			g_direct_equal, NULL, fuzzy_client_conn_free);
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check", "symbol")) != NULL) {
 		fuzzy_module_ctx->default_symbol = ucl_obj_tostring (value);
@@ -475,6 +536,33 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 		fuzzy_module_ctx->io_timeout = DEFAULT_IO_TIMEOUT;
 	}
 
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"retransmits")) != NULL) {
+		fuzzy_module_ctx->retransmits = ucl_obj_toint (value);
+	}
+	else {
+		fuzzy_module_ctx->retransmits = DEFAULT_RETRANSMITS;
+	}
+
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"cache_size")) != NULL) {
+		fuzzy_module_ctx->cache_size = ucl_obj_toint (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_size = 0;
+	}
+
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"cache_ttl")) != NULL) {
+		fuzzy_module_ctx->cache_ttl = ucl_obj_todouble (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_ttl = DEFAULT_CACHE_TTL;
+	}
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check",
 		"whitelist")) != NULL) {
@@ -500,6 +588,7 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 	if (fuzzy_module_ctx->fuzzy_rules != NULL) {
 		register_callback_symbol (&cfg->cache, fuzzy_module_ctx->default_symbol,
 			1.0, fuzzy_symbol_callback, NULL);
+		set_symbol_async (cfg->cache, fuzzy_module_ctx->default_symbol);
 	}
 	else {
 		msg_warn ("fuzzy module is enabled but no rules are defined");
@@ -513,6 +602,10 @@ fuzzy_check_module_reconfig (struct rspamd_config *cfg)
 {
 	rspamd_mempool_delete (fuzzy_module_ctx->fuzzy_pool);
 
+	if (fuzzy_module_ctx->conns != NULL) {
+		g_hash_table_destroy (fuzzy_module_ctx->conns);
+	}
+
 	memset (fuzzy_module_ctx, 0, sizeof (*fuzzy_module_ctx));
 	fuzzy_module_ctx->fuzzy_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
@@ -526,12 +619,20 @@ static void
 fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
+	struct rspamd_fuzzy_cmd *cmd;
+	guint i;
 
 	if (session->commands) {
+		/* Forget requests that have not been replied */
+		for (i = 0; i < session->commands->len; i ++) {
+			cmd = g_ptr_array_index (session->commands, i);
+			g_hash_table_remove (session->conn->requests,
+					GUINT_TO_POINTER (cmd->tag));
+			g_queue_remove (session->conn->out, cmd);
+		}
 		g_ptr_array_free (session->commands, TRUE);
 	}
 	event_del (&session->ev);
-	close (session->fd);
 }
 
 static void
@@ -773,104 +874,348 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
 	return NULL;
 }
 
-/* Call this whenever we got data from fuzzy storage */
 static void
-fuzzy_io_callback (gint fd, short what, void *arg)
+fuzzy_insert_result (struct rspamd_task *task, struct fuzzy_rule *rule,
+		const struct rspamd_fuzzy_reply *rep)
 {
-	struct fuzzy_client_session *session = arg;
-	const struct rspamd_fuzzy_reply *rep;
 	struct fuzzy_mapping *map;
-	guchar buf[2048], *p;
 	const gchar *symbol;
-	gint r;
+	gchar buf[64];
 	double nval;
-	gint ret = -1;
 
-	if (what == EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
-			ret = -1;
+	/* Get mapping by flag */
+	if ((map =
+			g_hash_table_lookup (rule->mappings,
+					GINT_TO_POINTER (rep->flag))) == NULL) {
+		/* Default symbol and default weight */
+		symbol = rule->symbol;
+
+	}
+	else {
+		/* Get symbol and weight from map */
+		symbol = map->symbol;
+	}
+
+	if (rep->prob > 0.5) {
+		nval = fuzzy_normalize (rep->value, rule->max_score);
+		nval *= rep->prob;
+		msg_info (
+				"<%s>, found fuzzy hash with weight: %.2f, in list: %s:%d%s",
+				task->message_id,
+				nval,
+				symbol,
+				rep->flag,
+				map == NULL ? "(unknown)" : "");
+		if (map != NULL || !rule->skip_unknown) {
+			rspamd_snprintf (buf,
+					sizeof (buf),
+					"%d: %.2f / %.2f",
+					rep->flag,
+					rep->prob,
+					nval);
+			rspamd_task_insert_result_single (task,
+					symbol,
+					nval,
+					g_list_prepend (NULL,
+						rspamd_mempool_strdup (
+							task->task_pool, buf)));
+		}
+	}
+}
+
+static void
+fuzzy_cache_insert (struct fuzzy_rule *rule, struct rspamd_task *task,
+		const struct rspamd_fuzzy_cmd *cmd,
+		const struct rspamd_fuzzy_reply *rep)
+{
+	struct rspamd_fuzzy_reply *cached;
+
+	if (rule->cache != NULL) {
+		cached = g_malloc (sizeof (*cached));
+		memcpy (cached, rep, sizeof (*cached));
+		rspamd_lru_hash_insert (rule->cache,
+				g_memdup (cmd->digest, sizeof (cmd->digest)), cached,
+				task->tv.tv_sec, fuzzy_module_ctx->cache_ttl);
+	}
+}
+
+/*
+ * Answer commands from cache and remove them from array
+ */
+static void
+fuzzy_cache_check (struct fuzzy_rule *rule, struct rspamd_task *task,
+		GPtrArray *commands)
+{
+	struct rspamd_fuzzy_reply *cached;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_stat *stat = NULL;
+	guint i = 0;
+
+	if (rule->cache == NULL) {
+		return;
+	}
+
+	if (task->worker != NULL) {
+		stat = task->worker->srv->stat;
+	}
+
+	while (i < commands->len) {
+		cmd = g_ptr_array_index (commands, i);
+		cached = rspamd_lru_hash_lookup (rule->cache, cmd->digest,
+				task->tv.tv_sec);
+
+		if (cached != NULL) {
+			fuzzy_insert_result (task, rule, cached);
+			g_ptr_array_remove_index_fast (commands, i);
+
+			if (stat != NULL) {
+				stat->fuzzy_cache_hits ++;
+			}
 		}
 		else {
-			event_del (&session->ev);
-			event_set (&session->ev, fd, EV_READ | EV_PERSIST,
-					fuzzy_io_callback, session);
-			event_add (&session->ev, &session->tv);
-			session->state = 1;
-			ret = 0;
+			i ++;
+
+			if (stat != NULL) {
+				stat->fuzzy_cache_misses ++;
+			}
 		}
 	}
-	else if (session->state == 1) {
-		/* Try to read reply */
-		if ((r = read (fd, buf, sizeof (buf) - 1)) == -1) {
-			ret = -1;
+}
+
+static void
+fuzzy_conn_want_write (struct fuzzy_client_conn *conn, gboolean want_write);
+
+/*
+ * Send queued commands of all tasks, with sendmmsg they are sent by a single
+ * syscall. Storage expects a single command per datagram, so commands are not
+ * merged in datagrams
+ */
+static void
+fuzzy_conn_flush (struct fuzzy_client_conn *conn)
+{
+	struct rspamd_fuzzy_cmd *cmd;
+	gint r;
+#ifdef FUZZY_CLIENT_BATCH
+	struct mmsghdr msg[FUZZY_CLIENT_BATCH];
+	struct iovec iov[FUZZY_CLIENT_BATCH];
+	GList *cur;
+	gint i, n;
+#else
+	gsize len;
+#endif
+
+#ifdef FUZZY_CLIENT_BATCH
+	while (!g_queue_is_empty (conn->out)) {
+		memset (msg, 0, sizeof (msg));
+
+		for (cur = conn->out->head, n = 0;
+				cur != NULL && n < FUZZY_CLIENT_BATCH;
+				cur = g_list_next (cur), n ++) {
+			cmd = cur->data;
+			iov[n].iov_base = cmd;
+			iov[n].iov_len = cmd->shingles_count > 0 ?
+					sizeof (struct rspamd_fuzzy_shingle_cmd) :
+					sizeof (struct rspamd_fuzzy_cmd);
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
 		}
-		else {
-			p = buf;
-			while ((rep = fuzzy_process_reply (&p, &r, session->commands)) != NULL) {
-				/* Get mapping by flag */
-				if ((map =
-						g_hash_table_lookup (session->rule->mappings,
-								GINT_TO_POINTER (rep->flag))) == NULL) {
-					/* Default symbol and default weight */
-					symbol = session->rule->symbol;
 
-				}
-				else {
-					/* Get symbol and weight from map */
-					symbol = map->symbol;
-				}
+		if ((r = sendmmsg (conn->fd, msg, n, 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			/* Drop the command, it is retransmitted by timeout */
+			msg_err ("cannot send fuzzy command to %s, %d, %s",
+					rspamd_upstream_name (conn->server), errno, strerror (errno));
+			rspamd_upstream_fail (conn->server);
+			r = 1;
+		}
 
-				if (rep->prob > 0.5) {
-					nval = fuzzy_normalize (rep->value, session->rule->max_score);
-					nval *= rep->prob;
-					msg_info (
-							"<%s>, found fuzzy hash with weight: %.2f, in list: %s:%d%s",
-							session->task->message_id,
-							nval,
-							symbol,
-							rep->flag,
-							map == NULL ? "(unknown)" : "");
-					if (map != NULL || !session->rule->skip_unknown) {
-						rspamd_snprintf (buf,
-								sizeof (buf),
-								"%d: %.2f / %.2f",
-								rep->flag,
-								rep->prob,
-								nval);
-						rspamd_task_insert_result_single (session->task,
-								symbol,
-								nval,
-								g_list_prepend (NULL,
-									rspamd_mempool_strdup (
-										session->task->task_pool, buf)));
-					}
-				}
-				ret = 1;
+		for (i = 0; i < r; i ++) {
+			g_queue_pop_head (conn->out);
+		}
+
+		if (r < n) {
+			break;
+		}
+	}
+#else
+	while ((cmd = g_queue_peek_head (conn->out)) != NULL) {
+		len = cmd->shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) :
+				sizeof (struct rspamd_fuzzy_cmd);
+
+		if ((r = send (conn->fd, cmd, len, 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
 			}
+			/* Drop the command, it is retransmitted by timeout */
+			msg_err ("cannot send fuzzy command to %s, %d, %s",
+					rspamd_upstream_name (conn->server), errno, strerror (errno));
+			rspamd_upstream_fail (conn->server);
 		}
+
+		g_queue_pop_head (conn->out);
 	}
-	else {
-		errno = ETIMEDOUT;
-		ret = -1;
+#endif
+
+	fuzzy_conn_want_write (conn, !g_queue_is_empty (conn->out));
+}
+
+static void
+fuzzy_conn_read (struct fuzzy_client_conn *conn)
+{
+	struct fuzzy_client_session *session;
+	struct rspamd_fuzzy_reply rep;
+	struct rspamd_fuzzy_cmd *cmd;
+	guchar buf[2048];
+	gint r;
+	guint i;
+
+	for (;;) {
+		if ((r = recv (conn->fd, buf, sizeof (buf), 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				msg_err ("got error on IO with server %s, %d, %s",
+						rspamd_upstream_name (conn->server),
+						errno,
+						strerror (errno));
+				rspamd_upstream_fail (conn->server);
+			}
+			return;
+		}
+
+		if ((guint)r != sizeof (rep)) {
+			msg_info ("invalid reply of size %d from %s", r,
+					rspamd_upstream_name (conn->server));
+			continue;
+		}
+
+		memcpy (&rep, buf, sizeof (rep));
+		session = g_hash_table_lookup (conn->requests,
+				GUINT_TO_POINTER (rep.tag));
+
+		if (session == NULL) {
+			/* Reply for a finished task or a retransmitted command */
+			msg_debug ("unexpected tag: %ud", rep.tag);
+			continue;
+		}
+
+		for (i = 0; i < session->commands->len; i ++) {
+			cmd = g_ptr_array_index (session->commands, i);
+
+			if (cmd->tag == rep.tag) {
+				fuzzy_cache_insert (session->rule, session->task, cmd, &rep);
+				g_ptr_array_remove_index (session->commands, i);
+				g_hash_table_remove (conn->requests, GUINT_TO_POINTER (rep.tag));
+				g_queue_remove (conn->out, cmd);
+				break;
+			}
+		}
+
+		rspamd_upstream_ok (conn->server);
+		fuzzy_insert_result (session->task, session->rule, &rep);
+
+		if (session->commands->len == 0) {
+			remove_normal_event (session->task->s, fuzzy_io_fin, session);
+		}
 	}
+}
 
-	if (ret == 0) {
-		return;
+/* Call this whenever we got data from fuzzy storage */
+static void
+fuzzy_io_callback (gint fd, short what, void *arg)
+{
+	struct fuzzy_client_conn *conn = arg;
+
+	if (what & EV_WRITE) {
+		fuzzy_conn_flush (conn);
 	}
-	else if (ret == -1) {
+	if (what & EV_READ) {
+		fuzzy_conn_read (conn);
+	}
+}
+
+static void
+fuzzy_conn_want_write (struct fuzzy_client_conn *conn, gboolean want_write)
+{
+	if (conn->want_write != want_write) {
+		conn->want_write = want_write;
+		event_del (&conn->ev);
+		event_set (&conn->ev, conn->fd,
+				EV_READ | EV_PERSIST | (want_write ? EV_WRITE : 0),
+				fuzzy_io_callback, conn);
+		event_add (&conn->ev, NULL);
+	}
+}
+
+static struct fuzzy_client_conn *
+fuzzy_client_conn_get (struct upstream *server)
+{
+	struct fuzzy_client_conn *conn;
+	gint sock;
+
+	conn = g_hash_table_lookup (fuzzy_module_ctx->conns, server);
+
+	if (conn == NULL) {
+		if ((sock = rspamd_inet_address_connect (rspamd_upstream_addr (server),
+				SOCK_DGRAM, TRUE)) == -1) {
+			return NULL;
+		}
+
+		conn = g_slice_alloc0 (sizeof (*conn));
+		conn->fd = sock;
+		conn->server = server;
+		conn->requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+		conn->out = g_queue_new ();
+		event_set (&conn->ev, sock, EV_READ | EV_PERSIST, fuzzy_io_callback,
+				conn);
+		event_add (&conn->ev, NULL);
+		g_hash_table_insert (fuzzy_module_ctx->conns, server, conn);
+	}
+
+	return conn;
+}
+
+/* Retransmit commands that have not been replied or give up */
+static void
+fuzzy_io_timer (gint fd, short what, void *arg)
+{
+	struct fuzzy_client_session *session = arg;
+	struct rspamd_fuzzy_cmd *cmd;
+	guint i;
+
+	if (session->retransmits < fuzzy_module_ctx->retransmits) {
+		session->retransmits ++;
+
+		for (i = 0; i < session->commands->len; i ++) {
+			cmd = g_ptr_array_index (session->commands, i);
+
+			if (g_queue_find (session->conn->out, cmd) == NULL) {
+				g_queue_push_tail (session->conn->out, cmd);
+			}
+		}
+
+		fuzzy_conn_want_write (session->conn, TRUE);
+		evtimer_add (&session->ev, &session->tv);
+	}
+	else {
+		errno = ETIMEDOUT;
 		msg_err ("got error on IO with server %s, %d, %s",
-			rspamd_upstream_name (session->server),
+			rspamd_upstream_name (session->conn->server),
 			errno,
 			strerror (errno));
-		rspamd_upstream_fail (session->server);
+		rspamd_upstream_fail (session->conn->server);
 		remove_normal_event (session->task->s, fuzzy_io_fin, session);
 	}
-	else {
-		rspamd_upstream_ok (session->server);
-		if (session->commands->len == 0) {
-			remove_normal_event (session->task->s, fuzzy_io_fin, session);
-		}
-	}
 }
 
 static void
@@ -1128,34 +1473,59 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	GPtrArray *commands)
 {
 	struct fuzzy_client_session *session;
+	struct fuzzy_client_conn *conn;
 	struct upstream *selected;
-	gint sock;
+	struct rspamd_fuzzy_cmd *cmd;
+	guint i;
+
+	fuzzy_cache_check (rule, task, commands);
+
+	if (commands->len == 0) {
+		/* All commands are answered from cache */
+		g_ptr_array_free (commands, TRUE);
+		return;
+	}
 
 	/* Get upstream */
 	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN);
 	if (selected) {
-		if ((sock = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
-				SOCK_DGRAM, TRUE)) == -1) {
+		if ((conn = fuzzy_client_conn_get (selected)) == NULL) {
 			msg_warn ("cannot connect to %s, %d, %s",
 				rspamd_upstream_name (selected),
 				errno,
 				strerror (errno));
+			g_ptr_array_free (commands, TRUE);
 		}
 		else {
-			/* Create session for a socket */
+			/* Create session for commands */
 			session =
 				rspamd_mempool_alloc (task->task_pool,
 					sizeof (struct fuzzy_client_session));
-			event_set (&session->ev, sock, EV_WRITE, fuzzy_io_callback,
-				session);
-			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
-			session->state = 0;
 			session->commands = commands;
 			session->task = task;
-			session->fd = sock;
-			session->server = selected;
+			session->conn = conn;
 			session->rule = rule;
-			event_add (&session->ev, &session->tv);
+			session->retransmits = 0;
+
+			for (i = 0; i < commands->len; i ++) {
+				cmd = g_ptr_array_index (commands, i);
+
+				/* Tags must be unique among all requests on a socket */
+				while (g_hash_table_lookup (conn->requests,
+						GUINT_TO_POINTER (cmd->tag)) != NULL) {
+					cmd->tag = ottery_rand_uint32 ();
+				}
+
+				g_hash_table_insert (conn->requests,
+						GUINT_TO_POINTER (cmd->tag), session);
+				g_queue_push_tail (conn->out, cmd);
+			}
+
+			/* Commands of all tasks are sent on the next loop iteration */
+			fuzzy_conn_want_write (conn, TRUE);
+			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
+			evtimer_set (&session->ev, fuzzy_io_timer, session);
+			evtimer_add (&session->ev, &session->tv);
 			register_async_event (task->s,
 				fuzzy_io_fin,
 				session,
@@ -31,16 +31,80 @@
 #include "libmime/message.h"
 #include "libmime/expressions.h"
 #include "libutil/map.h"
+#include "libutil/trie.h"
 #include "lua/lua_common.h"
 #include "main.h"
 
 #define DEFAULT_STATFILE_PREFIX "./"
 
+/*
+ * Expressions are compiled to a flat program that uses a single result
+ * register: operands store their value in it, '!' inverts it and conditional
+ * jumps implement short-circuit evaluation of '&' and '|'
+ */
+/* Number of evaluations between reordering of a compiled expression */
+#define REGEXP_BC_REORDER_EVALS 1024
+/* Evaluation time is measured for one of each 16 evaluations */
+#define REGEXP_BC_TIME_SAMPLE_MASK 0xf
+/* Minimum number of samples to trust measured values of an operand */
+#define REGEXP_BC_MIN_SAMPLES 8
+
+enum regexp_bc_op {
+	REGEXP_BC_OPERAND = 0,
+	REGEXP_BC_NOT,
+	REGEXP_BC_JUMP_IF_FALSE,
+	REGEXP_BC_JUMP_IF_TRUE
+};
+
+/* Measured statistics of an expression operand */
+struct regexp_operand_stat {
+	struct expression *operand;
+	guint evals;
+	guint hits;
+	guint time_samples;
+	/* Total evaluation time of sampled evaluations in microseconds */
+	gdouble time;
+};
+
+struct regexp_bc_insn {
+	enum regexp_bc_op op;
+	guint target;
+	struct expression *operand;
+	struct regexp_operand_stat *stat;
+};
+
 struct regexp_module_item {
 	struct expression *expr;
 	const gchar *symbol;
 	guint32 avg_time;
 	struct ucl_lua_funcdata *lua_function;
+	struct regexp_bc_insn *bc;
+	guint bc_len;
+	/* Operands statistics in order of their appearance in expression */
+	struct regexp_operand_stat *stats;
+	guint nstats;
+	guint evals;
+};
+
+/*
+ * Scan set groups all regexps that are applied to the same data (e.g. the same
+ * header or all text parts), so this data is extracted just once per task and
+ * required literals of all regexps of a set are searched in a single pass
+ */
+struct regexp_scan_set {
+	/* Id of the first regexp of the set, indexes the task's re_sets */
+	guint id;
+	enum rspamd_regexp_type type;
+	const gchar *header;
+	gboolean is_strong;
+	GPtrArray *regexps;
+	/* Required literals of regexps used to skip regexps that cannot match */
+	rspamd_trie_t *literals;
+	/* Literal -> index of the last regexp with this literal */
+	GHashTable *literal_heads;
+	/* Index of the previous regexp with the same literal + 1 or 0 */
+	GPtrArray *literal_chain;
+	gboolean has_raw_literals;
 };
 
 struct regexp_ctx {
@@ -50,6 +114,10 @@ struct regexp_ctx {
 	gsize max_size;
 	gsize max_threads;
 	GThreadPool *workers;
+	/* Scan sets indexed by data type description */
+	GHashTable *scan_sets;
+	/* Regexp -> scan set mapping */
+	GHashTable *re_scan_sets;
 };
 
 /* Lua regexp module for checking rspamd regexps */
@@ -111,64 +179,61 @@ module_t regexp_module = {
 	NULL
 };
 
-/* Task cache functions */
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-static GStaticMutex task_cache_mtx = G_STATIC_MUTEX_INIT;
-#else
-G_LOCK_DEFINE (task_cache_mtx);
-#endif
+/*
+ * Task cache functions: each task has a bitset with two bits per regexp id,
+ * the lower bit is set if regexp is checked and the higher one if it matched.
+ * Bits are set atomically, so no locking is needed for threaded processing
+ */
+#define REGEXP_CACHE_CHECKED 0x1
+#define REGEXP_CACHE_MATCHED 0x2
+#define REGEXP_CACHE_SHIFT(id) (((id) % 16) * 2)
 
 void
 task_cache_add (struct rspamd_task *task,
 	struct rspamd_regexp *re,
 	gint32 result)
 {
-	if (result == 0) {
-		result = -1;
+	volatile guint *word;
+	guint old, bits;
+
+	if (re->id >= task->re_cache_size) {
+		/* Regexp has been created after the task */
+		return;
 	}
-	/* Avoid concurrenting inserting of results */
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_lock (&task_cache_mtx);
-#else
-	G_LOCK (task_cache_mtx);
-#endif
-	g_hash_table_insert (task->re_cache, re->regexp_text,
-		GINT_TO_POINTER (result));
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_unlock (&task_cache_mtx);
-#else
-	G_UNLOCK (task_cache_mtx);
-#endif
+
+	word = &task->re_cache[re->id / 16];
+	bits = REGEXP_CACHE_CHECKED;
+
+	if (result != 0) {
+		bits |= REGEXP_CACHE_MATCHED;
+	}
+
+	bits <<= REGEXP_CACHE_SHIFT (re->id);
+
+	/* Glib atomics are defined for signed integers only */
+	do {
+		old = (guint)g_atomic_int_get ((volatile gint *)word);
+	} while (!g_atomic_int_compare_and_exchange ((volatile gint *)word,
+			(gint)old, (gint)(old | bits)));
 }
 
 gint32
 task_cache_check (struct rspamd_task *task, struct rspamd_regexp *re)
 {
-	gpointer res;
-	gint32 r;
+	guint bits;
 
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_lock (&task_cache_mtx);
-#else
-	G_LOCK (task_cache_mtx);
-#endif
-	if ((res = g_hash_table_lookup (task->re_cache, re->regexp_text)) != NULL) {
-		r = GPOINTER_TO_INT (res);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-		g_static_mutex_unlock (&task_cache_mtx);
-#else
-		G_UNLOCK (task_cache_mtx);
-#endif
-		if (r == -1) {
-			return 0;
-		}
-		return 1;
+	if (re->id >= task->re_cache_size) {
+		return -1;
 	}
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_unlock (&task_cache_mtx);
-#else
-	G_UNLOCK (task_cache_mtx);
-#endif
+
+	bits = (guint)g_atomic_int_get (
+			(volatile gint *)&task->re_cache[re->id / 16]);
+	bits = (bits >> REGEXP_CACHE_SHIFT (re->id)) & 0x3;
+
+	if (bits & REGEXP_CACHE_CHECKED) {
+		return (bits & REGEXP_CACHE_MATCHED) ? 1 : 0;
+	}
+
 	return -1;
 }
 
@@ -211,6 +276,439 @@ op_less_equal (gint a, gint b)
 	return a <= b;
 }
 
+/* Add regexp to the scan set corresponding to its data type */
+static void
+regexp_scan_set_add (rspamd_mempool_t *pool, struct rspamd_regexp *re)
+{
+	struct regexp_scan_set *set;
+	gchar *key;
+	guint idx, prev;
+
+	if (regexp_module_ctx->scan_sets == NULL || re->type == REGEXP_NONE ||
+		g_hash_table_lookup (regexp_module_ctx->re_scan_sets, re) != NULL) {
+		return;
+	}
+
+	if (re->type == REGEXP_HEADER || re->type == REGEXP_RAW_HEADER) {
+		if (re->header == NULL) {
+			return;
+		}
+		key = rspamd_mempool_alloc (pool, strlen (re->header) + 16);
+		rspamd_snprintf (key, strlen (re->header) + 16, "%d:%d:%s",
+			(gint)re->type, re->is_strong, re->header);
+	}
+	else {
+		key = rspamd_mempool_alloc (pool, 16);
+		rspamd_snprintf (key, 16, "%d", (gint)re->type);
+	}
+
+	set = g_hash_table_lookup (regexp_module_ctx->scan_sets, key);
+
+	if (set == NULL) {
+		set = rspamd_mempool_alloc0 (pool, sizeof (struct regexp_scan_set));
+		set->id = re->id;
+		set->type = re->type;
+		set->header = re->header;
+		set->is_strong = re->is_strong;
+		set->regexps = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_ptr_array_unref,
+			set->regexps);
+		set->literal_chain = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_ptr_array_unref,
+			set->literal_chain);
+		g_hash_table_insert (regexp_module_ctx->scan_sets, key, set);
+	}
+
+	g_ptr_array_add (set->regexps, re);
+	g_hash_table_insert (regexp_module_ctx->re_scan_sets, re, set);
+	idx = set->regexps->len - 1;
+
+	if (re->literal != NULL && re->regexp != NULL) {
+		if (set->literals == NULL) {
+			set->literals = rspamd_trie_create (TRUE);
+			set->literal_heads = g_hash_table_new (rspamd_strcase_hash,
+					rspamd_strcase_equal);
+			rspamd_mempool_add_destructor (pool,
+				(rspamd_mempool_destruct_t)rspamd_trie_free,
+				set->literals);
+			rspamd_mempool_add_destructor (pool,
+				(rspamd_mempool_destruct_t)g_hash_table_unref,
+				set->literal_heads);
+		}
+
+		/*
+		 * Regexps with the same literal are chained, trie returns the last
+		 * inserted one as reinsertion of a pattern overwrites its id
+		 */
+		prev = GPOINTER_TO_UINT (g_hash_table_lookup (set->literal_heads,
+				re->literal));
+		g_ptr_array_add (set->literal_chain, GUINT_TO_POINTER (prev));
+		g_hash_table_insert (set->literal_heads, re->literal,
+			GUINT_TO_POINTER (idx + 1));
+		rspamd_trie_insert (set->literals, re->literal, idx);
+
+		if (re->is_raw) {
+			set->has_raw_literals = TRUE;
+		}
+	}
+	else {
+		g_ptr_array_add (set->literal_chain, NULL);
+	}
+}
+
+/* Expression tree used to compile postfix expressions */
+struct regexp_expr_node {
+	gchar op;
+	struct expression *operand;
+	struct regexp_operand_stat *stat;
+	GPtrArray *children;
+	/* Expected evaluation cost and probability to be true */
+	gdouble cost;
+	gdouble prob;
+	/* Position among siblings: the lower the earlier node is evaluated */
+	gdouble rank;
+};
+
+/* Estimated cost of a single operand evaluation */
+static gdouble
+regexp_operand_cost (struct expression *e)
+{
+	struct rspamd_regexp *re;
+	gdouble cost;
+
+	switch (e->type) {
+	case EXPR_REGEXP_PARSED:
+		re = e->content.operand;
+		switch (re->type) {
+		case REGEXP_HEADER:
+		case REGEXP_RAW_HEADER:
+			cost = re->regexp == NULL ? 0.5 : 1.0;
+			break;
+		case REGEXP_URL:
+			cost = 3.0;
+			break;
+		case REGEXP_MIME:
+			cost = 5.0;
+			break;
+		case REGEXP_MESSAGE:
+			cost = 8.0;
+			break;
+		default:
+			cost = 1.0;
+			break;
+		}
+		/* Regexps with literals are usually resolved by prefilter */
+		if (re->literal != NULL) {
+			cost /= 2.0;
+		}
+		break;
+	case EXPR_FUNCTION:
+		cost = 2.0;
+		break;
+	case EXPR_STR:
+		/* Lua functions */
+		cost = 10.0;
+		break;
+	default:
+		cost = 10.0;
+		break;
+	}
+
+	return cost;
+}
+
+/*
+ * Returns factor to convert static costs to microseconds, it is the average
+ * ratio of measured and static costs of operands that have enough samples
+ */
+static gdouble
+regexp_operand_cost_scale (struct regexp_module_item *item)
+{
+	struct regexp_operand_stat *st;
+	gdouble sum = 0;
+	guint i, n = 0;
+
+	for (i = 0; i < item->nstats; i++) {
+		st = &item->stats[i];
+
+		if (st->time_samples >= REGEXP_BC_MIN_SAMPLES) {
+			sum += st->time / st->time_samples /
+				regexp_operand_cost (st->operand);
+			n++;
+		}
+	}
+
+	return n > 0 ? sum / n : 1.0;
+}
+
+static gint
+regexp_expr_node_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct regexp_expr_node *n1 = *(const struct regexp_expr_node **)a,
+		*n2 = *(const struct regexp_expr_node **)b;
+
+	if (n1->rank < n2->rank) {
+		return -1;
+	}
+	else if (n1->rank > n2->rank) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Calculates expected cost and probability of node and orders its children:
+ * '&' evaluates first children that are cheap and likely false, '|' evaluates
+ * first children that are cheap and likely true. Operands use measured
+ * values when there are enough samples and scaled static estimations otherwise
+ */
+static void
+regexp_expr_node_estimate (struct regexp_expr_node *node, gdouble scale)
+{
+	struct regexp_expr_node *child;
+	struct regexp_operand_stat *st = node->stat;
+	gdouble reach = 1.0;
+	guint i;
+
+	switch (node->op) {
+	case '\0':
+		if (st != NULL && st->time_samples >= REGEXP_BC_MIN_SAMPLES) {
+			node->cost = st->time / st->time_samples;
+		}
+		else {
+			node->cost = regexp_operand_cost (node->operand) * scale;
+		}
+		if (st != NULL && st->evals >= REGEXP_BC_MIN_SAMPLES) {
+			/* Laplace smoothing keeps probability inside (0, 1) */
+			node->prob = (st->hits + 1.0) / (st->evals + 2.0);
+		}
+		else {
+			node->prob = 0.5;
+		}
+		break;
+	case '!':
+		child = g_ptr_array_index (node->children, 0);
+		regexp_expr_node_estimate (child, scale);
+		node->cost = child->cost;
+		node->prob = 1.0 - child->prob;
+		break;
+	default:
+		for (i = 0; i < node->children->len; i++) {
+			child = g_ptr_array_index (node->children, i);
+			regexp_expr_node_estimate (child, scale);
+
+			if (node->op == '&') {
+				child->rank = child->cost / MAX (1.0 - child->prob, 1e-6);
+			}
+			else {
+				child->rank = child->cost / MAX (child->prob, 1e-6);
+			}
+		}
+
+		g_ptr_array_sort (node->children, regexp_expr_node_cmp);
+		node->cost = 0;
+
+		for (i = 0; i < node->children->len; i++) {
+			child = g_ptr_array_index (node->children, i);
+			/* Child is evaluated only if previous ones have not decided */
+			node->cost += child->cost * reach;
+			reach *= node->op == '&' ? child->prob : 1.0 - child->prob;
+		}
+
+		node->prob = node->op == '&' ? reach : 1.0 - reach;
+		break;
+	}
+}
+
+static void
+regexp_expr_node_add_child (struct regexp_expr_node *node,
+	struct regexp_expr_node *child)
+{
+	guint i;
+
+	if (child->op == node->op && node->op != '!') {
+		/* Flatten chains of the same operation: (a & b) & c -> &(a, b, c) */
+		for (i = 0; i < child->children->len; i++) {
+			g_ptr_array_add (node->children,
+				g_ptr_array_index (child->children, i));
+		}
+	}
+	else {
+		g_ptr_array_add (node->children, child);
+	}
+}
+
+static void
+regexp_expr_node_free (struct regexp_expr_node *node)
+{
+	if (node->children) {
+		g_ptr_array_free (node->children, TRUE);
+	}
+	g_slice_free1 (sizeof (*node), node);
+}
+
+static void
+regexp_expr_emit (struct regexp_expr_node *node, GArray *prog)
+{
+	struct regexp_bc_insn insn;
+	GArray *jumps;
+	guint i, j;
+
+	memset (&insn, 0, sizeof (insn));
+
+	switch (node->op) {
+	case '\0':
+		insn.op = REGEXP_BC_OPERAND;
+		insn.operand = node->operand;
+		insn.stat = node->stat;
+		g_array_append_val (prog, insn);
+		break;
+	case '!':
+		regexp_expr_emit (g_ptr_array_index (node->children, 0), prog);
+		insn.op = REGEXP_BC_NOT;
+		g_array_append_val (prog, insn);
+		break;
+	default:
+		/* Children are ordered by estimation, stop as soon as result is known */
+		jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+
+		for (i = 0; i < node->children->len; i++) {
+			regexp_expr_emit (g_ptr_array_index (node->children, i), prog);
+
+			if (i != node->children->len - 1) {
+				insn.op = node->op == '&' ?
+					REGEXP_BC_JUMP_IF_FALSE : REGEXP_BC_JUMP_IF_TRUE;
+				g_array_append_val (prog, insn);
+				j = prog->len - 1;
+				g_array_append_val (jumps, j);
+			}
+		}
+
+		for (i = 0; i < jumps->len; i++) {
+			j = g_array_index (jumps, guint, i);
+			g_array_index (prog, struct regexp_bc_insn, j).target = prog->len;
+		}
+
+		g_array_free (jumps, TRUE);
+		break;
+	}
+}
+
+/*
+ * Compile postfix expression to the short-circuit program, returns FALSE if
+ * expression cannot be compiled, so it should be interpreted. If item is
+ * already compiled, then its program is rebuilt in place using the operands
+ * statistics collected so far
+ */
+static gboolean
+regexp_expression_compile (rspamd_mempool_t *pool,
+	struct regexp_module_item *item)
+{
+	struct expression *cur;
+	struct regexp_expr_node *node, *op1, *op2;
+	GQueue *stack;
+	GPtrArray *nodes;
+	GArray *prog;
+	gboolean ret = TRUE;
+	guint i, nops = 0;
+
+	if (item->stats == NULL) {
+		for (cur = item->expr; cur != NULL; cur = cur->next) {
+			if (cur->type != EXPR_OPERATION) {
+				nops++;
+			}
+		}
+
+		item->nstats = nops;
+		item->stats = rspamd_mempool_alloc0 (pool,
+				MAX (nops, 1) * sizeof (struct regexp_operand_stat));
+		nops = 0;
+	}
+
+	stack = g_queue_new ();
+	nodes = g_ptr_array_new ();
+
+	for (cur = item->expr; cur != NULL && ret; cur = cur->next) {
+		node = g_slice_alloc0 (sizeof (*node));
+		g_ptr_array_add (nodes, node);
+
+		if (cur->type != EXPR_OPERATION) {
+			if (cur->type == EXPR_REGEXP) {
+				/* Not parsed regexp */
+				ret = FALSE;
+				break;
+			}
+			node->operand = cur;
+			node->stat = &item->stats[nops++];
+			node->stat->operand = cur;
+			g_queue_push_head (stack, node);
+			continue;
+		}
+
+		node->op = cur->content.operation;
+		node->children = g_ptr_array_new ();
+
+		switch (node->op) {
+		case '!':
+			if (g_queue_get_length (stack) < 1) {
+				ret = FALSE;
+				break;
+			}
+			regexp_expr_node_add_child (node, g_queue_pop_head (stack));
+			break;
+		case '&':
+		case '|':
+			if (g_queue_get_length (stack) < 2) {
+				ret = FALSE;
+				break;
+			}
+			op1 = g_queue_pop_head (stack);
+			op2 = g_queue_pop_head (stack);
+			regexp_expr_node_add_child (node, op2);
+			regexp_expr_node_add_child (node, op1);
+			break;
+		default:
+			ret = FALSE;
+			break;
+		}
+
+		g_queue_push_head (stack, node);
+	}
+
+	if (ret && g_queue_get_length (stack) == 1) {
+		node = g_queue_peek_head (stack);
+		regexp_expr_node_estimate (node, regexp_operand_cost_scale (item));
+		prog = g_array_new (FALSE, FALSE, sizeof (struct regexp_bc_insn));
+		regexp_expr_emit (node, prog);
+
+		if (item->bc == NULL) {
+			item->bc_len = prog->len;
+			item->bc = rspamd_mempool_alloc (pool,
+					prog->len * sizeof (struct regexp_bc_insn));
+		}
+
+		/* Reordering does not change the length of program */
+		g_assert (item->bc_len == prog->len);
+		memcpy (item->bc, prog->data, prog->len * sizeof (struct regexp_bc_insn));
+		g_array_free (prog, TRUE);
+	}
+	else {
+		ret = FALSE;
+	}
+
+	for (i = 0; i < nodes->len; i++) {
+		regexp_expr_node_free (g_ptr_array_index (nodes, i));
+	}
+
+	g_ptr_array_free (nodes, TRUE);
+	g_queue_free (stack);
+
+	return ret;
+}
+
 /* Process regexp expression */
 static gboolean
 read_regexp_expression (rspamd_mempool_t * pool,
@@ -240,10 +738,16 @@ read_regexp_expression (rspamd_mempool_t * pool,
 				return FALSE;
 			}
 			cur->type = EXPR_REGEXP_PARSED;
+			regexp_scan_set_add (pool, cur->content.operand);
 		}
 		cur = cur->next;
 	}
 
+	if (!regexp_expression_compile (pool, chain)) {
+		msg_info ("cannot compile expression %s = \"%s\", it will be interpreted",
+			symbol, line);
+	}
+
 	return TRUE;
 }
 
@@ -257,6 +761,8 @@ regexp_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	regexp_module_ctx->regexp_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
 	regexp_module_ctx->workers = NULL;
+	regexp_module_ctx->scan_sets = NULL;
+	regexp_module_ctx->re_scan_sets = NULL;
 
 	*ctx = (struct module_ctx *)regexp_module_ctx;
 	register_expression_function ("regexp_match_number",
@@ -299,8 +805,10 @@ gint
 regexp_module_config (struct rspamd_config *cfg)
 {
 	struct regexp_module_item *cur_item;
+	struct regexp_scan_set *set;
 	const ucl_object_t *sec, *value;
 	ucl_object_iter_t it = NULL;
+	GHashTableIter sit;
 	gint res = TRUE;
 
 	sec = ucl_object_find_key (cfg->rcl_obj, "regexp");
@@ -312,6 +820,16 @@ regexp_module_config (struct rspamd_config *cfg)
 	regexp_module_ctx->max_size = 0;
 	regexp_module_ctx->max_threads = 0;
 	regexp_module_ctx->workers = NULL;
+	regexp_module_ctx->scan_sets = g_hash_table_new (rspamd_str_hash,
+			rspamd_str_equal);
+	regexp_module_ctx->re_scan_sets = g_hash_table_new (g_direct_hash,
+			g_direct_equal);
+	rspamd_mempool_add_destructor (regexp_module_ctx->regexp_pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref,
+		regexp_module_ctx->scan_sets);
+	rspamd_mempool_add_destructor (regexp_module_ctx->regexp_pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref,
+		regexp_module_ctx->re_scan_sets);
 
 	while ((value = ucl_iterate_object (sec, &it, true)) != NULL) {
 		if (g_ascii_strncasecmp (ucl_object_key (value), "max_size",
@@ -354,12 +872,22 @@ regexp_module_config (struct rspamd_config *cfg)
 		}
 	}
 
+	/* Freeze literals prefilters as all regexps are now known */
+	g_hash_table_iter_init (&sit, regexp_module_ctx->scan_sets);
+	while (g_hash_table_iter_next (&sit, NULL, (gpointer *)&set)) {
+		if (set->literals != NULL) {
+			rspamd_trie_compile (set->literals);
+		}
+	}
+
 	return res;
 }
 
 gint
 regexp_module_reconfig (struct rspamd_config *cfg)
 {
+	regexp_module_ctx->scan_sets = NULL;
+	regexp_module_ctx->re_scan_sets = NULL;
 	rspamd_mempool_delete (regexp_module_ctx->regexp_pool);
 	regexp_module_ctx->regexp_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
@@ -404,6 +932,258 @@ tree_url_callback (gpointer key, gpointer value, void *data)
 	return FALSE;
 }
 
+struct regexp_literal_cbdata {
+	struct regexp_scan_set *set;
+	gboolean *present;
+};
+
+static gboolean
+regexp_literal_callback (gint id, const gchar *begin, const gchar *end,
+	gpointer ud)
+{
+	struct regexp_literal_cbdata *cbd = ud;
+	guint idx = id, prev;
+
+	/* Mark all regexps that share this literal */
+	while (!cbd->present[idx]) {
+		cbd->present[idx] = TRUE;
+		prev = GPOINTER_TO_UINT (g_ptr_array_index (cbd->set->literal_chain,
+				idx));
+
+		if (prev == 0) {
+			break;
+		}
+		idx = prev - 1;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Find which required literals are present in the specified data, regexps
+ * whose literals are absent cannot match, so there is no need to call PCRE
+ */
+static void
+regexp_scan_set_prefilter (struct regexp_scan_set *set,
+	const gchar *data,
+	gsize len,
+	gboolean *present)
+{
+	struct regexp_literal_cbdata cbd;
+
+	if (set->literals == NULL) {
+		return;
+	}
+
+	memset (present, 0, set->regexps->len * sizeof (gboolean));
+	cbd.set = set;
+	cbd.present = present;
+	rspamd_trie_lookup_multiple (set->literals, data, len,
+		regexp_literal_callback, &cbd);
+}
+
+/*
+ * Literals that are found in any data item of a set, regexps whose literals
+ * are found nowhere cannot match
+ */
+struct regexp_scan_set_literals {
+	struct regexp_scan_set *set;
+	gboolean *present;
+	gboolean *found;
+	gboolean *found_raw;
+};
+
+static void
+regexp_scan_set_merge (struct regexp_scan_set_literals *lit, gboolean *found,
+	gboolean raw)
+{
+	struct rspamd_regexp *re;
+	guint i;
+
+	for (i = 0; i < lit->set->regexps->len; i++) {
+		re = g_ptr_array_index (lit->set->regexps, i);
+
+		if (lit->present[i] && re->is_raw == raw) {
+			found[i] = TRUE;
+		}
+	}
+}
+
+static gboolean
+tree_url_scan_set_callback (gpointer key, gpointer value, void *data)
+{
+	struct regexp_scan_set_literals *lit = data;
+	struct rspamd_url *url = value;
+	const gchar *in;
+
+	in = struri (url);
+	regexp_scan_set_prefilter (lit->set, in, strlen (in), lit->present);
+	regexp_scan_set_merge (lit, lit->found, FALSE);
+	regexp_scan_set_merge (lit, lit->found_raw, TRUE);
+
+	return FALSE;
+}
+
+/*
+ * Mark scan set as prefiltered for a task, regexps can be processed by several
+ * threads, so the mark is set atomically
+ * @return TRUE if the set has not been marked before
+ */
+static gboolean
+regexp_scan_set_mark (struct regexp_scan_set *set, struct rspamd_task *task)
+{
+	volatile guint *word;
+	guint old, bit;
+
+	if (set->id >= task->re_cache_size) {
+		/* Set has been created after the task */
+		return FALSE;
+	}
+
+	word = &task->re_sets[set->id / 32];
+	bit = 1U << (set->id % 32);
+
+	do {
+		old = (guint)g_atomic_int_get ((volatile gint *)word);
+
+		if (old & bit) {
+			return FALSE;
+		}
+	} while (!g_atomic_int_compare_and_exchange ((volatile gint *)word,
+			(gint)old, (gint)(old | bit)));
+
+	return TRUE;
+}
+
+/*
+ * Prefilter a scan set for a task: data of the set is extracted once and
+ * literals of all regexps are searched in a single pass over it. Regexps that
+ * cannot match are stored in the task's cache as negative results, the rest
+ * are left to be checked by PCRE when the expressions need them, so
+ * short-circuit evaluation of expressions is preserved
+ */
+static void
+process_regexp_scan_set (struct regexp_scan_set *set, struct rspamd_task *task)
+{
+	struct rspamd_regexp *re;
+	struct mime_text_part *part;
+	struct raw_header *rh;
+	struct regexp_scan_set_literals lit;
+	GList *cur, *headerlist;
+	gboolean *found;
+	const gchar *in;
+	guint i, nregexps;
+
+	if (!regexp_scan_set_mark (set, task)) {
+		/* Set is already prefiltered for this task */
+		return;
+	}
+
+	nregexps = set->regexps->len;
+
+	if (set->type == REGEXP_HEADER || set->type == REGEXP_RAW_HEADER) {
+		headerlist = message_get_header (task, set->header, set->is_strong);
+
+		if (headerlist == NULL) {
+			/* No header - no matches */
+			for (i = 0; i < nregexps; i++) {
+				re = g_ptr_array_index (set->regexps, i);
+
+				if (task_cache_check (task, re) == -1) {
+					task_cache_add (task, re, 0);
+				}
+			}
+
+			return;
+		}
+	}
+	else {
+		headerlist = NULL;
+	}
+
+	if (set->literals == NULL) {
+		return;
+	}
+
+	lit.set = set;
+	lit.present = g_malloc0 (nregexps * sizeof (gboolean));
+	lit.found = g_malloc0 (nregexps * sizeof (gboolean));
+	lit.found_raw = g_malloc0 (nregexps * sizeof (gboolean));
+
+	switch (set->type) {
+	case REGEXP_HEADER:
+	case REGEXP_RAW_HEADER:
+		for (cur = headerlist; cur != NULL; cur = g_list_next (cur)) {
+			rh = cur->data;
+			in = set->type == REGEXP_RAW_HEADER ? rh->value : rh->decoded;
+
+			if (in == NULL) {
+				continue;
+			}
+
+			regexp_scan_set_prefilter (set, in, strlen (in), lit.present);
+			regexp_scan_set_merge (&lit, lit.found, FALSE);
+			regexp_scan_set_merge (&lit, lit.found_raw, TRUE);
+		}
+		break;
+	case REGEXP_MIME:
+		for (cur = task->text_parts; cur != NULL; cur = g_list_next (cur)) {
+			part = cur->data;
+
+			if (part->is_empty) {
+				continue;
+			}
+
+			regexp_scan_set_prefilter (set, (const gchar *)part->content->data,
+				part->content->len, lit.present);
+			regexp_scan_set_merge (&lit, lit.found, FALSE);
+
+			if (set->has_raw_literals) {
+				regexp_scan_set_prefilter (set, (const gchar *)part->orig->data,
+					part->orig->len, lit.present);
+				regexp_scan_set_merge (&lit, lit.found_raw, TRUE);
+			}
+		}
+		break;
+	case REGEXP_MESSAGE:
+		if (regexp_module_ctx->max_size != 0 && task->msg.len >
+			regexp_module_ctx->max_size) {
+			/* Do not prefilter these regexps, process_regexp checks them */
+			break;
+		}
+
+		regexp_scan_set_prefilter (set, task->msg.start, task->msg.len,
+			lit.present);
+		regexp_scan_set_merge (&lit, lit.found, FALSE);
+		regexp_scan_set_merge (&lit, lit.found_raw, TRUE);
+		break;
+	case REGEXP_URL:
+		if (task->urls) {
+			g_tree_foreach (task->urls, tree_url_scan_set_callback, &lit);
+		}
+		if (task->emails) {
+			g_tree_foreach (task->emails, tree_url_scan_set_callback, &lit);
+		}
+		break;
+	default:
+		break;
+	}
+
+	for (i = 0; i < nregexps; i++) {
+		re = g_ptr_array_index (set->regexps, i);
+		found = re->is_raw ? lit.found_raw : lit.found;
+
+		if (re->literal != NULL && re->regexp != NULL && !found[i] &&
+			task_cache_check (task, re) == -1) {
+			task_cache_add (task, re, 0);
+		}
+	}
+
+	g_free (lit.present);
+	g_free (lit.found);
+	g_free (lit.found_raw);
+}
+
 static gsize
 process_regexp (struct rspamd_regexp *re,
 	struct rspamd_task *task,
@@ -428,6 +1208,7 @@ process_regexp (struct rspamd_regexp *re,
 	};
 	struct mime_text_part *part;
 	struct raw_header *rh;
+	struct regexp_scan_set *set;
 
 	if (re == NULL) {
 		msg_info ("invalid regexp passed");
@@ -442,6 +1223,18 @@ process_regexp (struct rspamd_regexp *re,
 		return r == 1;
 	}
 
+	if (additional == NULL && (f == NULL || limit <= 1) &&
+		regexp_module_ctx->re_scan_sets != NULL &&
+		(set = g_hash_table_lookup (regexp_module_ctx->re_scan_sets,
+		re)) != NULL) {
+		/* Skip all regexps for the same data that cannot match at once */
+		process_regexp_scan_set (set, task);
+
+		if ((r = task_cache_check (task, re)) != -1) {
+			return r == 1;
+		}
+	}
+
 	if (additional != NULL) {
 		/* We have additional parameter defined, so ignore type of regexp expression and use it for parsing */
 		if (G_UNLIKELY (re->is_test)) {
@@ -1002,6 +1795,152 @@ process_regexp_expression (struct expression *expr,
 	return FALSE;
 }
 
+static gboolean
+regexp_bc_eval_operand (struct expression *e,
+	struct rspamd_task *task,
+	struct lua_locked_state *nL)
+{
+	lua_State *L = nL ? nL->L : task->cfg->lua_state;
+	gboolean res = FALSE;
+
+	switch (e->type) {
+	case EXPR_REGEXP_PARSED:
+		res = process_regexp ((struct rspamd_regexp *)e->content.operand,
+				task, NULL, 0, NULL);
+		break;
+	case EXPR_FUNCTION:
+		if (nL) {
+			rspamd_mutex_lock (nL->m);
+		}
+		res = call_expression_function (
+			(struct expression_function *)e->content.operand, task, L);
+		if (nL) {
+			rspamd_mutex_unlock (nL->m);
+		}
+		break;
+	case EXPR_STR:
+		if (nL) {
+			rspamd_mutex_lock (nL->m);
+		}
+		res = maybe_call_lua_function ((const gchar *)e->content.operand,
+				task, L);
+		if (nL) {
+			rspamd_mutex_unlock (nL->m);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return res;
+}
+
+/* Halve operands statistics so that recent evaluations weigh more */
+static void
+regexp_operand_stats_decay (struct regexp_module_item *item)
+{
+	struct regexp_operand_stat *st;
+	guint i;
+
+	for (i = 0; i < item->nstats; i++) {
+		st = &item->stats[i];
+		st->evals /= 2;
+		st->hits /= 2;
+		st->time /= 2.0;
+		st->time_samples /= 2;
+	}
+}
+
+/* Returns process time in microseconds */
+static gdouble
+regexp_get_ticks (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+# elif defined(HAVE_CLOCK_VIRTUAL)
+	clock_gettime (CLOCK_VIRTUAL,			 &ts);
+# else
+	clock_gettime (CLOCK_REALTIME,			 &ts);
+# endif
+
+	return ts.tv_sec * 1000000. + ts.tv_nsec / 1000.;
+#else
+	struct timeval tv;
+
+	if (gettimeofday (&tv, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
+
+	return tv.tv_sec * 1000000. + tv.tv_usec;
+#endif
+}
+
+/*
+ * Run compiled expression of regexp module item. In non-threaded mode each
+ * evaluated operand updates its statistics and the program is reordered
+ * according to them once per REGEXP_BC_REORDER_EVALS runs
+ */
+static gboolean
+process_regexp_bytecode (struct regexp_module_item *item,
+	struct rspamd_task *task,
+	struct lua_locked_state *nL)
+{
+	struct regexp_bc_insn *insn;
+	gboolean res = FALSE, measure = FALSE, sample = FALSE;
+	gdouble t1 = 0;
+	guint pc = 0;
+
+	if (nL == NULL) {
+		/* Item is never evaluated concurrently in this mode */
+		measure = TRUE;
+		sample = (item->evals & REGEXP_BC_TIME_SAMPLE_MASK) == 0;
+	}
+
+	while (pc < item->bc_len) {
+		insn = &item->bc[pc];
+
+		switch (insn->op) {
+		case REGEXP_BC_OPERAND:
+			if (sample) {
+				t1 = regexp_get_ticks ();
+			}
+			res = regexp_bc_eval_operand (insn->operand, task, nL);
+			if (measure) {
+				insn->stat->evals++;
+				if (res) {
+					insn->stat->hits++;
+				}
+				if (sample) {
+					insn->stat->time += regexp_get_ticks () - t1;
+					insn->stat->time_samples++;
+				}
+			}
+			pc++;
+			break;
+		case REGEXP_BC_NOT:
+			res = !res;
+			pc++;
+			break;
+		case REGEXP_BC_JUMP_IF_FALSE:
+			pc = res ? pc + 1 : insn->target;
+			break;
+		case REGEXP_BC_JUMP_IF_TRUE:
+			pc = res ? insn->target : pc + 1;
+			break;
+		}
+	}
+
+	if (measure && ++item->evals % REGEXP_BC_REORDER_EVALS == 0) {
+		regexp_expression_compile (NULL, item);
+		regexp_operand_stats_decay (item);
+	}
+
+	return res;
+}
+
 /* Call custom lua function in rspamd expression */
 static gboolean
 rspamd_lua_call_expression_func (struct ucl_lua_funcdata *lua_data,
@@ -1067,10 +2006,18 @@ process_regexp_item_threaded (gpointer data, gpointer user_data)
 {
 	struct regexp_threaded_ud *ud = data;
 	struct lua_locked_state *nL = user_data;
+	gboolean res;
 
 	/* Process expression */
-	if (process_regexp_expression (ud->item->expr, ud->item->symbol, ud->task,
-		NULL, nL)) {
+	if (ud->item->bc != NULL) {
+		res = process_regexp_bytecode (ud->item, ud->task, nL);
+	}
+	else {
+		res = process_regexp_expression (ud->item->expr, ud->item->symbol,
+				ud->task, NULL, nL);
+	}
+
+	if (res) {
 		g_mutex_lock (workers_mtx);
 		rspamd_task_insert_result (ud->task, ud->item->symbol, 1, NULL);
 		g_mutex_unlock (workers_mtx);
@@ -1148,8 +2095,14 @@ process_regexp_item (struct rspamd_task *task, void *user_data)
 		}
 		else {
 			/* Process expression */
-			if (process_regexp_expression (item->expr, item->symbol, task, NULL,
-				NULL)) {
+			if (item->bc != NULL) {
+				res = process_regexp_bytecode (item, task, NULL);
+			}
+			else {
+				res = process_regexp_expression (item->expr, item->symbol, task,
+						NULL, NULL);
+			}
+			if (res) {
 				rspamd_task_insert_result (task, item->symbol, 1, NULL);
 			}
 		}
@@ -159,6 +159,7 @@ spf_module_config (struct rspamd_config *cfg)
 		1,
 		spf_symbol_callback,
 		NULL);
+	set_symbol_async (cfg->cache, spf_module_ctx->symbol_fail);
 	register_virtual_symbol (&cfg->cache, spf_module_ctx->symbol_softfail, 1);
 	register_virtual_symbol (&cfg->cache, spf_module_ctx->symbol_neutral,  1);
 	register_virtual_symbol (&cfg->cache, spf_module_ctx->symbol_allow,	   1);
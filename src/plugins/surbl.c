@@ -227,6 +227,9 @@ read_redirectors_list (rspamd_mempool_t * pool,
 void
 fin_redirectors_list (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
+	/* All redirectors are inserted, so freeze the trie */
+	rspamd_trie_compile (surbl_module_ctx->redirector_trie);
+
 	if (data->prev_data) {
 		g_hash_table_destroy (data->prev_data);
 	}
@@ -489,6 +492,7 @@ surbl_module_config (struct rspamd_config *cfg)
 				1,
 				surbl_test_url,
 				new_suffix);
+			set_symbol_async (cfg->cache, new_suffix->symbol);
 		}
 	}
 	/* Add default suffix */
@@ -13,12 +13,28 @@ char *test_expressions[] = {
 	NULL
 }; 
 
+/* Regexps and their required literals */
+static const struct {
+	const char *re;
+	const char *literal;
+} test_literals[] = {
+	{"/hello\\s+world/P", "hello"},
+	{"Subject=/\\[SPAM\\]\\s*viagra?/iH", "[SPAM]"},
+	{"/www\\.example\\.com/U", "www.example.com"},
+	{"/abcd{0,3}efgh/P", "efgh"},
+	{"/viagra|cialis/P", NULL},
+	{"/(?x)a b c d/P", NULL},
+	{"/\\x41\\x42\\x43/P", NULL},
+	{NULL, NULL}
+};
+
 void 
 rspamd_expression_test_func ()
 {
 	rspamd_mempool_t *pool;
 	struct expression *cur;
 	struct expression_argument *arg;
+	struct rspamd_regexp *re;
 	char **line, *outstr;
 	int r, s;
 	GList *cur_arg;
@@ -60,5 +76,17 @@ rspamd_expression_test_func ()
 		line ++;
 	}
 
+	for (r = 0; test_literals[r].re != NULL; r ++) {
+		re = parse_regexp (pool, test_literals[r].re, FALSE);
+		g_assert (re != NULL);
+		if (test_literals[r].literal == NULL) {
+			g_assert (re->literal == NULL);
+		}
+		else {
+			g_assert (re->literal != NULL);
+			g_assert_cmpstr (re->literal, ==, test_literals[r].literal);
+		}
+	}
+
 	rspamd_mempool_delete (pool);
 }
@@ -0,0 +1,288 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "fuzzy_backend.h"
+#include "ottery.h"
+#include "tests.h"
+#include <sqlite3.h>
+
+#define TEST_MASTER "/tmp/rspamd_fuzzy_master.sqlite"
+#define TEST_REPLICA "/tmp/rspamd_fuzzy_replica.sqlite"
+#define TEST_DIGESTS 16
+#define TEST_EXPIRE 86400
+
+static void
+fuzzy_backend_unlink (const gchar *path)
+{
+	gchar tmp[PATH_MAX];
+
+	unlink (path);
+	rspamd_snprintf (tmp, sizeof (tmp), "%s-journal", path);
+	unlink (tmp);
+	rspamd_snprintf (tmp, sizeof (tmp), "%s-wal", path);
+	unlink (tmp);
+	rspamd_snprintf (tmp, sizeof (tmp), "%s-shm", path);
+	unlink (tmp);
+}
+
+static void
+fuzzy_backend_make_cmd (struct rspamd_fuzzy_cmd *cmd, guint8 type)
+{
+	memset (cmd, 0, sizeof (*cmd));
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->cmd = type;
+	cmd->flag = 1;
+	cmd->value = 1;
+	ottery_rand_bytes (cmd->digest, sizeof (cmd->digest));
+}
+
+struct fuzzy_backend_update {
+	guint64 seq;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+};
+
+/* Copies commands from the master log as fuzzy storage master sends them */
+static gboolean
+fuzzy_backend_log_cb (guint64 seq, const struct rspamd_fuzzy_cmd *cmd,
+		gsize len, gpointer ud)
+{
+	GArray *updates = ud;
+	struct fuzzy_backend_update upd;
+
+	memset (&upd, 0, sizeof (upd));
+	upd.seq = seq;
+	memcpy (&upd.cmd, cmd, MIN (len, sizeof (upd.cmd)));
+	g_array_append_val (updates, upd);
+
+	return TRUE;
+}
+
+/* Reads master log after seq, master and replica cannot be opened at once */
+static GArray *
+fuzzy_backend_read_master (guint64 seq)
+{
+	struct rspamd_fuzzy_backend *master;
+	GArray *updates;
+	GError *err = NULL;
+
+	master = rspamd_fuzzy_backend_open (TEST_MASTER, FALSE, 0, FALSE, 0, &err);
+	g_assert (master != NULL);
+	rspamd_fuzzy_backend_set_log_size (master, TEST_DIGESTS * 2);
+
+	updates = g_array_new (FALSE, FALSE, sizeof (struct fuzzy_backend_update));
+	rspamd_fuzzy_backend_read_log (master, seq, 0, fuzzy_backend_log_cb,
+			updates);
+	rspamd_fuzzy_backend_close (master);
+
+	return updates;
+}
+
+/*
+ * Applies updates as fuzzy storage replica does: updates before checkpoint
+ * are skipped unless master has reset replication
+ */
+static void
+fuzzy_backend_apply (struct rspamd_fuzzy_backend *replica, GArray *updates,
+		gboolean reset)
+{
+	struct fuzzy_backend_update *upd;
+	guint i;
+
+	if (reset) {
+		rspamd_fuzzy_backend_set_checkpoint (replica, 0);
+	}
+
+	for (i = 0; i < updates->len; i ++) {
+		upd = &g_array_index (updates, struct fuzzy_backend_update, i);
+
+		if (upd->seq <= rspamd_fuzzy_backend_checkpoint (replica)) {
+			continue;
+		}
+
+		rspamd_fuzzy_backend_set_checkpoint (replica, upd->seq);
+
+		if (upd->cmd.basic.cmd == FUZZY_WRITE) {
+			g_assert (rspamd_fuzzy_backend_add (replica, &upd->cmd.basic));
+		}
+		else if (upd->cmd.basic.cmd == FUZZY_DEL) {
+			g_assert (rspamd_fuzzy_backend_del (replica, &upd->cmd.basic));
+		}
+	}
+}
+
+void
+rspamd_fuzzy_backend_test_func (void)
+{
+	struct rspamd_fuzzy_backend *master, *replica;
+	struct rspamd_fuzzy_cmd cmds[TEST_DIGESTS];
+	struct rspamd_fuzzy_reply rep;
+	GArray *updates;
+	sqlite3 *lock;
+	GError *err = NULL;
+	guint i;
+
+	fuzzy_backend_unlink (TEST_MASTER);
+	fuzzy_backend_unlink (TEST_REPLICA);
+
+	master = rspamd_fuzzy_backend_open (TEST_MASTER, FALSE, 0, FALSE, 0, &err);
+	g_assert (master != NULL);
+	rspamd_fuzzy_backend_set_log_size (master, TEST_DIGESTS * 2);
+
+	for (i = 0; i < TEST_DIGESTS; i ++) {
+		fuzzy_backend_make_cmd (&cmds[i], FUZZY_WRITE);
+		g_assert (rspamd_fuzzy_backend_add (master, &cmds[i]));
+	}
+
+	g_assert (rspamd_fuzzy_backend_commit (master));
+	g_assert (rspamd_fuzzy_backend_log_seq (master) == TEST_DIGESTS);
+	rspamd_fuzzy_backend_close (master);
+
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == 0);
+	rspamd_fuzzy_backend_close (replica);
+
+	updates = fuzzy_backend_read_master (0);
+	g_assert (updates->len == TEST_DIGESTS);
+
+	/* The first update creates partition of the replica */
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+	g_array_set_size (updates, 1);
+	fuzzy_backend_apply (replica, updates, FALSE);
+	g_assert (rspamd_fuzzy_backend_commit (replica));
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == 1);
+	rspamd_fuzzy_backend_close (replica);
+	g_array_free (updates, TRUE);
+
+	/* Replica cannot commit while another process holds the write lock */
+	updates = fuzzy_backend_read_master (1);
+	g_assert (updates->len == TEST_DIGESTS - 1);
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+	g_assert (sqlite3_open (TEST_REPLICA, &lock) == SQLITE_OK);
+	g_assert (sqlite3_exec (lock, "BEGIN IMMEDIATE;", NULL, NULL, NULL)
+			== SQLITE_OK);
+
+	fuzzy_backend_apply (replica, updates, FALSE);
+	g_array_free (updates, TRUE);
+	g_assert (!rspamd_fuzzy_backend_commit (replica));
+	g_assert (rspamd_fuzzy_backend_failed (replica));
+	g_assert (!rspamd_fuzzy_backend_sync (replica, TEST_EXPIRE));
+
+	/* Failed writes and checkpoint are kept for the next commit */
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == TEST_DIGESTS);
+
+	g_assert (sqlite3_exec (lock, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close (lock);
+
+	g_assert (rspamd_fuzzy_backend_commit (replica));
+	g_assert (!rspamd_fuzzy_backend_failed (replica));
+	rspamd_fuzzy_backend_close (replica);
+
+	/* Delete digest on master */
+	master = rspamd_fuzzy_backend_open (TEST_MASTER, FALSE, 0, FALSE, 0, &err);
+	g_assert (master != NULL);
+	rspamd_fuzzy_backend_set_log_size (master, TEST_DIGESTS * 2);
+	cmds[0].cmd = FUZZY_DEL;
+	g_assert (rspamd_fuzzy_backend_del (master, &cmds[0]));
+	g_assert (rspamd_fuzzy_backend_commit (master));
+	rspamd_fuzzy_backend_close (master);
+
+	/* Reopened replica continues from the committed checkpoint */
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == TEST_DIGESTS);
+	g_assert (rspamd_fuzzy_backend_count (replica) == TEST_DIGESTS);
+
+	for (i = 0; i < TEST_DIGESTS; i ++) {
+		rep = rspamd_fuzzy_backend_check (replica, &cmds[i],
+				TEST_EXPIRE);
+		g_assert (rep.prob > 0.5);
+		g_assert (rep.flag == 1);
+	}
+
+	rspamd_fuzzy_backend_close (replica);
+	updates = fuzzy_backend_read_master (TEST_DIGESTS);
+	g_assert (updates->len == 1);
+
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+	fuzzy_backend_apply (replica, updates, FALSE);
+	g_array_free (updates, TRUE);
+	g_assert (rspamd_fuzzy_backend_sync (replica, TEST_EXPIRE));
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == TEST_DIGESTS + 1);
+
+	rep = rspamd_fuzzy_backend_check (replica, &cmds[0], TEST_EXPIRE);
+	g_assert (rep.prob < 0.5);
+	rspamd_fuzzy_backend_close (replica);
+
+	/* Master database is replaced, so its log restarts below checkpoint */
+	fuzzy_backend_unlink (TEST_MASTER);
+	master = rspamd_fuzzy_backend_open (TEST_MASTER, FALSE, 0, FALSE, 0, &err);
+	g_assert (master != NULL);
+	rspamd_fuzzy_backend_set_log_size (master, TEST_DIGESTS * 2);
+
+	for (i = 0; i < 2; i ++) {
+		fuzzy_backend_make_cmd (&cmds[i], FUZZY_WRITE);
+		g_assert (rspamd_fuzzy_backend_add (master, &cmds[i]));
+	}
+
+	g_assert (rspamd_fuzzy_backend_commit (master));
+	g_assert (rspamd_fuzzy_backend_log_seq (master) == 2);
+	rspamd_fuzzy_backend_close (master);
+
+	updates = fuzzy_backend_read_master (0);
+	g_assert (updates->len == 2);
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+
+	/* Without reset the whole log would be skipped as already applied */
+	fuzzy_backend_apply (replica, updates, FALSE);
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == TEST_DIGESTS + 1);
+	rep = rspamd_fuzzy_backend_check (replica, &cmds[0], TEST_EXPIRE);
+	g_assert (rep.prob < 0.5);
+
+	/* Master sends reset before the log as replica checkpoint is ahead */
+	fuzzy_backend_apply (replica, updates, TRUE);
+	g_array_free (updates, TRUE);
+	g_assert (rspamd_fuzzy_backend_sync (replica, TEST_EXPIRE));
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == 2);
+
+	for (i = 0; i < 2; i ++) {
+		rep = rspamd_fuzzy_backend_check (replica, &cmds[i], TEST_EXPIRE);
+		g_assert (rep.prob > 0.5);
+	}
+
+	rspamd_fuzzy_backend_close (replica);
+
+	/* Reset checkpoint is persistent */
+	replica = rspamd_fuzzy_backend_open (TEST_REPLICA, FALSE, 0, FALSE, 0, &err);
+	g_assert (replica != NULL);
+	g_assert (rspamd_fuzzy_backend_checkpoint (replica) == 2);
+	rspamd_fuzzy_backend_close (replica);
+	fuzzy_backend_unlink (TEST_MASTER);
+	fuzzy_backend_unlink (TEST_REPLICA);
+}
@@ -0,0 +1,311 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cfg_file.h"
+#include "stat_internal.h"
+#include "tests.h"
+#ifndef WITH_SYSTEM_HIREDIS
+#include "hiredis.h"
+#else
+#include <hiredis/hiredis.h>
+#endif
+
+/* Redis server could be redefined by RSPAMD_TEST_REDIS environment variable */
+#define TEST_REDIS_DEFAULT "127.0.0.1:6379"
+#define TEST_TOKENS 50
+
+extern struct event_base *base;
+
+static struct rspamd_stat_backend redis_test_backend = {
+	.name = "redis"
+};
+
+static gboolean redis_test_finished;
+
+static gboolean
+redis_stat_session_fin (gpointer unused)
+{
+	redis_test_finished = TRUE;
+
+	return TRUE;
+}
+
+/* Runs event loop until all redis requests of the task are finished */
+static void
+redis_stat_wait (struct rspamd_task *task)
+{
+	redis_test_finished = FALSE;
+	task->s->wanna_die = TRUE;
+	check_session_pending (task->s);
+
+	while (!redis_test_finished) {
+		event_base_loop (base, EVLOOP_ONCE);
+	}
+}
+
+/*
+ * Emulates statistics processing of a single message: tokens of all statfiles
+ * are loaded, then learns are read and, if learn is TRUE, statfile
+ * is_spam == spam is incremented by one for each token. Tokens are not
+ * loaded on learning
+ */
+static void
+redis_stat_process (struct rspamd_classifier_config *clf, gboolean learn,
+		gboolean spam, gdouble *spam_values, gdouble *ham_values,
+		gulong *spam_learns, gulong *ham_learns)
+{
+	struct rspamd_task *task;
+	struct rspamd_classifier_runtime *cl_runtime;
+	struct rspamd_statfile_runtime *st_runtime;
+	struct rspamd_statfile_config *stcf;
+	rspamd_token_t *tok;
+	GArray *tokens;
+	GList *cur;
+	gulong learns;
+	guint i, id, nst = 0;
+
+	task = rspamd_task_new (NULL);
+	task->ev_base = base;
+	task->s = new_async_session (task->task_pool, redis_stat_session_fin,
+			NULL, NULL, task);
+	cl_runtime = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cl_runtime));
+	cl_runtime->clcf = clf;
+
+	for (cur = clf->statfiles; cur != NULL; cur = g_list_next (cur)) {
+		stcf = cur->data;
+
+		if (learn && stcf->is_spam != spam) {
+			continue;
+		}
+
+		st_runtime = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (*st_runtime));
+		st_runtime->st = stcf;
+		st_runtime->backend = &redis_test_backend;
+		st_runtime->backend_runtime = rspamd_redis_runtime (task, stcf, learn,
+				redis_test_backend.ctx);
+		g_assert (st_runtime->backend_runtime != NULL);
+		cl_runtime->st_runtime = g_list_prepend (cl_runtime->st_runtime,
+				st_runtime);
+		nst ++;
+	}
+
+	cl_runtime->end_pos = nst;
+	tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+			TEST_TOKENS);
+
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		g_array_set_size (tokens, i + 1);
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		tok->data = 0xdeadbeefULL + i;
+		tok->results = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (*tok->results) * nst);
+
+		for (id = 0; id < nst; id ++) {
+			tok->results[id].cl_runtime = cl_runtime;
+		}
+	}
+
+	for (cur = cl_runtime->st_runtime, id = 0; cur != NULL;
+			cur = g_list_next (cur), id ++) {
+		rspamd_redis_process_tokens (tokens, id, cur->data,
+				redis_test_backend.ctx);
+	}
+
+	/* Statfiles are loaded by a single request that holds the task */
+	g_assert (g_hash_table_size (task->s->events) == (learn ? 0 : 1));
+	redis_stat_wait (task);
+
+	for (cur = cl_runtime->st_runtime, id = 0; cur != NULL;
+			cur = g_list_next (cur), id ++) {
+		st_runtime = cur->data;
+		g_assert (!st_runtime->failed);
+		learns = rspamd_redis_total_learns (st_runtime->backend_runtime,
+				redis_test_backend.ctx);
+
+		for (i = 0; i < TEST_TOKENS; i ++) {
+			tok = &g_array_index (tokens, rspamd_token_t, i);
+
+			if (st_runtime->st->is_spam) {
+				spam_values[i] = tok->results[id].value;
+			}
+			else {
+				ham_values[i] = tok->results[id].value;
+			}
+		}
+
+		if (st_runtime->st->is_spam) {
+			*spam_learns = learns;
+		}
+		else {
+			*ham_learns = learns;
+		}
+	}
+
+	if (learn) {
+		for (i = 0; i < TEST_TOKENS; i ++) {
+			tok = &g_array_index (tokens, rspamd_token_t, i);
+			tok->results[0].value += 1.0;
+		}
+
+		st_runtime = cl_runtime->st_runtime->data;
+		g_assert (rspamd_redis_learn_tokens (tokens, 0, st_runtime,
+				redis_test_backend.ctx) == TEST_TOKENS);
+		g_assert (g_hash_table_size (task->s->events) == 1);
+		redis_stat_wait (task);
+		g_assert (!st_runtime->failed);
+		learns = rspamd_redis_inc_learns (st_runtime->backend_runtime,
+				redis_test_backend.ctx);
+
+		if (spam) {
+			*spam_learns = learns;
+		}
+		else {
+			*ham_learns = learns;
+		}
+	}
+
+	g_array_free (tokens, TRUE);
+	g_list_free (cl_runtime->st_runtime);
+	rspamd_task_free (task, FALSE);
+}
+
+void
+rspamd_redis_stat_test_func (void)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_stat_ctx stat_ctx;
+	struct rspamd_classifier_config *clf;
+	struct rspamd_statfile_config *spam_st, *ham_st;
+	struct ucl_parser *parser;
+	ucl_object_t *opts;
+	redisContext *conn;
+	redisReply *reply;
+	const gchar *server;
+	gchar *host, *p, spam_key[64], ham_key[64], conf[256];
+	gdouble spam_values[TEST_TOKENS], ham_values[TEST_TOKENS];
+	gulong spam_learns, ham_learns;
+	struct timeval tv = { 1, 0 };
+	guint i;
+
+	server = getenv ("RSPAMD_TEST_REDIS");
+
+	if (server == NULL) {
+		server = TEST_REDIS_DEFAULT;
+	}
+
+	host = g_strdup (server);
+	p = strrchr (host, ':');
+	g_assert (p != NULL);
+	*p++ = '\0';
+	conn = redisConnectWithTimeout (host, strtoul (p, NULL, 10), tv);
+	g_free (host);
+
+	if (conn == NULL || conn->err) {
+		msg_info ("redis server %s is not available, skip test", server);
+
+		if (conn != NULL) {
+			redisFree (conn);
+		}
+
+		return;
+	}
+
+	rspamd_snprintf (spam_key, sizeof (spam_key), "rspamd_test_spam_%P",
+			getpid ());
+	rspamd_snprintf (ham_key, sizeof (ham_key), "rspamd_test_ham_%P",
+			getpid ());
+	reply = redisCommand (conn, "DEL %s %s", spam_key, ham_key);
+	g_assert (reply != NULL);
+	freeReplyObject (reply);
+
+	cfg = g_malloc0 (sizeof (*cfg));
+	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	clf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*clf));
+	spam_st = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*spam_st));
+	ham_st = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ham_st));
+
+	/* Both statfiles should be served by the same upstreams */
+	rspamd_snprintf (conf, sizeof (conf), "servers = \"%s\"; timeout = 1.0;",
+			server);
+	parser = ucl_parser_new (0);
+	g_assert (ucl_parser_add_chunk (parser, conf, strlen (conf)));
+	opts = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+	g_assert (opts != NULL);
+
+	spam_st->symbol = spam_key;
+	spam_st->is_spam = TRUE;
+	spam_st->backend = "redis";
+	spam_st->opts = opts;
+	ham_st->symbol = ham_key;
+	ham_st->is_spam = FALSE;
+	ham_st->backend = "redis";
+	ham_st->opts = opts;
+	clf->statfiles = g_list_prepend (clf->statfiles, ham_st);
+	clf->statfiles = g_list_prepend (clf->statfiles, spam_st);
+	cfg->classifiers = g_list_prepend (cfg->classifiers, clf);
+
+	memset (&stat_ctx, 0, sizeof (stat_ctx));
+	redis_test_backend.ctx = rspamd_redis_init (&stat_ctx, cfg);
+	g_assert (redis_test_backend.ctx != NULL);
+	g_assert (stat_ctx.statfiles == 2);
+
+	/* Empty statfiles */
+	redis_stat_process (clf, FALSE, FALSE, spam_values, ham_values,
+			&spam_learns, &ham_learns);
+	g_assert (spam_learns == 0 && ham_learns == 0);
+
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		g_assert (spam_values[i] == 0.0 && ham_values[i] == 0.0);
+	}
+
+	/* Learns are counted with tokens */
+	redis_stat_process (clf, TRUE, TRUE, spam_values, ham_values,
+			&spam_learns, &ham_learns);
+	g_assert (spam_learns == 1);
+	redis_stat_process (clf, TRUE, TRUE, spam_values, ham_values,
+			&spam_learns, &ham_learns);
+	g_assert (spam_learns == 2);
+
+	redis_stat_process (clf, FALSE, FALSE, spam_values, ham_values,
+			&spam_learns, &ham_learns);
+	g_assert (spam_learns == 2 && ham_learns == 0);
+
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		g_assert (spam_values[i] == 2.0 && ham_values[i] == 0.0);
+	}
+
+	reply = redisCommand (conn, "DEL %s %s", spam_key, ham_key);
+	g_assert (reply != NULL);
+	freeReplyObject (reply);
+	redisFree (conn);
+
+	g_list_free (clf->statfiles);
+	g_list_free (cfg->classifiers);
+	rspamd_mempool_delete (cfg->cfg_pool);
+	ucl_object_unref (opts);
+	g_free (cfg);
+}
@@ -45,9 +45,11 @@ main (int argc, char **argv)
 
 	g_test_add_func ("/rspamd/mem_pool", rspamd_mem_pool_test_func);
 	g_test_add_func ("/rspamd/fuzzy", rspamd_fuzzy_test_func);
+	g_test_add_func ("/rspamd/fuzzy_backend", rspamd_fuzzy_backend_test_func);
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
 	g_test_add_func ("/rspamd/expression", rspamd_expression_test_func);
 	g_test_add_func ("/rspamd/statfile", rspamd_statfile_test_func);
+	g_test_add_func ("/rspamd/redis_stat", rspamd_redis_stat_test_func);
 	g_test_add_func ("/rspamd/radix", rspamd_radix_test_func);
 	g_test_add_func ("/rspamd/dns", rspamd_dns_test_func);
 	g_test_add_func ("/rspamd/aio", rspamd_async_test_func);
@@ -56,6 +58,7 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
+	g_test_add_func ("/rspamd/trie", rspamd_trie_test_func);
 
 	g_test_run ();
 
@@ -0,0 +1,100 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "trie.h"
+#include "tests.h"
+
+static const gchar *test_patterns[] = {
+	"he",
+	"she",
+	"his",
+	"hers",
+	"http://"
+};
+
+static const gchar *test_text = "ushers at HTTP://example.com with his hat";
+
+/* Expected matches in order of their end position */
+static const gint expected_ids[] = {1, 0, 3, 4, 2};
+
+struct rspamd_trie_test_cbdata {
+	guint nmatches;
+};
+
+static gboolean
+rspamd_trie_test_cb (gint id, const gchar *begin, const gchar *end,
+	gpointer ud)
+{
+	struct rspamd_trie_test_cbdata *cbd = ud;
+
+	g_assert (cbd->nmatches < G_N_ELEMENTS (expected_ids));
+	g_assert_cmpint (id, ==, expected_ids[cbd->nmatches]);
+	g_assert (g_ascii_strncasecmp (begin, test_patterns[id],
+		end - begin) == 0);
+	g_assert_cmpint (end - begin, ==, strlen (test_patterns[id]));
+	cbd->nmatches ++;
+
+	return FALSE;
+}
+
+void
+rspamd_trie_test_func (void)
+{
+	rspamd_trie_t *trie;
+	struct rspamd_trie_test_cbdata cbd;
+	const gchar *pos;
+	gint id = -1;
+	guint i;
+
+	trie = rspamd_trie_create (TRUE);
+
+	for (i = 0; i < G_N_ELEMENTS (test_patterns); i ++) {
+		rspamd_trie_insert (trie, test_patterns[i], i);
+	}
+
+	rspamd_trie_compile (trie);
+
+	/* The first match must be the leftmost ending one */
+	pos = rspamd_trie_lookup (trie, test_text, strlen (test_text), &id);
+	g_assert (pos == test_text + 1);
+	g_assert_cmpint (id, ==, 1);
+
+	g_assert (rspamd_trie_lookup (trie, "nothing", sizeof ("nothing") - 1,
+		&id) == NULL);
+
+	cbd.nmatches = 0;
+	g_assert_cmpint (rspamd_trie_lookup_multiple (trie, test_text,
+		strlen (test_text), rspamd_trie_test_cb, &cbd), ==,
+		G_N_ELEMENTS (expected_ids));
+	g_assert_cmpint (cbd.nmatches, ==, G_N_ELEMENTS (expected_ids));
+
+	/* Insertion after compilation must be visible for lookups */
+	rspamd_trie_insert (trie, "us", i);
+	pos = rspamd_trie_lookup (trie, test_text, strlen (test_text), &id);
+	g_assert (pos == test_text);
+	g_assert_cmpint (id, ==, i);
+
+	rspamd_trie_free (trie);
+}
@@ -17,9 +17,15 @@ void rspamd_expression_test_func (void);
 /* Fuzzy hashes */
 void rspamd_fuzzy_test_func (void);
 
+/* Fuzzy storage replication */
+void rspamd_fuzzy_backend_test_func (void);
+
 /* Stat file */
 void rspamd_statfile_test_func (void);
 
+/* Redis statistics backend */
+void rspamd_redis_stat_test_func (void);
+
 /* Radix test */
 void rspamd_radix_test_func (void);
 
@@ -41,4 +47,6 @@ void rspamd_shingles_test_func (void);
 
 void rspamd_http_test_func (void);
 
+void rspamd_trie_test_func (void);
+
 #endif